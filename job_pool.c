@@ -0,0 +1,195 @@
+// NOTE: Work stealing job pool for the offline exporters. Every worker
+// owns a deque: it pushes and pops its own jobs at the bottom, newest first,
+// and when it runs dry it steals the oldest job from the top of another
+// worker's deque. Jobs may submit more jobs from inside the pool.
+//
+// Worker 0 is the thread that calls job_pool_wait. It runs jobs too, so a pool
+// started with no threads simply runs everything on the caller.
+
+typedef struct Job_Pool Job_Pool;
+typedef void Job_Function(Job_Pool *pool, u32 worker_index, void *data);
+
+typedef struct Job {
+	Job_Function *function;
+	void *data;
+} Job;
+
+typedef struct Job_Deque {
+	SDL_SpinLock lock;
+	u32 top;      // Next job to steal
+	u32 bottom;   // One past the owner's newest job
+	u32 capacity; // Power of two, indices wrap
+	Job *jobs;
+} Job_Deque;
+
+typedef struct Job_Worker {
+	Job_Pool *pool;
+	u32 index;
+	SDL_Thread *thread;
+} Job_Worker;
+
+struct Job_Pool {
+	u32 worker_count;
+	Job_Worker *workers;
+	Job_Deque *deques;
+
+	SDL_atomic_t pending; // Submitted and not finished
+	SDL_atomic_t quit;
+	SDL_sem *work_available;
+};
+
+
+static void job_deque_push(Job_Deque *deque, Job job) {
+	SDL_AtomicLock(&deque->lock);
+
+	if (deque->bottom - deque->top == deque->capacity) {
+		u32 new_capacity = deque->capacity ? 2 * deque->capacity : 64;
+		Job *new_jobs = malloc(new_capacity * sizeof(Job));
+
+		if (!new_jobs) {
+			SDL_AtomicUnlock(&deque->lock);
+			panic("Out of memory growing a job queue.\n");
+		}
+
+		for (u32 i = deque->top; i != deque->bottom; ++i) {
+			new_jobs[i & (new_capacity - 1)] = deque->jobs[i & (deque->capacity - 1)];
+		}
+
+		free(deque->jobs);
+		deque->jobs = new_jobs;
+		deque->capacity = new_capacity;
+	}
+
+	deque->jobs[deque->bottom & (deque->capacity - 1)] = job;
+	++deque->bottom;
+
+	SDL_AtomicUnlock(&deque->lock);
+}
+
+static b32 job_deque_pop(Job_Deque *deque, Job *out_job) {
+	b32 result = false;
+	SDL_AtomicLock(&deque->lock);
+
+	if (deque->bottom != deque->top) {
+		--deque->bottom;
+		*out_job = deque->jobs[deque->bottom & (deque->capacity - 1)];
+		result = true;
+	}
+
+	SDL_AtomicUnlock(&deque->lock);
+	return result;
+}
+
+static b32 job_deque_steal(Job_Deque *deque, Job *out_job) {
+	b32 result = false;
+	SDL_AtomicLock(&deque->lock);
+
+	if (deque->bottom != deque->top) {
+		*out_job = deque->jobs[deque->top & (deque->capacity - 1)];
+		++deque->top;
+		result = true;
+	}
+
+	SDL_AtomicUnlock(&deque->lock);
+	return result;
+}
+
+static void job_pool_submit(Job_Pool *pool, u32 worker_index, Job_Function *function, void *data) {
+	Job job = {function, data};
+
+	SDL_AtomicAdd(&pool->pending, 1);
+	job_deque_push(&pool->deques[worker_index], job);
+	SDL_SemPost(pool->work_available);
+}
+
+// NOTE: Own jobs first, then one steal attempt from every other worker,
+// starting with the next one so thieves spread out.
+static b32 job_pool_run_one(Job_Pool *pool, u32 worker_index) {
+	Job job;
+	b32 found = job_deque_pop(&pool->deques[worker_index], &job);
+
+	for (u32 i = 1; !found && i < pool->worker_count; ++i) {
+		u32 victim = (worker_index + i) % pool->worker_count;
+		found = job_deque_steal(&pool->deques[victim], &job);
+	}
+
+	if (found) {
+		job.function(pool, worker_index, job.data);
+		SDL_AtomicAdd(&pool->pending, -1);
+	}
+
+	return found;
+}
+
+static int job_pool_worker_thread(void *data) {
+	Job_Worker *worker = data;
+	Job_Pool *pool = worker->pool;
+
+	while (!SDL_AtomicGet(&pool->quit)) {
+		if (!job_pool_run_one(pool, worker->index)) {
+			// The timeout covers jobs whose wake up another worker took
+			SDL_SemWaitTimeout(pool->work_available, 10);
+		}
+	}
+
+	return 0;
+}
+
+// NOTE: thread_count extra threads next to the caller
+static void job_pool_start(Job_Pool *pool, u32 thread_count) {
+
+	*pool = (Job_Pool){0};
+	pool->worker_count = thread_count + 1;
+	pool->workers = calloc(pool->worker_count, sizeof(Job_Worker));
+	pool->deques = calloc(pool->worker_count, sizeof(Job_Deque));
+	pool->work_available = SDL_CreateSemaphore(0);
+
+	if (!pool->workers || !pool->deques || !pool->work_available) {
+		panic("Could not create the job pool.\n");
+	}
+
+	for (u32 i = 0; i < pool->worker_count; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+	}
+
+	for (u32 i = 1; i < pool->worker_count; ++i) {
+		pool->workers[i].thread = SDL_CreateThread(job_pool_worker_thread, "Job worker", &pool->workers[i]);
+
+		if (!pool->workers[i].thread) {
+			fprintf(stderr, "Could not start job worker: %s\n", SDL_GetError());
+		}
+	}
+}
+
+// NOTE: The caller works as worker 0 until every submitted job,
+// including jobs submitted by jobs, has finished.
+static void job_pool_wait(Job_Pool *pool) {
+	while (SDL_AtomicGet(&pool->pending)) {
+		if (!job_pool_run_one(pool, 0)) {
+			SDL_SemWaitTimeout(pool->work_available, 1);
+		}
+	}
+}
+
+static void job_pool_stop(Job_Pool *pool) {
+	job_pool_wait(pool);
+	SDL_AtomicSet(&pool->quit, 1);
+
+	for (u32 i = 1; i < pool->worker_count; ++i) {
+		SDL_SemPost(pool->work_available);
+	}
+
+	for (u32 i = 1; i < pool->worker_count; ++i) {
+		if (pool->workers[i].thread) SDL_WaitThread(pool->workers[i].thread, NULL);
+	}
+
+	for (u32 i = 0; i < pool->worker_count; ++i) {
+		free(pool->deques[i].jobs);
+	}
+
+	free(pool->workers);
+	free(pool->deques);
+	SDL_DestroySemaphore(pool->work_available);
+	*pool = (Job_Pool){0};
+}
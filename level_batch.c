@@ -0,0 +1,479 @@
+// NOTE: Headless batch mode for CI and build scripts:
+//
+//     level_editor.program --batch [options] level...
+//
+//     --bin          <level>.bin, the raw planes with collision recomputed
+//     --level        <level>.level, the container format
+//     --rle          <level>.rle
+//     --lz           <level>.lz
+//     --asm          <level>.asm, and <level>.c with <level>.h (<level>_<n>.c per bank when over 16 KiB)
+//     --png N        <level>.Nx.png, a screenshot at N times size (1-4), drawn with --tileset
+//     --png-level N  deflate level for --png, 0 (stored) to 9 (smallest), default 6
+//     --tileset FILE tile set for --png; imported PNGs default to their own
+//     --size WxH     dimensions for raw inputs, otherwise they are taken to be square
+//     --threads N    worker threads next to the main thread, default one per extra core
+//
+// With no outputs given, --bin is assumed. PNG inputs are imported first,
+// and their tile set is written as <image>.tileset.bin. Every input is a job on the job
+// pool, so files are processed in parallel. Nothing here touches SDL video or
+// GTK, so it runs on machines without a display.
+//
+//     level_editor.program --diff [--size WxH] [--quiet] a b
+//
+// Lists the runs of cells that differ as "x,y count", one per line, unless
+// --quiet. Exits with 0 if the levels are the same and 1 if they differ.
+//
+//     level_editor.program --merge [--size WxH] [--output FILE] base ours theirs
+//
+// Three-way merge into ours, or into --output, as a git merge driver:
+//
+//     .gitattributes:  *.level merge=level
+//     .git/config:     [merge "level"]
+//                          driver = level_editor.program --merge %O %A %B
+//
+// Objects are merged as well. Conflicts keep ours and are listed as
+// "conflict x,y count" for tiles and "conflict object x,y type subtype
+// parameter" for objects; the merge then exits with 1. See level_diff.c.
+
+#define BATCH_OUTPUT_BIN   (1 << 0)
+#define BATCH_OUTPUT_LEVEL (1 << 1)
+#define BATCH_OUTPUT_RLE   (1 << 2)
+#define BATCH_OUTPUT_LZ    (1 << 3)
+#define BATCH_OUTPUT_ASM   (1 << 4)
+#define BATCH_OUTPUT_PNG   (1 << 5)
+
+typedef struct Batch_File {
+	char *path;
+	umm cell_count;
+	b32 success;
+	u64 load_ticks;
+	u64 export_ticks;
+	Rle_Stats rle_stats;
+} Batch_File;
+
+typedef struct Batch {
+	u32 outputs;
+	u32 width; // 0 unless given with --size
+	u32 height;
+
+	u32 png_scale;
+	u32 png_level;
+	Length_Buffer tile_data; // --tileset, empty if not given
+
+	u32 file_count;
+	Batch_File *files;
+
+	// One per worker, reused from file to file
+	Source_Buffer *source_buffers;
+} Batch;
+
+typedef struct Batch_Job {
+	Batch *batch;
+	Batch_File *file;
+} Batch_Job;
+
+
+static void batch_file_job(Job_Pool *pool, u32 worker_index, void *data) {
+	(void)pool;
+
+	Batch_Job *job = data;
+	Batch *batch = job->batch;
+	Batch_File *file = job->file;
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	// A missing file would load as a new empty level of the --size dimensions
+	FILE *exists = fopen(file->path, "rb");
+
+	if (!exists) {
+		fprintf(stderr, "Could not open file %s for reading.\n", file->path);
+		return;
+	}
+
+	fclose(exists);
+
+	Level_Entry entry = {0};
+	copy_string(entry.path, sizeof(entry.path), file->path, strlen(file->path));
+	entry.width = batch->width;
+	entry.height = batch->height;
+
+	Level *level = NULL;
+	Length_Buffer image_tile_data = {0};
+
+	if (level_path_is_png(file->path)) {
+		level = calloc(1, sizeof(Level));
+		char tileset_path[1100];
+
+		if (level && import_png_grid(file->path, &level->grid, &image_tile_data) &&
+			write_png_tileset(file->path, image_tile_data, tileset_path, sizeof(tileset_path)))
+		{
+			level_count_tile_uses(level);
+		}
+		else if (level) {
+			level_free(level);
+			level = NULL;
+		}
+	}
+	else {
+		level = level_load_for_entry(&entry);
+	}
+
+	u64 loaded = SDL_GetPerformanceCounter();
+	file->load_ticks = loaded - start;
+
+	if (!level) {
+		free(image_tile_data.data);
+		return;
+	}
+
+	file->cell_count = (umm)level->grid.width * level->grid.height;
+
+	char export_path[1100];
+	b32 success = true;
+
+	if (batch->outputs & BATCH_OUTPUT_BIN) {
+		success = export_level_binary(level, file->path) && success;
+	}
+
+	if (batch->outputs & BATCH_OUTPUT_LEVEL) {
+		level_export_path(export_path, sizeof(export_path), file->path, ".level");
+		success = save_level_container(level, export_path) && success;
+	}
+
+	if (batch->outputs & BATCH_OUTPUT_RLE) {
+		success = export_level_rle(level, file->path, &file->rle_stats) && success;
+	}
+
+	if (batch->outputs & BATCH_OUTPUT_LZ) {
+		success = export_level_lz(level, file->path) && success;
+	}
+
+	if (batch->outputs & BATCH_OUTPUT_ASM) {
+		success = export_level_sources(level, file->path, &batch->source_buffers[worker_index]) && success;
+	}
+
+	if (batch->outputs & BATCH_OUTPUT_PNG) {
+		Length_Buffer tile_data = batch->tile_data.data ? batch->tile_data : image_tile_data;
+
+		if (tile_data.data) {
+			success = export_level_png(level, file->path, tile_data.data, tile_data.length, batch->png_scale, batch->png_level) && success;
+		}
+		else {
+			fprintf(stderr, "No tile set to draw %s with, give one with --tileset.\n", file->path);
+			success = false;
+		}
+	}
+
+	free(image_tile_data.data);
+	level_free(level);
+
+	file->export_ticks = SDL_GetPerformanceCounter() - loaded;
+	file->success = success;
+}
+
+static int batch_main(int argc, char **argv) {
+
+	Batch batch = {0};
+	batch.png_level = PNG_DEFAULT_COMPRESSION;
+	s32 cpu_count = SDL_GetCPUCount();
+	u32 thread_count = cpu_count > 1 ? cpu_count - 1 : 0;
+
+	batch.files = calloc(argc ? argc : 1, sizeof(Batch_File));
+	if (!batch.files) panic("Out of memory.\n");
+
+	for (int i = 0; i < argc; ++i) {
+		char *arg = argv[i];
+
+		if (strcmp(arg, "--bin") == 0) batch.outputs |= BATCH_OUTPUT_BIN;
+		else if (strcmp(arg, "--level") == 0) batch.outputs |= BATCH_OUTPUT_LEVEL;
+		else if (strcmp(arg, "--rle") == 0) batch.outputs |= BATCH_OUTPUT_RLE;
+		else if (strcmp(arg, "--lz") == 0) batch.outputs |= BATCH_OUTPUT_LZ;
+		else if (strcmp(arg, "--asm") == 0) batch.outputs |= BATCH_OUTPUT_ASM;
+		else if (strcmp(arg, "--png") == 0 && i + 1 < argc) {
+			batch.outputs |= BATCH_OUTPUT_PNG;
+			batch.png_scale = strtoul(argv[++i], NULL, 10);
+			if (batch.png_scale < 1 || batch.png_scale > 4) panic("Bad screenshot scale %s, expected 1 to 4.\n", argv[i]);
+		}
+		else if (strcmp(arg, "--png-level") == 0 && i + 1 < argc) {
+			char *end;
+			batch.png_level = strtoul(argv[++i], &end, 10);
+			if (*end || end == argv[i] || batch.png_level > 9) panic("Bad deflate level %s, expected 0 to 9.\n", argv[i]);
+		}
+		else if (strcmp(arg, "--tileset") == 0 && i + 1 < argc) {
+			char *tileset_path = argv[++i];
+			batch.tile_data = read_entire_file(tileset_path);
+			if (!batch.tile_data.data) panic("Could not open file %s for reading.\n", tileset_path);
+		}
+		else if (strcmp(arg, "--size") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%ux%u", &batch.width, &batch.height) != 2 ||
+				batch.width == 0 || batch.width > LEVEL_MAX_WIDTH ||
+				batch.height == 0 || batch.height > LEVEL_MAX_HEIGHT)
+			{
+				panic("Bad level size %s.\n", argv[i]);
+			}
+		}
+		else if (strcmp(arg, "--threads") == 0 && i + 1 < argc) {
+			thread_count = strtoul(argv[++i], NULL, 10);
+		}
+		else if (arg[0] == '-' && arg[1] == '-') {
+			panic("Unknown batch option %s.\n", arg);
+		}
+		else {
+			batch.files[batch.file_count++].path = arg;
+		}
+	}
+
+	if (batch.file_count == 0) {
+		panic("--batch expects at least one level file.\n");
+	}
+
+	if (!batch.outputs) batch.outputs = BATCH_OUTPUT_BIN;
+
+	// Several files already keep every thread busy
+	png_import_thread_count = batch.file_count == 1 ? thread_count : 0;
+
+	Batch_Job *jobs = calloc(batch.file_count, sizeof(Batch_Job));
+	batch.source_buffers = calloc(thread_count + 1, sizeof(Source_Buffer));
+
+	if (!jobs || !batch.source_buffers) panic("Out of memory.\n");
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	Job_Pool pool;
+	job_pool_start(&pool, thread_count);
+
+	for (u32 i = 0; i < batch.file_count; ++i) {
+		jobs[i] = (Batch_Job){&batch, &batch.files[i]};
+		job_pool_submit(&pool, 0, batch_file_job, &jobs[i]);
+	}
+
+	job_pool_stop(&pool);
+
+	u64 end = SDL_GetPerformanceCounter();
+	double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+
+	u32 failed_count = 0;
+	u64 busy_ticks = 0;
+	u64 cell_count = 0;
+	Rle_Stats rle_stats = {0};
+
+	for (u32 i = 0; i < batch.file_count; ++i) {
+		Batch_File *file = &batch.files[i];
+
+		printf("%-6s %8.2f ms load %8.2f ms export  %s\n",
+			file->success ? "ok" : "FAILED",
+			file->load_ticks * ms_per_tick,
+			file->export_ticks * ms_per_tick,
+			file->path);
+
+		failed_count += !file->success;
+		busy_ticks += file->load_ticks + file->export_ticks;
+		cell_count += file->cell_count;
+
+		rle_stats.raw_size += file->rle_stats.raw_size;
+		rle_stats.compressed_size += file->rle_stats.compressed_size;
+		rle_stats.decode_cycles += file->rle_stats.decode_cycles;
+	}
+
+	double wall_ms = (end - start) * ms_per_tick;
+
+	printf("\n%u files, %u failed, %llu cells, %.1f ms on %u threads (%.2f files in flight on average)\n",
+		batch.file_count, failed_count, cell_count, wall_ms, thread_count + 1,
+		wall_ms > 0 ? busy_ticks * ms_per_tick / wall_ms : 0.0);
+
+	if (rle_stats.raw_size) {
+		printf("RLE: %llu -> %llu bytes (%.1f%%)\n",
+			rle_stats.raw_size, rle_stats.compressed_size,
+			100.0 * rle_stats.compressed_size / rle_stats.raw_size);
+	}
+
+	for (u32 i = 0; i <= thread_count; ++i) {
+		source_buffer_free(&batch.source_buffers[i]);
+	}
+
+	free(batch.source_buffers);
+	free(batch.tile_data.data);
+	free(jobs);
+	free(batch.files);
+
+	return failed_count ? 1 : 0;
+}
+
+// NOTE: Loads a level for --diff and --merge. Raw files take the
+// --size dimensions, or are taken to be square when width is 0.
+static Level *diff_load_level(char *path, u32 width, u32 height) {
+	FILE *exists = fopen(path, "rb");
+
+	if (!exists) {
+		fprintf(stderr, "Could not open file %s for reading.\n", path);
+		return NULL;
+	}
+
+	fclose(exists);
+
+	Level_Entry entry = {0};
+	copy_string(entry.path, sizeof(entry.path), path, strlen(path));
+	entry.width = width;
+	entry.height = height;
+
+	return level_load_for_entry(&entry);
+}
+
+static void diff_print_runs(char *label, Diff_Runs *runs) {
+	for (umm i = 0; i < runs->count; ++i) {
+		Diff_Run *run = &runs->runs[i];
+		printf("%s%u,%u %u\n", label, run->x, run->y, run->count);
+	}
+}
+
+static void diff_parse_size(char *arg, u32 *width, u32 *height) {
+	if (sscanf(arg, "%ux%u", width, height) != 2 ||
+		*width == 0 || *width > LEVEL_MAX_WIDTH ||
+		*height == 0 || *height > LEVEL_MAX_HEIGHT)
+	{
+		panic("Bad level size %s.\n", arg);
+	}
+}
+
+static int diff_main(int argc, char **argv) {
+	u32 width = 0;
+	u32 height = 0;
+	b32 quiet = false;
+	char *paths[2];
+	u32 path_count = 0;
+
+	for (int i = 0; i < argc; ++i) {
+		char *arg = argv[i];
+
+		if (strcmp(arg, "--quiet") == 0) quiet = true;
+		else if (strcmp(arg, "--size") == 0 && i + 1 < argc) diff_parse_size(argv[++i], &width, &height);
+		else if (arg[0] == '-' && arg[1] == '-') panic("Unknown diff option %s.\n", arg);
+		else if (path_count < 2) paths[path_count++] = arg;
+		else panic("--diff expects two level files.\n");
+	}
+
+	if (path_count != 2) panic("--diff expects two level files.\n");
+
+	Level *a = diff_load_level(paths[0], width, height);
+	Level *b = diff_load_level(paths[1], width, height);
+
+	int result = 2;
+
+	if (a && b) {
+		Diff_Runs runs = {0};
+		u32 changed_rows;
+
+		u64 start = SDL_GetPerformanceCounter();
+		b32 success = diff_grids(&a->grid, &b->grid, &runs, &changed_rows);
+		u64 end = SDL_GetPerformanceCounter();
+
+		if (success) {
+			if (!quiet) diff_print_runs("", &runs);
+
+			fprintf(stderr, "%llu cells in %llu runs differ, on %u of %u rows (%.2f ms)\n",
+				runs.cell_count, runs.count,
+				changed_rows, a->grid.height,
+				(double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+
+			result = runs.cell_count ? 1 : 0;
+		}
+
+		diff_runs_free(&runs);
+	}
+
+	if (a) level_free(a);
+	if (b) level_free(b);
+
+	return result;
+}
+
+static int merge_main(int argc, char **argv) {
+	u32 width = 0;
+	u32 height = 0;
+	char *output_path = NULL;
+	char *paths[3];
+	u32 path_count = 0;
+
+	for (int i = 0; i < argc; ++i) {
+		char *arg = argv[i];
+
+		if (strcmp(arg, "--size") == 0 && i + 1 < argc) diff_parse_size(argv[++i], &width, &height);
+		else if (strcmp(arg, "--output") == 0 && i + 1 < argc) output_path = argv[++i];
+		else if (arg[0] == '-' && arg[1] == '-') panic("Unknown merge option %s.\n", arg);
+		else if (path_count < 3) paths[path_count++] = arg;
+		else panic("--merge expects the base, our and their level files.\n");
+	}
+
+	if (path_count != 3) panic("--merge expects the base, our and their level files.\n");
+
+	char *our_path = paths[1];
+
+	if (!output_path && (level_path_is_png(our_path) || level_path_is_tiled(our_path))) {
+		panic("%s is only imported, give the merged level a name with --output.\n", our_path);
+	}
+
+	Level *base = diff_load_level(paths[0], width, height);
+	Level *ours = diff_load_level(our_path, width, height);
+	Level *theirs = diff_load_level(paths[2], width, height);
+
+	int result = 2;
+
+	if (base && ours && theirs) {
+		Level_Merge merge;
+
+		u64 start = SDL_GetPerformanceCounter();
+		b32 success = merge_grids(&base->grid, &ours->grid, &theirs->grid, &merge);
+		if (success) {
+			merge_apply(&merge, &ours->grid, &theirs->grid);
+			merge_objects(&base->objects, &ours->objects, &theirs->objects, &merge);
+			merge_apply_objects(&merge, &ours->objects);
+		}
+		u64 end = SDL_GetPerformanceCounter();
+
+		if (success) {
+			// NOTE: Written back in the format ours came in, git hands
+			// the driver temporary files without an extension.
+			if (output_path) {
+				success = save_level(ours, output_path);
+			}
+			else if (level_file_is_container(our_path)) {
+				success = save_level_container(ours, our_path);
+			}
+			else {
+				success = save_level_binary(&ours->grid, our_path);
+				success = save_level_objects(&ours->objects, our_path) && success;
+			}
+		}
+
+		if (success) {
+			diff_print_runs("conflict ", &merge.conflicts);
+
+			for (u32 i = 0; i < merge.object_conflict_count; ++i) {
+				Object *object = &merge.object_conflicts[i];
+				printf("conflict object %u,%u %u %u %u\n", object->x, object->y, object->type, object->subtype, object->parameter);
+			}
+
+			fprintf(stderr, "%llu cells from ours, %llu from theirs, %llu changed the same on both, %llu conflicts kept as ours (%.2f ms)\n",
+				merge.ours_count,
+				merge.theirs.cell_count,
+				merge.same_count,
+				merge.conflicts.cell_count,
+				(double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+
+			fprintf(stderr, "%u objects added and %u removed from theirs, %u object conflicts kept as ours\n",
+				merge.objects_added_count,
+				merge.objects_removed_count,
+				merge.object_conflict_count);
+
+			result = merge.conflicts.cell_count || merge.object_conflict_count ? 1 : 0;
+		}
+
+		level_merge_free(&merge);
+	}
+
+	if (base) level_free(base);
+	if (ours) level_free(ours);
+	if (theirs) level_free(theirs);
+
+	return result;
+}
@@ -0,0 +1,580 @@
+// NOTE: Metatile (block) layer. The game thinks in 16x16 pixel blocks
+// (see the 2x2 neighbourhood in tile_collision_flags), so a level can also be
+// shipped as a grid of indices into a dictionary of the distinct 2x2 (or 4x4)
+// groups of tiles it uses, see save_level_blocks.
+//
+// NOTE: The tile grid stays the level; the block layer is a deduplicated view
+// of it, used to paint and pick whole blocks and to export <level>.blocks. It
+// is built by block_layer_extract and kept in sync with every tile edit by
+// block_layer_tile_changed. Blocks are reference counted: a block no cell uses
+// any more goes on a free list and its slot is reused by the next new block,
+// so the dictionary stays at the blocks in use instead of growing with every
+// edit. The block the editor paints with (brush) is never reused.
+
+#define BLOCK_MAX_SIZE 4
+#define BLOCK_NONE 0xffffffff
+#define BLOCK_FILE_MAGIC 0x314b4c42 // "BLK1"
+
+typedef struct Block_Layer {
+	u32 block_size; // 2 or 4, 0 when the level is not in metatile mode
+	u32 width;      // In blocks
+	u32 height;
+	u32 *cells;     // Block index per block cell, row by row
+
+	u32 block_count;
+	u32 block_capacity;
+	Tile *block_tiles; // block_size*block_size tiles per block, row by row
+	u32 *block_uses;
+
+	// Blocks whose uses dropped to 0. Some may have been used again since,
+	// they are skipped when popped.
+	u32 free_count;
+	u32 *free_blocks; // block_capacity long
+
+	u32 brush; // Kept even when unused, and renumbered by block_layer_compact
+
+	// Open addressing hash of block contents. Slots hold block index + 1.
+	u32 hash_capacity;
+	u32 *hash_slots;
+} Block_Layer;
+
+
+static inline u32 block_hash(Tile *tiles, u32 tile_count) {
+	u32 hash = 2166136261u;
+
+	for (u32 i = 0; i < tile_count; ++i) {
+		hash = (hash ^ tiles[i]) * 16777619u;
+	}
+
+	return hash ^ (hash >> 15);
+}
+
+static inline Tile *block_layer_block_tiles(Block_Layer *layer, u32 block_index) {
+	return &layer->block_tiles[(umm)block_index * layer->block_size * layer->block_size];
+}
+
+static void block_layer_free(Block_Layer *layer) {
+	free(layer->cells);
+	free(layer->block_tiles);
+	free(layer->block_uses);
+	free(layer->free_blocks);
+	free(layer->hash_slots);
+	*layer = (Block_Layer){0};
+}
+
+static umm block_layer_memory_size(Block_Layer *layer) {
+	umm result = (umm)layer->width * layer->height * sizeof(u32);
+	result += (umm)layer->block_capacity * (layer->block_size * layer->block_size * sizeof(Tile) + 2 * sizeof(u32));
+	result += (umm)layer->hash_capacity * sizeof(u32);
+	return result;
+}
+
+static void block_layer_rehash(Block_Layer *layer, u32 new_capacity) {
+	free(layer->hash_slots);
+	layer->hash_capacity = new_capacity;
+	layer->hash_slots = calloc(new_capacity, sizeof(u32));
+
+	if (!layer->hash_slots) {
+		panic("Out of memory growing the block dictionary.\n");
+	}
+
+	u32 tile_count = layer->block_size * layer->block_size;
+
+	for (u32 block = 0; block < layer->block_count; ++block) {
+		u32 slot = block_hash(block_layer_block_tiles(layer, block), tile_count) & (new_capacity - 1);
+		while (layer->hash_slots[slot]) slot = (slot + 1) & (new_capacity - 1);
+		layer->hash_slots[slot] = block + 1;
+	}
+}
+
+// NOTE: The slot holding the block with these tiles, or the empty
+// slot it would go in.
+static u32 block_layer_slot(Block_Layer *layer, Tile *tiles) {
+
+	u32 tile_count = layer->block_size * layer->block_size;
+	u32 slot = block_hash(tiles, tile_count) & (layer->hash_capacity - 1);
+
+	while (layer->hash_slots[slot]) {
+		u32 block = layer->hash_slots[slot] - 1;
+
+		if (memcmp(block_layer_block_tiles(layer, block), tiles, tile_count * sizeof(Tile)) == 0) {
+			break;
+		}
+
+		slot = (slot + 1) & (layer->hash_capacity - 1);
+	}
+
+	return slot;
+}
+
+// NOTE: Takes block out of the hash, moving the blocks after it in its probe
+// sequence back so no lookup runs into the hole.
+static void block_layer_unlink(Block_Layer *layer, u32 block) {
+
+	u32 tile_count = layer->block_size * layer->block_size;
+	u32 mask = layer->hash_capacity - 1;
+	u32 hole = block_hash(block_layer_block_tiles(layer, block), tile_count) & mask;
+
+	while (layer->hash_slots[hole] != block + 1) hole = (hole + 1) & mask;
+
+	for (u32 slot = (hole + 1) & mask; layer->hash_slots[slot]; slot = (slot + 1) & mask) {
+		u32 home = block_hash(block_layer_block_tiles(layer, layer->hash_slots[slot] - 1), tile_count) & mask;
+
+		// Can move if the hole is between its home slot and where it is now
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			layer->hash_slots[hole] = layer->hash_slots[slot];
+			hole = slot;
+		}
+	}
+
+	layer->hash_slots[hole] = 0;
+}
+
+// NOTE: One use less of block. Unused blocks, other than the brush, can be
+// reused by block_layer_intern.
+static void block_layer_release(Block_Layer *layer, u32 block) {
+
+	if (--layer->block_uses[block] || block == layer->brush) return;
+
+	if (layer->free_count == layer->block_capacity) {
+		// Full of blocks that were used again, start over from the ones unused now
+		layer->free_count = 0;
+
+		for (u32 i = 0; i < layer->block_count; ++i) {
+			if (!layer->block_uses[i] && i != layer->brush) layer->free_blocks[layer->free_count++] = i;
+		}
+
+		return;
+	}
+
+	layer->free_blocks[layer->free_count++] = block;
+}
+
+// NOTE: Returns the index of the block with these tiles, adding it to
+// the dictionary if it is new. A new block takes the place of an unused one
+// if there is any.
+static u32 block_layer_intern(Block_Layer *layer, Tile *tiles) {
+
+	u32 tile_count = layer->block_size * layer->block_size;
+
+	if (2 * (layer->block_count + 1) > layer->hash_capacity) {
+		block_layer_rehash(layer, layer->hash_capacity ? 2 * layer->hash_capacity : 256);
+	}
+
+	u32 slot = block_layer_slot(layer, tiles);
+	if (layer->hash_slots[slot]) return layer->hash_slots[slot] - 1;
+
+	u32 block = BLOCK_NONE;
+
+	while (layer->free_count && block == BLOCK_NONE) {
+		u32 candidate = layer->free_blocks[--layer->free_count];
+		if (!layer->block_uses[candidate] && candidate != layer->brush) block = candidate;
+	}
+
+	if (block != BLOCK_NONE) {
+		block_layer_unlink(layer, block);
+		slot = block_layer_slot(layer, tiles);
+	}
+	else {
+		if (layer->block_count == layer->block_capacity) {
+			u32 new_capacity = layer->block_capacity ? 2 * layer->block_capacity : 256;
+			Tile *block_tiles = realloc(layer->block_tiles, (umm)new_capacity * tile_count * sizeof(Tile));
+			if (block_tiles) layer->block_tiles = block_tiles;
+			u32 *block_uses = realloc(layer->block_uses, new_capacity * sizeof(u32));
+			if (block_uses) layer->block_uses = block_uses;
+			u32 *free_blocks = realloc(layer->free_blocks, new_capacity * sizeof(u32));
+			if (free_blocks) layer->free_blocks = free_blocks;
+
+			if (!block_tiles || !block_uses || !free_blocks) {
+				panic("Out of memory growing the block dictionary.\n");
+			}
+
+			layer->block_capacity = new_capacity;
+		}
+
+		block = layer->block_count++;
+	}
+
+	memcpy(block_layer_block_tiles(layer, block), tiles, tile_count * sizeof(Tile));
+	layer->block_uses[block] = 0;
+	layer->hash_slots[slot] = block + 1;
+
+	return block;
+}
+
+// NOTE: Tiles past the edge of a level whose size is not a multiple of
+// the block size read as tile 0.
+static void block_layer_read_block(Block_Layer *layer, Level_Grid *grid, u32 block_x, u32 block_y, Tile *out_tiles) {
+	u32 n = layer->block_size;
+
+	for (u32 y = 0; y < n; ++y) {
+		u32 tile_y = block_y * n + y;
+
+		for (u32 x = 0; x < n; ++x) {
+			u32 tile_x = block_x * n + x;
+			out_tiles[y*n + x] = (tile_x < grid->width && tile_y < grid->height) ? level_grid_row(grid, tile_y)[tile_x] : 0;
+		}
+	}
+}
+
+// NOTE: Builds the smallest dictionary for the grid by hashing every
+// aligned block_size x block_size group of tiles.
+static b32 block_layer_extract(Block_Layer *layer, Level_Grid *grid, u32 block_size) {
+
+	assert(block_size == 2 || block_size == 4);
+
+	block_layer_free(layer);
+
+	layer->block_size = block_size;
+	layer->width = (grid->width + block_size - 1) / block_size;
+	layer->height = (grid->height + block_size - 1) / block_size;
+	layer->cells = malloc((umm)layer->width * layer->height * sizeof(u32));
+
+	if (!layer->cells) {
+		block_layer_free(layer);
+		return false;
+	}
+
+	Tile tiles[BLOCK_MAX_SIZE*BLOCK_MAX_SIZE];
+
+	for (u32 block_y = 0; block_y < layer->height; ++block_y) {
+		for (u32 block_x = 0; block_x < layer->width; ++block_x) {
+			block_layer_read_block(layer, grid, block_x, block_y, tiles);
+
+			u32 block = block_layer_intern(layer, tiles);
+			++layer->block_uses[block];
+			layer->cells[block_y * layer->width + block_x] = block;
+		}
+	}
+
+	return true;
+}
+
+static void block_layer_tile_changed(Block_Layer *layer, Level_Grid *grid, u32 x, u32 y) {
+	u32 block_x = x / layer->block_size;
+	u32 block_y = y / layer->block_size;
+
+	Tile tiles[BLOCK_MAX_SIZE*BLOCK_MAX_SIZE];
+	block_layer_read_block(layer, grid, block_x, block_y, tiles);
+
+	u32 *cell = &layer->cells[block_y * layer->width + block_x];
+	u32 tile_count = layer->block_size * layer->block_size;
+
+	if (memcmp(block_layer_block_tiles(layer, *cell), tiles, tile_count * sizeof(Tile)) == 0) return;
+
+	// Released first, so a block only this cell used is the one reused
+	block_layer_release(layer, *cell);
+
+	u32 block = block_layer_intern(layer, tiles);
+	++layer->block_uses[block];
+	*cell = block;
+}
+
+// NOTE: The block the editor paints with. It is kept while unused, and goes
+// back to the free list once it is neither used nor the brush.
+static void block_layer_set_brush(Block_Layer *layer, u32 block) {
+	u32 previous = layer->brush;
+	layer->brush = block < layer->block_count ? block : 0;
+
+	if (previous != layer->brush && previous < layer->block_count && !layer->block_uses[previous] &&
+		layer->free_count < layer->block_capacity)
+	{
+		layer->free_blocks[layer->free_count++] = previous;
+	}
+}
+
+// NOTE: Drops blocks no cell uses any more, other than the brush. The
+// remaining blocks keep their order, so block numbers only change when
+// something was dropped.
+static void block_layer_compact(Block_Layer *layer) {
+
+	u32 tile_count = layer->block_size * layer->block_size;
+	u32 *remap = malloc((layer->block_count + 1) * sizeof(u32));
+	if (!remap) return;
+
+	u32 new_count = 0;
+
+	for (u32 block = 0; block < layer->block_count; ++block) {
+		if (layer->block_uses[block] == 0 && block != layer->brush) {
+			remap[block] = BLOCK_NONE;
+			continue;
+		}
+
+		if (new_count != block) {
+			memcpy(block_layer_block_tiles(layer, new_count), block_layer_block_tiles(layer, block), tile_count * sizeof(Tile));
+			layer->block_uses[new_count] = layer->block_uses[block];
+		}
+
+		remap[block] = new_count++;
+	}
+
+	if (new_count != layer->block_count) {
+		umm cell_count = (umm)layer->width * layer->height;
+
+		for (umm i = 0; i < cell_count; ++i) {
+			layer->cells[i] = remap[layer->cells[i]];
+		}
+
+		if (layer->brush < layer->block_count) layer->brush = remap[layer->brush];
+
+		layer->block_count = new_count;
+
+		u32 hash_capacity = 256;
+		while (hash_capacity < 2 * (new_count + 1)) hash_capacity *= 2;
+		block_layer_rehash(layer, hash_capacity);
+	}
+
+	layer->free_count = 0;
+
+	free(remap);
+}
+
+static void block_layer_blocks_path(char *out_path, umm out_path_size, char *level_path) {
+	snprintf(out_path, out_path_size, "%s.blocks", level_path);
+}
+
+// NOTE: <level>.blocks is what the game ships:
+//
+//     u32 magic, u32 block_size, u32 width, u32 height, u32 block_count
+//     block_count * block_size^2 u8 tile indices
+//     block_count u16 solid masks, bit i is tile i of the block
+//     width * height block indices, u8 if block_count <= 256 else u16
+//
+// NOTE: Only blocks in use are written, so an unused brush is left out.
+static b32 save_level_blocks(Block_Layer *layer, char *level_path) {
+
+	if (!layer->block_size) return true;
+
+	block_layer_compact(layer);
+
+	u32 *remap = malloc((layer->block_count + 1) * sizeof(u32));
+	if (!remap) {
+		fprintf(stderr, "Out of memory saving blocks.\n");
+		return false;
+	}
+
+	u32 file_block_count = 0;
+
+	for (u32 block = 0; block < layer->block_count; ++block) {
+		remap[block] = layer->block_uses[block] ? file_block_count++ : BLOCK_NONE;
+	}
+
+	if (file_block_count > 65536) {
+		fprintf(stderr, "Level uses %u distinct blocks, more than a blocks file can index.\n", file_block_count);
+		free(remap);
+		return false;
+	}
+
+	u32 tile_count = layer->block_size * layer->block_size;
+	umm cell_count = (umm)layer->width * layer->height;
+	umm index_size = file_block_count <= 256 ? 1 : 2;
+
+	umm size = 5 * sizeof(u32);
+	size += (umm)file_block_count * tile_count;
+	size += (umm)file_block_count * sizeof(u16);
+	size += cell_count * index_size;
+
+	u8 *buffer = malloc(size);
+	if (!buffer) {
+		fprintf(stderr, "Out of memory saving blocks.\n");
+		free(remap);
+		return false;
+	}
+
+	u8 *at = buffer;
+	u32 header[5] = {BLOCK_FILE_MAGIC, layer->block_size, layer->width, layer->height, file_block_count};
+	memcpy(at, header, sizeof(header));
+	at += sizeof(header);
+
+	for (u32 block = 0; block < layer->block_count; ++block) {
+		if (remap[block] == BLOCK_NONE) continue;
+
+		Tile *tiles = block_layer_block_tiles(layer, block);
+		for (u32 i = 0; i < tile_count; ++i) {
+			if ((tiles[i] & ~TILE_MASK_SOLID) > 0xff) {
+				fprintf(stderr, "Blocks use flipped tiles or tile indices above 255, which a blocks file cannot store.\n");
+				free(buffer);
+				free(remap);
+				return false;
+			}
+			*at++ = (u8)tiles[i];
+		}
+	}
+
+	for (u32 block = 0; block < layer->block_count; ++block) {
+		if (remap[block] == BLOCK_NONE) continue;
+
+		Tile *tiles = block_layer_block_tiles(layer, block);
+		u16 solid_mask = 0;
+		for (u32 i = 0; i < tile_count; ++i) solid_mask |= ((tiles[i] >> TILE_SHIFT_SOLID) & 1) << i;
+		*at++ = (u8)solid_mask;
+		*at++ = (u8)(solid_mask >> 8);
+	}
+
+	for (umm i = 0; i < cell_count; ++i) {
+		u32 block = remap[layer->cells[i]];
+		*at++ = (u8)block;
+		if (index_size == 2) *at++ = (u8)(block >> 8);
+	}
+
+	assert((umm)(at - buffer) == size);
+
+	char path[1100];
+	block_layer_blocks_path(path, sizeof(path), level_path);
+
+	b32 success = write_entire_file_atomic(path, buffer, size);
+
+	free(buffer);
+	free(remap);
+	return success;
+}
+
+// NOTE: Loads the saved dictionary so block numbers stay stable between
+// sessions. Cells that disagree with the tile grid (the level binary was
+// changed by something else) are taken from the grid.
+static b32 load_level_blocks(Block_Layer *layer, Level_Grid *grid, char *level_path) {
+
+	char path[1100];
+	block_layer_blocks_path(path, sizeof(path), level_path);
+
+	block_layer_free(layer);
+
+	Length_Buffer file = read_entire_file(path);
+	if (!file.data) return true;
+
+	u32 header[5];
+	b32 valid = file.length >= sizeof(header);
+
+	u32 tile_count = 0;
+	umm index_size = 0;
+
+	if (valid) {
+		memcpy(header, file.data, sizeof(header));
+		tile_count = header[1] * header[1];
+		index_size = header[4] <= 256 ? 1 : 2;
+
+		valid =
+			header[0] == BLOCK_FILE_MAGIC &&
+			(header[1] == 2 || header[1] == 4) &&
+			header[2] == (grid->width + header[1] - 1) / header[1] &&
+			header[3] == (grid->height + header[1] - 1) / header[1] &&
+			file.length == sizeof(header) + (umm)header[4] * (tile_count + sizeof(u16)) + (umm)header[2] * header[3] * index_size;
+	}
+
+	if (!valid) {
+		fprintf(stderr, "Blocks file %s does not match its level, ignoring it.\n", path);
+		free(file.data);
+		return true;
+	}
+
+	layer->block_size = header[1];
+	layer->width = header[2];
+	layer->height = header[3];
+	u32 block_count = header[4];
+
+	layer->cells = malloc((umm)layer->width * layer->height * sizeof(u32));
+	u32 *file_to_layer = malloc((block_count + 1) * sizeof(u32));
+
+	if (!layer->cells || !file_to_layer) {
+		block_layer_free(layer);
+		free(file_to_layer);
+		free(file.data);
+		return false;
+	}
+
+	u8 *tile_indices = file.data + sizeof(header);
+	u8 *solid_masks = tile_indices + (umm)block_count * tile_count;
+	u8 *cell_indices = solid_masks + (umm)block_count * sizeof(u16);
+
+	Tile tiles[BLOCK_MAX_SIZE*BLOCK_MAX_SIZE];
+
+	for (u32 block = 0; block < block_count; ++block) {
+		u16 solid_mask = solid_masks[2*block] | (solid_masks[2*block + 1] << 8);
+
+		for (u32 i = 0; i < tile_count; ++i) {
+			tiles[i] = tile_indices[block*tile_count + i] | (((solid_mask >> i) & 1) << TILE_SHIFT_SOLID);
+		}
+
+		// A file without duplicates keeps its numbering
+		file_to_layer[block] = block_layer_intern(layer, tiles);
+	}
+
+	umm cell_count = (umm)layer->width * layer->height;
+
+	for (umm i = 0; i < cell_count; ++i) {
+		u32 block = cell_indices[i * index_size];
+		if (index_size == 2) block |= cell_indices[i * index_size + 1] << 8;
+		block = (block < block_count) ? file_to_layer[block] : BLOCK_NONE;
+
+		u32 block_x = i % layer->width;
+		u32 block_y = i / layer->width;
+		block_layer_read_block(layer, grid, block_x, block_y, tiles);
+
+		if (block == BLOCK_NONE || memcmp(block_layer_block_tiles(layer, block), tiles, tile_count * sizeof(Tile)) != 0) {
+			block = block_layer_intern(layer, tiles);
+		}
+
+		layer->cells[i] = block;
+	}
+
+	for (u32 block = 0; block < layer->block_count; ++block) layer->block_uses[block] = 0;
+	for (umm i = 0; i < cell_count; ++i) ++layer->block_uses[layer->cells[i]];
+
+	for (u32 block = 0; block < layer->block_count; ++block) {
+		if (!layer->block_uses[block] && block != layer->brush) layer->free_blocks[layer->free_count++] = block;
+	}
+
+	free(file_to_layer);
+	free(file.data);
+	return true;
+}
+
+static void render_block(
+	SDL_Renderer *renderer,
+	Block_Layer *layer,
+	u32 block,
+	Tile_Map *tile_map,
+	SDL_Texture *tile_map_texture,
+	s32 x, s32 y,
+	s32 tile_size)
+{
+	const u32 tiles_per_row = tile_map->pixels_per_row / GAMEBOY_TILE_WIDTH;
+	if (tiles_per_row == 0) return;
+
+	u32 n = layer->block_size;
+	Tile *tiles = block_layer_block_tiles(layer, block);
+
+	for (u32 tile_y = 0; tile_y < n; ++tile_y) {
+		for (u32 tile_x = 0; tile_x < n; ++tile_x) {
+
+			u32 tile_index = tiles[tile_y*n + tile_x];
+			u32 solid_flag = tile_index & TILE_MASK_SOLID;
+			SDL_RendererFlip flip = tile_render_flip(tile_index);
+			tile_index &= TILE_MASK_INDEX;
+
+			SDL_Rect dest_rect = {
+				x + tile_x * tile_size,
+				y + tile_y * tile_size,
+				tile_size,
+				tile_size,
+			};
+			SDL_Rect source_rect = {
+				tile_index % tiles_per_row * GAMEBOY_TILE_WIDTH,
+				tile_index / tiles_per_row * GAMEBOY_TILE_WIDTH,
+				GAMEBOY_TILE_WIDTH,
+				GAMEBOY_TILE_WIDTH,
+			};
+
+			SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+			SDL_RenderCopyEx(renderer, tile_map_texture, &source_rect, &dest_rect, 0, NULL, flip);
+
+			if (solid_flag) {
+				SDL_SetRenderDrawColor(renderer, 0, 64, 128, 255);
+				SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+				SDL_RenderFillRect(renderer, &dest_rect);
+			}
+		}
+	}
+
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+}
@@ -1,9 +1,28 @@
+#if !defined(_WIN32) && !defined(WIN32)
+#define _POSIX_C_SOURCE 200809L // open, write, fsync
+#endif
+
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <errno.h>
 #include <SDL2/SDL.h>
 
+#if defined(_WIN32) || defined(WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h> // level_select.c
+#endif
+
 #define MFD_IMPLEMENTATION
 #include "miscellus_file_dialog.h"
 
@@ -39,6 +58,15 @@ typedef struct Length_Buffer {
 	u8 *data;
 } Length_Buffer;
 
+typedef struct Mapped_File {
+	umm length;
+	u8 *data; // Read only, NULL if the file could not be mapped
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} Mapped_File;
+
 
 typedef struct Tile_Map {
 	u32 tile_count;
@@ -51,7 +79,8 @@ typedef enum Application_Mode {
 	APP_MODE_EDIT_LEVEL = 1,
 	APP_MODE_EDIT_TILE = 2,
 	APP_MODE_PICK_TILE = 3,
-	COUNT_APP_MODE = 4
+	APP_MODE_EDIT_OBJECTS = 4,
+	COUNT_APP_MODE = 5
 } Application_Mode;
 
 typedef struct View {
@@ -65,77 +94,41 @@ typedef enum Action_Flags {
 	ACTION_DRAGGING = 0x2,
 } Action_Flags;
 
-typedef enum History_Span_Kind {
-	HISTORY_SPAN_GRID_DIFFERENCE = 0,
-} History_Span_Kind;
+typedef enum Draw_Tool {
+	DRAW_TOOL_FREEHAND = 0,
+	DRAW_TOOL_LINE = 1,
+	DRAW_TOOL_RECT = 2,
+	DRAW_TOOL_FILLED_RECT = 3,
+	DRAW_TOOL_ELLIPSE = 4,
+	DRAW_TOOL_FILLED_ELLIPSE = 5,
+	DRAW_TOOL_MARQUEE = 6,
+	COUNT_DRAW_TOOL = 7
+} Draw_Tool;
 
 #define TILE_SHIFT_SOLID 31
+#define TILE_SHIFT_FLIP_Y 30
+#define TILE_SHIFT_FLIP_X 29
 #define TILE_MASK_SOLID (1 << TILE_SHIFT_SOLID)
-#define TILE_MASK_INDEX (~TILE_MASK_SOLID)
+// NOTE: Mirrored tiles, as in the CGB BG map attributes. They share
+// the VRAM tile of the unflipped index.
+#define TILE_MASK_FLIP_Y (1 << TILE_SHIFT_FLIP_Y)
+#define TILE_MASK_FLIP_X (1 << TILE_SHIFT_FLIP_X)
+#define TILE_MASK_INDEX (~(TILE_MASK_SOLID | TILE_MASK_FLIP_Y | TILE_MASK_FLIP_X))
 typedef u32 Tile;
 
-typedef struct History_Span {
-	u16 kind;
-	//sequence_number;
-	u16 op_first_index;
-	u16 op_count;
-} History_Span;
-
-#define HISTORY_OP_BUFFER_LENGTH 65536
-#define HISTORY_SPAN_BUFFER_LENGTH 256
-typedef struct History {
-	u16 op_buffer_at;
-	u16 op_buffer_head;
-	u16 op_buffer_tail;
-	u8 op_buffer[HISTORY_OP_BUFFER_LENGTH];
-
-	u16 span_buffer_at;
-	u16 span_buffer_head;
-	u16 span_buffer_tail;
-	History_Span span_buffer[HISTORY_SPAN_BUFFER_LENGTH];
-} History;
-
-
+// NOTE: Dimensions of a new, empty level. Loaded levels carry their own dimensions.
 #define LEVEL_WIDTH 32
 #define LEVEL_HEIGHT 32
 #define LEVEL_SIZE (LEVEL_WIDTH*LEVEL_HEIGHT)
 
-typedef union Level_Grid {
-	Tile tiles[LEVEL_HEIGHT][LEVEL_WIDTH];
-	Tile by_index[LEVEL_SIZE];
-} Level_Grid;
-
-typedef struct Application_State {
-	Application_Mode mode;
-
-	View view_edit;
-	View view_pick;
-
-	SDL_Rect selection;
-
-	Action_Flags interaction_flags;
-
-	s32 drag_start_x;
-	s32 drag_start_y;
-
-	Tile tile_to_draw;
-	Tile_Map tile_map;
-	SDL_Texture *tile_map_texture;
-	Level_Grid level_grid;
-
-	s32 window_width;
-	s32 window_height;
-
-
-	s32 mouse_previous_x;
-	s32 mouse_previous_y;
-	u32 mouse_previous_flags;
-	s32 mouse_x;
-	s32 mouse_y;
-	u32 mouse_flags;
+#define LEVEL_MAX_WIDTH 4096
+#define LEVEL_MAX_HEIGHT 4096
 
-	History history;
-} Application_State;
+typedef struct Level_Grid {
+	u32 width;
+	u32 height;
+	Tile *tiles; // width*height tiles, row by row
+} Level_Grid;
 
 
 static Length_Buffer read_entire_file(s8 *path) {
@@ -170,6 +163,192 @@ static Length_Buffer read_entire_file(s8 *path) {
 }
 
 
+// NOTE: Writes to a temporary file next to the destination, flushes it
+// to disk and renames it over the destination. A crash mid-save leaves either
+// the old file or the new one, never a mix.
+static b32 write_entire_file_atomic(s8 *path, void *data, umm size) {
+
+	char temp_path[1100];
+	if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+		fprintf(stderr, "Path too long: %s\n", path);
+		return false;
+	}
+
+	u8 *at = data;
+	umm remaining = size;
+	b32 success = false;
+
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file = CreateFileA(temp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file != INVALID_HANDLE_VALUE) {
+		success = true;
+
+		while (success && remaining) {
+			// WriteFile takes a 32-bit size
+			DWORD chunk = remaining > 0x40000000 ? 0x40000000 : (DWORD)remaining;
+			DWORD written = 0;
+			success = WriteFile(file, at, chunk, &written, NULL) && written == chunk;
+			at += chunk;
+			remaining -= chunk;
+		}
+
+		success = FlushFileBuffers(file) && success;
+		success = CloseHandle(file) && success;
+		success = success && MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+	}
+#else
+	int file = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+	if (file >= 0) {
+		success = true;
+
+		while (success && remaining) {
+			ssize_t written = write(file, at, remaining);
+
+			if (written < 0 && errno == EINTR) continue;
+
+			success = written > 0;
+			if (success) {
+				at += written;
+				remaining -= written;
+			}
+		}
+
+		success = (fsync(file) == 0) && success;
+		success = (close(file) == 0) && success;
+		success = success && rename(temp_path, path) == 0;
+	}
+#endif
+
+	if (!success) {
+		fprintf(stderr, "Could not write file %s.\n", path);
+		remove(temp_path);
+	}
+
+	return success;
+}
+
+
+static Mapped_File map_file(s8 *path) {
+
+	Mapped_File result = {0};
+
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return result;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+
+	if (mapping) {
+		result.data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+
+	if (result.data) {
+		result.length = size.QuadPart;
+		result.file = file;
+		result.mapping = mapping;
+	}
+	else {
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+	}
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0) return result;
+
+	struct stat status;
+
+	if (fstat(file, &status) == 0 && status.st_size > 0) {
+		void *data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+		if (data != MAP_FAILED) {
+			result.data = data;
+			result.length = status.st_size;
+		}
+	}
+
+	// The mapping keeps its own reference to the file
+	close(file);
+#endif
+
+	return result;
+}
+
+static void unmap_file(Mapped_File *mapped) {
+	if (!mapped->data) return;
+
+#if defined(_WIN32) || defined(WIN32)
+	UnmapViewOfFile(mapped->data);
+	CloseHandle(mapped->mapping);
+	CloseHandle(mapped->file);
+#else
+	munmap(mapped->data, mapped->length);
+#endif
+
+	*mapped = (Mapped_File){0};
+}
+
+
+// NOTE: CRC-32 as used by zip and PNG, eight bytes at a time. The
+// tables are built by crc32_init, which must run before any thread uses them.
+static u32 crc32_tables[8][256];
+
+static void crc32_init(void) {
+	for (u32 i = 0; i < 256; ++i) {
+		u32 crc = i;
+		for (u32 bit = 0; bit < 8; ++bit) {
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+		}
+		crc32_tables[0][i] = crc;
+	}
+
+	for (u32 i = 0; i < 256; ++i) {
+		for (u32 table = 1; table < 8; ++table) {
+			u32 previous = crc32_tables[table - 1][i];
+			crc32_tables[table][i] = (previous >> 8) ^ crc32_tables[0][previous & 0xff];
+		}
+	}
+}
+
+// NOTE: Pass 0 to start, or the previous result to continue
+static u32 crc32(u32 crc, void *data, umm size) {
+	assert(crc32_tables[0][1] != 0 && "crc32_init was not called");
+
+	u8 *at = data;
+	crc = ~crc;
+
+	while (size >= 8) {
+		u32 low = (at[0] | (at[1] << 8) | (at[2] << 16) | ((u32)at[3] << 24)) ^ crc;
+		u32 high = at[4] | (at[5] << 8) | (at[6] << 16) | ((u32)at[7] << 24);
+
+		crc =
+			crc32_tables[7][low & 0xff] ^
+			crc32_tables[6][(low >> 8) & 0xff] ^
+			crc32_tables[5][(low >> 16) & 0xff] ^
+			crc32_tables[4][low >> 24] ^
+			crc32_tables[3][high & 0xff] ^
+			crc32_tables[2][(high >> 8) & 0xff] ^
+			crc32_tables[1][(high >> 16) & 0xff] ^
+			crc32_tables[0][high >> 24];
+
+		at += 8;
+		size -= 8;
+	}
+
+	while (size--) {
+		crc = (crc >> 8) ^ crc32_tables[0][(crc ^ *at++) & 0xff];
+	}
+
+	return ~crc;
+}
+
+
 __attribute__((noreturn)) static void panic(char *format, ...) {
 	fprintf(stderr, "[ERROR] ");
 	va_list args;
@@ -212,18 +391,19 @@ static Tile_Map prepare_tile_map(Length_Buffer raw_data_buffer) {
 	return result;
 }
 
+// NOTE: RGBA, lightest shade first
+static const u32 game_boy_palette[4] = {
+	0xc4cfa1ff,
+	0x8b956dff,
+	0x4d533cff,
+	0x1f1f1fff,
+};
+
 static void compute_pixels_from_gameboy_tile_format(
 	Tile_Map tile_map,
 	Length_Buffer raw_game_boy_tile_data)
 {
 
-	static const u32 game_boy_palette[4] = {
-		0xc4cfa1ff,
-		0x8b956dff,
-		0x4d533cff,
-		0x1f1f1fff,
-	};
-
 	s32 pixels_per_row = tile_map.pixels_per_row;
 
 	u8 *source_at = raw_game_boy_tile_data.data;
@@ -256,420 +436,1391 @@ static void compute_pixels_from_gameboy_tile_format(
 }
 
 
-static inline View *get_current_view(Application_State *app_state) {
-	if (app_state->mode == APP_MODE_EDIT_LEVEL) {
-		return &app_state->view_edit;
-	}
-	else if (app_state->mode == APP_MODE_PICK_TILE) {
-		return &app_state->view_pick;
+static b32 level_grid_allocate(Level_Grid *grid, u32 width, u32 height) {
+	assert(width > 0 && width <= LEVEL_MAX_WIDTH);
+	assert(height > 0 && height <= LEVEL_MAX_HEIGHT);
+
+	Tile *tiles = calloc((umm)width * height, sizeof(Tile));
+
+	if (!tiles) {
+		return false;
 	}
 
-	return NULL;
+	free(grid->tiles);
+	grid->width = width;
+	grid->height = height;
+	grid->tiles = tiles;
+
+	return true;
 }
 
+static void level_grid_free(Level_Grid *grid) {
+	free(grid->tiles);
+	grid->tiles = NULL;
+	grid->width = 0;
+	grid->height = 0;
+}
 
-static b32 load_tile_palette(Application_State *app_state, SDL_Renderer *renderer, char *palette_file_path) {
-	Length_Buffer tile_file_buffer = read_entire_file(palette_file_path);
+static inline Tile *level_grid_row(Level_Grid *grid, u32 y) {
+	return &grid->tiles[(umm)y * grid->width];
+}
 
-	if (tile_file_buffer.data == NULL) {
-		return false;
-	}
+static inline SDL_RendererFlip tile_render_flip(Tile tile) {
+	return
+		((tile & TILE_MASK_FLIP_X) ? SDL_FLIP_HORIZONTAL : 0) |
+		((tile & TILE_MASK_FLIP_Y) ? SDL_FLIP_VERTICAL : 0);
+}
 
-	// Cleanup after potential previous texture
-	if (app_state->tile_map_texture) {
-		SDL_DestroyTexture(app_state->tile_map_texture);
-	}
+// NOTE: Tile indices a level can use, enough for all of CGB VRAM. The
+// raw level format only stores the low byte.
+#define TILE_INDEX_COUNT 1024
+#define tile_index(tile) ((tile) & (TILE_INDEX_COUNT - 1))
 
-	app_state->tile_map = prepare_tile_map(tile_file_buffer);
+#include "level_objects.c"
+#include "level_blocks.c"
+#include "level_vram.c"
+#include "level_journal.c"
+#include "level_history.c"
+#include "level_diff.c"
+#include "level_select.c"
+#include "level_fill.c"
+#include "level_shapes.c"
+#include "level_stamp.c"
 
+// NOTE: All edits of a loaded level go through level_set_tile so that
+// derived state (the pre-rendered texture, the modified flag, the tile usage
+// counts) stays in sync.
+typedef struct Level {
+	Level_Grid grid;
 
-	app_state->tile_map_texture = SDL_CreateTexture(
-		renderer,
-		SDL_PIXELFORMAT_RGBA8888,
-		SDL_TEXTUREACCESS_STREAMING,
-		app_state->tile_map.pixels_per_row,
-		app_state->tile_map.pixels_per_row);
+	// Pre-rendered image of the whole level, one texel per Game Boy pixel.
+	// NULL when the level is too big for a texture, or not rendered yet.
+	SDL_Texture *texture;
 
-	void *texture_pixels;
-	s32 pitch;
+	// Tiles changed since the texture was last brought up to date.
+	// w == 0 means nothing is dirty.
+	SDL_Rect dirty;
 
-	s32 error = SDL_LockTexture(app_state->tile_map_texture, NULL, &texture_pixels, &pitch);
-	if(error) {
-		panic("Could not lock tile map texture: %s\n", SDL_GetError());
-	}
+	Object_Layer objects;
+	Block_Layer blocks;
 
-	app_state->tile_map.pixels = texture_pixels;
-	compute_pixels_from_gameboy_tile_format(app_state->tile_map, tile_file_buffer);
-	SDL_UnlockTexture(app_state->tile_map_texture);
+	// Number of cells using each tile index, and how many indices are used at all
+	u32 tile_uses[TILE_INDEX_COUNT];
+	u32 tile_kinds_used;
 
-	return true;
-}
+	Vram_Analysis vram;
 
-static inline u8 tile_collision_flags(Level_Grid *grid, u32 x, u32 y) {
-	u8 collision_flags;
+	// Records edits while this level is the one being journaled
+	Journal *journal;
 
-	u32 x_next = (x + 1) % LEVEL_WIDTH;
-	u32 y_next = (y + 1) % LEVEL_HEIGHT;
-	u32 x_next2 = (x + 2) % LEVEL_WIDTH;
-	u32 y_next2 = (y + 2) % LEVEL_HEIGHT;
+	// Set when the level was read from disk, so the journal left next to it
+	// may hold edits the file does not. Cleared once it has been looked at.
+	b32 recover_journal;
 
-	collision_flags  = ((grid->tiles[y     ][x     ] >> TILE_SHIFT_SOLID) & 1) << 0;
-	collision_flags |= ((grid->tiles[y     ][x_next] >> TILE_SHIFT_SOLID) & 1) << 1;
-	collision_flags |= ((grid->tiles[y_next][x     ] >> TILE_SHIFT_SOLID) & 1) << 2;
-	collision_flags |= ((grid->tiles[y_next][x_next] >> TILE_SHIFT_SOLID) & 1) << 3;
-	collision_flags |= (!!collision_flags) << 4;
-	collision_flags |= ((grid->tiles[y      ][x_next2] >> TILE_SHIFT_SOLID) & 1) << 5;
-	collision_flags |= ((grid->tiles[y_next2][x      ] >> TILE_SHIFT_SOLID) & 1) << 6;
-	collision_flags |= ((grid->tiles[y_next2][x_next2] >> TILE_SHIFT_SOLID) & 1) << 7;
+	// Undo steps, opened from <level>.history when the level is first shown
+	// in the editor
+	History *history;
 
-	return collision_flags;
-}
+	// Comparison with a level file, shown over the level
+	Level_Diff diff;
 
-static void save_level_binary(Level_Grid *grid, char *file_path) {
+	// Every cell holding a tile when it was selected, for replacing them all at once
+	Tile_Mask selected_cells;
 
-	FILE *file = fopen(file_path, "wb");
-	if (file) {
-		for (u32 y = 0; y < LEVEL_HEIGHT; ++y) {
-			for (u32 x = 0; x < LEVEL_HEIGHT; ++x) {
-				u8 tile_index = (u8)grid->tiles[y][x];
-				fwrite(&tile_index, sizeof(tile_index), 1, file);
-			}
-		}
+	b32 modified;
+} Level;
 
-		for (u32 y = 0; y < LEVEL_HEIGHT; ++y) {
-			for (u32 x = 0; x < LEVEL_HEIGHT; ++x) {
-				u8 collision_flags = tile_collision_flags(grid, x, y);
-				fwrite(&collision_flags, sizeof(collision_flags), 1, file);
-			}
-		}
+static inline void level_mark_dirty(Level *level, s32 x, s32 y, s32 w, s32 h) {
+	SDL_Rect *dirty = &level->dirty;
 
-		fclose(file);
-	}
-	else {
-		fprintf(stderr, "Could not open file %s for writing.\n", file_path);
+	if (dirty->w == 0) {
+		*dirty = (SDL_Rect){x, y, w, h};
+		return;
 	}
-}
-
-static void load_level_binary(Level_Grid *grid, char *file_path) {
 
-	Length_Buffer file = read_entire_file(file_path);
+	s32 x_end = dirty->x + dirty->w;
+	s32 y_end = dirty->y + dirty->h;
+	if (x + w > x_end) x_end = x + w;
+	if (y + h > y_end) y_end = y + h;
+	if (x < dirty->x) dirty->x = x;
+	if (y < dirty->y) dirty->y = y;
+	dirty->w = x_end - dirty->x;
+	dirty->h = y_end - dirty->y;
+}
 
-	u8 *tile_indices = file.data;
-	u8 *collision_flags = &file.data[LEVEL_SIZE];
+// NOTE: Usage counts, journal and history for a cell about to change
+static inline void level_record_tile_change(Level *level, u32 x, u32 y, Tile tile_from, Tile tile_to) {
+	u32 index_from = tile_index(tile_from);
+	u32 index_to = tile_index(tile_to);
 
-	if (file.data) {
-		for (u32 i = 0; i < LEVEL_SIZE; ++i) {
-			Tile tile = tile_indices[i];
-			tile |= (collision_flags[i] & 1) << TILE_SHIFT_SOLID;
-			grid->by_index[i] = tile;
-		}
-	}
-	else {
-		fprintf(stderr, "Could not open file %s for reading.\n", file_path);
+	if (index_from != index_to) {
+		if (--level->tile_uses[index_from] == 0) --level->tile_kinds_used;
+		if (level->tile_uses[index_to]++ == 0) ++level->tile_kinds_used;
 	}
+
+	if (level->journal) journal_record(level->journal, &level->grid, x, y, tile_to);
+	tile_mask_update_cell(&level->selected_cells, x, y, tile_to);
+	if (level->history) history_record(level->history, y * level->grid.width + x, tile_from, tile_to);
 }
 
-#if 0
-static History_Entry *history_next_entry(History *history) {
+// NOTE: Leaves the block layer alone, for callers that bring it up to
+// date themselves.
+static inline b32 level_write_tile(Level *level, u32 x, u32 y, Tile tile) {
+	Tile *cell = &level_grid_row(&level->grid, y)[x];
 
-	history->last = history->at + 1;
+	if (*cell != tile) {
+		level_record_tile_change(level, x, y, *cell, tile);
 
-	if (history->last >= HISTORY_OP_BUFFER_LENGTH) {
-		history->last = 0;
+		*cell = tile;
+		level_mark_dirty(level, x, y, 1, 1);
+		vram_analysis_mark_dirty(&level->vram, x, y, 1, 1);
+		level_diff_mark_dirty(&level->diff, y);
+		level->modified = true;
+		return true;
 	}
 
-	if (history->last == history->first) {
-		++history->first;
+	return false;
+}
 
-		if (history->first >= HISTORY_OP_BUFFER_LENGTH) {
-			history->first = 0;
-		}
+static inline void level_set_tile(Level *level, u32 x, u32 y, Tile tile) {
+	if (level_write_tile(level, x, y, tile) && level->blocks.block_size) {
+		block_layer_tile_changed(&level->blocks, &level->grid, x, y);
 	}
-
-	history->at = history->last;
-
-	return &history->buffer[history->last];
 }
-#endif
 
-#if 0
-static History_Span *history_append_span(History *history) {
+// NOTE: The row form of level_set_tile, for copying whole rectangles:
+// unchanged rows are skipped with memcmp, the changed cells are recorded, and
+// then each row is copied with memcpy and the rectangle marked dirty once.
+// A source_stride of 0 writes the same row into every row. The rectangle has
+// to be inside the level, and the source outside of it.
+static void level_blit(Level *level, SDL_Rect rect, Tile *source, u32 source_stride) {
+	Level_Grid *grid = &level->grid;
+	b32 changed = false;
+
+	for (s32 y = 0; y < rect.h; ++y) {
+		Tile *row = &level_grid_row(grid, rect.y + y)[rect.x];
+		Tile *from = source + (umm)y * source_stride;
 
+		if (memcmp(row, from, rect.w * sizeof(Tile)) == 0) continue;
 
-	history->span_buffer_tail = history->span_buffer_at + 1;
+		for (s32 x = 0; x < rect.w; ++x) {
+			if (row[x] != from[x]) level_record_tile_change(level, rect.x + x, rect.y + y, row[x], from[x]);
+		}
 
-	if (history->span_buffer_tail >= HISTORY_SPAN_BUFFER_LENGTH) {
-		history->span_buffer_tail = 0;
+		memcpy(row, from, rect.w * sizeof(Tile));
+		level_diff_mark_dirty(&level->diff, rect.y + y);
+		changed = true;
 	}
 
-	if (history->span_buffer_tail == history->span_buffer_head) {
-		++history->span_buffer_head;
+	if (!changed) return;
+
+	level_mark_dirty(level, rect.x, rect.y, rect.w, rect.h);
+	vram_analysis_mark_dirty(&level->vram, rect.x, rect.y, rect.w, rect.h);
+	level->modified = true;
 
-		if (history->span_buffer_head >= HISTORY_OP_BUFFER_LENGTH) {
-			history->span_buffer_head = 0;
+	if (level->blocks.block_size) {
+		u32 n = level->blocks.block_size;
+
+		for (u32 block_y = rect.y / n; block_y <= (rect.y + rect.h - 1) / n; ++block_y) {
+			for (u32 block_x = rect.x / n; block_x <= (rect.x + rect.w - 1) / n; ++block_x) {
+				block_layer_tile_changed(&level->blocks, grid, block_x * n, block_y * n);
+			}
 		}
 	}
+}
 
-	History_Span *result = &history->span_buffer[history->span_buffer_at];
+// NOTE: Writes the bits of tile under replace_bits into every cell set
+// in a bit mask laid out like Tile_Mask, keeping the rest of each cell.
+static void level_set_tiles_masked(Level *level, u64 *bits, u32 words_per_row, u32 y0, u32 y1, Tile tile, Tile replace_bits) {
+	tile &= replace_bits;
 
-	history->span_buffer_at = history->span_buffer_tail;
+	for (u32 y = y0; y <= y1; ++y) {
+		u64 *row_bits = &bits[(umm)y * words_per_row];
+		Tile *row = level_grid_row(&level->grid, y);
 
-	return result;
+		for (u32 word = 0; word < words_per_row; ++word) {
+			for (u64 word_bits = row_bits[word]; word_bits; word_bits &= word_bits - 1) {
+				u32 x = word * 64 + __builtin_ctzll(word_bits);
+				level_set_tile(level, x, y, (row[x] & ~replace_bits) | tile);
+			}
+		}
+	}
 }
-#endif
 
-#if 0
-static void history_append_op(History *history, void *data, umm size) {
+// NOTE: Applies one step of the history in either direction through
+// level_set_tile, so the texture, block layer, usage counts and journal follow.
+// Costs as much as the step changed, whatever the size of the level. False if
+// the step does not fit the level or does not decode.
+static b32 level_apply_history_step(Level *level, History_Span *span, b32 undo) {
+	History *history = level->history;
+	u32 width = level->grid.width;
+	u32 cell_count = level->grid.width * level->grid.height;
+	History_Reader reader = history_reader(span);
 
-	history->span_buffer_tail = history->span_buffer_at + size;
+	while (history_read_run(history, &reader)) {
+		Tile_Change_Run run = reader.run;
+		Tile tile = undo ? run.tile_from : run.tile_to;
 
-	if (history->span_buffer_tail >= HISTORY_SPAN_BUFFER_LENGTH) {
-		assert(history->span_buffer_tail == HISTORY_SPAN_BUFFER_LENGTH);
+		if (run.first_cell >= cell_count || run.count > cell_count - run.first_cell) return false;
 
-		history->span_buffer_tail = size - (HISTORY_SPAN_BUFFER_LENGTH - history->span_buffer_at);
-		assert(history->span_buffer_tail < HISTORY_SPAN_BUFFER_LENGTH);
+		for (u32 cell = run.first_cell; cell < run.first_cell + run.count; ++cell) {
+			level_set_tile(level, cell % width, cell / width, tile);
+		}
 	}
 
-	if (history->span_buffer_tail == history->span_buffer_head) {
-		++history->span_buffer_head;
+	return reader.runs_left == 0;
+}
 
-		if (history->span_buffer_head >= HISTORY_OP_BUFFER_LENGTH) {
-			history->span_buffer_head = 0;
-		}
-	}
+// NOTE: Sets the cells that differ from the checkpoint, comparing a
+// row of a chunk at a time
+static void level_restore_history_checkpoint(Level *level, History_Checkpoint *checkpoint) {
+	Level_Grid *grid = &level->grid;
+	if (checkpoint->width != grid->width || checkpoint->height != grid->height) return;
 
-	History_Span *result = &history->span_buffer[history->span_buffer_at];
+	for (u32 y = 0; y < grid->height; ++y) {
+		Tile *row = level_grid_row(grid, y);
+		History_Chunk **chunks = checkpoint->chunks + y / HISTORY_CHUNK_WIDTH * checkpoint->chunks_x;
+		u32 chunk_y = y % HISTORY_CHUNK_WIDTH;
 
-	history->span_buffer_at = history->span_buffer_tail;
+		for (u32 x0 = 0; x0 < grid->width; x0 += HISTORY_CHUNK_WIDTH) {
+			Tile *tiles = chunks[x0 / HISTORY_CHUNK_WIDTH]->tiles + chunk_y * HISTORY_CHUNK_WIDTH;
+			u32 width = grid->width - x0 < HISTORY_CHUNK_WIDTH ? grid->width - x0 : HISTORY_CHUNK_WIDTH;
 
-	return result;
+			if (memcmp(row + x0, tiles, width * sizeof(Tile)) == 0) continue;
+
+			for (u32 x = 0; x < width; ++x) {
+				if (row[x0 + x] != tiles[x]) level_set_tile(level, x0 + x, y, tiles[x]);
+			}
+		}
+	}
 }
-#endif
 
-#if 0
-static void history_append_grid_transition(History *history, Level_Grid *grid_from, Level_Grid *grid_to) {
+// NOTE: Takes the level to the state after step, or to the state
+// before the oldest steps for the step that was their parent. Anything not
+// yet committed is committed first.
+static b32 level_history_jump(Level *level, u32 step) {
+	History *history = level->history;
+	if (!history) return false;
 
-	History_Span *span = history_append_span(history);
-	span->kind = HISTORY_SPAN_GRID_DIFFERENCE;
-	span->op_first_index = history->op_buffer_at;
-	span->op_count = 0;
+	history_commit(history);
 
-	u32 index = 0;
+	if (step == history->current || !history_plan(history, step)) return false;
 
-	for (;;) {
+	b32 applied = true;
+	history->replaying = true;
 
-		u32 prev_index = index;
+	if (history->plan_checkpoint) {
+		level_restore_history_checkpoint(level, history->plan_checkpoint);
+	}
 
-		while (grid_from->by_index[index] == grid_to->by_index[index]) {
-			++index;
-			if (index == LEVEL_SIZE) break;
-		}
+	// Checkpoints along the way, for the steps that have none near them yet
+	for (u32 i = 0; applied && i < history->path_undo_count; ++i) {
+		History_Span *span = history_span(history, history->path_undo[i]);
+		applied = level_apply_history_step(level, span, true);
+		if (applied) history_cover_step(history, span->parent);
+	}
 
-		// NOTE(jakob): tile_from = tile_to implies skip or "no change"
-		Tile_Change_Run run;
-		run.tile_from = 0;
-		run.tile_to = 0;
-		run.count = index - prev_index;
+	for (u32 i = 0; applied && i < history->path_redo_count; ++i) {
+		applied = level_apply_history_step(level, history_span(history, history->path_redo[i]), false);
+		if (applied) history_cover_step(history, history->path_redo[i]);
+	}
 
-		if (run.count) {
-			++span->op_count;
-			history_append_op(history, &run, sizeof(run));
-		}
+	history->replaying = false;
 
-		if (index < LEVEL_SIZE) {
-			run.tile_from = grid_from->by_index[index];
-			run.tile_to = grid_to->by_index[index];
+	if (!applied) {
+		fprintf(stderr, "The undo history is damaged, clearing it.\n");
+		history_clear(history);
+		return false;
+	}
 
-			assert(run.tile_from != run.tile_to);
+	history_arrive(history, step);
+	return true;
+}
 
-			prev_index = index;
+static b32 level_undo(Level *level) {
+	if (!level->history) return false;
 
-			for (;;) {
-				++index;
-				if (index == LEVEL_SIZE) break;
-				if (run.tile_from != grid_from->by_index[index]) break;
-				if (run.tile_to != grid_to->by_index[index]) break;
-			}
+	history_commit(level->history);
 
-			run.count = index - prev_index;
+	if (!history_can_undo(level->history)) return false;
+	return level_history_jump(level, history_span(level->history, level->history->current)->parent);
+}
 
-			if (run.count) {
-				++span->op_count;
-				history_append_op(history, &run, sizeof(run));
-			}
-		}
-		else {
-			break;
-		}
-	}
+static b32 level_redo(Level *level) {
+	if (!level->history) return false;
+
+	history_commit(level->history);
+
+	u32 step = history_redo_target(level->history);
+	return step != HISTORY_NO_STEP ? level_history_jump(level, step) : false;
 }
-#endif
 
-static void draw_tile_flood_fill(u32 x, u32 y, Tile tile, Level_Grid *grid/*, History *history*/) {
+// NOTE: The steps from oldest to newest across rect, light where they
+// lead to the current step and dark on other branches, with the current step
+// marked. Steps share a column when there are more of them than pixels.
+static void draw_history_timeline(SDL_Renderer *renderer, History *history, SDL_Rect rect) {
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 120);
+	SDL_RenderFillRect(renderer, &rect);
 
-	u32 tile_to_fill_over = grid->tiles[y][x];
+	if (rect.w <= 0) return;
 
-	if (tile_to_fill_over != tile) {
+	u32 base;
+	u32 mark = history_mark_current_branch(history, &base);
+	u32 length = history_timeline_length(history);
 
-		// Level_Grid old_grid = *grid;
+	s32 run_start = 0;
+	s32 run_kind = -1; // 1 on the current branch, 0 off it
 
-		u32 stack_position = 0;
-		u32 stack[LEVEL_SIZE];
+	for (s32 column = 0; column <= rect.w; ++column) {
+		s32 kind = -1;
 
-		for (;;) {
+		if (column < rect.w) {
+			u32 first = (u32)((u64)column * length / rect.w);
+			u32 last = (u32)((u64)(column + 1) * length / rect.w);
+			if (last > first) --last;
 
-			// Spool to beginning of line segment:
-			while (x != 0) {
-				if (tile_to_fill_over != grid->tiles[y][x-1]) {
-					break;
-				}
-				--x;
-			}
+			kind = 0;
 
-			b32 search_above = true;
-			b32 search_below = true;
+			for (u32 position = first; position <= last && !kind; ++position) {
+				u32 step = history_timeline_step(history, position);
+				kind = position ? history_step_marked(history, step, mark) : step == base;
+			}
+		}
 
-			do {
-				// Fill
-				grid->tiles[y][x] = tile;
+		if (kind == run_kind) continue;
 
-				if (y > 0) {
+		if (run_kind >= 0) {
+			if (run_kind) SDL_SetRenderDrawColor(renderer, 220, 220, 220, 220);
+			else SDL_SetRenderDrawColor(renderer, 100, 100, 100, 200);
 
-					b32 above_should_fill = (tile_to_fill_over == grid->tiles[y-1][x]);
+			SDL_Rect run = {rect.x + run_start, rect.y + 4, column - run_start, rect.h - 8};
+			SDL_RenderFillRect(renderer, &run);
+		}
 
-					if (search_above && above_should_fill) {
-						stack[stack_position++] = x;
-						stack[stack_position++] = y-1;
-						search_above = false;
-					}
-					else if (!search_above && !above_should_fill) {
-						search_above = true;
-					}
-				}
+		run_start = column;
+		run_kind = kind;
+	}
 
-				if (y < LEVEL_HEIGHT-1) {
+	u32 position = history_timeline_position(history, history->current);
+	SDL_Rect current = {rect.x + (s32)(((u64)position * 2 + 1) * rect.w / (2 * length)) - 1, rect.y, 3, rect.h};
 
-					b32 below_should_fill = (tile_to_fill_over == grid->tiles[y+1][x]);
+	SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+	SDL_RenderFillRect(renderer, &current);
+}
 
-					if (search_below && below_should_fill) {
-						stack[stack_position++] = x;
-						stack[stack_position++] = y+1;
-						search_below = false;
-					}
-					else if (!search_below && !below_should_fill) {
-						search_below = true;
-					}
-				}
+// NOTE: Only needed when a whole grid is replaced (loading). Edits keep
+// the counts up to date in level_write_tile.
+static void level_count_tile_uses(Level *level) {
+	memset(level->tile_uses, 0, sizeof(level->tile_uses));
 
-				++x;
+	umm cell_count = (umm)level->grid.width * level->grid.height;
 
-				if (tile_to_fill_over != grid->tiles[y][x]) {
-					break;
-				}
-			} while (x < LEVEL_WIDTH);
+	for (umm i = 0; i < cell_count; ++i) {
+		++level->tile_uses[tile_index(level->grid.tiles[i])];
+	}
 
-			if (stack_position >= 2) {
-				do {
-					y = stack[--stack_position];
-					x = stack[--stack_position];
-				} while (stack_position >= 2 && tile_to_fill_over != grid->tiles[y][x]);
-			}
-			else {
-				break;
-			}
-		}
+	level->tile_kinds_used = 0;
 
-		//history_append_grid_transition(history, &old_grid, grid);
+	for (u32 i = 0; i < TILE_INDEX_COUNT; ++i) {
+		if (level->tile_uses[i]) ++level->tile_kinds_used;
 	}
 }
 
-void draw_tile_line(u32 x0, u32 y0, u32 x1, u32 y1, Tile tile, Tile grid[LEVEL_HEIGHT][LEVEL_WIDTH]) {
+// NOTE: Starts journaling level under path. If the level was just loaded
+// and an earlier session left a journal there, the edits it holds are applied
+// first, through level_set_tile so they count as unsaved changes. The undo
+// history next to path is opened here too, for the grid as recovered: a
+// history that was closed there already holds the recovered edits, otherwise
+// they are one step.
+static void level_open_journal(Level *level, Journal *journal, char *path) {
+
+	Level_Grid recovered = {0};
+	Level_Grid *grid = &level->grid;
+	u32 generation = 0;
+	umm record_count = 0;
+
+	// A level that stayed in memory is up to date, only a fresh load recovers
+	b32 has_recovered = level->recover_journal && journal_recover(path, &recovered, &generation, &record_count);
+	level->recover_journal = false;
+
+	if (has_recovered && (recovered.width != grid->width || recovered.height != grid->height)) {
+		fprintf(stderr, "The journal for %s is for a %ux%u level, not recovering it.\n", path, recovered.width, recovered.height);
+		level_grid_free(&recovered);
+		has_recovered = false;
+	}
 
-	s32 dx = x1 - x0;
-	s32 dy = y1 - y0;
-	u32 x, x_end;
-	u32 y, y_end;
-	s32 sx, sy;
+	b32 history_restored = false;
 
-	float error = 0;
+	if (!level->history) {
+		level->history = history_open(path, has_recovered ? &recovered : grid, &history_restored);
+		if (level->history) level->history->grid = grid;
+	}
+	else {
+		// The level was saved under a new path, the history goes with it
+		history_move(level->history, grid, path);
+	}
 
-	if (abs(dx) > abs(dy)) {
+	if (has_recovered) {
+		u32 changed_count = 0;
 
-		sy = dy ? (dy > 0 ? 1 : -1) : 0;
+		if (level->history) level->history->replaying = history_restored;
 
-		float delta_error = fabs((float)dy / (float)dx); // dx can not be 0 since condition is: '>'
+		for (u32 y = 0; y < grid->height; ++y) {
+			Tile *row = level_grid_row(&recovered, y);
 
-		if (dx > 0) {
-			x = x0;
-			y = y0;
-			x_end = x1;
+			for (u32 x = 0; x < grid->width; ++x) {
+				if (level_grid_row(grid, y)[x] != row[x]) {
+					level_set_tile(level, x, y, row[x]);
+					++changed_count;
+				}
+			}
 		}
-		else {
-			x = x1;
-			y = y1;
-			x_end = x0;
-			sy = -sy;
+
+		if (level->history) {
+			level->history->replaying = false;
+			history_commit(level->history);
+		}
+
+		if (changed_count) {
+			fprintf(stderr, "Recovered %u changed tiles for %s from its journal (%llu edits).\n", changed_count, path, record_count);
+		}
+
+		level_grid_free(&recovered);
+	}
+
+	level->journal = journal;
+	journal_open(journal, &level->grid, path, generation);
+}
+
+static inline u8 tile_collision_flags(Level_Grid *grid, u32 x, u32 y) {
+	u8 collision_flags;
+
+	u32 x_next = (x + 1) % grid->width;
+	u32 y_next = (y + 1) % grid->height;
+	u32 x_next2 = (x + 2) % grid->width;
+	u32 y_next2 = (y + 2) % grid->height;
+
+	Tile *row       = level_grid_row(grid, y);
+	Tile *row_next  = level_grid_row(grid, y_next);
+	Tile *row_next2 = level_grid_row(grid, y_next2);
+
+	collision_flags  = ((row      [x      ] >> TILE_SHIFT_SOLID) & 1) << 0;
+	collision_flags |= ((row      [x_next ] >> TILE_SHIFT_SOLID) & 1) << 1;
+	collision_flags |= ((row_next [x      ] >> TILE_SHIFT_SOLID) & 1) << 2;
+	collision_flags |= ((row_next [x_next ] >> TILE_SHIFT_SOLID) & 1) << 3;
+	collision_flags |= (!!collision_flags) << 4;
+	collision_flags |= ((row      [x_next2] >> TILE_SHIFT_SOLID) & 1) << 5;
+	collision_flags |= ((row_next2[x      ] >> TILE_SHIFT_SOLID) & 1) << 6;
+	collision_flags |= ((row_next2[x_next2] >> TILE_SHIFT_SOLID) & 1) << 7;
+
+	return collision_flags;
+}
+
+// NOTE: The two planes of the raw format in one buffer of 2*w*h bytes:
+// tile indices, then collision flags. Counts the tiles whose index does not
+// fit in a byte.
+static u8 *level_raw_planes(Level_Grid *grid, u32 *out_truncated_count) {
+	umm cell_count = (umm)grid->width * grid->height;
+	u8 *planes = malloc(2 * cell_count);
+	if (!planes) return NULL;
+
+	u8 *tile_indices = planes;
+	u8 *collision_flags = planes + cell_count;
+	u32 truncated_count = 0;
+
+	for (u32 y = 0; y < grid->height; ++y) {
+		Tile *row = level_grid_row(grid, y);
+
+		for (u32 x = 0; x < grid->width; ++x) {
+			*tile_indices++ = (u8)row[x];
+			truncated_count += (row[x] & TILE_MASK_INDEX) > 0xff;
+			*collision_flags++ = tile_collision_flags(grid, x, y);
 		}
+	}
+
+	if (out_truncated_count) *out_truncated_count = truncated_count;
+	return planes;
+}
+
+static b32 save_level_binary(Level_Grid *grid, char *file_path) {
+
+	u32 truncated_count;
+	u8 *planes = level_raw_planes(grid, &truncated_count);
+
+	if (!planes) {
+		fprintf(stderr, "Out of memory saving %s.\n", file_path);
+		return false;
+	}
 
-		for (; x <= x_end; ++x) {
-			grid[y][x] = tile;
-			error += delta_error;
+	if (truncated_count) {
+		fprintf(stderr, "Warning: %u tiles in %s use indices above 255, which the raw format cannot store.\n", truncated_count, file_path);
+	}
+
+	b32 success = write_entire_file_atomic(file_path, planes, 2 * (umm)grid->width * grid->height);
+	free(planes);
+
+	return success;
+}
+
+// NOTE: The raw format is just the two planes without a header. If the
+// file does not match the dimensions already in the grid it is taken to be a
+// square level.
+static b32 load_level_binary(Level_Grid *grid, char *file_path) {
+
+	Length_Buffer file = read_entire_file(file_path);
+
+	if (!file.data) {
+		fprintf(stderr, "Could not open file %s for reading.\n", file_path);
+		return false;
+	}
+
+	umm size = file.length / 2;
+
+	if (file.length != 2 * (umm)grid->width * grid->height) {
+		u32 side = (u32)sqrt((double)size);
+		while ((umm)side * side < size) ++side;
+
+		if ((file.length & 1) || side == 0 || (umm)side * side != size || side > LEVEL_MAX_WIDTH) {
+			fprintf(stderr, "Level file %s has an unexpected size of %llu bytes.\n", file_path, file.length);
+			free(file.data);
+			return false;
+		}
+
+		if (!level_grid_allocate(grid, side, side)) {
+			fprintf(stderr, "Out of memory loading %s.\n", file_path);
+			free(file.data);
+			return false;
+		}
+	}
+
+	u8 *tile_indices = file.data;
+	u8 *collision_flags = &file.data[size];
+
+	for (umm i = 0; i < size; ++i) {
+		Tile tile = tile_indices[i];
+		tile |= (collision_flags[i] & 1) << TILE_SHIFT_SOLID;
+		grid->tiles[i] = tile;
+	}
+
+	free(file.data);
+	return true;
+}
+
+#include "job_pool.c"
+#include "level_png.c"
+#include "level_tiled.c"
+#include "level_file.c"
+#include "level_export.c"
+#include "level_project.c"
+#include "level_lz.c"
+#include "level_source.c"
+#include "level_batch.c"
+
+// NOTE: Shows the cells where the level differs from a level file
+static void level_diff_open(Level *level, char *path) {
+	Level *other = diff_load_level(path, level->grid.width, level->grid.height);
+	if (!other) return;
+
+	u64 start = SDL_GetPerformanceCounter();
+	b32 success = level_diff_begin(&level->diff, &level->grid, &other->grid);
+	u64 end = SDL_GetPerformanceCounter();
+
+	if (success) {
+		fprintf(stderr, "%llu cells on %u rows differ from %s (%.2f ms)\n",
+			level->diff.changed_count, level->diff.changed_row_count, path,
+			(double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+	}
+
+	level_free(other);
+}
 
-			if (error > 0.5) {
-				y += sy;
-				error -= 1.0;
+// NOTE: Three-way merge of the changes from base to their level into
+// the level, through level_set_tile so it is one step to undo. Objects are
+// merged too, which like other object edits cannot be undone. Afterwards the
+// level is shown against the base, with the conflicts outlined.
+static void level_merge_from(Level *level, char *base_path, char *their_path) {
+	Level *base = diff_load_level(base_path, level->grid.width, level->grid.height);
+	Level *theirs = base ? diff_load_level(their_path, level->grid.width, level->grid.height) : NULL;
+
+	Level_Merge merge;
+
+	if (theirs && merge_grids(&base->grid, &level->grid, &theirs->grid, &merge)) {
+		for (umm i = 0; i < merge.theirs.count; ++i) {
+			Diff_Run *run = &merge.theirs.runs[i];
+			Tile *their_row = level_grid_row(&theirs->grid, run->y);
+
+			for (u32 x = run->x; x < run->x + run->count; ++x) {
+				level_set_tile(level, x, run->y, their_row[x]);
 			}
 		}
+
+		merge_objects(&base->objects, &level->objects, &theirs->objects, &merge);
+		merge_apply_objects(&merge, &level->objects);
+		if (merge.objects_added_count || merge.objects_removed_count) level->modified = true;
+
+		fprintf(stderr, "Merged %llu cells from %s, %llu conflicts kept as ours.\n",
+			merge.theirs.cell_count, their_path, merge.conflicts.cell_count);
+		fprintf(stderr, "Merged %u added and %u removed objects, %u object conflicts kept as ours.\n",
+			merge.objects_added_count, merge.objects_removed_count, merge.object_conflict_count);
+
+		if (level_diff_begin(&level->diff, &level->grid, &base->grid)) {
+			level->diff.conflicts = merge.conflicts;
+			merge.conflicts = (Diff_Runs){0};
+		}
+
+		level_merge_free(&merge);
 	}
-	else {
 
-		sx = dx ? (dx > 0 ? 1 : -1) : 0;
+	if (base) level_free(base);
+	if (theirs) level_free(theirs);
+}
+
+typedef struct Application_State {
+	Application_Mode mode;
+
+	View view_edit;
+	View view_pick;
+
+	// Marquee selection in tiles, shown while ACTION_SELECTING is set
+	SDL_Rect selection;
+	b32 marqueeing; // Dragging out the selection
+	s32 marquee_start_x;
+	s32 marquee_start_y;
+
+	// Ctrl+C and Ctrl+X, width*height tiles row by row
+	Level_Grid clipboard;
+
+	// Tiles lifted out of the selection to be moved, or pasted, following the
+	// mouse until they are dropped. A move drops when the button is released,
+	// a paste on the next click.
+	Level_Grid floating;
+	b32 floating_moved;
+	SDL_Rect floating_origin; // Where a move came from, to put it back
+	s32 floating_x;
+	s32 floating_y;
+	s32 floating_grab_x; // The mouse relative to the top left of the tiles
+	s32 floating_grab_y;
+
+	Action_Flags interaction_flags;
+
+	s32 drag_start_x;
+	s32 drag_start_y;
+
+	Tile tile_to_draw;
+
+	Draw_Tool draw_tool;
+	u32 brush_size;
+
+	// A shape follows the mouse from where the left button went down, and is
+	// written when it is released
+	b32 drawing_shape;
+	s32 shape_start_x;
+	s32 shape_start_y;
+	Span_List shape_spans;
+
+	// Tiles dragged out of the picker, drawn in place of tile_to_draw by the
+	// freehand tool. No tiles when a single tile was picked.
+	Level_Grid stamp;
+	Stamp_Stroke stamp_stroke;
+	b32 picking_stamp;
+	u32 stamp_pick_x; // Picker slot where the drag started
+	u32 stamp_pick_y;
+
+	b32 pick_by_usage;
+	b32 show_vram;
+	u32 vram_tile_limit;
+	u32 vram_reported_violations;
+	Object_Type object_type_to_place;
+	b32 moving_objects;
+	s32 object_move_x;
+	s32 object_move_y;
+	Tile_Map tile_map;
+	SDL_Texture *tile_map_texture;
+	Length_Buffer tile_data; // The tile set file, for exports that draw the level themselves
+	Project project;
+
+	s32 window_width;
+	s32 window_height;
 
-		float delta_error = fabs((float)dx / (float)dy);
 
-		if (dy > 0) {
-			x = x0;
-			y = y0;
-			y_end = y1;
+	s32 mouse_previous_x;
+	s32 mouse_previous_y;
+	u32 mouse_previous_flags;
+	s32 mouse_x;
+	s32 mouse_y;
+	u32 mouse_flags;
+
+	b32 show_timeline;
+	b32 scrubbing; // Dragging on the timeline
+
+	Journal journal;
+} Application_State;
+
+
+static inline View *get_current_view(Application_State *app_state) {
+	if (app_state->mode == APP_MODE_EDIT_LEVEL || app_state->mode == APP_MODE_EDIT_OBJECTS) {
+		return &app_state->view_edit;
+	}
+	else if (app_state->mode == APP_MODE_PICK_TILE) {
+		return &app_state->view_pick;
+	}
+
+	return NULL;
+}
+
+// NOTE: The selection clipped to the level, w == 0 if nothing is left
+static SDL_Rect selection_in_level(Application_State *app_state, Level *level) {
+	SDL_Rect result = {0};
+	SDL_Rect selection = app_state->selection;
+
+	if (!level || !(app_state->interaction_flags & ACTION_SELECTING)) return result;
+
+	s32 x0 = selection.x > 0 ? selection.x : 0;
+	s32 y0 = selection.y > 0 ? selection.y : 0;
+	s32 x1 = selection.x + selection.w;
+	s32 y1 = selection.y + selection.h;
+	if (x1 > (s32)level->grid.width) x1 = level->grid.width;
+	if (y1 > (s32)level->grid.height) y1 = level->grid.height;
+
+	if (x0 < x1 && y0 < y1) result = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+
+	return result;
+}
+
+// NOTE: Copies a rectangle inside the level into a grid of its own,
+// a memcpy per row
+static b32 level_copy_rect(Level *level, SDL_Rect rect, Level_Grid *out) {
+	if (!level_grid_allocate(out, rect.w, rect.h)) {
+		fprintf(stderr, "Out of memory copying %dx%d tiles.\n", rect.w, rect.h);
+		return false;
+	}
+
+	for (s32 y = 0; y < rect.h; ++y) {
+		memcpy(level_grid_row(out, y), &level_grid_row(&level->grid, rect.y + y)[rect.x], rect.w * sizeof(Tile));
+	}
+
+	return true;
+}
+
+static void level_clear_rect(Level *level, SDL_Rect rect) {
+	Tile *empty_row = calloc(rect.w, sizeof(Tile));
+	if (!empty_row) panic("Out of memory.\n");
+
+	level_blit(level, rect, empty_row, 0);
+	free(empty_row);
+}
+
+// NOTE: Writes tiles with their top left at (x, y), clipped to the
+// level. Returns the rectangle written, w == 0 if none.
+static SDL_Rect level_paste(Level *level, Level_Grid *tiles, s32 x, s32 y) {
+	SDL_Rect rect = {x, y, tiles->width, tiles->height};
+	s32 skip_x = 0;
+	s32 skip_y = 0;
+
+	if (rect.x < 0) { skip_x = -rect.x; rect.w += rect.x; rect.x = 0; }
+	if (rect.y < 0) { skip_y = -rect.y; rect.h += rect.y; rect.y = 0; }
+	if (rect.x + rect.w > (s32)level->grid.width) rect.w = level->grid.width - rect.x;
+	if (rect.y + rect.h > (s32)level->grid.height) rect.h = level->grid.height - rect.y;
+
+	if (rect.w <= 0 || rect.h <= 0) return (SDL_Rect){0};
+
+	level_blit(level, rect, &level_grid_row(tiles, skip_y)[skip_x], tiles->width);
+
+	return rect;
+}
+
+// NOTE: Puts the floating tiles down and selects where they landed
+static void drop_floating(Application_State *app_state, Level *level, s32 x, s32 y) {
+	SDL_Rect landed = level_paste(level, &app_state->floating, x, y);
+
+	app_state->selection = landed;
+	if (landed.w) app_state->interaction_flags |= ACTION_SELECTING;
+	else app_state->interaction_flags &= ~ACTION_SELECTING;
+
+	level_grid_free(&app_state->floating);
+	app_state->floating_moved = false;
+}
+
+// NOTE: Cancels a move, putting the lifted tiles back where they came
+// from. Pasted tiles are kept floating, so they can go into another level.
+static void cancel_floating_move(Application_State *app_state, Level *level) {
+	if (level && app_state->floating_moved) {
+		drop_floating(app_state, level, app_state->floating_origin.x, app_state->floating_origin.y);
+	}
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+	u64 value_a = *(const u64 *)a;
+	u64 value_b = *(const u64 *)b;
+	return (value_a > value_b) - (value_a < value_b);
+}
+
+// NOTE: Fills order with the tile index to show in each slot of the
+// picker: by index, or most used first. Returns the number of slots.
+static u32 tile_pick_order(Level *level, u32 tile_count, b32 by_usage, u32 *order) {
+
+	if (tile_count > TILE_INDEX_COUNT) tile_count = TILE_INDEX_COUNT;
+
+	if (!by_usage || !level) {
+		for (u32 i = 0; i < tile_count; ++i) order[i] = i;
+		return tile_count;
+	}
+
+	u64 keys[TILE_INDEX_COUNT];
+
+	for (u32 i = 0; i < tile_count; ++i) {
+		// Descending use count, ties by index
+		keys[i] = ((u64)(0xffffffff - level->tile_uses[i]) << 32) | i;
+	}
+
+	qsort(keys, tile_count, sizeof(*keys), compare_u64);
+
+	for (u32 i = 0; i < tile_count; ++i) order[i] = (u32)keys[i];
+	return tile_count;
+}
+
+static b32 load_tile_palette(Application_State *app_state, SDL_Renderer *renderer, char *palette_file_path) {
+	Length_Buffer tile_file_buffer = read_entire_file(palette_file_path);
+
+	if (tile_file_buffer.data == NULL) {
+		return false;
+	}
+
+	// Cleanup after potential previous texture
+	if (app_state->tile_map_texture) {
+		SDL_DestroyTexture(app_state->tile_map_texture);
+	}
+
+	app_state->tile_map = prepare_tile_map(tile_file_buffer);
+
+
+	app_state->tile_map_texture = SDL_CreateTexture(
+		renderer,
+		SDL_PIXELFORMAT_RGBA8888,
+		SDL_TEXTUREACCESS_STREAMING,
+		app_state->tile_map.pixels_per_row,
+		app_state->tile_map.pixels_per_row);
+
+	void *texture_pixels;
+	s32 pitch;
+
+	s32 error = SDL_LockTexture(app_state->tile_map_texture, NULL, &texture_pixels, &pitch);
+	if(error) {
+		panic("Could not lock tile map texture: %s\n", SDL_GetError());
+	}
+
+	app_state->tile_map.pixels = texture_pixels;
+	compute_pixels_from_gameboy_tile_format(app_state->tile_map, tile_file_buffer);
+	SDL_UnlockTexture(app_state->tile_map_texture);
+
+	free(app_state->tile_data.data);
+	app_state->tile_data = tile_file_buffer;
+
+	return true;
+}
+
+// NOTE: The tile set is shared by the whole project, so the one cut from an
+// image being imported is checked against it first. If the project's tile
+// set starts with the same tiles the indices mean the same and nothing
+// changes. A different one is refused unless switch_tileset, in which case it
+// is written next to the image and the project draws with it from now on.
+static b32 import_png_tileset(Application_State *app_state, SDL_Renderer *renderer, char *image_path, Length_Buffer tile_data, b32 switch_tileset) {
+	Project *project = &app_state->project;
+	Length_Buffer current = app_state->tile_data;
+
+	if (current.data && tile_data.length <= current.length && memcmp(current.data, tile_data.data, tile_data.length) == 0) {
+		return true;
+	}
+
+	if (!switch_tileset) {
+		fprintf(stderr, "%s uses other tiles than the tile set %s, not importing it. "
+			"Ctrl+Shift+O imports it with its own tile set, which every level is then drawn with.\n",
+			image_path, project->tileset_path);
+		return false;
+	}
+
+	char tileset_path[PROJECT_PATH_LENGTH];
+
+	if (!write_png_tileset(image_path, tile_data, tileset_path, sizeof(tileset_path)) ||
+		!load_tile_palette(app_state, renderer, tileset_path))
+	{
+		return false;
+	}
+
+	copy_string(project->tileset_path, sizeof(project->tileset_path), tileset_path, strlen(tileset_path));
+	project_invalidate_all_levels(project);
+
+	if (project->path[0]) {
+		fprintf(stderr, "Now using the tile set %s, change the tileset line of %s to keep it.\n", tileset_path, project->path);
+	}
+
+	return true;
+}
+
+// NOTE: Finds the region on bitboards first, see level_fill.c, then
+// writes it row by row through the mask.
+static void draw_tile_flood_fill(u32 x, u32 y, Tile tile, Level *level) {
+
+	Level_Grid *grid = &level->grid;
+
+	if (level_grid_row(grid, y)[x] == tile) return;
+
+	Fill_Region region;
+
+	if (!fill_region_compute(&region, grid, x, y)) {
+		fprintf(stderr, "Out of memory in flood fill.\n");
+		return;
+	}
+
+	level_set_tiles_masked(level, region.filled, region.words_per_row, region.y0, region.y1, tile, TILE_MATCH_EXACT);
+	fill_region_free(&region);
+}
+
+static void draw_shape_spans(Span_List *list, Draw_Tool tool, s32 x0, s32 y0, s32 x1, s32 y1, u32 brush_size) {
+	switch (tool) {
+		case DRAW_TOOL_FREEHAND:
+		case DRAW_TOOL_LINE: span_list_line(list, x0, y0, x1, y1, brush_size); break;
+		case DRAW_TOOL_RECT: span_list_rect(list, x0, y0, x1, y1, brush_size, false); break;
+		case DRAW_TOOL_FILLED_RECT: span_list_rect(list, x0, y0, x1, y1, brush_size, true); break;
+		case DRAW_TOOL_ELLIPSE: span_list_ellipse(list, x0, y0, x1, y1, brush_size, false); break;
+		case DRAW_TOOL_FILLED_ELLIPSE: span_list_ellipse(list, x0, y0, x1, y1, brush_size, true); break;
+		default: break;
+	}
+
+	span_list_finish(list);
+}
+
+// NOTE: Writes the spans of a finished Span_List, row by row
+static void level_set_spans(Level *level, Span_List *list, Tile tile) {
+	for (u32 i = 0; i < list->count; ++i) {
+		Span *span = &list->spans[i];
+
+		for (s32 x = span->x0; x < span->x1; ++x) {
+			level_set_tile(level, x, span->y, tile);
+		}
+	}
+}
+
+static void draw_tile_line(s32 x0, s32 y0, s32 x1, s32 y1, u32 brush_size, Tile tile, Level *level) {
+	Span_List list = {0};
+
+	span_list_begin(&list, level->grid.width, level->grid.height);
+	span_list_line(&list, x0, y0, x1, y1, brush_size);
+	span_list_finish(&list);
+	level_set_spans(level, &list, tile);
+
+	span_list_free(&list);
+}
+
+// NOTE: Stamps along the line from (x0, y0) to (x1, y1), the mouse
+// positions of the stamp, on the lattice of the stroke. Only lattice cells
+// not stamped yet are written, so every cell is written once per stroke.
+static void draw_stamp_line(s32 x0, s32 y0, s32 x1, s32 y1, Level_Grid *stamp, Stamp_Stroke *stroke, Level *level) {
+	s32 dx = abs(x1 - x0);
+	s32 dy = -abs(y1 - y0);
+	s32 sx = x0 < x1 ? 1 : -1;
+	s32 sy = y0 < y1 ? 1 : -1;
+	s32 error = dx + dy;
+
+	for (;;) {
+		s32 stamp_x, stamp_y;
+		stamp_position(stamp, x0, y0, &stamp_x, &stamp_y);
+
+		if (stamp_stroke_claim(stroke, &stamp_x, &stamp_y)) {
+			level_paste(level, stamp, stamp_x, stamp_y);
+		}
+
+		if (x0 == x1 && y0 == y1) break;
+
+		s32 error2 = 2 * error;
+		if (error2 >= dy) { error += dy; x0 += sx; }
+		if (error2 <= dx) { error += dx; y0 += sy; }
+	}
+}
+
+// NOTE: Random clicks, strokes and fills, undone, redone and jumped
+// through at random. The grid is copied after every step and has to match the
+// copy exactly whenever the history lands on that step again. Run it on a
+// small level with a new history, steps past HISTORY_SPAN_BUFFER_LENGTH
+// exercise dropping the oldest steps. False on the first mismatch.
+static b32 level_history_fuzz_test(Level *level, u32 iteration_count) {
+	History *history = level->history;
+	Level_Grid *grid = &level->grid;
+	umm cell_count = (umm)grid->width * grid->height;
+	umm grid_size = cell_count * sizeof(Tile);
+
+	history->grid = grid;
+
+	// The grid after each step, at the step number plus one
+	Tile *states = malloc((iteration_count + 1) * grid_size);
+	if (!states) panic("Out of memory.\n");
+	memcpy(states, grid->tiles, grid_size);
+
+	srand(1234);
+
+	for (u32 iteration = 0; iteration < iteration_count; ++iteration) {
+		u32 action = rand() % 12;
+
+		if (action < 6) {
+			u32 x = rand() % grid->width;
+			u32 y = rand() % grid->height;
+			Tile tile = (rand() % 8) | ((rand() % 4 == 0) ? TILE_MASK_SOLID : 0);
+			u32 steps_before = history->span_buffer_tail;
+
+			if (action < 3) {
+				level_set_tile(level, x, y, tile);
+			}
+			else if (action < 5) {
+				// A drag over several frames, crossing itself
+				history_begin_stroke(history);
+
+				for (u32 frame = rand() % 8; frame > 0; --frame) {
+					u32 to_x = rand() % grid->width;
+					u32 to_y = rand() % grid->height;
+					draw_tile_line(x, y, to_x, to_y, 1 + rand() % 3, tile, level);
+					x = to_x;
+					y = to_y;
+				}
+
+				history_end_stroke(history);
+			}
+			else {
+				draw_tile_flood_fill(x, y, tile, level);
+			}
+
+			history_commit(history);
+
+			if (history->span_buffer_tail != steps_before) {
+				memcpy(states + (history->current + 1) * cell_count, grid->tiles, grid_size);
+			}
+		}
+		else if (action < 10) {
+			b32 undo = action < 8;
+			u32 count = 1 + rand() % 5;
+
+			for (u32 i = 0; i < count; ++i) {
+				if (undo) level_undo(level);
+				else level_redo(level);
+			}
 		}
 		else {
-			x = x1;
-			y = y1;
-			y_end = y0;
-			sx = -sx;
+			u32 position = rand() % history_timeline_length(history);
+			level_history_jump(level, history_timeline_step(history, position));
+		}
+
+		if (memcmp(grid->tiles, states + (history->current + 1) * cell_count, grid_size) != 0) {
+			fprintf(stderr, "History fuzz test: grid differs from step %u after iteration %u.\n", history->current, iteration);
+			free(states);
+			return false;
+		}
+	}
+
+	fprintf(stderr, "History fuzz test: %u iterations passed.\n", iteration_count);
+	free(states);
+	return true;
+}
+
+// NOTE: level_editor.program --test-history [width height [iterations]]
+//
+// Runs level_history_fuzz_test on an empty level, 64x64 and 2000 iterations
+// unless given. Exits with 0 if it passes and 1 if not.
+static int history_test_main(int argc, char **argv) {
+	u32 width = 64;
+	u32 height = 64;
+	u32 iteration_count = 2000;
+
+	if (argc >= 2) {
+		width = strtoul(argv[0], NULL, 10);
+		height = strtoul(argv[1], NULL, 10);
+	}
+	if (argc >= 3) iteration_count = strtoul(argv[2], NULL, 10);
+
+	if (width == 0 || width > LEVEL_MAX_WIDTH || height == 0 || height > LEVEL_MAX_HEIGHT || iteration_count == 0) {
+		fprintf(stderr, "--test-history [width height [iterations]], up to %ux%u\n", LEVEL_MAX_WIDTH, LEVEL_MAX_HEIGHT);
+		return 2;
+	}
+
+	Level *level = calloc(1, sizeof(Level));
+	if (!level || !level_grid_allocate(&level->grid, width, height)) panic("Out of memory.\n");
+
+	level_count_tile_uses(level);
+	level->history = history_create();
+
+	b32 passed = level_history_fuzz_test(level, iteration_count);
+
+	level_free(level);
+	return passed ? 0 : 1;
+}
+
+// NOTE: The scanline fill draw_tile_flood_fill used before level_fill.c,
+// kept to benchmark against.
+static void flood_fill_scanline_reference(Level *level, u32 x, u32 y, Tile tile) {
+	Level_Grid *grid = &level->grid;
+	u32 width = grid->width;
+	u32 height = grid->height;
+	Tile tile_to_fill_over = level_grid_row(grid, y)[x];
+
+	if (tile_to_fill_over == tile) return;
+
+	u32 stack_position = 0;
+	u32 stack_capacity = 1024;
+	u32 *stack = malloc(stack_capacity * sizeof(*stack));
+	if (!stack) panic("Out of memory.\n");
+
+	for (;;) {
+		Tile *row = level_grid_row(grid, y);
+
+		while (x != 0 && tile_to_fill_over == row[x-1]) --x;
+
+		b32 search_above = true;
+		b32 search_below = true;
+
+		while (stack_position + 4*(width - x) > stack_capacity) {
+			stack_capacity *= 2;
+			stack = realloc(stack, stack_capacity * sizeof(*stack));
+			if (!stack) panic("Out of memory.\n");
 		}
 
-		for (; y <= y_end; ++y) {
-			grid[y][x] = tile;
-			error += delta_error;
+		do {
+			level_set_tile(level, x, y, tile);
+
+			if (y > 0) {
+				b32 above_should_fill = tile_to_fill_over == level_grid_row(grid, y-1)[x];
+				if (search_above && above_should_fill) {
+					stack[stack_position++] = x;
+					stack[stack_position++] = y-1;
+					search_above = false;
+				}
+				else if (!above_should_fill) search_above = true;
+			}
+
+			if (y < height-1) {
+				b32 below_should_fill = tile_to_fill_over == level_grid_row(grid, y+1)[x];
+				if (search_below && below_should_fill) {
+					stack[stack_position++] = x;
+					stack[stack_position++] = y+1;
+					search_below = false;
+				}
+				else if (!below_should_fill) search_below = true;
+			}
+
+			++x;
+		} while (x < width && tile_to_fill_over == row[x]);
+
+		if (stack_position < 2) break;
+
+		do {
+			y = stack[--stack_position];
+			x = stack[--stack_position];
+		} while (stack_position >= 2 && tile_to_fill_over != level_grid_row(grid, y)[x]);
+	}
+
+	free(stack);
+}
+
+// NOTE: Fills an open level (scattered walls), a serpentine maze (one
+// corridor through every row) and a random maze (a quarter of the cells walls)
+// with both fills and checks they agree. Both write through level_set_tile,
+// the region time is the bitboard fill without the writes. False if the fills
+// disagree on any layout.
+static b32 flood_fill_benchmark(u32 width, u32 height) {
+	static char *layout_names[] = {"open", "serpentine", "random maze"};
+	double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+
+	Level *level = calloc(1, sizeof(Level));
+	Level *reference = calloc(1, sizeof(Level));
+
+	if (!level || !reference || !level_grid_allocate(&level->grid, width, height) ||
+		!level_grid_allocate(&reference->grid, width, height))
+	{
+		panic("Out of memory.\n");
+	}
+
+	umm grid_size = (umm)width * height * sizeof(Tile);
+	b32 agree = true;
+
+	srand(1234);
+
+	for (u32 layout = 0; layout < 3; ++layout) {
+		for (u32 y = 0; y < height; ++y) {
+			Tile *row = level_grid_row(&level->grid, y);
 
-			if (error > 0.5) {
-				x += sx;
-				error -= 1.0;
+			for (u32 x = 0; x < width; ++x) {
+				Tile wall = 1;
+				if (layout == 0) row[x] = rand() % 64 == 0 ? wall : 0;
+				else if (layout == 1) row[x] = (y % 2 == 1 && x != ((y / 2) % 2 ? 0 : width - 1)) ? wall : 0;
+				else row[x] = rand() % 4 == 0 ? wall : 0;
 			}
 		}
+
+		level_grid_row(&level->grid, 0)[0] = 0;
+		level_grid_row(&level->grid, 0)[1] = 0;
+		level_grid_row(&level->grid, 1)[0] = 0;
+		level_count_tile_uses(level);
+		memcpy(reference->grid.tiles, level->grid.tiles, grid_size);
+		level_count_tile_uses(reference);
+
+		u64 start = SDL_GetPerformanceCounter();
+		flood_fill_scanline_reference(reference, 0, 0, 2);
+		u64 scanline_end = SDL_GetPerformanceCounter();
+
+		Fill_Region region;
+		fill_region_compute(&region, &level->grid, 0, 0);
+		u64 region_end = SDL_GetPerformanceCounter();
+		fill_region_free(&region);
+
+		u64 fill_start = SDL_GetPerformanceCounter();
+		draw_tile_flood_fill(0, 0, 2, level);
+		u64 fill_end = SDL_GetPerformanceCounter();
+
+		b32 same = memcmp(reference->grid.tiles, level->grid.tiles, grid_size) == 0;
+		agree = agree && same;
+
+		fprintf(stderr, "%ux%u %-12s scanline %8.2f ms, bitboard region %8.2f ms, bitboard fill %8.2f ms%s\n",
+			width, height, layout_names[layout],
+			(scanline_end - start) * ms_per_tick,
+			(region_end - scanline_end) * ms_per_tick,
+			(fill_end - fill_start) * ms_per_tick,
+			same ? "" : "  MISMATCH");
 	}
+
+	level_free(reference);
+	level_free(level);
+	return agree;
 }
 
-#if 0
-static void history_undo(History *history, Level_Grid *grid) {
-	if (history->at == history->head) return;
+// NOTE: level_editor.program --bench-fill [width height]
+//
+// Runs flood_fill_benchmark, 1024x1024 unless given. Exits with 0 if the
+// fills agree and 1 if not.
+static int fill_bench_main(int argc, char **argv) {
+	u32 width = 1024;
+	u32 height = 1024;
+
+	if (argc >= 2) {
+		width = strtoul(argv[0], NULL, 10);
+		height = strtoul(argv[1], NULL, 10);
+	}
 
-	History_Span *span = (History_Span *)&history->buffer[history->at];
+	if (width < 2 || width > LEVEL_MAX_WIDTH || height < 2 || height > LEVEL_MAX_HEIGHT) {
+		fprintf(stderr, "--bench-fill [width height], from 2x2 up to %ux%u\n", LEVEL_MAX_WIDTH, LEVEL_MAX_HEIGHT);
+		return 2;
+	}
+
+	return flood_fill_benchmark(width, height) ? 0 : 1;
+}
 
-	switch (span->id) {
+// NOTE: Writes the tiles of a whole block first and interns the result
+// once, so a stamp never leaves half-painted blocks in the dictionary.
+static void draw_block(u32 block_x, u32 block_y, u32 block, Level *level) {
 
-		case HISTORY_SPAN_GRID_DIFFERENCE: {
+	Block_Layer *blocks = &level->blocks;
+	Level_Grid *grid = &level->grid;
+	u32 n = blocks->block_size;
+	Tile *block_tiles = block_layer_block_tiles(blocks, block);
 
-			u32 op_count = span->op_count;
+	b32 changed = false;
 
+	for (u32 y = 0; y < n; ++y) {
+		u32 tile_y = block_y * n + y;
+		if (tile_y >= grid->height) break;
 
+		for (u32 x = 0; x < n; ++x) {
+			u32 tile_x = block_x * n + x;
+			if (tile_x >= grid->width) break;
 
-		} break;
+			changed |= level_write_tile(level, tile_x, tile_y, block_tiles[y*n + x]);
+		}
 	}
 
+	if (changed) {
+		block_layer_tile_changed(blocks, grid, block_x * n, block_y * n);
+	}
+}
+
+static void draw_block_line(s32 x0, s32 y0, s32 x1, s32 y1, u32 block, Level *level) {
+
+	s32 dx = abs(x1 - x0);
+	s32 dy = -abs(y1 - y0);
+	s32 sx = x0 < x1 ? 1 : -1;
+	s32 sy = y0 < y1 ? 1 : -1;
+	s32 error = dx + dy;
+
+	for (;;) {
+		draw_block(x0, y0, block, level);
+
+		if (x0 == x1 && y0 == y1) break;
+
+		s32 error2 = 2 * error;
+		if (error2 >= dy) { error += dy; x0 += sx; }
+		if (error2 <= dx) { error += dx; y0 += sy; }
+	}
+}
+
+static void draw_block_flood_fill(u32 block_x, u32 block_y, u32 block, Level *level) {
+
+	Block_Layer *blocks = &level->blocks;
+	u32 width = blocks->width;
+	u32 height = blocks->height;
+
+	u32 block_to_fill_over = blocks->cells[block_y * width + block_x];
+	if (block_to_fill_over == block) return;
+
+	// NOTE: Partial blocks at the level edge can intern back to the
+	// block being filled over, so visited cells are tracked explicitly.
+	u8 *visited = calloc((umm)width * height, 1);
+	u32 stack_position = 0;
+	u32 stack_capacity = 1024;
+	u32 *stack = malloc(stack_capacity * sizeof(*stack));
+
+	if (!visited || !stack) {
+		fprintf(stderr, "Out of memory in block flood fill.\n");
+		free(visited);
+		free(stack);
+		return;
+	}
+
+	stack[stack_position++] = block_y * width + block_x;
+	visited[block_y * width + block_x] = 1;
+
+	while (stack_position) {
+		u32 cell = stack[--stack_position];
+		u32 x = cell % width;
+		u32 y = cell / width;
+
+		draw_block(x, y, block, level);
+
+		if (stack_position + 4 > stack_capacity) {
+			stack_capacity *= 2;
+			u32 *new_stack = realloc(stack, stack_capacity * sizeof(*stack));
+			if (!new_stack) {
+				fprintf(stderr, "Out of memory in block flood fill.\n");
+				break;
+			}
+			stack = new_stack;
+		}
+
+		u32 neighbours[4];
+		u32 neighbour_count = 0;
+		if (x > 0)          neighbours[neighbour_count++] = cell - 1;
+		if (x < width - 1)  neighbours[neighbour_count++] = cell + 1;
+		if (y > 0)          neighbours[neighbour_count++] = cell - width;
+		if (y < height - 1) neighbours[neighbour_count++] = cell + width;
+
+		for (u32 i = 0; i < neighbour_count; ++i) {
+			u32 neighbour = neighbours[i];
+			if (!visited[neighbour] && blocks->cells[neighbour] == block_to_fill_over) {
+				visited[neighbour] = 1;
+				stack[stack_position++] = neighbour;
+			}
+		}
+	}
+
+	free(visited);
+	free(stack);
 }
-#endif
 
 static void screen_to_world_space(View *view, float screen_x, float screen_y, float *world_x, float *world_y) {
 	*world_x = screen_x / view->zoom + view->offset_x;
@@ -677,6 +1828,19 @@ static void screen_to_world_space(View *view, float screen_x, float screen_y, fl
 }
 
 int main(int argc, char **argv) {
+	if (argc >= 2 && (strcmp(argv[1], "--batch") == 0 || strcmp(argv[1], "--diff") == 0 || strcmp(argv[1], "--merge") == 0 ||
+		strcmp(argv[1], "--test-history") == 0 || strcmp(argv[1], "--bench-fill") == 0))
+	{
+		crc32_init();
+		source_export_init();
+
+		if (strcmp(argv[1], "--test-history") == 0) return history_test_main(argc - 2, argv + 2);
+		if (strcmp(argv[1], "--bench-fill") == 0) return fill_bench_main(argc - 2, argv + 2);
+		if (strcmp(argv[1], "--diff") == 0) return diff_main(argc - 2, argv + 2);
+		if (strcmp(argv[1], "--merge") == 0) return merge_main(argc - 2, argv + 2);
+		return batch_main(argc - 2, argv + 2);
+	}
+
 	if (argc < 2) {
 		panic("%s expects the path to a tile palette file as the first argument.\n", argv[0]);
 	}
@@ -703,35 +1867,71 @@ int main(int argc, char **argv) {
 
 	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
 
+	crc32_init();
+	source_export_init();
+
+	{
+		s32 cpu_count = SDL_GetCPUCount();
+		png_import_thread_count = cpu_count > 1 ? cpu_count - 1 : 0;
+	}
+
 	Application_State app_state = {0};
 	app_state.mode = APP_MODE_EDIT_LEVEL;
 	app_state.tile_to_draw = 0;
+	app_state.brush_size = 1;
+	app_state.vram_tile_limit = VRAM_TILE_LIMIT;
+	app_state.vram_reported_violations = (u32)-1;
 	app_state.view_edit.zoom = 1;
 	app_state.view_pick.zoom = 1;
-	app_state.selection = (SDL_Rect){10, 10, 5, 10};
 
-	for (s32 y = 0; y < LEVEL_HEIGHT; ++y) {
-		for (s32 x = 0; x < LEVEL_WIDTH; ++x) {
-			app_state.level_grid.tiles[y][x] = 0; //!(x&y&1);
-			// app_state.collision_map[y][x] = 0;
+	Project *project = &app_state.project;
+	char *tileset_path = project->tileset_path;
+
+	// The first argument is either a project index or a tile set
+	if (project_load_index(project, argv[1])) {
+		if (!project->tileset_path[0]) {
+			panic("Project %s does not name a tileset.\n", argv[1]);
+		}
+	}
+	else {
+		project_init_single_level(project, LEVEL_WIDTH, LEVEL_HEIGHT);
+		copy_string(project->tileset_path, sizeof(project->tileset_path), argv[1], strlen(argv[1]));
+	}
+
+	{
+		SDL_RendererInfo renderer_info;
+		if (SDL_GetRendererInfo(renderer, &renderer_info) == 0 && (renderer_info.flags & SDL_RENDERER_TARGETTEXTURE)) {
+			project->max_texture_width = renderer_info.max_texture_width ? renderer_info.max_texture_width : 4096;
+			project->max_texture_height = renderer_info.max_texture_height ? renderer_info.max_texture_height : 4096;
 		}
 	}
 
+	project_start_loader(project);
+	project_request_load(project, project->current, true);
+
 #if 0
 	// Test line drawing
+	while (!project_current_level(project)) SDL_Delay(1);
+
 	for (int i = 0; i < 24; ++i) {
 		float angle = i/24.0 * 6.283185307179586;
 
 		u32 x1 = 15.5 + 15 * cos(angle);
 		u32 y1 = 15.5 + 15 * sin(angle);
 
-		app_state.level_grid.tiles[y1][x1] = 1000;
-		draw_tile_line(15.5, 15.5, x1, y1, i * 150 | TILE_MASK_SOLID, app_state.level_grid.tiles);
+		level_set_tile(project_current_level(project), x1, y1, 1000);
+		draw_tile_line(15, 15, x1, y1, 1, i * 150 | TILE_MASK_SOLID, project_current_level(project));
 
 	}
 #endif
 
-	load_tile_palette(&app_state, renderer, argv[1]);
+	if (!load_tile_palette(&app_state, renderer, tileset_path)) {
+		fprintf(stderr, "Could not load tile set %s.\n", tileset_path);
+	}
+
+	u32 title_level = LEVEL_ENTRY_NONE;
+	Level_Entry_State title_state = LEVEL_ENTRY_UNLOADED;
+	umm title_selected_count = 0;
 
 	b32 move_view_left = false;
 	b32 move_view_right = false;
@@ -763,6 +1963,9 @@ int main(int argc, char **argv) {
 		screen_to_world_space(view, app_state.mouse_x, app_state.mouse_y, &world_mouse_x, &world_mouse_y);
 
 		b32 do_fill = false;
+		Tile select_cells = 0; // Key mask to select by, 0 for none
+
+		Level *level = project_current_level(project);
 
 		while (SDL_PollEvent(&e)) {
 
@@ -777,53 +1980,394 @@ int main(int argc, char **argv) {
 						if (e.key.keysym.mod & KMOD_CTRL) {
 							char file_path[1024];
 
-							if (miscellus_file_dialog(file_path, sizeof(file_path), false)) {
-								// load_tile_palette(&app_state, renderer, file_path);
-								load_level_binary(&app_state.level_grid, file_path);
+							cancel_floating_move(&app_state, level);
+
+							b32 opened = level && miscellus_file_dialog(file_path, sizeof(file_path), false);
+							b32 is_png = opened && level_path_is_png(file_path);
+							Level_Grid image_grid = {0};
+
+							// Cut into a grid and a tile set up front, which may be refused
+							if (is_png) {
+								Length_Buffer image_tile_data = {0};
+
+								opened = import_png_grid(file_path, &image_grid, &image_tile_data) &&
+									import_png_tileset(&app_state, renderer, file_path, image_tile_data, (e.key.keysym.mod & KMOD_SHIFT) != 0);
+
+								free(image_tile_data.data);
+								if (!opened) level_grid_free(&image_grid);
+							}
+
+							if (opened) {
+								Level_Entry *entry = &project->entries[project->current];
+								b32 imported = level_path_is_import(file_path);
+
+								char old_journal_path[PROJECT_PATH_LENGTH];
+								project_level_journal_path(project, project->current, old_journal_path);
+
+								// The journal and history stay with the level they were kept for,
+								// and are opened again next frame for the path the level has then
+								journal_close(&app_state.journal);
+								history_close(level->history, &level->grid);
+								level->history = NULL;
+
+								b32 loaded = true;
+
+								if (is_png) {
+									level_grid_free(&level->grid);
+									level->grid = image_grid;
+									object_layer_free(&level->objects);
+								}
+								else {
+									// load_tile_palette(&app_state, renderer, file_path);
+									loaded = load_level(level, file_path);
+								}
+
+								if (loaded) {
+									level_count_tile_uses(level);
+									vram_analysis_free(&level->vram);
+									level_diff_free(&level->diff);
+									tile_mask_free(&level->selected_cells);
+									if (level->blocks.block_size) {
+										block_layer_extract(&level->blocks, &level->grid, level->blocks.block_size);
+									}
+
+									// Saving writes back to the opened file, an import asks where to go
+									if (imported) {
+										entry->path[0] = '\0';
+									}
+									else {
+										copy_string(entry->path, sizeof(entry->path), file_path, strlen(file_path));
+									}
+
+									char journal_path[PROJECT_PATH_LENGTH];
+									project_level_journal_path(project, project->current, journal_path);
+
+									// What the old journal holds was replaced, do not replay it over this
+									if (strcmp(journal_path, old_journal_path) == 0) {
+										journal_remove(journal_path);
+									}
+
+									level->modified = imported;
+									level->recover_journal = true;
+									project_invalidate_level(project, project->current);
+								}
+							}
+						}
+					}
+					break;
+
+					case SDLK_s: {
+						if (e.key.keysym.mod & KMOD_CTRL) {
+							Level_Entry *entry = &project->entries[project->current];
+							char file_path[1024];
+							char *save_path = entry->path;
+
+							// Save as (Ctrl+Shift+S), and the first save of a new or imported level
+							if (level && (!entry->path[0] || (e.key.keysym.mod & KMOD_SHIFT))) {
+								save_path = miscellus_file_dialog(file_path, sizeof(file_path), true) ? file_path : NULL;
+							}
+
+							if (level && save_path && save_path[0]) {
+								b32 saved = save_level(level, save_path);
+
+								// Keep the level marked unsaved, under its old path and in the
+								// cache, if anything failed
+								if (saved) {
+									if (save_path != entry->path) {
+										copy_string(entry->path, sizeof(entry->path), save_path, strlen(save_path));
+									}
+
+									level->modified = false;
+
+									// Reopened next frame, under the new path after a first save or save as
+									journal_discard(&app_state.journal);
+									journal_close(&app_state.journal);
+								}
+							}
+						}
+						else if (app_state.mode == APP_MODE_EDIT_LEVEL) {
+							// Toggle draw solid
+							app_state.tile_to_draw ^= TILE_MASK_SOLID;
+
+							if (app_state.stamp.tiles) {
+								umm stamp_count = (umm)app_state.stamp.width * app_state.stamp.height;
+								Tile solid_flag = app_state.tile_to_draw & TILE_MASK_SOLID;
+
+								for (umm i = 0; i < stamp_count; ++i) {
+									app_state.stamp.tiles[i] = (app_state.stamp.tiles[i] & ~TILE_MASK_SOLID) | solid_flag;
+								}
+							}
+						}
+					}
+					break;
+
+					case SDLK_d: {
+						if (level && (e.key.keysym.mod & KMOD_CTRL)) {
+							char file_path[1024];
+							char their_file_path[1024];
+
+							if (level->diff.other.tiles) {
+								level_diff_free(&level->diff);
+							}
+							else if (e.key.keysym.mod & KMOD_SHIFT) {
+								// Merge: the common ancestor first, then their level
+								if (miscellus_file_dialog(file_path, sizeof(file_path), false) &&
+									miscellus_file_dialog(their_file_path, sizeof(their_file_path), false))
+								{
+									level_merge_from(level, file_path, their_file_path);
+								}
+							}
+							else if (miscellus_file_dialog(file_path, sizeof(file_path), false)) {
+								level_diff_open(level, file_path);
+							}
+						}
+					}
+					break;
+
+					case SDLK_f: {
+						view->offset_x = 0;
+						view->offset_y = 0;
+						view->zoom = 1;
+					}
+					break;
+
+					case SDLK_b: {
+						do_fill = true;
+					}
+					break;
+
+					case SDLK_t: {
+						// Next drawing tool: freehand, line, rectangle, filled rectangle, ellipse, filled ellipse, marquee
+						if (!app_state.drawing_shape && !app_state.marqueeing && !app_state.floating.tiles) {
+							app_state.draw_tool = (app_state.draw_tool + 1) % COUNT_DRAW_TOOL;
+						}
+					}
+					break;
+
+					case SDLK_LEFTBRACKET: {
+						if (app_state.brush_size > 1) --app_state.brush_size;
+					}
+					break;
+
+					case SDLK_RIGHTBRACKET: {
+						if (app_state.brush_size < BRUSH_MAX_SIZE) ++app_state.brush_size;
+					}
+					break;
+
+					case SDLK_q: {
+						// Select every cell holding the tile under the mouse, Shift to tell flips apart
+						if (app_state.mode == APP_MODE_EDIT_LEVEL) {
+							select_cells = (e.key.keysym.mod & KMOD_SHIFT) ? TILE_MATCH_EXACT : TILE_MATCH_SIMILAR;
+						}
+					}
+					break;
+
+					case SDLK_ESCAPE: {
+						if (level) tile_mask_free(&level->selected_cells);
+
+						// A move goes back where it came from, a paste is dropped
+						cancel_floating_move(&app_state, level);
+						level_grid_free(&app_state.floating);
+
+						app_state.interaction_flags &= ~ACTION_SELECTING;
+						app_state.marqueeing = false;
+					}
+					break;
+
+					case SDLK_c:
+					case SDLK_x: {
+						SDL_Rect selection = selection_in_level(&app_state, level);
+
+						if ((e.key.keysym.mod & KMOD_CTRL) && selection.w && !app_state.floating.tiles) {
+							if (level_copy_rect(level, selection, &app_state.clipboard)) {
+								if (e.key.keysym.sym == SDLK_x) level_clear_rect(level, selection);
+							}
+						}
+					}
+					break;
+
+					case SDLK_z: {
+						if (level && (e.key.keysym.mod & KMOD_CTRL)) {
+							if (e.key.keysym.mod & KMOD_SHIFT) level_redo(level);
+							else level_undo(level);
+						}
+					}
+					break;
+
+					case SDLK_y: {
+						if (level && (e.key.keysym.mod & KMOD_CTRL)) {
+							level_redo(level);
+						}
+					}
+					break;
+
+					case SDLK_h: {
+						app_state.show_timeline = !app_state.show_timeline;
+					}
+					break;
+
+					case SDLK_PAGEDOWN: {
+						cancel_floating_move(&app_state, level);
+						project_switch_to(project, project->current + 1);
+					}
+					break;
+
+					case SDLK_PAGEUP: {
+						cancel_floating_move(&app_state, level);
+						project_switch_to(project, project->current - 1);
+					}
+					break;
+
+					case SDLK_BACKQUOTE: {
+						// Flip back to the previously edited level
+						cancel_floating_move(&app_state, level);
+						project_switch_to(project, project->previous);
+					}
+					break;
+
+					case SDLK_l: {
+						if (e.key.keysym.mod & KMOD_CTRL) {
+							// Compress the whole project for a shipping build, from the saved files
+							project_warn_unsaved_levels(project);
+
+							s32 cpu_count = SDL_GetCPUCount();
+							lz_export_project(project, tileset_path, cpu_count > 1 ? cpu_count - 1 : 0);
+						}
+					}
+					break;
+
+					case SDLK_g: {
+						if (e.key.keysym.mod & KMOD_CTRL) {
+							// RGBDS and GBDK sources for the whole project, from the saved files
+							project_warn_unsaved_levels(project);
+							export_project_sources(project);
+						}
+					}
+					break;
+
+					case SDLK_r: {
+						if (e.key.keysym.mod & KMOD_CTRL) {
+							Level_Entry *entry = &project->entries[project->current];
+							if (level && entry->path[0]) export_level_rle(level, entry->path, NULL);
+						}
+					}
+					break;
+
+					case SDLK_p: {
+						if (e.key.keysym.mod & KMOD_CTRL) {
+							// Screenshot of the whole level at the zoom it is viewed at, 1x to 4x
+							Level_Entry *entry = &project->entries[project->current];
+							s32 scale = (s32)(app_state.view_edit.zoom + 0.5f);
+							if (scale < 1) scale = 1;
+							if (scale > 4) scale = 4;
+
+							if (level && entry->path[0]) {
+								export_level_png(level, entry->path, app_state.tile_data.data, app_state.tile_data.length, scale, PNG_DEFAULT_COMPRESSION);
 							}
 						}
 					}
 					break;
 
-					case SDLK_s: {
-						if (e.key.keysym.mod & KMOD_CTRL) {
-							char file_path[1024];
-							if (miscellus_file_dialog(file_path, sizeof(file_path), true)) {
-								save_level_binary(&app_state.level_grid, file_path);
-							}
-
-						}
-						else if (app_state.mode == APP_MODE_EDIT_LEVEL) {
-							// Toggle draw solid
-							app_state.tile_to_draw ^= TILE_MASK_SOLID;
+					case SDLK_e: {
+						if (e.key.keysym.mod & KMOD_CTRL) {
+							Level_Entry *entry = &project->entries[project->current];
+							if (level && entry->path[0]) export_level_binary(level, entry->path);
+						}
+						else if (app_state.mode == APP_MODE_EDIT_OBJECTS) app_state.mode = APP_MODE_EDIT_LEVEL;
+						else app_state.mode = APP_MODE_EDIT_OBJECTS;
+					}
+					break;
+
+					case SDLK_1:
+					case SDLK_2:
+					case SDLK_3: {
+						if (app_state.mode == APP_MODE_EDIT_OBJECTS) {
+							app_state.object_type_to_place = OBJECT_ENEMY + (e.key.keysym.sym - SDLK_1);
 						}
 					}
 					break;
 
-					case SDLK_f: {
-						view->offset_x = 0;
-						view->offset_y = 0;
-						view->zoom = 1;
+					case SDLK_DELETE: {
+						if (level && app_state.mode == APP_MODE_EDIT_OBJECTS && level->objects.selection_count) {
+							object_layer_delete_selection(&level->objects);
+							level->modified = true;
+						}
 					}
 					break;
 
-					case SDLK_b: {
-						do_fill = true;
+					case SDLK_m: {
+						// Toggle metatile mode, Shift for 4x4 blocks
+						if (level && app_state.mode != APP_MODE_EDIT_OBJECTS) {
+							u32 block_size = (e.key.keysym.mod & KMOD_SHIFT) ? 4 : 2;
+
+							if (level->blocks.block_size == block_size) {
+								block_layer_free(&level->blocks);
+							}
+							else {
+								u64 start = SDL_GetPerformanceCounter();
+								block_layer_extract(&level->blocks, &level->grid, block_size);
+								u64 end = SDL_GetPerformanceCounter();
+
+								fprintf(stderr, "%ux%u blocks: %u distinct in %ux%u cells (%.2f ms)\n",
+									block_size, block_size,
+									level->blocks.block_count,
+									level->blocks.width, level->blocks.height,
+									(double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+							}
+						}
 					}
 					break;
 
-#if 0
-					case SDLK_z: {
+					case SDLK_v: {
 						if (e.key.keysym.mod & KMOD_CTRL) {
-							history_undo(&app_state.history, &app_state.level_grid);
+							// Paste under the mouse, placed with the next click
+							if (level && app_state.clipboard.tiles && !app_state.floating.tiles &&
+								level_grid_allocate(&app_state.floating, app_state.clipboard.width, app_state.clipboard.height))
+							{
+								memcpy(app_state.floating.tiles, app_state.clipboard.tiles,
+									(umm)app_state.clipboard.width * app_state.clipboard.height * sizeof(Tile));
+
+								app_state.floating_moved = false;
+								app_state.floating_grab_x = app_state.clipboard.width / 2;
+								app_state.floating_grab_y = app_state.clipboard.height / 2;
+								app_state.draw_tool = DRAW_TOOL_MARQUEE;
+								app_state.mode = APP_MODE_EDIT_LEVEL;
+							}
+						}
+						else if (e.key.keysym.mod & KMOD_SHIFT) {
+							// Switch between 8000 and 8800 BG tile addressing
+							app_state.vram_tile_limit = app_state.vram_tile_limit == VRAM_TILE_LIMIT ? VRAM_TILE_LIMIT_8800 : VRAM_TILE_LIMIT;
+							if (level) vram_analysis_set_limit(&level->vram, app_state.vram_tile_limit);
+							app_state.vram_reported_violations = (u32)-1;
+						}
+						else {
+							app_state.show_vram = !app_state.show_vram;
+						}
+					}
+					break;
+
+					case SDLK_u: {
+						if (app_state.mode == APP_MODE_PICK_TILE) {
+							// Toggle ordering the picker by how often each tile is used
+							app_state.pick_by_usage = !app_state.pick_by_usage;
 						}
 					}
 					break;
-#endif
 
 					case SDLK_TAB: {
-						if (app_state.mode == APP_MODE_EDIT_LEVEL) app_state.mode = APP_MODE_PICK_TILE;
-						else app_state.mode = APP_MODE_EDIT_LEVEL;
+						if (app_state.mode == APP_MODE_EDIT_LEVEL) {
+							app_state.mode = APP_MODE_PICK_TILE;
+
+							if (level && level->blocks.block_size) {
+								// NOTE: Drop blocks left behind by edits before showing
+								// the dictionary. The brush is kept and renumbered.
+								block_layer_compact(&level->blocks);
+							}
+						}
+						else {
+							app_state.mode = APP_MODE_EDIT_LEVEL;
+							app_state.picking_stamp = false;
+						}
 					}
 					break;
 
@@ -871,9 +2415,15 @@ int main(int argc, char **argv) {
 			}
 			else if (e.type == SDL_DROPFILE) {
 				char *dropped_file_path = e.drop.file;
-				load_tile_palette(&app_state, renderer, dropped_file_path);
+				if (load_tile_palette(&app_state, renderer, dropped_file_path)) {
+					project_invalidate_all_levels(project);
+				}
 				SDL_free(dropped_file_path);
 			}
+			else if (e.type == SDL_RENDER_TARGETS_RESET || e.type == SDL_RENDER_DEVICE_RESET) {
+				// Pre-rendered level textures lost their contents
+				project_invalidate_all_levels(project);
+			}
 			else if (e.type == SDL_MOUSEBUTTONDOWN) {
 				if (e.button.button == SDL_BUTTON_MIDDLE) {
 					drag_update = DRAG_START;
@@ -906,6 +2456,42 @@ int main(int argc, char **argv) {
 		if (move_view_up)     view->offset_y -= view_speed;
 		if (move_view_down)   view->offset_y += view_speed;
 
+		// Level switches and tile set reloads above may have changed this
+		project_update(project, renderer, &app_state.tile_map, app_state.tile_map_texture);
+		level = project_current_level(project);
+
+		if (app_state.journal.grid != (level ? &level->grid : NULL)) {
+			journal_close(&app_state.journal);
+
+			if (level) {
+				char journal_path[PROJECT_PATH_LENGTH];
+				project_level_journal_path(project, project->current, journal_path);
+
+				level_open_journal(level, &app_state.journal, journal_path);
+			}
+		}
+
+		umm selected_count = level ? level->selected_cells.count : 0;
+
+		if (title_level != project->current || title_state != level_entry_state(&project->entries[project->current]) ||
+			title_selected_count != selected_count)
+		{
+			title_level = project->current;
+			title_state = level_entry_state(&project->entries[project->current]);
+			title_selected_count = selected_count;
+
+			char selected[64] = "";
+			if (selected_count) snprintf(selected, sizeof(selected), " - %llu cells selected", selected_count);
+
+			char title[256];
+			snprintf(title, sizeof(title), "Miscellus Game Boy Level Editor - %s (%u/%u)%s%s",
+				project->entries[title_level].name, title_level + 1, project->entry_count,
+				title_state == LEVEL_ENTRY_FAILED ? " [failed to load]" :
+				title_state != LEVEL_ENTRY_LOADED ? " [loading]" : "",
+				selected);
+			SDL_SetWindowTitle(window, title);
+		}
+
 		SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
 		SDL_RenderClear(renderer);
 
@@ -914,13 +2500,78 @@ int main(int argc, char **argv) {
 		b32 mouse_left_clicked = app_state.mouse_flags & SDL_BUTTON(SDL_BUTTON_LEFT);
 		b32 mouse_right_clicked = app_state.mouse_flags & SDL_BUTTON(SDL_BUTTON_RIGHT);
 
+		// The undo timeline along the bottom. Dragging on it scrubs through the
+		// history instead of painting.
+		SDL_Rect timeline_rect = {16, app_state.window_height - 32, app_state.window_width - 32, 16};
+		b32 timeline_shown = app_state.show_timeline && level && level->history && app_state.mode != APP_MODE_PICK_TILE && timeline_rect.w > 0;
+
+		if (timeline_shown && mouse_left_clicked && !(app_state.mouse_previous_flags & SDL_BUTTON(SDL_BUTTON_LEFT)) &&
+			app_state.mouse_x >= timeline_rect.x && app_state.mouse_x < timeline_rect.x + timeline_rect.w &&
+			app_state.mouse_y >= timeline_rect.y && app_state.mouse_y < timeline_rect.y + timeline_rect.h)
+		{
+			app_state.scrubbing = true;
+		}
+
+		if (!mouse_left_clicked || !timeline_shown) app_state.scrubbing = false;
+
+		if (app_state.scrubbing) {
+			s32 offset = app_state.mouse_x - timeline_rect.x;
+			if (offset < 0) offset = 0;
+			if (offset >= timeline_rect.w) offset = timeline_rect.w - 1;
+
+			u32 position = (u32)((u64)offset * history_timeline_length(level->history) / timeline_rect.w);
+			u32 step = history_timeline_step(level->history, position);
+
+			if (step != level->history->current) level_history_jump(level, step);
+
+			mouse_left_clicked = false;
+		}
+
+		// Everything painted while the left button is held is one undo step, and
+		// so is a move from lifting the tiles to dropping them
+		if (level && level->history) {
+			if (mouse_left_clicked || app_state.floating_moved) history_begin_stroke(level->history);
+			else history_end_stroke(level->history);
+		}
+
+		if (!mouse_left_clicked && app_state.stamp_stroke.stamped) stamp_stroke_free(&app_state.stamp_stroke);
+
 		s32 pixel_scale_factor = app_state.window_height/256;
 		if (pixel_scale_factor <= 0) pixel_scale_factor = 1;
 		s32 scaled_tile_width = pixel_scale_factor * GAMEBOY_TILE_WIDTH;
 
 		const u32 tiles_per_row = app_state.tile_map.pixels_per_row / GAMEBOY_TILE_WIDTH;
 
-		const u32 level_width_pixels = LEVEL_WIDTH * scaled_tile_width;
+		// Metatile mode paints and picks whole blocks instead of single tiles
+		Block_Layer *blocks = NULL;
+		u32 block_size = 1;
+		u32 blocks_per_row = 0;
+
+		if (level && level->blocks.block_size && app_state.mode != APP_MODE_EDIT_OBJECTS) {
+			blocks = &level->blocks;
+			block_size = blocks->block_size;
+			blocks_per_row = (u32)ceil(sqrt((double)blocks->block_count));
+		}
+
+		u32 canvas_width_pixels;
+		u32 canvas_height_pixels;
+
+		if (app_state.mode == APP_MODE_PICK_TILE && blocks) {
+			canvas_width_pixels = blocks_per_row * block_size * scaled_tile_width;
+			canvas_height_pixels = canvas_width_pixels;
+		}
+		else if (app_state.mode == APP_MODE_PICK_TILE) {
+			canvas_width_pixels = pixel_scale_factor * app_state.tile_map.pixels_per_row;
+			canvas_height_pixels = canvas_width_pixels;
+		}
+		else if (level) {
+			canvas_width_pixels = level->grid.width * scaled_tile_width;
+			canvas_height_pixels = level->grid.height * scaled_tile_width;
+		}
+		else {
+			canvas_width_pixels = LEVEL_WIDTH * scaled_tile_width;
+			canvas_height_pixels = LEVEL_HEIGHT * scaled_tile_width;
+		}
 
 		float effective_view_offset_x = view->offset_x;
 		float effective_view_offset_y = view->offset_y;
@@ -930,109 +2581,465 @@ int main(int argc, char **argv) {
 			effective_view_offset_y += app_state.drag_start_y - world_mouse_y;
 		}
 
-		s32 canvas_offset_x = (app_state.window_width/2 - level_width_pixels/2) - effective_view_offset_x;
-		s32 canvas_offset_y = (app_state.window_height/2 - level_width_pixels/2) - effective_view_offset_y;
+		s32 canvas_offset_x = (app_state.window_width/2 - (s32)canvas_width_pixels/2) - effective_view_offset_x;
+		s32 canvas_offset_y = (app_state.window_height/2 - (s32)canvas_height_pixels/2) - effective_view_offset_y;
 
 		hot_tile_previous_x = hot_tile_x;
 		hot_tile_previous_y = hot_tile_y;
 		hot_tile_x = (((float)app_state.mouse_x / view->zoom) - canvas_offset_x) / scaled_tile_width;
 		hot_tile_y = (((float)app_state.mouse_y / view->zoom) - canvas_offset_y) / scaled_tile_width;
 
+		// Mouse and visible area in Game Boy pixels of the canvas
+		s32 pixel_mouse_x = (s32)floorf((((float)app_state.mouse_x / view->zoom) - canvas_offset_x) / pixel_scale_factor);
+		s32 pixel_mouse_y = (s32)floorf((((float)app_state.mouse_y / view->zoom) - canvas_offset_y) / pixel_scale_factor);
+
+		s32 visible_x0 = (s32)floorf((float)-canvas_offset_x / pixel_scale_factor);
+		s32 visible_y0 = (s32)floorf((float)-canvas_offset_y / pixel_scale_factor);
+		s32 visible_x1 = (s32)ceilf(((float)app_state.window_width / view->zoom - canvas_offset_x) / pixel_scale_factor);
+		s32 visible_y1 = (s32)ceilf(((float)app_state.window_height / view->zoom - canvas_offset_y) / pixel_scale_factor);
+
 		SDL_Rect dest_rect;
 		SDL_Rect source_rect;
 
 		switch (app_state.mode) {
 			case APP_MODE_VIEW:
-			case APP_MODE_EDIT_LEVEL: {
+			case APP_MODE_EDIT_LEVEL:
+			case APP_MODE_EDIT_OBJECTS: {
+
+				if (!level) {
+					// Still loading
+					break;
+				}
+
+				Level_Grid *grid = &level->grid;
+
+				if (app_state.mode == APP_MODE_EDIT_OBJECTS) {
+					Object_Layer *objects = &level->objects;
+					u32 width_pixels = grid->width * GAMEBOY_TILE_WIDTH;
+					u32 height_pixels = grid->height * GAMEBOY_TILE_WIDTH;
+
+					b32 mouse_previous_left_clicked = app_state.mouse_previous_flags & SDL_BUTTON(SDL_BUTTON_LEFT);
+					b32 shift_held = (SDL_GetModState() & KMOD_SHIFT) != 0;
+
+					if (mouse_left_clicked && !mouse_previous_left_clicked) {
+						u32 hit = object_layer_hit_test(objects, pixel_mouse_x, pixel_mouse_y);
+
+						if (hit != OBJECT_NONE) {
+							if (shift_held) {
+								object_layer_select(objects, hit, !objects->selected[hit]);
+							}
+							else if (!objects->selected[hit]) {
+								object_layer_clear_selection(objects);
+								object_layer_select(objects, hit, true);
+							}
+						}
+						else if (!shift_held) {
+							object_layer_clear_selection(objects);
+
+							u16 size = object_type_sizes[app_state.object_type_to_place];
+
+							if (pixel_mouse_x >= 0 && pixel_mouse_y >= 0 && pixel_mouse_x + size <= (s32)width_pixels && pixel_mouse_y + size <= (s32)height_pixels) {
+								Object object = {0};
+								object.x = pixel_mouse_x;
+								object.y = pixel_mouse_y;
+								object.type = app_state.object_type_to_place;
+
+								u32 index = object_layer_add(objects, object);
+								object_layer_select(objects, index, true);
+								level->modified = true;
+							}
+						}
+
+						app_state.moving_objects = objects->selection_count > 0;
+						app_state.object_move_x = pixel_mouse_x;
+						app_state.object_move_y = pixel_mouse_y;
+					}
+					else if (mouse_left_clicked && app_state.moving_objects) {
+						s32 dx = pixel_mouse_x - app_state.object_move_x;
+						s32 dy = pixel_mouse_y - app_state.object_move_y;
+
+						if (dx || dy) {
+							object_layer_move_selection(objects, dx, dy, width_pixels, height_pixels);
+							app_state.object_move_x = pixel_mouse_x;
+							app_state.object_move_y = pixel_mouse_y;
+							level->modified = true;
+						}
+					}
+					else if (!mouse_left_clicked) {
+						app_state.moving_objects = false;
+					}
+				}
+				else if (blocks) {
+					u32 hot_block_x = hot_tile_x / block_size;
+					u32 hot_block_y = hot_tile_y / block_size;
+					u32 hot_block_previous_x = hot_tile_previous_x / block_size;
+					u32 hot_block_previous_y = hot_tile_previous_y / block_size;
+
+					if (hot_block_x < blocks->width && hot_block_y < blocks->height) {
+
+						if (mouse_left_clicked) {
+							b32 mouse_previous_left_clicked = app_state.mouse_previous_flags & SDL_BUTTON(SDL_BUTTON_LEFT);
+
+							if (mouse_previous_left_clicked && hot_block_previous_x < blocks->width && hot_block_previous_y < blocks->height) {
+								draw_block_line(hot_block_previous_x, hot_block_previous_y, hot_block_x, hot_block_y, blocks->brush, level);
+							}
+							else {
+								draw_block(hot_block_x, hot_block_y, blocks->brush, level);
+							}
+						}
+						else if (mouse_right_clicked) {
+							block_layer_set_brush(blocks, blocks->cells[hot_block_y * blocks->width + hot_block_x]);
+						}
+
+						if (do_fill) {
+							draw_block_flood_fill(hot_block_x, hot_block_y, blocks->brush, level);
+						}
+					}
+				}
+				else if (app_state.draw_tool == DRAW_TOOL_MARQUEE) {
+					s32 mouse_tile_x = (s32)floorf((float)pixel_mouse_x / GAMEBOY_TILE_WIDTH);
+					s32 mouse_tile_y = (s32)floorf((float)pixel_mouse_y / GAMEBOY_TILE_WIDTH);
+					b32 mouse_left_pressed = mouse_left_clicked && !(app_state.mouse_previous_flags & SDL_BUTTON(SDL_BUTTON_LEFT));
+					SDL_Rect selection = selection_in_level(&app_state, level);
+
+					b32 in_selection =
+						mouse_tile_x >= selection.x && mouse_tile_x < selection.x + selection.w &&
+						mouse_tile_y >= selection.y && mouse_tile_y < selection.y + selection.h;
+
+					if (app_state.floating.tiles) {
+						app_state.floating_x = mouse_tile_x - app_state.floating_grab_x;
+						app_state.floating_y = mouse_tile_y - app_state.floating_grab_y;
+
+						if (app_state.floating_moved ? !mouse_left_clicked : mouse_left_pressed) {
+							drop_floating(&app_state, level, app_state.floating_x, app_state.floating_y);
+						}
+					}
+					else if (mouse_left_pressed && in_selection) {
+						// Lift the selection out of the level to move it, which
+						// also makes moves onto themselves safe
+						if (level_copy_rect(level, selection, &app_state.floating)) {
+							level_clear_rect(level, selection);
+							app_state.floating_moved = true;
+							app_state.floating_origin = selection;
+							app_state.floating_grab_x = mouse_tile_x - selection.x;
+							app_state.floating_grab_y = mouse_tile_y - selection.y;
+							app_state.floating_x = selection.x;
+							app_state.floating_y = selection.y;
+						}
+					}
+					else if (mouse_left_pressed && hot_tile_x < grid->width && hot_tile_y < grid->height) {
+						app_state.marqueeing = true;
+						app_state.marquee_start_x = hot_tile_x;
+						app_state.marquee_start_y = hot_tile_y;
+					}
+
+					if (app_state.marqueeing) {
+						s32 end_x = mouse_tile_x;
+						s32 end_y = mouse_tile_y;
+						if (end_x < 0) end_x = 0;
+						if (end_y < 0) end_y = 0;
+						if (end_x >= (s32)grid->width) end_x = grid->width - 1;
+						if (end_y >= (s32)grid->height) end_y = grid->height - 1;
+
+						s32 start_x = app_state.marquee_start_x;
+						s32 start_y = app_state.marquee_start_y;
+
+						app_state.selection = (SDL_Rect){
+							start_x < end_x ? start_x : end_x,
+							start_y < end_y ? start_y : end_y,
+							abs(end_x - start_x) + 1,
+							abs(end_y - start_y) + 1,
+						};
+						app_state.interaction_flags |= ACTION_SELECTING;
+
+						if (!mouse_left_clicked) app_state.marqueeing = false;
+					}
+				}
+				else if (app_state.draw_tool != DRAW_TOOL_FREEHAND && (app_state.drawing_shape ||
+					(mouse_left_clicked && hot_tile_x < grid->width && hot_tile_y < grid->height)))
+				{
+					// The far corner may be dragged off the level
+					s32 shape_x = (s32)floorf((float)pixel_mouse_x / GAMEBOY_TILE_WIDTH);
+					s32 shape_y = (s32)floorf((float)pixel_mouse_y / GAMEBOY_TILE_WIDTH);
+					if (shape_x < 0) shape_x = 0;
+					if (shape_y < 0) shape_y = 0;
+					if (shape_x >= (s32)grid->width) shape_x = grid->width - 1;
+					if (shape_y >= (s32)grid->height) shape_y = grid->height - 1;
+
+					if (!app_state.drawing_shape) {
+						app_state.drawing_shape = true;
+						app_state.shape_start_x = shape_x;
+						app_state.shape_start_y = shape_y;
+					}
+
+					span_list_begin(&app_state.shape_spans, grid->width, grid->height);
+					draw_shape_spans(&app_state.shape_spans, app_state.draw_tool,
+						app_state.shape_start_x, app_state.shape_start_y, shape_x, shape_y, app_state.brush_size);
 
-				if (
-					hot_tile_x < LEVEL_WIDTH &&
-					hot_tile_y < LEVEL_HEIGHT
+					if (!mouse_left_clicked) {
+						level_set_spans(level, &app_state.shape_spans, app_state.tile_to_draw);
+						app_state.shape_spans.count = 0;
+						app_state.drawing_shape = false;
+					}
+				}
+				else if (
+					hot_tile_x < grid->width &&
+					hot_tile_y < grid->height
 				) {
 
-					if (mouse_left_clicked) {
+					if (mouse_left_clicked && app_state.stamp.tiles) {
+						b32 mouse_previous_left_clicked = app_state.mouse_previous_flags & SDL_BUTTON(SDL_BUTTON_LEFT);
+
+						if (mouse_previous_left_clicked && app_state.stamp_stroke.stamped && hot_tile_previous_x < grid->width && hot_tile_previous_y < grid->height) {
+							draw_stamp_line(hot_tile_previous_x, hot_tile_previous_y, hot_tile_x, hot_tile_y, &app_state.stamp, &app_state.stamp_stroke, level);
+						}
+						else {
+							s32 stamp_x, stamp_y;
+							stamp_position(&app_state.stamp, hot_tile_x, hot_tile_y, &stamp_x, &stamp_y);
+
+							if (stamp_stroke_begin(&app_state.stamp_stroke, &app_state.stamp, grid->width, grid->height, stamp_x, stamp_y)) {
+								draw_stamp_line(hot_tile_x, hot_tile_y, hot_tile_x, hot_tile_y, &app_state.stamp, &app_state.stamp_stroke, level);
+							}
+							else {
+								fprintf(stderr, "Out of memory starting a stamp stroke.\n");
+							}
+						}
+					}
+					else if (mouse_left_clicked) {
 						b32 mouse_previous_left_clicked = app_state.mouse_previous_flags & SDL_BUTTON(SDL_BUTTON_LEFT);
 
-						if (mouse_previous_left_clicked && hot_tile_previous_x < LEVEL_WIDTH && hot_tile_previous_y < LEVEL_HEIGHT) {
-							draw_tile_line(hot_tile_previous_x, hot_tile_previous_y, hot_tile_x, hot_tile_y, app_state.tile_to_draw, app_state.level_grid.tiles);
+						if (mouse_previous_left_clicked && hot_tile_previous_x < grid->width && hot_tile_previous_y < grid->height) {
+							draw_tile_line(hot_tile_previous_x, hot_tile_previous_y, hot_tile_x, hot_tile_y, app_state.brush_size, app_state.tile_to_draw, level);
 						}
 						else {
-							app_state.level_grid.tiles[hot_tile_y][hot_tile_x] = app_state.tile_to_draw;
+							draw_tile_line(hot_tile_x, hot_tile_y, hot_tile_x, hot_tile_y, app_state.brush_size, app_state.tile_to_draw, level);
 						}
 					}
 					else if (mouse_right_clicked) {
-						app_state.tile_to_draw = app_state.level_grid.tiles[hot_tile_y][hot_tile_x];
+						app_state.tile_to_draw = level_grid_row(grid, hot_tile_y)[hot_tile_x];
+						level_grid_free(&app_state.stamp);
+					}
+
+					if (select_cells) {
+						Tile key = level_grid_row(grid, hot_tile_y)[hot_tile_x];
+
+						tile_mask_select(&level->selected_cells, grid, key, select_cells);
 					}
 
-					if (do_fill) {
-						draw_tile_flood_fill(hot_tile_x, hot_tile_y, app_state.tile_to_draw, &app_state.level_grid);
+					if (do_fill && level->selected_cells.bits) {
+						// Replace every selected cell, keeping the flips unless they were selected by
+						Tile_Mask *selected = &level->selected_cells;
+						level_set_tiles_masked(level, selected->bits, selected->words_per_row, selected->y0, selected->y1, app_state.tile_to_draw, selected->key_mask);
+					}
+					else if (do_fill) {
+						draw_tile_flood_fill(hot_tile_x, hot_tile_y, app_state.tile_to_draw, level);
 					}
 				}
 
+				// Outside of a stroke, everything this frame changed is one undo step
+				if (level->history && !level->history->stroke) history_commit(level->history);
 
+				level_update_texture(level, renderer, &app_state.tile_map, app_state.tile_map_texture);
 
 				{ // Drop shadow
 					s32 border_radius = 6;
 					dest_rect = (SDL_Rect){
 						canvas_offset_x - border_radius,
 						canvas_offset_y - border_radius,
-						scaled_tile_width*LEVEL_WIDTH + (2*border_radius),
-						scaled_tile_width*LEVEL_HEIGHT + (2*border_radius)
+						scaled_tile_width*grid->width + (2*border_radius),
+						scaled_tile_width*grid->height + (2*border_radius)
 					};
 
 					SDL_SetRenderDrawColor(renderer, 0, 0, 0, 60);
 					SDL_RenderFillRect(renderer, &dest_rect);
 				}
 
-				for (u32 y = 0; y < LEVEL_HEIGHT; ++y) {
-					for (u32 x = 0; x < LEVEL_WIDTH; ++x) {
+				SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
 
-						b32 is_hot_tile = (app_state.mode == APP_MODE_EDIT_LEVEL && x == hot_tile_x && y == hot_tile_y);
+				// Visible tiles, clipped to the level
+				s32 first_x = (s32)floorf((float)visible_x0 / GAMEBOY_TILE_WIDTH);
+				s32 first_y = (s32)floorf((float)visible_y0 / GAMEBOY_TILE_WIDTH);
+				s32 last_x = (s32)ceilf((float)visible_x1 / GAMEBOY_TILE_WIDTH);
+				s32 last_y = (s32)ceilf((float)visible_y1 / GAMEBOY_TILE_WIDTH);
 
-						u32 tile_index;
+				if (first_x < 0) first_x = 0;
+				if (first_y < 0) first_y = 0;
+				if (last_x > (s32)grid->width) last_x = grid->width;
+				if (last_y > (s32)grid->height) last_y = grid->height;
 
-						if (!is_hot_tile) {
-							tile_index = app_state.level_grid.tiles[y][x];
-						}
-						else {
-							tile_index = app_state.tile_to_draw;
-						}
+				SDL_Rect visible_tiles = {first_x, first_y, last_x - first_x, last_y - first_y};
+
+				if (level->texture) {
+					dest_rect = (SDL_Rect){
+						canvas_offset_x,
+						canvas_offset_y,
+						scaled_tile_width*grid->width,
+						scaled_tile_width*grid->height,
+					};
+
+					SDL_RenderCopy(renderer, level->texture, NULL, &dest_rect);
+				}
+				else if (first_x < last_x && first_y < last_y) {
+					// Too big to pre-render, draw only the visible tiles
+					render_level_tiles(renderer, grid, visible_tiles, &app_state.tile_map, app_state.tile_map_texture, canvas_offset_x, canvas_offset_y, scaled_tile_width);
+				}
+
+				if (app_state.show_vram) {
+					Vram_Analysis *vram = &level->vram;
+
+					if (!vram->unique_counts) {
+						vram_analysis_begin(vram, grid, app_state.vram_tile_limit);
+					}
+
+					// A few milliseconds per frame, the rest carries over to the next frames
+					b32 done = vram_analysis_update(vram, grid, SDL_GetPerformanceFrequency() / 250);
+
+					if (done && vram->violation_count != app_state.vram_reported_violations) {
+						app_state.vram_reported_violations = vram->violation_count;
+						fprintf(stderr, "VRAM: %u of %u window positions need more than %u tiles.\n",
+							vram->violation_count, vram->positions_x * vram->positions_y, vram->tile_limit);
+					}
+
+					if (first_x < last_x && first_y < last_y) {
+						render_vram_violations(renderer, vram, visible_tiles, canvas_offset_x, canvas_offset_y, scaled_tile_width);
+					}
 
-						u32 solid_flag = tile_index & TILE_MASK_SOLID;
-						tile_index &= TILE_MASK_INDEX;
+					if (app_state.mode == APP_MODE_EDIT_LEVEL && vram->unique_counts && hot_tile_x < grid->width && hot_tile_y < grid->height) {
+						// Outline the window whose top left corner is under the mouse
+						u32 position_x = hot_tile_x < vram->positions_x ? hot_tile_x : vram->positions_x - 1;
+						u32 position_y = hot_tile_y < vram->positions_y ? hot_tile_y : vram->positions_y - 1;
 
 						dest_rect = (SDL_Rect){
-							x * scaled_tile_width + canvas_offset_x,
-							y * scaled_tile_width + canvas_offset_y,
-							scaled_tile_width,
-							scaled_tile_width,
-						};
-						source_rect = (SDL_Rect){
-							tile_index % tiles_per_row * GAMEBOY_TILE_WIDTH,
-							tile_index / tiles_per_row * GAMEBOY_TILE_WIDTH,
-							GAMEBOY_TILE_WIDTH,
-							GAMEBOY_TILE_WIDTH,
+							position_x * scaled_tile_width + canvas_offset_x,
+							position_y * scaled_tile_width + canvas_offset_y,
+							vram->window_width * scaled_tile_width,
+							vram->window_height * scaled_tile_width,
 						};
 
-						SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-						SDL_RenderCopy(renderer, app_state.tile_map_texture, &source_rect, &dest_rect);
+						if (vram_analysis_violates(vram, position_x, position_y)) SDL_SetRenderDrawColor(renderer, 220, 0, 0, 255);
+						else SDL_SetRenderDrawColor(renderer, 0, 160, 0, 255);
+						SDL_RenderDrawRect(renderer, &dest_rect);
+					}
+				}
 
-						if (solid_flag) {
-							SDL_SetRenderDrawColor(renderer, 0, 64, 128, 255);
-							SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
-							SDL_RenderFillRect(renderer, &dest_rect);
-						}
+				if (level->diff.other.tiles) {
+					level_diff_update(&level->diff, grid);
 
-						if (is_hot_tile) {
-							SDL_SetRenderDrawColor(renderer, 240, 240, 0, 200);
-							SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
-							SDL_RenderDrawRect(renderer, &dest_rect);
-						}
+					if (first_x < last_x && first_y < last_y) {
+						render_level_diff(renderer, &level->diff, grid, visible_tiles, canvas_offset_x, canvas_offset_y, scaled_tile_width);
+					}
+				}
+
+				if (first_x < last_x && first_y < last_y) {
+					render_tile_mask(renderer, &level->selected_cells, visible_tiles, canvas_offset_x, canvas_offset_y, scaled_tile_width);
+				}
+
+				render_objects(renderer, &level->objects, visible_x0, visible_y0, visible_x1, visible_y1, canvas_offset_x, canvas_offset_y, pixel_scale_factor);
+
+				if (app_state.mode == APP_MODE_EDIT_LEVEL && blocks && hot_tile_x < grid->width && hot_tile_y < grid->height) {
+					render_block(renderer, blocks, blocks->brush, &app_state.tile_map, app_state.tile_map_texture,
+						hot_tile_x / block_size * block_size * scaled_tile_width + canvas_offset_x,
+						hot_tile_y / block_size * block_size * scaled_tile_width + canvas_offset_y,
+						scaled_tile_width);
+				}
+				else if (app_state.mode == APP_MODE_EDIT_LEVEL && app_state.draw_tool == DRAW_TOOL_FREEHAND && app_state.stamp.tiles && hot_tile_x < grid->width && hot_tile_y < grid->height) {
+					// Where the stamp would go, on the lattice while stamping
+					s32 stamp_x, stamp_y;
+					stamp_position(&app_state.stamp, hot_tile_x, hot_tile_y, &stamp_x, &stamp_y);
+					if (app_state.stamp_stroke.stamped) stamp_stroke_snap(&app_state.stamp_stroke, &stamp_x, &stamp_y);
+
+					dest_rect = (SDL_Rect){
+						stamp_x * scaled_tile_width + canvas_offset_x,
+						stamp_y * scaled_tile_width + canvas_offset_y,
+						app_state.stamp.width * scaled_tile_width,
+						app_state.stamp.height * scaled_tile_width,
+					};
+
+					render_stamp_ghost(renderer, &app_state.stamp, &app_state.tile_map, app_state.tile_map_texture,
+						dest_rect.x, dest_rect.y, scaled_tile_width);
+
+					SDL_SetRenderDrawColor(renderer, 240, 240, 0, 200);
+					SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+					SDL_RenderDrawRect(renderer, &dest_rect);
+					SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+				}
+				else if (app_state.mode == APP_MODE_EDIT_LEVEL && app_state.draw_tool != DRAW_TOOL_MARQUEE && hot_tile_x < grid->width && hot_tile_y < grid->height) {
+					u32 tile_index = app_state.tile_to_draw;
+					u32 solid_flag = tile_index & TILE_MASK_SOLID;
+					tile_index &= TILE_MASK_INDEX;
+
+					dest_rect = (SDL_Rect){
+						hot_tile_x * scaled_tile_width + canvas_offset_x,
+						hot_tile_y * scaled_tile_width + canvas_offset_y,
+						scaled_tile_width,
+						scaled_tile_width,
+					};
+					source_rect = (SDL_Rect){
+						tile_index % tiles_per_row * GAMEBOY_TILE_WIDTH,
+						tile_index / tiles_per_row * GAMEBOY_TILE_WIDTH,
+						GAMEBOY_TILE_WIDTH,
+						GAMEBOY_TILE_WIDTH,
+					};
+
+					SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+					SDL_RenderCopy(renderer, app_state.tile_map_texture, &source_rect, &dest_rect);
 
+					if (solid_flag) {
+						SDL_SetRenderDrawColor(renderer, 0, 64, 128, 255);
+						SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+						SDL_RenderFillRect(renderer, &dest_rect);
 					}
+
+					// Outline the whole brush
+					s32 brush_low = (app_state.brush_size - 1) / 2;
+					dest_rect.x -= brush_low * scaled_tile_width;
+					dest_rect.y -= brush_low * scaled_tile_width;
+					dest_rect.w = app_state.brush_size * scaled_tile_width;
+					dest_rect.h = app_state.brush_size * scaled_tile_width;
+
+					SDL_SetRenderDrawColor(renderer, 240, 240, 0, 200);
+					SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+					SDL_RenderDrawRect(renderer, &dest_rect);
+					SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+				}
+
+				if (app_state.drawing_shape && first_x < last_x && first_y < last_y) {
+					SDL_SetRenderDrawColor(renderer, 240, 240, 0, 120);
+					render_spans(renderer, &app_state.shape_spans, visible_tiles, canvas_offset_x, canvas_offset_y, scaled_tile_width);
 				}
 
-				if (app_state.interaction_flags & ACTION_SELECTING) {
+				if (app_state.floating.tiles) {
+					// The part of the floating tiles over the visible part of the level
+					Level_Grid *floating = &app_state.floating;
+					s32 x0 = first_x - app_state.floating_x;
+					s32 y0 = first_y - app_state.floating_y;
+					s32 x1 = last_x - app_state.floating_x;
+					s32 y1 = last_y - app_state.floating_y;
+					if (x0 < 0) x0 = 0;
+					if (y0 < 0) y0 = 0;
+					if (x1 > (s32)floating->width) x1 = floating->width;
+					if (y1 > (s32)floating->height) y1 = floating->height;
+
+					s32 floating_origin_x = canvas_offset_x + app_state.floating_x * scaled_tile_width;
+					s32 floating_origin_y = canvas_offset_y + app_state.floating_y * scaled_tile_width;
+
+					if (x0 < x1 && y0 < y1) {
+						render_level_tiles(renderer, floating, (SDL_Rect){x0, y0, x1 - x0, y1 - y0}, &app_state.tile_map, app_state.tile_map_texture,
+							floating_origin_x, floating_origin_y, scaled_tile_width);
+					}
+
+					dest_rect = (SDL_Rect){
+						floating_origin_x,
+						floating_origin_y,
+						floating->width * scaled_tile_width,
+						floating->height * scaled_tile_width,
+					};
+
+					SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+					SDL_SetRenderDrawColor(renderer, 0, 150, 200, 255);
+					SDL_RenderDrawRect(renderer, &dest_rect);
+				}
+				else if (app_state.interaction_flags & ACTION_SELECTING) {
 					SDL_Rect selection = app_state.selection;
 
 					selection.x *= scaled_tile_width;
@@ -1052,6 +3059,37 @@ int main(int argc, char **argv) {
 			break;
 
 			case APP_MODE_PICK_TILE: {
+				if (blocks) {
+					// Drop shadow
+					s32 border_radius = 6;
+					dest_rect = (SDL_Rect){
+						canvas_offset_x - border_radius,
+						canvas_offset_y - border_radius,
+						canvas_width_pixels + (2*border_radius),
+						canvas_height_pixels + (2*border_radius)
+					};
+
+					SDL_SetRenderDrawColor(renderer, 0, 0, 0, 60);
+					SDL_RenderFillRect(renderer, &dest_rect);
+
+					for (u32 block = 0; block < blocks->block_count; ++block) {
+						render_block(renderer, blocks, block, &app_state.tile_map, app_state.tile_map_texture,
+							block % blocks_per_row * block_size * scaled_tile_width + canvas_offset_x,
+							block / blocks_per_row * block_size * scaled_tile_width + canvas_offset_y,
+							scaled_tile_width);
+					}
+
+					u32 hot_block_x = hot_tile_x / block_size;
+					u32 hot_block_y = hot_tile_y / block_size;
+					u32 hot_block = hot_block_y * blocks_per_row + hot_block_x;
+
+					if (mouse_left_clicked && hot_block_x < blocks_per_row && hot_block < blocks->block_count) {
+						block_layer_set_brush(blocks, hot_block);
+					}
+
+					break;
+				}
+
 				// Drop shadow
 				s32 border_radius = 6;
 				dest_rect = (SDL_Rect){
@@ -1072,13 +3110,106 @@ int main(int argc, char **argv) {
 				};
 
 				SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-				SDL_RenderCopy(renderer, app_state.tile_map_texture, NULL, &dest_rect);
 
+				u32 pick_order[TILE_INDEX_COUNT];
+				u32 pick_count = tile_pick_order(level, app_state.tile_map.tile_count, app_state.pick_by_usage, pick_order);
+
+				if (app_state.pick_by_usage && level) {
+					for (u32 slot = 0; slot < pick_count; ++slot) {
+						u32 tile_index = pick_order[slot];
+
+						source_rect = (SDL_Rect){
+							tile_index % tiles_per_row * GAMEBOY_TILE_WIDTH,
+							tile_index / tiles_per_row * GAMEBOY_TILE_WIDTH,
+							GAMEBOY_TILE_WIDTH,
+							GAMEBOY_TILE_WIDTH,
+						};
+						dest_rect = (SDL_Rect){
+							slot % tiles_per_row * scaled_tile_width + canvas_offset_x,
+							slot / tiles_per_row * scaled_tile_width + canvas_offset_y,
+							scaled_tile_width,
+							scaled_tile_width,
+						};
+
+						SDL_RenderCopy(renderer, app_state.tile_map_texture, &source_rect, &dest_rect);
+					}
+				}
+				else {
+					SDL_RenderCopy(renderer, app_state.tile_map_texture, NULL, &dest_rect);
+				}
+
+				if (level) {
+					// Shade the tiles the level does not use
+					SDL_SetRenderDrawColor(renderer, 0, 0, 0, 150);
+
+					for (u32 slot = 0; slot < pick_count; ++slot) {
+						if (level->tile_uses[pick_order[slot]]) continue;
+
+						dest_rect = (SDL_Rect){
+							slot % tiles_per_row * scaled_tile_width + canvas_offset_x,
+							slot / tiles_per_row * scaled_tile_width + canvas_offset_y,
+							scaled_tile_width,
+							scaled_tile_width,
+						};
+
+						SDL_RenderFillRect(renderer, &dest_rect);
+					}
+				}
+
+				u32 hot_slot = hot_tile_y * tiles_per_row + hot_tile_x;
+				u32 pick_rows = (pick_count + tiles_per_row - 1) / tiles_per_row;
+				b32 mouse_previous_left_clicked = app_state.mouse_previous_flags & SDL_BUTTON(SDL_BUTTON_LEFT);
+
+				// A click picks one tile, a drag a rectangle of tiles to stamp
+				if (mouse_left_clicked && !mouse_previous_left_clicked && (hot_tile_y < tiles_per_row) && (hot_tile_x < tiles_per_row) && hot_slot < pick_count) {
+					app_state.picking_stamp = true;
+					app_state.stamp_pick_x = hot_tile_x;
+					app_state.stamp_pick_y = hot_tile_y;
+				}
+
+				if (app_state.picking_stamp) {
+					u32 end_x = hot_tile_x < tiles_per_row ? hot_tile_x : tiles_per_row - 1;
+					u32 end_y = hot_tile_y < pick_rows ? hot_tile_y : pick_rows - 1;
+					if ((s32)hot_tile_x < 0) end_x = 0;
+					if ((s32)hot_tile_y < 0) end_y = 0;
+
+					SDL_Rect picked = {
+						app_state.stamp_pick_x < end_x ? app_state.stamp_pick_x : end_x,
+						app_state.stamp_pick_y < end_y ? app_state.stamp_pick_y : end_y,
+						abs((s32)end_x - (s32)app_state.stamp_pick_x) + 1,
+						abs((s32)end_y - (s32)app_state.stamp_pick_y) + 1,
+					};
+
+					if (!mouse_left_clicked) {
+						u32 solid_flag = app_state.tile_to_draw & TILE_MASK_SOLID;
+						app_state.tile_to_draw = pick_order[picked.y * tiles_per_row + picked.x] | solid_flag;
+						app_state.picking_stamp = false;
+
+						if (picked.w == 1 && picked.h == 1) {
+							level_grid_free(&app_state.stamp);
+						}
+						else if (level_grid_allocate(&app_state.stamp, picked.w, picked.h)) {
+							for (s32 y = 0; y < picked.h; ++y) {
+								Tile *row = level_grid_row(&app_state.stamp, y);
+
+								for (s32 x = 0; x < picked.w; ++x) {
+									// Past the last tile of the tile set the stamp holds tile 0
+									u32 slot = (picked.y + y) * tiles_per_row + picked.x + x;
+									row[x] = (slot < pick_count ? pick_order[slot] : 0) | solid_flag;
+								}
+							}
+						}
+					}
+
+					dest_rect = (SDL_Rect){
+						picked.x * scaled_tile_width + canvas_offset_x,
+						picked.y * scaled_tile_width + canvas_offset_y,
+						picked.w * scaled_tile_width,
+						picked.h * scaled_tile_width,
+					};
 
-				if (mouse_left_clicked && (hot_tile_y < tiles_per_row) && (hot_tile_x < tiles_per_row)) {
-					u32 solid_flag = app_state.tile_to_draw & TILE_MASK_SOLID;
-					app_state.tile_to_draw = (hot_tile_y * tiles_per_row) + hot_tile_x;
-					app_state.tile_to_draw |= solid_flag;
+					SDL_SetRenderDrawColor(renderer, 0, 150, 200, 120);
+					SDL_RenderFillRect(renderer, &dest_rect);
 				}
 			}
 			break;
@@ -1090,19 +3221,26 @@ int main(int argc, char **argv) {
 
 		SDL_SetRenderDrawColor(renderer, 255, 255, 0, 200);
 		SDL_Rect hot_rect = {
-			hot_tile_x * scaled_tile_width + canvas_offset_x,
-			hot_tile_y * scaled_tile_width + canvas_offset_y,
-			scaled_tile_width,
-			scaled_tile_width,
+			hot_tile_x / block_size * block_size * scaled_tile_width + canvas_offset_x,
+			hot_tile_y / block_size * block_size * scaled_tile_width + canvas_offset_y,
+			block_size * scaled_tile_width,
+			block_size * scaled_tile_width,
 		};
 		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
 		SDL_RenderDrawRect(renderer, &hot_rect);
 
 		SDL_RenderSetScale(renderer, 1, 1);
 
+		if (timeline_shown) draw_history_timeline(renderer, level->history, timeline_rect);
+
 		SDL_RenderPresent(renderer);
+
+		journal_update(&app_state.journal);
 	}
 
+	journal_close(&app_state.journal);
+	project_shutdown(project);
+
 	SDL_Quit();
 	return 0;
 }
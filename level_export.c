@@ -0,0 +1,204 @@
+// NOTE: Compressed exports for the game ROM.
+//
+// RLE stream, decoded front to back until the terminator:
+//
+//     0x00                end of stream
+//     0x01..0x7f  n       n literal bytes follow
+//     0x80..0xff  c, v    v repeated (c & 0x7f) + 3 times
+//
+// This is the SM83 decoder the cycle estimates are for, in M-cycles:
+//
+//     .next:   ld a, [hl+]     2      .run:    and $7f         2
+//              or a            1               add 3           2
+//              ret z           2/5             ld b, a         1
+//              bit 7, a        2               ld a, [hl+]     2
+//              jr nz, .run     2/3      .fill: ld [de], a      2
+//              ld b, a         1               inc de          2
+//     .literal:ld a, [hl+]     2               dec b           1
+//              ld [de], a      2               jr nz, .fill    3/2
+//              inc de          2               jr .next        3
+//              dec b           1
+//              jr nz, .literal 3/2
+//              jr .next        3
+
+#define RLE_MAX_LITERAL 0x7f
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN (0x7f + RLE_MIN_RUN)
+
+#define RLE_CYCLES_LITERAL_TOKEN 12
+#define RLE_CYCLES_LITERAL_BYTE 10
+#define RLE_CYCLES_RUN_TOKEN 19
+#define RLE_CYCLES_RUN_BYTE 8
+#define RLE_CYCLES_END 8
+
+// One frame of the DMG at 1.048576 MHz
+#define GAMEBOY_CYCLES_PER_FRAME 17556
+
+typedef struct Rle_Stats {
+	umm raw_size;
+	umm compressed_size;
+	u64 decode_cycles;
+} Rle_Stats;
+
+
+static inline umm rle_max_compressed_size(umm size) {
+	return size + size / RLE_MAX_LITERAL + 2;
+}
+
+// NOTE: Literals are copied out as they come and the token byte in
+// front of them is patched when the literal run ends, so there is no second
+// pass and no look-behind.
+static umm rle_compress(u8 *source, umm size, u8 *dest, Rle_Stats *stats) {
+
+	u8 *at = source;
+	u8 *end = source + size;
+	u8 *out = dest;
+
+	u8 *literal_token = NULL;
+	u32 literal_count = 0;
+	u64 cycles = 0;
+
+	while (at < end) {
+		u8 value = *at;
+
+		umm limit = end - at;
+		if (limit > RLE_MAX_RUN) limit = RLE_MAX_RUN;
+
+		umm run = 1;
+		while (run < limit && at[run] == value) ++run;
+
+		if (run >= RLE_MIN_RUN) {
+			if (literal_count) {
+				*literal_token = (u8)literal_count;
+				cycles += RLE_CYCLES_LITERAL_TOKEN + RLE_CYCLES_LITERAL_BYTE * literal_count;
+				literal_count = 0;
+			}
+
+			*out++ = 0x80 | (u8)(run - RLE_MIN_RUN);
+			*out++ = value;
+			cycles += RLE_CYCLES_RUN_TOKEN + RLE_CYCLES_RUN_BYTE * run;
+			at += run;
+			continue;
+		}
+
+		for (umm i = 0; i < run; ++i) {
+			if (literal_count == 0) literal_token = out++;
+
+			*out++ = value;
+
+			if (++literal_count == RLE_MAX_LITERAL) {
+				*literal_token = (u8)literal_count;
+				cycles += RLE_CYCLES_LITERAL_TOKEN + RLE_CYCLES_LITERAL_BYTE * literal_count;
+				literal_count = 0;
+			}
+		}
+
+		at += run;
+	}
+
+	if (literal_count) {
+		*literal_token = (u8)literal_count;
+		cycles += RLE_CYCLES_LITERAL_TOKEN + RLE_CYCLES_LITERAL_BYTE * literal_count;
+	}
+
+	*out++ = 0;
+	cycles += RLE_CYCLES_END;
+
+	umm compressed_size = out - dest;
+	assert(compressed_size <= rle_max_compressed_size(size));
+
+	if (stats) {
+		stats->raw_size += size;
+		stats->compressed_size += compressed_size;
+		stats->decode_cycles += cycles;
+	}
+
+	return compressed_size;
+}
+
+static umm rle_decompress(u8 *source, umm source_size, u8 *dest, umm dest_size) {
+	u8 *at = source;
+	u8 *end = source + source_size;
+	u8 *out = dest;
+	u8 *out_end = dest + dest_size;
+
+	while (at < end) {
+		u8 token = *at++;
+		if (token == 0) break;
+
+		if (token & 0x80) {
+			umm run = (token & 0x7f) + RLE_MIN_RUN;
+			if (at >= end || run > (umm)(out_end - out)) return 0;
+			memset(out, *at++, run);
+			out += run;
+		}
+		else {
+			if (token > (umm)(end - at) || token > (umm)(out_end - out)) return 0;
+			memcpy(out, at, token);
+			out += token;
+			at += token;
+		}
+	}
+
+	return out - dest;
+}
+
+// NOTE: <level>.rle holds the tile plane stream followed by the
+// collision plane stream, each with its own terminator.
+static b32 export_level_rle(Level *level, char *path, Rle_Stats *stats) {
+
+	Level_Grid *grid = &level->grid;
+	umm cell_count = (umm)grid->width * grid->height;
+
+	u8 *planes = level_raw_planes(grid, NULL);
+	u8 *buffer = malloc(2 * rle_max_compressed_size(cell_count));
+
+	if (!planes || !buffer) {
+		fprintf(stderr, "Out of memory exporting %s.\n", path);
+		free(planes);
+		free(buffer);
+		return false;
+	}
+
+	Rle_Stats level_stats = {0};
+	umm tiles_size = rle_compress(planes, cell_count, buffer, &level_stats);
+	umm size = tiles_size + rle_compress(planes + cell_count, cell_count, buffer + tiles_size, &level_stats);
+
+	// Decode both streams back over the planes they were made from
+	u8 *check = malloc(cell_count);
+	b32 success =
+		check &&
+		rle_decompress(buffer, tiles_size, check, cell_count) == cell_count &&
+		memcmp(check, planes, cell_count) == 0 &&
+		rle_decompress(buffer + tiles_size, size - tiles_size, check, cell_count) == cell_count &&
+		memcmp(check, planes + cell_count, cell_count) == 0;
+	free(check);
+
+	char export_path[1100];
+	level_export_path(export_path, sizeof(export_path), path, ".rle");
+
+	if (!success) {
+		fprintf(stderr, "RLE round trip failed for %s, not exporting.\n", export_path);
+	}
+
+	success = success && write_entire_file_atomic(export_path, buffer, size);
+
+	if (success) {
+		fprintf(stderr, "Exported %s: %llu -> %llu bytes (%.1f%%), decodes in ~%llu M-cycles (%.1f frames)\n",
+			export_path,
+			level_stats.raw_size, level_stats.compressed_size,
+			100.0 * level_stats.compressed_size / level_stats.raw_size,
+			level_stats.decode_cycles,
+			(double)level_stats.decode_cycles / GAMEBOY_CYCLES_PER_FRAME);
+
+		if (stats) {
+			stats->raw_size += level_stats.raw_size;
+			stats->compressed_size += level_stats.compressed_size;
+			stats->decode_cycles += level_stats.decode_cycles;
+		}
+	}
+
+	free(planes);
+	free(buffer);
+	return success;
+}
@@ -0,0 +1,382 @@
+// NOTE: Level container format. A fixed header, a table of sections and
+// the sections themselves, each at a 64 byte aligned offset with its own CRC32.
+// Sections are stored exactly as they are used, little endian, so a tool can
+// map the file and point straight into it with level_file_section.
+//
+//     Level_File_Header   at offset 0
+//     Level_File_Section  section_count entries at section_table_offset
+//     section data        at section.offset, padded to 64 bytes
+//
+// The raw two plane .bin format is still written for levels saved under a
+// .bin name, and can be exported from any level (Ctrl+E).
+
+#define LEVEL_FILE_MAGIC 0x4c42474d // "MGBL"
+#define LEVEL_FILE_VERSION 1
+#define LEVEL_FILE_ALIGNMENT 64
+
+// One u16 per cell, row by row: tile index in the low 10 bits, flags on top
+#define LEVEL_SECTION_TILES 0x454c4954 // "TILE"
+#define LEVEL_SECTION_TILE_SOLID 0x8000
+#define LEVEL_SECTION_TILE_FLIP_Y 0x4000
+#define LEVEL_SECTION_TILE_FLIP_X 0x2000
+// One u8 per cell, the collision plane of the raw format
+#define LEVEL_SECTION_COLLISION 0x4c4c4f43 // "COLL"
+// Object records, see level_objects.c
+#define LEVEL_SECTION_OBJECTS 0x534a424f // "OBJS"
+
+typedef struct Level_File_Header {
+	u32 magic;
+	u16 version;
+	u16 header_size;
+	u32 width;
+	u32 height;
+	u32 section_count;
+	u32 section_table_offset;
+	u64 file_size;
+	u32 header_crc; // Of the header with this field zeroed, and the section table
+	u32 reserved[7];
+} Level_File_Header;
+
+typedef struct Level_File_Section {
+	u32 kind;
+	u32 element_size;
+	u64 offset;
+	u64 size;
+	u32 crc;
+	u32 reserved;
+} Level_File_Section;
+
+typedef int check_level_file_header[sizeof(Level_File_Header) == 64 ? 1 : -1];
+typedef int check_level_file_section[sizeof(Level_File_Section) == 32 ? 1 : -1];
+
+typedef struct Level_File {
+	Mapped_File mapped;
+	Level_File_Header *header;
+	Level_File_Section *sections;
+} Level_File;
+
+
+static inline umm level_file_align(umm offset) {
+	return (offset + LEVEL_FILE_ALIGNMENT - 1) & ~(umm)(LEVEL_FILE_ALIGNMENT - 1);
+}
+
+static u32 level_file_header_crc(Level_File_Header *header, Level_File_Section *sections) {
+	Level_File_Header copy = *header;
+	copy.header_crc = 0;
+
+	u32 crc = crc32(0, &copy, sizeof(copy));
+	return crc32(crc, sections, (umm)header->section_count * sizeof(Level_File_Section));
+}
+
+static b32 level_file_is_container(char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return false;
+
+	u32 magic = 0;
+	b32 result = fread(&magic, sizeof(magic), 1, file) == 1 && magic == LEVEL_FILE_MAGIC;
+	fclose(file);
+
+	return result;
+}
+
+static b32 save_level_container(Level *level, char *path) {
+
+	Level_Grid *grid = &level->grid;
+	umm cell_count = (umm)grid->width * grid->height;
+
+	Level_File_Section sections[3] = {
+		{LEVEL_SECTION_TILES, sizeof(u16), 0, cell_count * sizeof(u16), 0, 0},
+		{LEVEL_SECTION_COLLISION, sizeof(u8), 0, cell_count, 0, 0},
+		{LEVEL_SECTION_OBJECTS, sizeof(Object), 0, (umm)level->objects.count * sizeof(Object), 0, 0},
+	};
+	u32 section_count = sizeof(sections) / sizeof(*sections);
+
+	umm offset = level_file_align(sizeof(Level_File_Header) + sizeof(sections));
+
+	for (u32 i = 0; i < section_count; ++i) {
+		sections[i].offset = offset;
+		offset = level_file_align(offset + sections[i].size);
+	}
+
+	umm file_size = offset;
+	u8 *buffer = calloc(file_size, 1);
+
+	if (!buffer) {
+		fprintf(stderr, "Out of memory saving %s.\n", path);
+		return false;
+	}
+
+	u16 *tiles = (u16 *)(buffer + sections[0].offset);
+	u8 *collision_flags = buffer + sections[1].offset;
+	u32 truncated_count = 0;
+
+	for (u32 y = 0; y < grid->height; ++y) {
+		Tile *row = level_grid_row(grid, y);
+
+		for (u32 x = 0; x < grid->width; ++x) {
+			Tile tile = row[x];
+			truncated_count += (tile & TILE_MASK_INDEX) >= TILE_INDEX_COUNT;
+
+			*tiles++ =
+				(u16)tile_index(tile) |
+				((tile & TILE_MASK_SOLID) ? LEVEL_SECTION_TILE_SOLID : 0) |
+				((tile & TILE_MASK_FLIP_Y) ? LEVEL_SECTION_TILE_FLIP_Y : 0) |
+				((tile & TILE_MASK_FLIP_X) ? LEVEL_SECTION_TILE_FLIP_X : 0);
+			*collision_flags++ = tile_collision_flags(grid, x, y);
+		}
+	}
+
+	if (truncated_count) {
+		fprintf(stderr, "Warning: %u tiles in %s use indices above %u.\n", truncated_count, path, TILE_INDEX_COUNT - 1);
+	}
+
+	if (sections[2].size) {
+		memcpy(buffer + sections[2].offset, level->objects.objects, sections[2].size);
+	}
+
+	for (u32 i = 0; i < section_count; ++i) {
+		sections[i].crc = crc32(0, buffer + sections[i].offset, sections[i].size);
+	}
+
+	Level_File_Header header = {0};
+	header.magic = LEVEL_FILE_MAGIC;
+	header.version = LEVEL_FILE_VERSION;
+	header.header_size = sizeof(header);
+	header.width = grid->width;
+	header.height = grid->height;
+	header.section_count = section_count;
+	header.section_table_offset = sizeof(header);
+	header.file_size = file_size;
+	header.header_crc = level_file_header_crc(&header, sections);
+
+	memcpy(buffer, &header, sizeof(header));
+	memcpy(buffer + sizeof(header), sections, sizeof(sections));
+
+	b32 success = write_entire_file_atomic(path, buffer, file_size);
+	free(buffer);
+
+	return success;
+}
+
+static void level_file_close(Level_File *file) {
+	unmap_file(&file->mapped);
+	*file = (Level_File){0};
+}
+
+// NOTE: Maps the file and checks that the header and section table can
+// be trusted. Section contents are only checked against their CRC when
+// verify_sections is set, which touches every page of the file.
+static b32 level_file_open(Level_File *file, char *path, b32 verify_sections) {
+
+	*file = (Level_File){0};
+	file->mapped = map_file(path);
+
+	if (!file->mapped.data) {
+		fprintf(stderr, "Could not open file %s for reading.\n", path);
+		return false;
+	}
+
+	u8 *data = file->mapped.data;
+	umm length = file->mapped.length;
+
+	Level_File_Header *header = (Level_File_Header *)data;
+	char *problem = NULL;
+
+	if (length < sizeof(Level_File_Header) || header->magic != LEVEL_FILE_MAGIC) {
+		problem = "not a level file";
+	}
+	else if (header->version != LEVEL_FILE_VERSION || header->header_size != sizeof(Level_File_Header)) {
+		problem = "unsupported version";
+	}
+	else if (header->file_size != length) {
+		problem = "truncated";
+	}
+	else if (
+		header->width == 0 || header->width > LEVEL_MAX_WIDTH ||
+		header->height == 0 || header->height > LEVEL_MAX_HEIGHT)
+	{
+		problem = "bad dimensions";
+	}
+	else if (
+		header->section_table_offset % 8 != 0 ||
+		header->section_table_offset > length ||
+		header->section_count > (length - header->section_table_offset) / sizeof(Level_File_Section))
+	{
+		problem = "bad section table";
+	}
+	else {
+		file->header = header;
+		file->sections = (Level_File_Section *)(data + header->section_table_offset);
+
+		if (level_file_header_crc(header, file->sections) != header->header_crc) {
+			problem = "header checksum mismatch";
+		}
+	}
+
+	for (u32 i = 0; !problem && i < header->section_count; ++i) {
+		Level_File_Section *section = &file->sections[i];
+
+		if (section->offset % LEVEL_FILE_ALIGNMENT != 0 || section->offset > length || section->size > length - section->offset) {
+			problem = "section out of bounds";
+		}
+		else if (verify_sections && crc32(0, data + section->offset, section->size) != section->crc) {
+			problem = "section checksum mismatch";
+		}
+	}
+
+	if (problem) {
+		fprintf(stderr, "Level file %s: %s.\n", path, problem);
+		level_file_close(file);
+		return false;
+	}
+
+	return true;
+}
+
+// NOTE: Points straight into the mapping. NULL if the file has no
+// section of that kind.
+static void *level_file_section(Level_File *file, u32 kind, umm *out_size) {
+	for (u32 i = 0; i < file->header->section_count; ++i) {
+		Level_File_Section *section = &file->sections[i];
+
+		if (section->kind == kind) {
+			*out_size = section->size;
+			return file->mapped.data + section->offset;
+		}
+	}
+
+	*out_size = 0;
+	return NULL;
+}
+
+static b32 load_level_container(Level *level, char *path) {
+
+	Level_File file;
+	if (!level_file_open(&file, path, true)) return false;
+
+	u32 width = file.header->width;
+	u32 height = file.header->height;
+	umm cell_count = (umm)width * height;
+
+	umm tiles_size;
+	umm objects_size;
+	u16 *tiles = level_file_section(&file, LEVEL_SECTION_TILES, &tiles_size);
+	Object *objects = level_file_section(&file, LEVEL_SECTION_OBJECTS, &objects_size);
+
+	b32 success = tiles && tiles_size == cell_count * sizeof(u16) && objects_size % sizeof(Object) == 0;
+
+	if (!success) {
+		fprintf(stderr, "Level file %s: missing or malformed sections.\n", path);
+	}
+
+	success = success && level_grid_allocate(&level->grid, width, height);
+
+	if (success) {
+		for (umm i = 0; i < cell_count; ++i) {
+			u16 tile = tiles[i];
+			level->grid.tiles[i] =
+				tile_index(tile) |
+				((tile & LEVEL_SECTION_TILE_SOLID) ? TILE_MASK_SOLID : 0) |
+				((tile & LEVEL_SECTION_TILE_FLIP_Y) ? TILE_MASK_FLIP_Y : 0) |
+				((tile & LEVEL_SECTION_TILE_FLIP_X) ? TILE_MASK_FLIP_X : 0);
+		}
+
+		object_layer_free(&level->objects);
+
+		if (objects_size) {
+			object_layer_set_objects(&level->objects, objects, objects_size / sizeof(Object));
+		}
+	}
+
+	level_file_close(&file);
+	return success;
+}
+
+// NOTE: Levels saved under a .bin name keep the raw format that game
+// builds consume directly, with objects in a side file.
+static b32 level_path_is_raw(char *path) {
+	umm length = strlen(path);
+	return length >= 4 && strcmp(path + length - 4, ".bin") == 0;
+}
+
+static b32 save_level(Level *level, char *path) {
+	b32 success;
+
+	if (level_path_is_tiled(path)) {
+		fprintf(stderr, "%s is a Tiled map, which is only imported. Save the level under a .level or .bin name.\n", path);
+		return false;
+	}
+
+	if (level_path_is_png(path)) {
+		fprintf(stderr, "%s is an image, which is only imported. Save the level under a .level or .bin name.\n", path);
+		return false;
+	}
+
+	if (level_path_is_raw(path)) {
+		success = save_level_binary(&level->grid, path);
+		success = save_level_objects(&level->objects, path) && success;
+	}
+	else {
+		success = save_level_container(level, path);
+	}
+
+	success = save_level_blocks(&level->blocks, path) && success;
+
+	return success;
+}
+
+// NOTE: Files load_level reads but save_level does not write
+static inline b32 level_path_is_import(char *path) {
+	return level_path_is_tiled(path) || level_path_is_png(path);
+}
+
+// NOTE: Loads the grid and objects of either format, told apart by the
+// magic number. The grid keeps its dimensions for a raw file of matching size.
+// Tiled maps and PNG mockups are imported, see level_tiled.c and level_png.c.
+static b32 load_level(Level *level, char *path) {
+	if (level_path_is_tiled(path)) {
+		return import_tiled_map(level, path);
+	}
+
+	if (level_path_is_png(path)) {
+		return import_png_level(level, path);
+	}
+
+	if (level_file_is_container(path)) {
+		return load_level_container(level, path);
+	}
+
+	return load_level_binary(&level->grid, path) && load_level_objects(&level->objects, path);
+}
+
+// NOTE: The level path with its extension replaced, for exports that
+// go next to the level.
+static void level_export_path(char *out_path, umm out_path_size, char *path, char *extension) {
+	umm length = strlen(path);
+
+	char *dot = strrchr(path, '.');
+	char *last_slash = strrchr(path, '/');
+	char *last_backslash = strrchr(path, '\\');
+
+	if (dot && (!last_slash || dot > last_slash) && (!last_backslash || dot > last_backslash)) {
+		length = dot - path;
+	}
+
+	snprintf(out_path, out_path_size, "%.*s%s", (int)length, path, extension);
+}
+
+// NOTE: <level>.bin for the game build, next to the level
+static b32 export_level_binary(Level *level, char *path) {
+	char export_path[1100];
+	level_export_path(export_path, sizeof(export_path), path, ".bin");
+
+	if (strcmp(export_path, path) == 0) {
+		// Already a raw level
+		return save_level_binary(&level->grid, path);
+	}
+
+	b32 success = save_level_binary(&level->grid, export_path);
+	if (success) fprintf(stderr, "Exported %s\n", export_path);
+
+	return success;
+}
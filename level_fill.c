@@ -0,0 +1,161 @@
+// NOTE: Flood fill on bitboards. Each row of the level gets a bit mask
+// of the cells holding the tile being filled over, built with tile_match_row
+// the first time the region reaches the row. The region is a second set of
+// masks that grows along a row with 64-bit shifts, carried from word to word,
+// and into the rows above and below by ANDing with their match masks. Rows
+// the region grows into go on a stack until nothing changes.
+//
+// The masks are one bit per cell, 4 MB for both on a 4096x4096 level, so the
+// memory is bounded by the level and not by the shape of the region. The
+// tiles are written afterwards, through the mask, see draw_tile_flood_fill.
+
+#define FILL_ROW_MATCHED (1 << 0) // The match mask of the row is built
+#define FILL_ROW_QUEUED  (1 << 1) // The row is on the stack
+
+typedef struct Fill_Region {
+	u32 width;
+	u32 height;
+	u32 words_per_row;
+
+	u64 *match;  // Cells holding the tile filled over, 64 per word, row by row
+	u64 *filled; // Cells in the region
+
+	u8 *row_flags;
+	u32 *row_stack; // Rows the region grew into since they were last spread
+	u32 row_stack_count;
+
+	// Rows holding the region, inclusive
+	u32 y0;
+	u32 y1;
+} Fill_Region;
+
+
+static void fill_region_free(Fill_Region *region) {
+	free(region->match);
+	free(region->filled);
+	free(region->row_flags);
+	free(region->row_stack);
+	*region = (Fill_Region){0};
+}
+
+static void fill_region_match_row(Fill_Region *region, Level_Grid *grid, u32 y, Tile tile) {
+	tile_match_row(level_grid_row(grid, y), grid->width, tile, TILE_MATCH_EXACT, &region->match[(umm)y * region->words_per_row]);
+	region->row_flags[y] |= FILL_ROW_MATCHED;
+}
+
+// NOTE: Kogge-Stone fills, spreading the seeds g through the runs of
+// set bits in p towards the high bits and towards the low bits.
+static inline u64 fill_spread_up(u64 g, u64 p) {
+	g |= p & (g << 1);  p &= p << 1;
+	g |= p & (g << 2);  p &= p << 2;
+	g |= p & (g << 4);  p &= p << 4;
+	g |= p & (g << 8);  p &= p << 8;
+	g |= p & (g << 16); p &= p << 16;
+	g |= p & (g << 32);
+	return g;
+}
+
+static inline u64 fill_spread_down(u64 g, u64 p) {
+	g |= p & (g >> 1);  p &= p >> 1;
+	g |= p & (g >> 2);  p &= p >> 2;
+	g |= p & (g >> 4);  p &= p >> 4;
+	g |= p & (g >> 8);  p &= p >> 8;
+	g |= p & (g >> 16); p &= p >> 16;
+	g |= p & (g >> 32);
+	return g;
+}
+
+// NOTE: Grows the region to the whole of every run it touches on the
+// row, rightwards and then leftwards, carrying across word boundaries.
+static void fill_region_spread_row(Fill_Region *region, u32 y) {
+	u32 words = region->words_per_row;
+	u64 *match = &region->match[(umm)y * words];
+	u64 *filled = &region->filled[(umm)y * words];
+
+	u64 carry = 0;
+	for (u32 word = 0; word < words; ++word) {
+		u64 seeds = filled[word] | (carry & match[word]);
+		filled[word] = seeds ? fill_spread_up(seeds, match[word]) : 0;
+		carry = filled[word] >> 63;
+	}
+
+	carry = 0;
+	for (u32 word = words; word-- > 0;) {
+		u64 seeds = filled[word] | ((carry << 63) & match[word]);
+		if (seeds) filled[word] = fill_spread_down(seeds, match[word]);
+		carry = filled[word] & 1;
+	}
+}
+
+// NOTE: Seeds the neighbouring row from the cells of the region on row
+// y, queueing it if it grew.
+static void fill_region_grow_into(Fill_Region *region, Level_Grid *grid, u32 y, u32 neighbour, Tile tile) {
+	u32 words = region->words_per_row;
+	u64 *filled = &region->filled[(umm)y * words];
+	u64 *neighbour_filled = &region->filled[(umm)neighbour * words];
+
+	if (!(region->row_flags[neighbour] & FILL_ROW_MATCHED)) {
+		fill_region_match_row(region, grid, neighbour, tile);
+	}
+
+	u64 *neighbour_match = &region->match[(umm)neighbour * words];
+	u64 grown = 0;
+
+	for (u32 word = 0; word < words; ++word) {
+		u64 seeds = filled[word] & neighbour_match[word] & ~neighbour_filled[word];
+		neighbour_filled[word] |= seeds;
+		grown |= seeds;
+	}
+
+	if (grown && !(region->row_flags[neighbour] & FILL_ROW_QUEUED)) {
+		region->row_flags[neighbour] |= FILL_ROW_QUEUED;
+		region->row_stack[region->row_stack_count++] = neighbour;
+
+		if (neighbour < region->y0) region->y0 = neighbour;
+		if (neighbour > region->y1) region->y1 = neighbour;
+	}
+}
+
+// NOTE: The 4-connected region of cells holding the same tile as cell
+// (x, y). False if out of memory.
+static b32 fill_region_compute(Fill_Region *region, Level_Grid *grid, u32 x, u32 y) {
+	*region = (Fill_Region){0};
+
+	u32 words = (grid->width + 63) / 64;
+	umm mask_words = (umm)words * grid->height;
+
+	region->width = grid->width;
+	region->height = grid->height;
+	region->words_per_row = words;
+
+	// NOTE: The pages of rows the region never reaches are not touched
+	region->match = malloc(mask_words * sizeof(u64));
+	region->filled = calloc(mask_words, sizeof(u64));
+	region->row_flags = calloc(grid->height, 1);
+	region->row_stack = malloc(grid->height * sizeof(u32));
+
+	if (!region->match || !region->filled || !region->row_flags || !region->row_stack) {
+		fill_region_free(region);
+		return false;
+	}
+
+	Tile tile = level_grid_row(grid, y)[x];
+
+	fill_region_match_row(region, grid, y, tile);
+	region->filled[(umm)y * words + x / 64] = (u64)1 << (x % 64);
+	region->row_flags[y] |= FILL_ROW_QUEUED;
+	region->row_stack[region->row_stack_count++] = y;
+	region->y0 = region->y1 = y;
+
+	while (region->row_stack_count) {
+		u32 row = region->row_stack[--region->row_stack_count];
+		region->row_flags[row] &= ~FILL_ROW_QUEUED;
+
+		fill_region_spread_row(region, row);
+
+		if (row > 0) fill_region_grow_into(region, grid, row, row - 1, tile);
+		if (row + 1 < grid->height) fill_region_grow_into(region, grid, row, row + 1, tile);
+	}
+
+	return true;
+}
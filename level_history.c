@@ -0,0 +1,1116 @@
+// NOTE: Undo history of a level's tiles. Every tile write is noted in
+// a pending set as it happens; once a frame, at the end of a stroke or when an
+// undo needs it, the set is committed as one step. A step is a span in the
+// span ring pointing at its ops in the op ring, and the ops are runs of
+// consecutive cells that all changed from one tile to another, so a step costs
+// space in proportion to what changed and undoing it touches only those cells.
+//
+// The rings count up forever and are indexed modulo their length. When a new
+// step does not fit, the oldest steps are dropped. The steps form a tree: each
+// step knows its parent, the step the grid was at when it was committed, so
+// doing something new after an undo starts a branch instead of throwing the
+// undone steps away. A step number stands for the grid as it was after that
+// step; the parent of the oldest steps stands for the grid before them, even
+// once that step itself is gone.
+//
+// Undo goes to the parent, redo to the child last committed or visited. Any
+// other state is reached through the nearest step both have in common. On top
+// of that, checkpoints of the whole grid are kept in memory at least every
+// HISTORY_CHECKPOINT_INTERVAL steps down each branch, so a jump costs no more
+// than restoring one checkpoint and that many steps. A checkpoint is a grid of
+// chunks shared with the checkpoint before it wherever nothing changed. Past
+// the memory budget older checkpoints are thinned out, and jumps far back
+// apply more steps.
+//
+// Both rings live in <level>.history, mapped into memory, so the history
+// outlives the editor and only the pages in use take up memory. The file is
+// only created by the first commit, so a level that is looked at and not
+// edited leaves nothing behind. It has a fixed size:
+//
+//     History_File_Header
+//     History_Span[HISTORY_SPAN_BUFFER_LENGTH]
+//     u8 op_buffer[HISTORY_OP_BUFFER_LENGTH]
+//
+// The counters in the header are only written when the history is closed,
+// together with the CRC of the grid the history is at. Opening checks that
+// CRC against the grid it is opened for; a history that was not closed (the
+// editor died) or is for another grid starts over. Opening never reads the
+// rings, so it costs the same however long the history is.
+//
+// A run is stored as varints, its first cell relative to the end of the run
+// before it and each tile left out when it is the same as in the run before:
+//
+//     (first_cell - previous end) << 2 | same tile_from << 1 | same tile_to
+//     count - 1
+//     tile_from, rotated (unless the same)
+//     tile_to, rotated (unless the same)
+//
+// A tile is rotated so its flags are the lowest bits, which makes the first
+// sixteen tiles one byte with any flags.
+
+#define HISTORY_MAGIC 0x4842474d // "MGBH"
+#define HISTORY_VERSION 2
+
+// NOTE: The parent of the steps committed on an empty history
+#define HISTORY_NO_STEP 0xffffffff
+
+typedef enum History_Span_Kind {
+	HISTORY_SPAN_GRID_DIFFERENCE = 0,
+} History_Span_Kind;
+
+typedef struct History_Span {
+	u32 kind;
+	u32 parent;
+	u32 redo_child;     // Where redo goes from this step, if it is still a child
+	u32 op_first_index; // Byte position of the first op in the op ring
+	u32 op_size;        // In bytes
+	u32 op_count;
+	u32 cell_count;     // Cells the step changes, what applying it costs
+	u32 reserved;
+} History_Span;
+
+// NOTE: Cells first_cell to first_cell + count - 1, in y*width + x
+// order, that all changed from tile_from to tile_to
+typedef struct Tile_Change_Run {
+	u32 first_cell;
+	u32 count;
+	Tile tile_from;
+	Tile tile_to;
+} Tile_Change_Run;
+
+typedef struct Tile_Change {
+	u32 cell;
+	Tile tile_from;
+	Tile tile_to;
+} Tile_Change;
+
+// NOTE: The most bytes one run can take
+#define HISTORY_RUN_MAX_SIZE (10 + 5 + 5 + 5)
+
+typedef struct History_File_Header {
+	u32 magic;
+	u32 version;
+	u32 op_buffer_length;
+	u32 span_buffer_length;
+	u32 width;
+	u32 height;
+	u32 closed;   // Cleared while the history is open
+	u32 grid_crc; // Of the tiles the history was closed at
+
+	u32 op_buffer_head;
+	u32 op_buffer_tail;
+	u32 span_buffer_head;
+	u32 span_buffer_tail;
+	u32 current;
+	u32 base_redo_child;
+	u32 reserved[2];
+} History_File_Header;
+
+#define HISTORY_CHUNK_WIDTH 32
+
+typedef struct History_Chunk {
+	u32 references;
+	Tile tiles[HISTORY_CHUNK_WIDTH * HISTORY_CHUNK_WIDTH];
+} History_Chunk;
+
+// NOTE: The grid after a step, in HISTORY_CHUNK_WIDTH squares row by
+// row. The squares on the right and bottom edges are only partly used.
+typedef struct History_Checkpoint {
+	u32 width;
+	u32 height;
+	u32 chunks_x;
+	u32 chunks_y;
+	History_Chunk *chunks[];
+} History_Checkpoint;
+
+#define HISTORY_CHECKPOINT_INTERVAL 32
+#define HISTORY_CHECKPOINT_MEMORY (64 << 20) // Or twice the grid, if that is more
+
+// NOTE: Restoring a checkpoint compares every cell, which is about
+// this many times cheaper per cell than applying a step
+#define HISTORY_RESTORE_CELLS_PER_STEP_CELL 16
+
+#define HISTORY_PATH_LENGTH 1100
+
+#define HISTORY_OP_BUFFER_LENGTH (1 << 22)
+#define HISTORY_SPAN_BUFFER_LENGTH 16384
+#define HISTORY_FILE_SIZE (sizeof(History_File_Header) + HISTORY_SPAN_BUFFER_LENGTH * sizeof(History_Span) + HISTORY_OP_BUFFER_LENGTH)
+
+typedef struct History {
+	u32 op_buffer_head; // Start of the oldest step
+	u32 op_buffer_tail; // End of the newest step
+	u8 *op_buffer;
+
+	u32 span_buffer_head;
+	u32 span_buffer_tail;
+	History_Span *span_buffer;
+
+	u32 current;         // The step the grid is at
+	u32 base_redo_child; // Where redo goes from a state that is not a step in the rings
+
+	// The grid checkpoints are taken of, NULL for none
+	Level_Grid *grid;
+	History_Checkpoint **checkpoints; // One slot per span
+	History_Checkpoint *newest_checkpoint;
+	umm checkpoint_memory;
+
+	// Working space of history_plan. The path is the steps to undo, then
+	// the steps to redo after restoring plan_checkpoint if it is set.
+	u32 *marks;
+	u32 mark_generation;
+	u32 *path_undo;
+	u32 *path_redo;
+	u32 path_undo_count;
+	u32 path_redo_count;
+	History_Checkpoint *plan_checkpoint;
+
+	// The start of the file mapping, or of plain memory when there is no file
+	History_File_Header *header;
+	b32 mapped;
+	b32 map_pending;                // The file is created by the first commit
+	char path[HISTORY_PATH_LENGTH]; // <level>.history, empty for none
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+	// Changes since the last commit, one per cell in the order the cells were
+	// first changed. pending_index maps a cell to its change, valid only if
+	// that change is for the same cell, so it never needs clearing.
+	Tile_Change *pending;
+	u32 pending_count;
+	u32 pending_capacity;
+	u32 *pending_index;
+	u32 pending_index_capacity;
+	b32 pending_lost; // Out of memory, the step cannot be undone
+
+	// Set while the mouse is held down painting, commits wait for the release
+	b32 stroke;
+
+	// Set while undoing and redoing, whose writes are not new changes
+	b32 replaying;
+} History;
+
+
+static inline History_Span *history_span(History *history, u32 index) {
+	return &history->span_buffer[index & (HISTORY_SPAN_BUFFER_LENGTH - 1)];
+}
+
+// NOTE: Whether step is still in the rings
+static inline b32 history_step_alive(History *history, u32 step) {
+	return step - history->span_buffer_head < history->span_buffer_tail - history->span_buffer_head;
+}
+
+static void history_free_checkpoint(History *history, u32 step) {
+	History_Checkpoint **slot = &history->checkpoints[step & (HISTORY_SPAN_BUFFER_LENGTH - 1)];
+	History_Checkpoint *checkpoint = *slot;
+	if (!checkpoint) return;
+
+	u32 chunk_count = checkpoint->chunks_x * checkpoint->chunks_y;
+
+	for (u32 i = 0; i < chunk_count; ++i) {
+		if (--checkpoint->chunks[i]->references == 0) {
+			free(checkpoint->chunks[i]);
+			history->checkpoint_memory -= sizeof(History_Chunk);
+		}
+	}
+
+	history->checkpoint_memory -= sizeof(History_Checkpoint) + chunk_count * sizeof(History_Chunk *);
+	if (history->newest_checkpoint == checkpoint) history->newest_checkpoint = NULL;
+
+	free(checkpoint);
+	*slot = NULL;
+}
+
+static void history_clear(History *history) {
+	for (u32 step = history->span_buffer_head; step != history->span_buffer_tail; ++step) {
+		history_free_checkpoint(history, step);
+	}
+
+	history->op_buffer_head = history->op_buffer_tail = 0;
+	history->span_buffer_head = history->span_buffer_tail = 0;
+	history->current = history->base_redo_child = HISTORY_NO_STEP;
+	history->pending_count = 0;
+	history->pending_lost = false;
+	history->stroke = false;
+}
+
+// NOTE: Points the rings into the block that header starts
+static History *history_wrap(History_File_Header *header, b32 mapped) {
+	History *history = calloc(1, sizeof(History));
+	if (!history) return NULL;
+
+	history->checkpoints = calloc(HISTORY_SPAN_BUFFER_LENGTH, sizeof(History_Checkpoint *));
+	history->marks = calloc(HISTORY_SPAN_BUFFER_LENGTH, sizeof(u32));
+	history->path_undo = malloc(2 * HISTORY_SPAN_BUFFER_LENGTH * sizeof(u32));
+
+	if (!history->checkpoints || !history->marks || !history->path_undo) {
+		free(history->checkpoints);
+		free(history->marks);
+		free(history->path_undo);
+		free(history);
+		return NULL;
+	}
+
+	history->path_redo = history->path_undo + HISTORY_SPAN_BUFFER_LENGTH;
+
+	history->header = header;
+	history->mapped = mapped;
+	history->span_buffer = (History_Span *)(header + 1);
+	history->op_buffer = (u8 *)(history->span_buffer + HISTORY_SPAN_BUFFER_LENGTH);
+	history->current = history->base_redo_child = HISTORY_NO_STEP;
+	return history;
+}
+
+// NOTE: A history that only lives in memory
+static History *history_create(void) {
+	History_File_Header *header = calloc(1, HISTORY_FILE_SIZE);
+	if (!header) return NULL;
+
+	History *history = history_wrap(header, false);
+	if (!history) free(header);
+	return history;
+}
+
+static b32 history_header_restorable(History_File_Header *header, Level_Grid *grid) {
+	u32 span_count = header->span_buffer_tail - header->span_buffer_head;
+	u32 op_size = header->op_buffer_tail - header->op_buffer_head;
+
+	b32 restorable =
+		header->magic == HISTORY_MAGIC &&
+		header->version == HISTORY_VERSION &&
+		header->op_buffer_length == HISTORY_OP_BUFFER_LENGTH &&
+		header->span_buffer_length == HISTORY_SPAN_BUFFER_LENGTH &&
+		header->width == grid->width &&
+		header->height == grid->height &&
+		header->closed &&
+		span_count <= HISTORY_SPAN_BUFFER_LENGTH &&
+		op_size <= HISTORY_OP_BUFFER_LENGTH;
+
+	// Last, as the only check that reads more than the header
+	return restorable && crc32(0, grid->tiles, (umm)grid->width * grid->height * sizeof(Tile)) == header->grid_crc;
+}
+
+// NOTE: Maps history->path in place of the rings in memory, which have to
+// be empty. With a grid, a history the file holds for it is picked up and
+// out_restored tells whether it was; without, the file starts over. False,
+// with the history left in memory, if the file cannot be mapped.
+static b32 history_map(History *history, Level_Grid *grid, b32 *out_restored) {
+	History_File_Header *header = NULL;
+	char *path = history->path;
+
+	history->map_pending = false;
+	if (out_restored) *out_restored = false;
+
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	HANDLE mapping = NULL;
+
+	if (file != INVALID_HANDLE_VALUE) {
+		// Grows the file to the size if it is smaller
+		mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)HISTORY_FILE_SIZE, NULL);
+	}
+
+	if (mapping) {
+		header = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, HISTORY_FILE_SIZE);
+	}
+
+	if (!header) {
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	}
+#else
+	int file = open(path, O_RDWR | O_CREAT, 0666);
+
+	if (file >= 0) {
+		struct stat status;
+		b32 sized = fstat(file, &status) == 0 && status.st_size == (off_t)HISTORY_FILE_SIZE;
+
+		// Zeros, which is no history
+		if (!sized) sized = ftruncate(file, 0) == 0 && ftruncate(file, HISTORY_FILE_SIZE) == 0;
+
+		if (sized) {
+			void *data = mmap(NULL, HISTORY_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+			if (data != MAP_FAILED) header = data;
+		}
+
+		// The mapping keeps its own reference to the file
+		close(file);
+	}
+#endif
+
+	if (!header) {
+		fprintf(stderr, "Could not map the undo history %s, keeping it in memory.\n", path);
+		return false;
+	}
+
+	free(history->header);
+
+	history->header = header;
+	history->mapped = true;
+	history->span_buffer = (History_Span *)(header + 1);
+	history->op_buffer = (u8 *)(history->span_buffer + HISTORY_SPAN_BUFFER_LENGTH);
+
+#if defined(_WIN32) || defined(WIN32)
+	history->file = file;
+	history->mapping = mapping;
+#endif
+
+	if (grid && history_header_restorable(header, grid)) {
+		history->op_buffer_head = header->op_buffer_head;
+		history->op_buffer_tail = header->op_buffer_tail;
+		history->span_buffer_head = header->span_buffer_head;
+		history->span_buffer_tail = header->span_buffer_tail;
+		history->current = header->current;
+		history->base_redo_child = header->base_redo_child;
+		if (out_restored) *out_restored = true;
+	}
+	else {
+		*header = (History_File_Header){0};
+		header->magic = HISTORY_MAGIC;
+		header->version = HISTORY_VERSION;
+		header->op_buffer_length = HISTORY_OP_BUFFER_LENGTH;
+		header->span_buffer_length = HISTORY_SPAN_BUFFER_LENGTH;
+	}
+
+	// Until it is closed again the rings cannot be trusted, which has to be
+	// on disk before any step is written over the old ones
+	header->closed = false;
+
+#if defined(_WIN32) || defined(WIN32)
+	FlushViewOfFile(header, sizeof(*header));
+#else
+	msync(header, sizeof(*header), MS_SYNC);
+#endif
+
+	return true;
+}
+
+// NOTE: Opens the history kept next to level_path for grid, the grid
+// as it is about to be edited. If there is no file yet the history starts in
+// memory and the file is made by the first commit. Falls back to a history
+// in memory if the file cannot be mapped. out_restored tells whether earlier
+// steps were picked up, in which case the history already ends at grid.
+static History *history_open(char *level_path, Level_Grid *grid, b32 *out_restored) {
+	*out_restored = false;
+
+	History *history = history_create();
+	if (!history) return NULL;
+
+	snprintf(history->path, sizeof(history->path), "%s.history", level_path);
+
+	FILE *exists = fopen(history->path, "rb");
+
+	if (exists) {
+		fclose(exists);
+		history_map(history, grid, out_restored);
+	}
+	else {
+		history->map_pending = true;
+	}
+
+	return history;
+}
+
+// NOTE: Writes the counters and the CRC of grid, the state the history is
+// at, into the header of a mapped history and unmaps it.
+static void history_unmap(History *history, Level_Grid *grid) {
+	History_File_Header *header = history->header;
+
+	header->width = grid->width;
+	header->height = grid->height;
+	header->grid_crc = crc32(0, grid->tiles, (umm)grid->width * grid->height * sizeof(Tile));
+	header->op_buffer_head = history->op_buffer_head;
+	header->op_buffer_tail = history->op_buffer_tail;
+	header->span_buffer_head = history->span_buffer_head;
+	header->span_buffer_tail = history->span_buffer_tail;
+	header->current = history->current;
+	header->base_redo_child = history->base_redo_child;
+	header->closed = true;
+
+#if defined(_WIN32) || defined(WIN32)
+	UnmapViewOfFile(header);
+	CloseHandle(history->mapping);
+	CloseHandle(history->file);
+#else
+	munmap(header, HISTORY_FILE_SIZE);
+#endif
+
+	history->header = NULL;
+	history->mapped = false;
+}
+
+// NOTE: Frees the history. A history with a file stamps it with grid,
+// which has to be the state the history is at, so the next open picks it up.
+static void history_close(History *history, Level_Grid *grid) {
+	if (!history) return;
+
+	// Pending changes were never committed, so the history is not at grid
+	if (history->pending_count || history->pending_lost) history_clear(history);
+
+	for (u32 step = history->span_buffer_head; step != history->span_buffer_tail; ++step) {
+		history_free_checkpoint(history, step);
+	}
+
+	if (history->mapped) {
+		history_unmap(history, grid);
+	}
+	else {
+		free(history->header);
+	}
+
+	free(history->checkpoints);
+	free(history->marks);
+	free(history->path_undo);
+	free(history->pending);
+	free(history->pending_index);
+	free(history);
+}
+
+// NOTE: Grows the cell index to cover cell. A fresh zeroed block is
+// cheaper than it looks: the pages are only touched for cells that are used.
+static b32 history_grow_pending_index(History *history, u32 cell) {
+	u32 new_capacity = history->pending_index_capacity ? history->pending_index_capacity : 4096;
+	while (new_capacity <= cell && new_capacity < 0x80000000) new_capacity *= 2;
+	if (new_capacity <= cell) return false;
+
+	u32 *new_index = calloc(new_capacity, sizeof(u32));
+	if (!new_index) return false;
+
+	for (u32 i = 0; i < history->pending_count; ++i) {
+		new_index[history->pending[i].cell] = i;
+	}
+
+	free(history->pending_index);
+	history->pending_index = new_index;
+	history->pending_index_capacity = new_capacity;
+	return true;
+}
+
+static inline void history_record(History *history, u32 cell, Tile tile_from, Tile tile_to) {
+	if (history->replaying || history->pending_lost) return;
+
+	if (cell >= history->pending_index_capacity && !history_grow_pending_index(history, cell)) {
+		history->pending_lost = true;
+		return;
+	}
+
+	// Painting over a cell again: it keeps the first from, and takes the new to
+	u32 index = history->pending_index[cell];
+	if (index < history->pending_count && history->pending[index].cell == cell) {
+		history->pending[index].tile_to = tile_to;
+		return;
+	}
+
+	if (history->pending_count == history->pending_capacity) {
+		u32 new_capacity = history->pending_capacity ? 2 * history->pending_capacity : 256;
+		Tile_Change *new_pending = realloc(history->pending, new_capacity * sizeof(Tile_Change));
+
+		if (!new_pending) {
+			history->pending_lost = true;
+			return;
+		}
+
+		history->pending = new_pending;
+		history->pending_capacity = new_capacity;
+	}
+
+	history->pending_index[cell] = history->pending_count;
+	history->pending[history->pending_count++] = (Tile_Change){cell, tile_from, tile_to};
+}
+
+static void history_write_ops(History *history, u32 position, void *data, u32 size) {
+	u32 offset = position & (HISTORY_OP_BUFFER_LENGTH - 1);
+	u32 first = HISTORY_OP_BUFFER_LENGTH - offset;
+	if (first > size) first = size;
+
+	memcpy(history->op_buffer + offset, data, first);
+	memcpy(history->op_buffer, (u8 *)data + first, size - first);
+}
+
+// NOTE: Undo goes to the parent of the current step, if that is in
+// the rings
+static inline b32 history_can_undo(History *history) {
+	return history_step_alive(history, history->current);
+}
+
+// NOTE: Where redo goes, HISTORY_NO_STEP if nowhere
+static inline u32 history_redo_target(History *history) {
+	u32 child = history_step_alive(history, history->current) ?
+		history_span(history, history->current)->redo_child :
+		history->base_redo_child;
+
+	b32 is_child = history_step_alive(history, child) && history_span(history, child)->parent == history->current;
+	return is_child ? child : HISTORY_NO_STEP;
+}
+
+static inline void history_set_redo_child(History *history, u32 parent, u32 child) {
+	if (history_step_alive(history, parent)) history_span(history, parent)->redo_child = child;
+	else history->base_redo_child = child;
+}
+
+static inline u32 history_tile_code(Tile tile) {
+	return (tile << 3) | (tile >> 29);
+}
+
+static inline Tile history_code_tile(u32 code) {
+	return (code >> 3) | (code << 29);
+}
+
+static inline u8 *history_put_varint(u8 *at, u64 value) {
+	while (value >= 0x80) {
+		*at++ = (u8)value | 0x80;
+		value >>= 7;
+	}
+
+	*at++ = (u8)value;
+	return at;
+}
+
+// NOTE: Walks the runs of one step in the op ring
+typedef struct History_Reader {
+	u32 position;
+	u32 end;
+	u32 runs_left;
+	Tile_Change_Run run; // The last one read
+} History_Reader;
+
+static History_Reader history_reader(History_Span *span) {
+	History_Reader reader = {0};
+	reader.position = span->op_first_index;
+	reader.end = span->op_first_index + span->op_size;
+	reader.runs_left = span->op_count;
+	return reader;
+}
+
+static b32 history_get_varint(History *history, History_Reader *reader, u64 *out_value) {
+	u64 value = 0;
+
+	for (u32 shift = 0; shift < 64 && reader->position != reader->end; shift += 7) {
+		u8 byte = history->op_buffer[reader->position++ & (HISTORY_OP_BUFFER_LENGTH - 1)];
+		value |= (u64)(byte & 0x7f) << shift;
+
+		if (!(byte & 0x80)) {
+			*out_value = value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// NOTE: Reads the next run of the step into reader->run. False at the
+// end, or if the step does not decode, which only a damaged file can do.
+static b32 history_read_run(History *history, History_Reader *reader) {
+	if (!reader->runs_left) return false;
+
+	Tile_Change_Run *run = &reader->run;
+	u64 gap, count;
+	u64 tile_from = history_tile_code(run->tile_from);
+	u64 tile_to = history_tile_code(run->tile_to);
+
+	if (!history_get_varint(history, reader, &gap)) return false;
+	if (!history_get_varint(history, reader, &count)) return false;
+	if (!(gap & 2) && !history_get_varint(history, reader, &tile_from)) return false;
+	if (!(gap & 1) && !history_get_varint(history, reader, &tile_to)) return false;
+
+	u64 first_cell = (u64)run->first_cell + run->count + (gap >> 2);
+	if (first_cell + count >= 0xffffffff || tile_from > 0xffffffff || tile_to > 0xffffffff) return false;
+
+	run->first_cell = (u32)first_cell;
+	run->count = (u32)count + 1;
+	run->tile_from = history_code_tile((u32)tile_from);
+	run->tile_to = history_code_tile((u32)tile_to);
+
+	--reader->runs_left;
+	return true;
+}
+
+// NOTE: Sort of the pending changes by cell, a byte at a time
+static b32 history_sort_pending(History *history) {
+	Tile_Change *changes = history->pending;
+	u32 count = history->pending_count;
+
+	u32 highest_cell = 0;
+	b32 sorted = true;
+
+	for (u32 i = 0; i < count; ++i) {
+		if (changes[i].cell > highest_cell) highest_cell = changes[i].cell;
+		if (i && changes[i].cell < changes[i - 1].cell) sorted = false;
+	}
+
+	// A click, a line left to right, a row of a fill
+	if (sorted) return true;
+
+	Tile_Change *buffer = malloc(count * sizeof(Tile_Change));
+	if (!buffer) return false;
+
+	Tile_Change *from = changes;
+	Tile_Change *to = buffer;
+
+	for (u32 shift = 0; shift < 32 && (highest_cell >> shift); shift += 8) {
+		u32 offsets[256] = {0};
+
+		for (u32 i = 0; i < count; ++i) ++offsets[(from[i].cell >> shift) & 0xff];
+
+		u32 total = 0;
+		for (u32 i = 0; i < 256; ++i) {
+			u32 bucket = offsets[i];
+			offsets[i] = total;
+			total += bucket;
+		}
+
+		for (u32 i = 0; i < count; ++i) to[offsets[(from[i].cell >> shift) & 0xff]++] = from[i];
+
+		Tile_Change *swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if (from != changes) memcpy(changes, from, count * sizeof(Tile_Change));
+
+	free(buffer);
+	return true;
+}
+
+static void history_drop_oldest(History *history) {
+	assert(history->span_buffer_head != history->span_buffer_tail);
+
+	history_free_checkpoint(history, history->span_buffer_head);
+	++history->span_buffer_head;
+
+	history->op_buffer_head = history->span_buffer_head != history->span_buffer_tail ?
+		history_span(history, history->span_buffer_head)->op_first_index :
+		history->op_buffer_tail;
+}
+
+// NOTE: Encodes changes, sorted by cell, as runs into out, up to end.
+// Returns the end of what was written, or NULL if less than
+// HISTORY_RUN_MAX_SIZE bytes are left for a run.
+static u8 *history_encode_runs(Tile_Change *changes, u32 change_count, u8 *out, u8 *end, u32 *out_run_count) {
+	u8 *at = out;
+	u32 run_count = 0;
+	Tile_Change_Run previous = {0};
+	Tile_Change_Run run = {0};
+
+	for (u32 i = 0; i <= change_count; ++i) {
+		Tile_Change *change = i < change_count ? &changes[i] : NULL;
+
+		if (change && run.count &&
+			change->cell == run.first_cell + run.count &&
+			change->tile_from == run.tile_from &&
+			change->tile_to == run.tile_to)
+		{
+			++run.count;
+			continue;
+		}
+
+		if (run.count) {
+			if (end - at < HISTORY_RUN_MAX_SIZE) return NULL;
+
+			b32 same_from = run_count && run.tile_from == previous.tile_from;
+			b32 same_to = run_count && run.tile_to == previous.tile_to;
+			u64 gap = run.first_cell - (previous.first_cell + previous.count);
+
+			at = history_put_varint(at, gap << 2 | (u64)same_from << 1 | same_to);
+			at = history_put_varint(at, run.count - 1);
+			if (!same_from) at = history_put_varint(at, history_tile_code(run.tile_from));
+			if (!same_to) at = history_put_varint(at, history_tile_code(run.tile_to));
+
+			previous = run;
+			++run_count;
+		}
+
+		if (change) run = (Tile_Change_Run){change->cell, 1, change->tile_from, change->tile_to};
+	}
+
+	*out_run_count = run_count;
+	return at;
+}
+
+static History_Checkpoint *history_nearest_checkpoint(History *history, u32 step, u32 max_distance, u32 *out_step) {
+	for (u32 distance = 0; distance <= max_distance && history_step_alive(history, step); ++distance) {
+		History_Checkpoint *checkpoint = history->checkpoints[step & (HISTORY_SPAN_BUFFER_LENGTH - 1)];
+
+		if (checkpoint) {
+			if (out_step) *out_step = step;
+			return checkpoint;
+		}
+
+		step = history_span(history, step)->parent;
+	}
+
+	return NULL;
+}
+
+static void history_release_chunk(History *history, History_Chunk *chunk) {
+	if (--chunk->references == 0) {
+		free(chunk);
+		history->checkpoint_memory -= sizeof(History_Chunk);
+	}
+}
+
+// NOTE: Copies the grid as it is after step. Chunks that did not change
+// since the newest checkpoint are shared with it, so a checkpoint after a
+// small edit costs little more than its table of chunks.
+static void history_take_checkpoint(History *history, u32 step) {
+	Level_Grid *grid = history->grid;
+	u32 chunks_x = (grid->width + HISTORY_CHUNK_WIDTH - 1) / HISTORY_CHUNK_WIDTH;
+	u32 chunks_y = (grid->height + HISTORY_CHUNK_WIDTH - 1) / HISTORY_CHUNK_WIDTH;
+	u32 chunk_count = chunks_x * chunks_y;
+
+	History_Checkpoint *reference = history->newest_checkpoint;
+	if (reference && (reference->width != grid->width || reference->height != grid->height)) reference = NULL;
+
+	umm checkpoint_size = sizeof(History_Checkpoint) + chunk_count * sizeof(History_Chunk *);
+	History_Checkpoint *checkpoint = malloc(checkpoint_size);
+	if (!checkpoint) return;
+
+	checkpoint->width = grid->width;
+	checkpoint->height = grid->height;
+	checkpoint->chunks_x = chunks_x;
+	checkpoint->chunks_y = chunks_y;
+
+	for (u32 i = 0; i < chunk_count; ++i) {
+		u32 x0 = i % chunks_x * HISTORY_CHUNK_WIDTH;
+		u32 y0 = i / chunks_x * HISTORY_CHUNK_WIDTH;
+		u32 width = grid->width - x0 < HISTORY_CHUNK_WIDTH ? grid->width - x0 : HISTORY_CHUNK_WIDTH;
+		u32 height = grid->height - y0 < HISTORY_CHUNK_WIDTH ? grid->height - y0 : HISTORY_CHUNK_WIDTH;
+
+		History_Chunk *chunk = reference ? reference->chunks[i] : NULL;
+
+		for (u32 y = 0; chunk && y < height; ++y) {
+			if (memcmp(level_grid_row(grid, y0 + y) + x0, chunk->tiles + y * HISTORY_CHUNK_WIDTH, width * sizeof(Tile)) != 0) {
+				chunk = NULL;
+			}
+		}
+
+		if (!chunk) {
+			chunk = calloc(1, sizeof(History_Chunk));
+
+			if (!chunk) {
+				while (i--) history_release_chunk(history, checkpoint->chunks[i]);
+				free(checkpoint);
+				return;
+			}
+
+			for (u32 y = 0; y < height; ++y) {
+				memcpy(chunk->tiles + y * HISTORY_CHUNK_WIDTH, level_grid_row(grid, y0 + y) + x0, width * sizeof(Tile));
+			}
+
+			history->checkpoint_memory += sizeof(History_Chunk);
+		}
+
+		++chunk->references;
+		checkpoint->chunks[i] = chunk;
+	}
+
+	history->checkpoint_memory += checkpoint_size;
+	history->checkpoints[step & (HISTORY_SPAN_BUFFER_LENGTH - 1)] = checkpoint;
+	history->newest_checkpoint = checkpoint;
+
+	umm budget = 2 * (umm)grid->width * grid->height * sizeof(Tile);
+	if (budget < HISTORY_CHECKPOINT_MEMORY) budget = HISTORY_CHECKPOINT_MEMORY;
+
+	// Over budget, every other older checkpoint goes, so the ones left are
+	// spread over the whole history, further apart the older they are
+	while (history->checkpoint_memory > budget) {
+		b32 keep = true;
+		b32 dropped = false;
+
+		for (u32 older = history->span_buffer_head; older != step && history->checkpoint_memory > budget; ++older) {
+			if (!history->checkpoints[older & (HISTORY_SPAN_BUFFER_LENGTH - 1)]) continue;
+
+			if (!keep) {
+				history_free_checkpoint(history, older);
+				dropped = true;
+			}
+
+			keep = !keep;
+		}
+
+		if (!dropped) {
+			for (u32 older = history->span_buffer_head; older != step; ++older) {
+				history_free_checkpoint(history, older);
+			}
+
+			break;
+		}
+	}
+}
+
+// NOTE: Takes a checkpoint at step, the step the grid is at, unless there
+// is one less than HISTORY_CHECKPOINT_INTERVAL steps up its branch. Called
+// for new steps and for the steps jumps pass through, so steps restored from
+// <level>.history are covered once the grid has been through them.
+static void history_cover_step(History *history, u32 step) {
+	if (history->grid && history_step_alive(history, step) &&
+		!history_nearest_checkpoint(history, step, HISTORY_CHECKPOINT_INTERVAL - 1, NULL))
+	{
+		history_take_checkpoint(history, step);
+	}
+}
+
+// NOTE: Turns the pending changes into a step, a child of the current
+// step. Cells changed back to what they were do not count; a step with no
+// changes left is not kept.
+static void history_commit(History *history) {
+	if (!history->pending_count && !history->pending_lost) return;
+
+	if (history->pending_lost || !history_sort_pending(history)) {
+		fprintf(stderr, "Out of memory recording an edit, clearing the undo history.\n");
+		history_clear(history);
+		return;
+	}
+
+	// Each cell is pending once, drop the ones that ended where they started
+	Tile_Change *changes = history->pending;
+	u32 change_count = 0;
+
+	for (u32 i = 0; i < history->pending_count; ++i) {
+		if (changes[i].tile_from != changes[i].tile_to) changes[change_count++] = changes[i];
+	}
+
+	history->pending_count = 0;
+
+	if (!change_count) return;
+
+	// NOTE: A step never holds more than the op ring, so encoding stops once
+	// it has run past that, however many cells changed
+	umm capacity = (umm)change_count * HISTORY_RUN_MAX_SIZE;
+	if (capacity > HISTORY_OP_BUFFER_LENGTH + HISTORY_RUN_MAX_SIZE) capacity = HISTORY_OP_BUFFER_LENGTH + HISTORY_RUN_MAX_SIZE;
+
+	u8 *encoded = malloc(capacity);
+
+	if (!encoded) {
+		fprintf(stderr, "Out of memory recording an edit, clearing the undo history.\n");
+		history_clear(history);
+		return;
+	}
+
+	u32 run_count = 0;
+	u8 *encoded_end = history_encode_runs(changes, change_count, encoded, encoded + capacity, &run_count);
+	umm size = encoded_end ? (umm)(encoded_end - encoded) : capacity;
+
+	if (size > HISTORY_OP_BUFFER_LENGTH) {
+		fprintf(stderr, "An edit of %u cells is too big to undo, clearing the undo history.\n", change_count);
+		free(encoded);
+		history_clear(history);
+		return;
+	}
+
+	if (history->map_pending) history_map(history, NULL, NULL);
+
+	while (history->span_buffer_tail - history->span_buffer_head >= HISTORY_SPAN_BUFFER_LENGTH ||
+		history->op_buffer_tail - history->op_buffer_head + size > HISTORY_OP_BUFFER_LENGTH)
+	{
+		history_drop_oldest(history);
+	}
+
+	u32 parent = history->current;
+	u32 step = history->span_buffer_tail;
+
+	History_Span *span = history_span(history, step);
+	span->kind = HISTORY_SPAN_GRID_DIFFERENCE;
+	span->parent = parent;
+	span->redo_child = HISTORY_NO_STEP;
+	span->op_first_index = history->op_buffer_tail;
+	span->op_size = (u32)size;
+	span->op_count = run_count;
+	span->cell_count = change_count;
+
+	history_write_ops(history, history->op_buffer_tail, encoded, (u32)size);
+	free(encoded);
+
+	history->op_buffer_tail += (u32)size;
+	history->span_buffer_tail += 1;
+
+	history_set_redo_child(history, parent, step);
+	history->current = step;
+
+	history_cover_step(history, step);
+}
+
+// NOTE: A stroke is everything painted while the mouse is held. Edits
+// from before it are committed on their own, and the stroke becomes one step
+// when it ends, however many frames it lasted.
+static void history_begin_stroke(History *history) {
+	if (history->stroke) return;
+
+	history_commit(history);
+	history->stroke = true;
+}
+
+static void history_end_stroke(History *history) {
+	if (!history->stroke) return;
+
+	history->stroke = false;
+	history_commit(history);
+}
+
+// NOTE: Moves the history to the one kept next to level_path, for a level
+// saved under a new path, with grid the state it is at. The file is renamed
+// so the steps are there the next time the level is opened.
+static void history_move(History *history, Level_Grid *grid, char *level_path) {
+	char path[HISTORY_PATH_LENGTH];
+	snprintf(path, sizeof(path), "%s.history", level_path);
+
+	if (!history->path[0] || strcmp(path, history->path) == 0) return;
+
+	if (!history->mapped) {
+		// Made under the new name by the first commit
+		snprintf(history->path, sizeof(history->path), "%s", path);
+		return;
+	}
+
+	history_commit(history);
+	history_unmap(history, grid);
+
+	remove(path);
+	if (rename(history->path, path) != 0) {
+		fprintf(stderr, "Could not move the undo history %s to %s.\n", history->path, path);
+	}
+
+	snprintf(history->path, sizeof(history->path), "%s", path);
+
+	// The rings are kept in memory until the file is mapped again
+	History_File_Header *header = calloc(1, HISTORY_FILE_SIZE);
+	if (!header) panic("Out of memory.\n");
+
+	history->header = header;
+	history->span_buffer = (History_Span *)(header + 1);
+	history->op_buffer = (u8 *)(history->span_buffer + HISTORY_SPAN_BUFFER_LENGTH);
+
+	b32 restored = false;
+	history_map(history, grid, &restored);
+
+	if (!restored) history_clear(history);
+}
+
+// NOTE: Marks the current step and the steps above it, the branch the
+// grid is on. Returns the mark they have in history->marks.
+static u32 history_mark_current_branch(History *history, u32 *out_base) {
+	if (++history->mark_generation == 0) {
+		memset(history->marks, 0, HISTORY_SPAN_BUFFER_LENGTH * sizeof(u32));
+		history->mark_generation = 1;
+	}
+
+	u32 mark = history->mark_generation;
+	u32 step = history->current;
+
+	while (history_step_alive(history, step)) {
+		history->marks[step & (HISTORY_SPAN_BUFFER_LENGTH - 1)] = mark;
+		step = history_span(history, step)->parent;
+	}
+
+	if (out_base) *out_base = step;
+	return mark;
+}
+
+static inline b32 history_step_marked(History *history, u32 step, u32 mark) {
+	return history_step_alive(history, step) && history->marks[step & (HISTORY_SPAN_BUFFER_LENGTH - 1)] == mark;
+}
+
+// NOTE: Works out how to get the grid from the current step to target:
+// undo up to the nearest step both have in common and redo down from there,
+// or restore the checkpoint nearest above target and redo the steps below it,
+// whichever applies fewer cells. Commit first. False if target cannot be
+// reached, when it is gone or only connected through steps that are gone.
+static b32 history_plan(History *history, u32 target) {
+	u32 base;
+	u32 mark = history_mark_current_branch(history, &base);
+
+	u32 undo_count = 0;
+	u32 redo_count = 0;
+	umm cost = 0;
+
+	u32 step = target;
+	while (history_step_alive(history, step) && !history_step_marked(history, step, mark)) {
+		history->path_redo[redo_count++] = step;
+		cost += history_span(history, step)->cell_count;
+		step = history_span(history, step)->parent;
+	}
+
+	u32 common = step;
+	b32 reachable = history_step_alive(history, common) || common == base;
+
+	if (reachable) {
+		for (step = history->current; step != common; step = history_span(history, step)->parent) {
+			history->path_undo[undo_count++] = step;
+			cost += history_span(history, step)->cell_count;
+		}
+	}
+
+	u32 checkpoint_step;
+	History_Checkpoint *checkpoint = history_nearest_checkpoint(history, target, HISTORY_SPAN_BUFFER_LENGTH, &checkpoint_step);
+	history->plan_checkpoint = NULL;
+
+	if (checkpoint) {
+		umm checkpoint_cost = (umm)checkpoint->width * checkpoint->height / HISTORY_RESTORE_CELLS_PER_STEP_CELL;
+
+		for (step = target; step != checkpoint_step; step = history_span(history, step)->parent) {
+			checkpoint_cost += history_span(history, step)->cell_count;
+		}
+
+		if (!reachable || checkpoint_cost < cost) {
+			undo_count = 0;
+			redo_count = 0;
+
+			for (step = target; step != checkpoint_step; step = history_span(history, step)->parent) {
+				history->path_redo[redo_count++] = step;
+			}
+
+			history->plan_checkpoint = checkpoint;
+			reachable = true;
+		}
+	}
+
+	if (!reachable) return false;
+
+	// Collected from target up, redone from the top down
+	for (u32 i = 0; i < redo_count / 2; ++i) {
+		u32 swap = history->path_redo[i];
+		history->path_redo[i] = history->path_redo[redo_count - 1 - i];
+		history->path_redo[redo_count - 1 - i] = swap;
+	}
+
+	history->path_undo_count = undo_count;
+	history->path_redo_count = redo_count;
+	return true;
+}
+
+// NOTE: Once the grid has been taken along the planned path. Redo
+// from anywhere on the way goes back the way it came.
+static void history_arrive(History *history, u32 target) {
+	for (u32 i = 0; i < history->path_undo_count; ++i) {
+		u32 step = history->path_undo[i];
+		history_set_redo_child(history, history_span(history, step)->parent, step);
+	}
+
+	for (u32 i = 0; i < history->path_redo_count; ++i) {
+		u32 step = history->path_redo[i];
+		history_set_redo_child(history, history_span(history, step)->parent, step);
+	}
+
+	history->current = target;
+}
+
+// NOTE: The timeline has the steps from oldest to newest, with the
+// state before the oldest step at position 0.
+static inline u32 history_timeline_length(History *history) {
+	return history->span_buffer_tail - history->span_buffer_head + 1;
+}
+
+static u32 history_timeline_step(History *history, u32 position) {
+	if (position) return history->span_buffer_head + position - 1;
+
+	if (history_step_alive(history, history->span_buffer_head)) {
+		return history_span(history, history->span_buffer_head)->parent;
+	}
+
+	return history->current;
+}
+
+static u32 history_timeline_position(History *history, u32 step) {
+	return history_step_alive(history, step) ? step - history->span_buffer_head + 1 : 0;
+}
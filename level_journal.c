@@ -0,0 +1,485 @@
+// NOTE: Crash journal for the level being edited. Every tile write is
+// appended to an in-memory list (a store, no locks) and once a frame the list
+// is handed to a writer thread, which appends it to <level>.journal and syncs
+// it to disk at most every JOURNAL_FLUSH_MS. Losing power loses at most that
+// much painting.
+//
+// The journal is replayed on top of <level>.snapshot, a full copy of the grid.
+// A new snapshot is taken when the journal would grow bigger than the grid,
+// and at least every JOURNAL_SNAPSHOT_MS while editing; the journal starts
+// over after each one. Both carry a generation number so a journal is never
+// replayed over a snapshot it does not belong to. Saving the level deletes
+// both files.
+//
+//     <level>.snapshot   Journal_Snapshot_Header, then width*height tiles
+//     <level>.journal    Journal_Header, then blocks of
+//                        Journal_Block_Header and record_count Journal_Records
+//
+// A block that was only partly written when the editor died fails its CRC,
+// and replay stops there.
+
+#define JOURNAL_SNAPSHOT_MAGIC 0x5342474d // "MGBS"
+#define JOURNAL_MAGIC 0x4a42474d // "MGBJ"
+
+#define JOURNAL_FLUSH_MS 250
+#define JOURNAL_SNAPSHOT_MS 60000
+
+typedef struct Journal_Snapshot_Header {
+	u32 magic;
+	u32 generation;
+	u32 width;
+	u32 height;
+	u32 crc; // Of the tiles
+	u32 reserved;
+} Journal_Snapshot_Header;
+
+typedef struct Journal_Header {
+	u32 magic;
+	u32 generation;
+	u32 width;
+	u32 height;
+} Journal_Header;
+
+typedef struct Journal_Block_Header {
+	u32 record_count;
+	u32 crc; // Of the records
+} Journal_Block_Header;
+
+typedef struct Journal_Record {
+	u32 cell; // y*width + x
+	Tile tile;
+} Journal_Record;
+
+typedef struct Journal_Records {
+	Journal_Record *records;
+	umm count;
+	umm capacity;
+} Journal_Records;
+
+typedef struct Journal {
+	char journal_path[1100];
+	char snapshot_path[1100];
+
+	// The grid being journaled, NULL when the journal is closed
+	Level_Grid *grid;
+
+	// Main thread
+	Journal_Records recording;
+	b32 overflowed;       // Stopped recording, a snapshot covers it
+	b32 has_snapshot;     // For the current generation
+	u32 generation;
+	umm records_since_snapshot;
+	u32 snapshot_ticks;
+
+	// Handed to the writer, under mutex
+	SDL_mutex *mutex;
+	SDL_cond *wakeup;
+	SDL_Thread *writer;
+	b32 quit;
+	b32 discard;          // Delete both files, before anything below
+	u8 *snapshot;         // Header and tiles to write, then start a new journal
+	umm snapshot_size;
+	Journal_Records pending;
+
+	// Writer thread
+	Journal_Records writing;
+#if defined(_WIN32) || defined(WIN32)
+	HANDLE file;
+#else
+	int file;
+#endif
+	b32 file_open;
+	b32 reported_error;
+} Journal;
+
+
+static b32 journal_records_reserve(Journal_Records *records, umm count) {
+	if (records->count + count <= records->capacity) return true;
+
+	umm new_capacity = records->capacity ? records->capacity : 4096;
+	while (new_capacity < records->count + count) new_capacity *= 2;
+
+	Journal_Record *new_records = realloc(records->records, new_capacity * sizeof(Journal_Record));
+	if (!new_records) return false;
+
+	records->records = new_records;
+	records->capacity = new_capacity;
+	return true;
+}
+
+// NOTE: Called from level_write_tile for every change
+static inline void journal_record(Journal *journal, Level_Grid *grid, u32 x, u32 y, Tile tile) {
+	if (journal->grid != grid || journal->overflowed) return;
+
+	Journal_Records *recording = &journal->recording;
+
+	if (recording->count == recording->capacity) {
+		// Past the size of the grid a snapshot is cheaper, so stop growing
+		b32 bigger_than_grid = recording->capacity * sizeof(Journal_Record) >= (umm)grid->width * grid->height * sizeof(Tile);
+
+		if (bigger_than_grid || !journal_records_reserve(recording, 1)) {
+			journal->overflowed = true;
+			return;
+		}
+	}
+
+	recording->records[recording->count++] = (Journal_Record){y * grid->width + x, tile};
+}
+
+static void journal_file_close(Journal *journal) {
+	if (!journal->file_open) return;
+
+#if defined(_WIN32) || defined(WIN32)
+	CloseHandle(journal->file);
+#else
+	close(journal->file);
+#endif
+
+	journal->file_open = false;
+}
+
+static b32 journal_file_write(Journal *journal, void *data, umm size) {
+	u8 *at = data;
+	b32 success = journal->file_open;
+
+#if defined(_WIN32) || defined(WIN32)
+	while (success && size) {
+		DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+		DWORD written = 0;
+		success = WriteFile(journal->file, at, chunk, &written, NULL) && written == chunk;
+		at += chunk;
+		size -= chunk;
+	}
+#else
+	while (success && size) {
+		ssize_t written = write(journal->file, at, size);
+
+		if (written < 0 && errno == EINTR) continue;
+
+		success = written > 0;
+		if (success) {
+			at += written;
+			size -= written;
+		}
+	}
+#endif
+
+	return success;
+}
+
+static b32 journal_file_sync(Journal *journal) {
+#if defined(_WIN32) || defined(WIN32)
+	return journal->file_open && FlushFileBuffers(journal->file);
+#else
+	return journal->file_open && fsync(journal->file) == 0;
+#endif
+}
+
+// NOTE: Starts an empty journal for the snapshot that was just written
+static b32 journal_file_start(Journal *journal, Journal_Snapshot_Header *snapshot) {
+	journal_file_close(journal);
+
+#if defined(_WIN32) || defined(WIN32)
+	journal->file = CreateFileA(journal->journal_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	journal->file_open = journal->file != INVALID_HANDLE_VALUE;
+#else
+	journal->file = open(journal->journal_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	journal->file_open = journal->file >= 0;
+#endif
+
+	Journal_Header header = {JOURNAL_MAGIC, snapshot->generation, snapshot->width, snapshot->height};
+	return journal_file_write(journal, &header, sizeof(header)) && journal_file_sync(journal);
+}
+
+static int journal_writer_thread(void *data) {
+	Journal *journal = data;
+
+	SDL_LockMutex(journal->mutex);
+
+	for (;;) {
+		// Batches go out at most every JOURNAL_FLUSH_MS, only closing cuts the wait short
+		if (!journal->quit) {
+			SDL_CondWaitTimeout(journal->wakeup, journal->mutex, JOURNAL_FLUSH_MS);
+		}
+
+		b32 quit = journal->quit;
+		b32 discard = journal->discard;
+		u8 *snapshot = journal->snapshot;
+		umm snapshot_size = journal->snapshot_size;
+
+		Journal_Records swap = journal->writing;
+		journal->writing = journal->pending;
+		journal->pending = swap;
+		journal->pending.count = 0;
+
+		journal->discard = false;
+		journal->snapshot = NULL;
+
+		SDL_UnlockMutex(journal->mutex);
+
+		b32 success = true;
+
+		if (discard) {
+			journal_file_close(journal);
+			remove(journal->journal_path);
+			remove(journal->snapshot_path);
+		}
+
+		if (snapshot) {
+			Journal_Snapshot_Header *header = (Journal_Snapshot_Header *)snapshot;
+			header->crc = crc32(0, snapshot + sizeof(*header), snapshot_size - sizeof(*header));
+
+			success = write_entire_file_atomic(journal->snapshot_path, snapshot, snapshot_size);
+			success = success && journal_file_start(journal, header);
+			free(snapshot);
+		}
+
+		Journal_Records *writing = &journal->writing;
+
+		if (writing->count && journal->file_open) {
+			Journal_Block_Header block = {(u32)writing->count, crc32(0, writing->records, writing->count * sizeof(Journal_Record))};
+
+			success = journal_file_write(journal, &block, sizeof(block)) && success;
+			success = journal_file_write(journal, writing->records, writing->count * sizeof(Journal_Record)) && success;
+			success = journal_file_sync(journal) && success;
+		}
+
+		writing->count = 0;
+
+		if (!success && !journal->reported_error) {
+			fprintf(stderr, "Could not write the journal %s, edits since the last save are not protected.\n", journal->journal_path);
+			journal->reported_error = true;
+		}
+
+		SDL_LockMutex(journal->mutex);
+		if (quit) break;
+	}
+
+	SDL_UnlockMutex(journal->mutex);
+
+	journal_file_close(journal);
+	return 0;
+}
+
+// NOTE: Copies the grid for the writer, which replaces the snapshot
+// and starts the journal over. Records not written yet are covered by it.
+static void journal_take_snapshot(Journal *journal) {
+	Level_Grid *grid = journal->grid;
+	if (!grid) return;
+
+	umm tiles_size = (umm)grid->width * grid->height * sizeof(Tile);
+	umm snapshot_size = sizeof(Journal_Snapshot_Header) + tiles_size;
+	u8 *snapshot = malloc(snapshot_size);
+
+	// Tried again next frame, the records are kept until then
+	if (!snapshot) return;
+
+	journal->recording.count = 0;
+	journal->records_since_snapshot = 0;
+	journal->snapshot_ticks = SDL_GetTicks();
+
+	++journal->generation;
+	journal->has_snapshot = true;
+	journal->overflowed = false;
+
+	Journal_Snapshot_Header header = {JOURNAL_SNAPSHOT_MAGIC, journal->generation, grid->width, grid->height, 0, 0};
+	memcpy(snapshot, &header, sizeof(header));
+	memcpy(snapshot + sizeof(header), grid->tiles, tiles_size);
+
+	SDL_LockMutex(journal->mutex);
+	free(journal->snapshot);
+	journal->snapshot = snapshot;
+	journal->snapshot_size = snapshot_size;
+	journal->pending.count = 0;
+	SDL_UnlockMutex(journal->mutex);
+}
+
+// NOTE: Once a frame. Hands this frame's records to the writer, or
+// takes a snapshot instead when that is cheaper to replay.
+static void journal_update(Journal *journal) {
+	if (!journal->grid) return;
+
+	Journal_Records *recording = &journal->recording;
+	if (!recording->count && !journal->overflowed) return;
+
+	umm cell_count = (umm)journal->grid->width * journal->grid->height;
+	journal->records_since_snapshot += recording->count;
+
+	if (!journal->has_snapshot ||
+		journal->overflowed ||
+		journal->records_since_snapshot * sizeof(Journal_Record) > cell_count * sizeof(Tile) ||
+		SDL_GetTicks() - journal->snapshot_ticks > JOURNAL_SNAPSHOT_MS)
+	{
+		journal_take_snapshot(journal);
+		return;
+	}
+
+	SDL_LockMutex(journal->mutex);
+
+	if (journal_records_reserve(&journal->pending, recording->count)) {
+		memcpy(journal->pending.records + journal->pending.count, recording->records, recording->count * sizeof(Journal_Record));
+		journal->pending.count += recording->count;
+		recording->count = 0;
+	}
+	else {
+		journal->overflowed = true;
+	}
+
+	SDL_UnlockMutex(journal->mutex);
+}
+
+// NOTE: After a save, the level file has everything
+static void journal_discard(Journal *journal) {
+	if (!journal->grid) return;
+
+	journal->recording.count = 0;
+	journal->records_since_snapshot = 0;
+	journal->overflowed = false;
+	journal->has_snapshot = false;
+
+	SDL_LockMutex(journal->mutex);
+	free(journal->snapshot);
+	journal->snapshot = NULL;
+	journal->pending.count = 0;
+	journal->discard = true;
+	SDL_UnlockMutex(journal->mutex);
+}
+
+static void journal_paths(char *journal_path, char *snapshot_path, umm path_size, char *level_path) {
+	snprintf(journal_path, path_size, "%s.journal", level_path);
+	snprintf(snapshot_path, path_size, "%s.snapshot", level_path);
+}
+
+// NOTE: For a level that was replaced by another file while its journal was
+// closed, so there is nothing left in it to recover.
+static void journal_remove(char *level_path) {
+	char journal_path[1100];
+	char snapshot_path[1100];
+	journal_paths(journal_path, snapshot_path, sizeof(journal_path), level_path);
+
+	remove(journal_path);
+	remove(snapshot_path);
+}
+
+// NOTE: Rebuilds the grid that was being edited when the journal for
+// level_path was last written. Returns false if there is nothing to recover.
+static b32 journal_recover(char *level_path, Level_Grid *out_grid, u32 *out_generation, umm *out_record_count) {
+
+	char journal_path[1100];
+	char snapshot_path[1100];
+	journal_paths(journal_path, snapshot_path, sizeof(journal_path), level_path);
+
+	*out_record_count = 0;
+
+	FILE *exists = fopen(snapshot_path, "rb");
+	if (!exists) return false;
+	fclose(exists);
+
+	Length_Buffer snapshot = read_entire_file(snapshot_path);
+	Journal_Snapshot_Header *header = (Journal_Snapshot_Header *)snapshot.data;
+
+	b32 valid =
+		snapshot.data &&
+		snapshot.length >= sizeof(*header) &&
+		header->magic == JOURNAL_SNAPSHOT_MAGIC &&
+		header->width > 0 && header->width <= LEVEL_MAX_WIDTH &&
+		header->height > 0 && header->height <= LEVEL_MAX_HEIGHT &&
+		snapshot.length == sizeof(*header) + (umm)header->width * header->height * sizeof(Tile) &&
+		crc32(0, snapshot.data + sizeof(*header), snapshot.length - sizeof(*header)) == header->crc;
+
+	if (!valid) {
+		fprintf(stderr, "Journal snapshot %s is damaged, not recovering it.\n", snapshot_path);
+		free(snapshot.data);
+		return false;
+	}
+
+	if (!level_grid_allocate(out_grid, header->width, header->height)) {
+		free(snapshot.data);
+		return false;
+	}
+
+	umm cell_count = (umm)header->width * header->height;
+	memcpy(out_grid->tiles, snapshot.data + sizeof(*header), cell_count * sizeof(Tile));
+	*out_generation = header->generation;
+
+	Length_Buffer journal = read_entire_file(journal_path);
+	Journal_Header *journal_header = (Journal_Header *)journal.data;
+
+	if (journal.data &&
+		journal.length >= sizeof(*journal_header) &&
+		journal_header->magic == JOURNAL_MAGIC &&
+		journal_header->generation == header->generation &&
+		journal_header->width == header->width &&
+		journal_header->height == header->height)
+	{
+		u8 *at = journal.data + sizeof(*journal_header);
+		u8 *end = journal.data + journal.length;
+
+		while ((umm)(end - at) >= sizeof(Journal_Block_Header)) {
+			Journal_Block_Header *block = (Journal_Block_Header *)at;
+			at += sizeof(*block);
+
+			umm records_size = (umm)block->record_count * sizeof(Journal_Record);
+			if (records_size > (umm)(end - at) || crc32(0, at, records_size) != block->crc) break;
+
+			Journal_Record *records = (Journal_Record *)at;
+
+			for (u32 i = 0; i < block->record_count; ++i) {
+				if (records[i].cell < cell_count) {
+					out_grid->tiles[records[i].cell] = records[i].tile;
+				}
+			}
+
+			*out_record_count += block->record_count;
+			at += records_size;
+		}
+	}
+
+	free(journal.data);
+	free(snapshot.data);
+	return true;
+}
+
+// NOTE: Starts journaling grid. The first edit takes a snapshot, so
+// opening a level that is only looked at writes nothing.
+static void journal_open(Journal *journal, Level_Grid *grid, char *level_path, u32 generation) {
+	assert(!journal->grid);
+
+	journal_paths(journal->journal_path, journal->snapshot_path, sizeof(journal->journal_path), level_path);
+
+	journal->grid = grid;
+	journal->generation = generation;
+	journal->has_snapshot = false;
+	journal->overflowed = false;
+	journal->reported_error = false;
+	journal->recording.count = 0;
+	journal->records_since_snapshot = 0;
+	journal->quit = false;
+
+	if (!journal->mutex) journal->mutex = SDL_CreateMutex();
+	if (!journal->wakeup) journal->wakeup = SDL_CreateCond();
+
+	journal->writer = journal->mutex && journal->wakeup ? SDL_CreateThread(journal_writer_thread, "Journal writer", journal) : NULL;
+
+	if (!journal->writer) {
+		fprintf(stderr, "Could not start the journal writer: %s\n", SDL_GetError());
+		journal->grid = NULL;
+	}
+}
+
+// NOTE: Writes out what is left and stops the writer. The files stay,
+// they are only removed by journal_discard.
+static void journal_close(Journal *journal) {
+	if (!journal->writer) return;
+
+	if (journal->grid) journal_update(journal);
+
+	SDL_LockMutex(journal->mutex);
+	journal->quit = true;
+	SDL_CondSignal(journal->wakeup);
+	SDL_UnlockMutex(journal->mutex);
+
+	SDL_WaitThread(journal->writer, NULL);
+	journal->writer = NULL;
+	journal->grid = NULL;
+}
@@ -0,0 +1,500 @@
+// NOTE: LZ compression for shipping builds. The stream is made for a
+// small SM83 decoder: one token byte, then literals or a back reference.
+// Matches may overlap their own output, so the decoder copies byte by byte.
+//
+//     0x00                    end of stream
+//     0x01..0x7f   n          n literal bytes follow
+//     10nnnnnn     o          copy n+2 bytes from o+1 bytes back (2..65, 1..256)
+//     11nnnnnn     lo hi      copy n+3 bytes from (hi:lo)+1 bytes back (3..66, 1..65536)
+//
+// The encoder parses optimally: every position gets its longest near (one
+// byte offset) and far match from hash chains, and a backwards pass picks the
+// cheapest path to the end of the input over all literal and match lengths. Literal runs are priced with a sliding window minimum, so the
+// whole parse is linear apart from the match search.
+
+#define LZ_MAX_LITERAL 0x7f
+#define LZ_NEAR_MIN 2
+#define LZ_NEAR_MAX (0x3f + LZ_NEAR_MIN)
+#define LZ_NEAR_WINDOW 256
+#define LZ_FAR_MIN 3
+#define LZ_FAR_MAX (0x3f + LZ_FAR_MIN)
+#define LZ_FAR_WINDOW 65536
+
+#define LZ_NONE 0xffffffff
+
+// How many earlier positions with the same first two bytes are tried. Deeper
+// chains find slightly longer far matches in sparse levels at a steep cost.
+#define LZ_DEFAULT_CHAIN_DEPTH 256
+
+typedef struct Lz_Match {
+	u8 near_length; // 0 if there is no near match
+	u8 far_length;
+	u16 near_offset; // Distance - 1
+	u16 far_offset;
+} Lz_Match;
+
+typedef struct Lz_Step {
+	u8 kind; // 0 literal run, 1 near match, 2 far match
+	u8 length;
+} Lz_Step;
+
+
+static inline umm lz_max_compressed_size(umm size) {
+	return size + size / LZ_MAX_LITERAL + 2;
+}
+
+static void lz_find_matches(u8 *source, umm size, Lz_Match *matches, u32 chain_depth) {
+
+	u32 *head = malloc(65536 * sizeof(u32));
+	u32 *previous = malloc(size * sizeof(u32));
+
+	if (!head || !previous) {
+		// Literals only
+		memset(matches, 0, size * sizeof(Lz_Match));
+		free(head);
+		free(previous);
+		return;
+	}
+
+	memset(head, 0xff, 65536 * sizeof(u32));
+
+	for (umm i = 0; i < size; ++i) {
+		Lz_Match match = {0};
+
+		if (i + 1 < size) {
+			u32 key = source[i] | (source[i+1] << 8);
+			umm limit = size - i;
+			if (limit > LZ_FAR_MAX) limit = LZ_FAR_MAX;
+
+			u32 depth = 0;
+
+			for (u32 j = head[key]; j != LZ_NONE && i - j <= LZ_FAR_WINDOW && depth < chain_depth; j = previous[j], ++depth) {
+
+				umm distance = i - j;
+
+				// Only a match longer than the best so far can help, and that
+				// needs the byte just past the best length to match first
+				umm best = match.far_length;
+				if (distance <= LZ_NEAR_WINDOW && match.near_length < best) best = match.near_length;
+				if (best >= limit || (best > 2 && source[j + best] != source[i + best])) continue;
+
+				// The first two bytes are known to match
+				umm length = 2;
+				while (length < limit && source[j + length] == source[i + length]) ++length;
+
+				if (distance <= LZ_NEAR_WINDOW && length > match.near_length) {
+					match.near_length = length > LZ_NEAR_MAX ? LZ_NEAR_MAX : length;
+					match.near_offset = distance - 1;
+				}
+
+				if (length >= LZ_FAR_MIN && length > match.far_length) {
+					match.far_length = length;
+					match.far_offset = distance - 1;
+				}
+
+				if (match.far_length == LZ_FAR_MAX && (match.near_length == LZ_NEAR_MAX || distance > LZ_NEAR_WINDOW)) break;
+			}
+
+			previous[i] = head[key];
+			head[key] = i;
+		}
+
+		matches[i] = match;
+	}
+
+	free(head);
+	free(previous);
+}
+
+// NOTE: Returns the compressed size, or 0 if out of memory. dest must
+// hold lz_max_compressed_size(size) bytes.
+static umm lz_compress(u8 *source, umm size, u8 *dest, u32 chain_depth) {
+
+	Lz_Match *matches = malloc((size + 1) * sizeof(Lz_Match));
+	u32 *cost = malloc((size + 1) * sizeof(u32));
+	Lz_Step *steps = malloc((size + 1) * sizeof(Lz_Step));
+	u32 *window = malloc((LZ_MAX_LITERAL + 1) * sizeof(u32));
+
+	if (!matches || !cost || !steps || !window) {
+		free(matches);
+		free(cost);
+		free(steps);
+		free(window);
+		return 0;
+	}
+
+	lz_find_matches(source, size, matches, chain_depth);
+
+	// Cheapest encoding of source[i..size), back to front. The literal choice
+	// is min over k of 1 + k + cost[i+k], that is 1 - i + min(j + cost[j]) for
+	// j in (i, i + 127], kept in a monotonic ring of candidate positions.
+	cost[size] = 0;
+
+	u32 window_first = 0;
+	u32 window_count = 0;
+
+	for (umm i = size; i-- > 0;) {
+
+		u32 candidate = i + 1;
+		u32 candidate_value = candidate + cost[candidate];
+
+		// Keep equal older (further) positions, longer literal runs mean fewer tokens
+		while (window_count) {
+			u32 newest = window[(window_first + window_count - 1) % (LZ_MAX_LITERAL + 1)];
+			if (newest + cost[newest] <= candidate_value) break;
+			--window_count;
+		}
+
+		window[(window_first + window_count) % (LZ_MAX_LITERAL + 1)] = candidate;
+		++window_count;
+
+		while (window[window_first] > i + LZ_MAX_LITERAL) {
+			window_first = (window_first + 1) % (LZ_MAX_LITERAL + 1);
+			--window_count;
+		}
+
+		u32 best_end = window[window_first];
+		u32 best_cost = 1 + (best_end - i) + cost[best_end];
+		Lz_Step best_step = {0, (u8)(best_end - i)};
+
+		Lz_Match match = matches[i];
+
+		for (u32 length = match.far_length; length > match.near_length && length >= LZ_FAR_MIN; --length) {
+			u32 match_cost = 3 + cost[i + length];
+			if (match_cost < best_cost) {
+				best_cost = match_cost;
+				best_step = (Lz_Step){2, (u8)length};
+			}
+		}
+
+		for (u32 length = match.near_length; length >= LZ_NEAR_MIN; --length) {
+			u32 match_cost = 2 + cost[i + length];
+			if (match_cost < best_cost) {
+				best_cost = match_cost;
+				best_step = (Lz_Step){1, (u8)length};
+			}
+		}
+
+		cost[i] = best_cost;
+		steps[i] = best_step;
+	}
+
+	u8 *out = dest;
+
+	for (umm i = 0; i < size;) {
+		Lz_Step step = steps[i];
+
+		switch (step.kind) {
+			case 0: {
+				*out++ = step.length;
+				memcpy(out, source + i, step.length);
+				out += step.length;
+			}
+			break;
+
+			case 1: {
+				*out++ = 0x80 | (step.length - LZ_NEAR_MIN);
+				*out++ = (u8)matches[i].near_offset;
+			}
+			break;
+
+			case 2: {
+				*out++ = 0xc0 | (step.length - LZ_FAR_MIN);
+				*out++ = (u8)matches[i].far_offset;
+				*out++ = (u8)(matches[i].far_offset >> 8);
+			}
+			break;
+		}
+
+		i += step.length;
+	}
+
+	*out++ = 0;
+
+	assert((umm)(out - dest) == cost[0] + 1);
+
+	free(matches);
+	free(cost);
+	free(steps);
+	free(window);
+
+	return out - dest;
+}
+
+// NOTE: Returns the decompressed size, or 0 for a malformed stream
+static umm lz_decompress(u8 *source, umm source_size, u8 *dest, umm dest_size) {
+	u8 *at = source;
+	u8 *end = source + source_size;
+	u8 *out = dest;
+	u8 *out_end = dest + dest_size;
+
+	while (at < end) {
+		u8 token = *at++;
+		if (token == 0) return out - dest;
+
+		umm length;
+		umm distance;
+
+		if (token < 0x80) {
+			if (token > (umm)(end - at) || token > (umm)(out_end - out)) return 0;
+			memcpy(out, at, token);
+			out += token;
+			at += token;
+			continue;
+		}
+		else if (token < 0xc0) {
+			if (at >= end) return 0;
+			length = (token & 0x3f) + LZ_NEAR_MIN;
+			distance = *at++ + 1;
+		}
+		else {
+			if (end - at < 2) return 0;
+			length = (token & 0x3f) + LZ_FAR_MIN;
+			distance = (at[0] | (at[1] << 8)) + 1;
+			at += 2;
+		}
+
+		if (distance > (umm)(out - dest) || length > (umm)(out_end - out)) return 0;
+
+		for (umm i = 0; i < length; ++i, ++out) {
+			*out = out[-(smm)distance];
+		}
+	}
+
+	return 0;
+}
+
+// NOTE: Compresses a buffer and checks that it decompresses to the
+// same bytes. Returns the compressed size, 0 on failure.
+static umm lz_compress_verified(u8 *source, umm size, u8 *dest, u32 chain_depth) {
+	umm compressed_size = lz_compress(source, size, dest, chain_depth);
+	if (!compressed_size) return 0;
+
+	u8 *check = malloc(size ? size : 1);
+	b32 verified = check && lz_decompress(dest, compressed_size, check, size) == size && memcmp(check, source, size) == 0;
+	free(check);
+
+	return verified ? compressed_size : 0;
+}
+
+
+// NOTE: Project export. Every level is a job that loads the level and
+// submits one job per plane; whichever plane finishes last writes <level>.lz
+// (the tile plane stream, then the collision plane stream). The tileset is one
+// more job writing <tileset>.lz.
+
+typedef struct Lz_Export_Item {
+	char path[1024];
+	char export_path[1100];
+	u32 width; // From the project index, for raw levels
+	u32 height;
+
+	u8 *planes;
+	umm plane_size;
+	u32 plane_count;
+
+	u8 *compressed[2];
+	umm compressed_size[2];
+	SDL_atomic_t planes_remaining;
+
+	umm raw_size;
+	umm total_compressed_size;
+	b32 failed;
+} Lz_Export_Item;
+
+static void lz_export_write_item(Lz_Export_Item *item) {
+
+	for (u32 i = 0; i < item->plane_count; ++i) {
+		if (!item->compressed_size[i]) {
+			fprintf(stderr, "LZ verification failed for %s.\n", item->path);
+			item->failed = true;
+		}
+	}
+
+	if (!item->failed) {
+		umm size = 0;
+		for (u32 i = 0; i < item->plane_count; ++i) size += item->compressed_size[i];
+
+		u8 *buffer = malloc(size);
+		u8 *at = buffer;
+
+		for (u32 i = 0; buffer && i < item->plane_count; ++i) {
+			memcpy(at, item->compressed[i], item->compressed_size[i]);
+			at += item->compressed_size[i];
+		}
+
+		item->failed = !buffer || !write_entire_file_atomic(item->export_path, buffer, size);
+		item->total_compressed_size = size;
+		free(buffer);
+	}
+
+	for (u32 i = 0; i < item->plane_count; ++i) {
+		free(item->compressed[i]);
+		item->compressed[i] = NULL;
+	}
+
+	free(item->planes);
+	item->planes = NULL;
+}
+
+static void lz_export_plane_job(Job_Pool *pool, u32 worker_index, void *data) {
+	(void)pool;
+	(void)worker_index;
+
+	// The plane index is packed into the low bits of the aligned item pointer
+	Lz_Export_Item *item = (Lz_Export_Item *)((umm)data & ~(umm)1);
+	u32 plane = (umm)data & 1;
+
+	u8 *source = item->planes + plane * item->plane_size;
+	item->compressed[plane] = malloc(lz_max_compressed_size(item->plane_size));
+
+	if (item->compressed[plane]) {
+		item->compressed_size[plane] = lz_compress_verified(source, item->plane_size, item->compressed[plane], LZ_DEFAULT_CHAIN_DEPTH);
+	}
+
+	if (SDL_AtomicAdd(&item->planes_remaining, -1) == 1) {
+		lz_export_write_item(item);
+	}
+}
+
+static void lz_export_level_job(Job_Pool *pool, u32 worker_index, void *data) {
+	Lz_Export_Item *item = data;
+
+	Level_Entry entry = {0};
+	copy_string(entry.path, sizeof(entry.path), item->path, strlen(item->path));
+	entry.width = item->width;
+	entry.height = item->height;
+
+	Level *level = level_load_for_entry(&entry);
+
+	if (!level) {
+		item->failed = true;
+		return;
+	}
+
+	item->plane_size = (umm)level->grid.width * level->grid.height;
+	item->planes = level_raw_planes(&level->grid, NULL);
+	item->plane_count = 2;
+	item->raw_size = 2 * item->plane_size;
+	level_free(level);
+
+	if (!item->planes) {
+		item->failed = true;
+		return;
+	}
+
+	SDL_AtomicSet(&item->planes_remaining, 2);
+	job_pool_submit(pool, worker_index, lz_export_plane_job, item);
+	job_pool_submit(pool, worker_index, lz_export_plane_job, (void *)((umm)item | 1));
+}
+
+static void lz_export_tileset_job(Job_Pool *pool, u32 worker_index, void *data) {
+	Lz_Export_Item *item = data;
+
+	Length_Buffer file = read_entire_file(item->path);
+
+	if (!file.data) {
+		fprintf(stderr, "Could not open file %s for reading.\n", item->path);
+		item->failed = true;
+		return;
+	}
+
+	item->planes = file.data;
+	item->plane_size = file.length;
+	item->plane_count = 1;
+	item->raw_size = file.length;
+
+	SDL_AtomicSet(&item->planes_remaining, 1);
+	lz_export_plane_job(pool, worker_index, item);
+}
+
+// NOTE: <level>.lz for a single level, both planes on the calling thread
+static b32 export_level_lz(Level *level, char *path) {
+	Lz_Export_Item item = {0};
+	copy_string(item.path, sizeof(item.path), path, strlen(path));
+	level_export_path(item.export_path, sizeof(item.export_path), path, ".lz");
+
+	item.plane_size = (umm)level->grid.width * level->grid.height;
+	item.planes = level_raw_planes(&level->grid, NULL);
+	item.plane_count = 2;
+	item.raw_size = 2 * item.plane_size;
+
+	if (!item.planes) {
+		fprintf(stderr, "Out of memory exporting %s.\n", path);
+		return false;
+	}
+
+	SDL_AtomicSet(&item.planes_remaining, 2);
+	lz_export_plane_job(NULL, 0, &item);
+	lz_export_plane_job(NULL, 0, (void *)((umm)&item | 1));
+
+	return !item.failed;
+}
+
+// NOTE: Compresses the saved files of every level in the project, not
+// the levels open in the editor.
+static b32 lz_export_project(Project *project, char *tileset_path, u32 thread_count) {
+
+	u32 item_count = project->entry_count + (tileset_path ? 1 : 0);
+	Lz_Export_Item *items = calloc(item_count, sizeof(Lz_Export_Item));
+
+	if (!items) {
+		fprintf(stderr, "Out of memory exporting the project.\n");
+		return false;
+	}
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	Job_Pool pool;
+	job_pool_start(&pool, thread_count);
+
+	for (u32 i = 0; i < item_count; ++i) {
+		Lz_Export_Item *item = &items[i];
+		b32 is_tileset = (i == project->entry_count);
+		char *path = is_tileset ? tileset_path : project->entries[i].path;
+
+		copy_string(item->path, sizeof(item->path), path, strlen(path));
+		level_export_path(item->export_path, sizeof(item->export_path), path, ".lz");
+
+		if (!is_tileset) {
+			item->width = project->entries[i].width;
+			item->height = project->entries[i].height;
+
+			if (!path[0]) {
+				// Never saved
+				item->failed = true;
+				continue;
+			}
+		}
+
+		job_pool_submit(&pool, 0, is_tileset ? lz_export_tileset_job : lz_export_level_job, item);
+	}
+
+	job_pool_stop(&pool);
+
+	u64 end = SDL_GetPerformanceCounter();
+
+	umm raw_size = 0;
+	umm compressed_size = 0;
+	u32 failed_count = 0;
+
+	for (u32 i = 0; i < item_count; ++i) {
+		if (items[i].failed) {
+			++failed_count;
+			continue;
+		}
+
+		raw_size += items[i].raw_size;
+		compressed_size += items[i].total_compressed_size;
+	}
+
+	fprintf(stderr, "LZ export: %u files, %llu -> %llu bytes (%.1f%%), %u failed, %.1f ms on %u threads\n",
+		item_count - failed_count, raw_size, compressed_size,
+		raw_size ? 100.0 * compressed_size / raw_size : 0.0,
+		failed_count,
+		(double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency(),
+		thread_count + 1);
+
+	free(items);
+	return failed_count == 0;
+}
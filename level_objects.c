@@ -0,0 +1,534 @@
+// NOTE: Object layer. Enemies, items and triggers sit at pixel
+// positions on top of the tile grid. Objects live in a dense array, and a
+// spatial hash maps each 8x8 tile cell to a chain of the objects whose top
+// left corner is inside that cell. Hit testing and visible-rectangle queries
+// then only touch the cells they cover, and moving an object only relinks it
+// when it crosses into another cell.
+
+typedef enum Object_Type {
+	OBJECT_ENEMY = 0,
+	OBJECT_ITEM = 1,
+	OBJECT_TRIGGER = 2,
+	COUNT_OBJECT_TYPE = 3
+} Object_Type;
+
+// NOTE: Same layout as a record in the .objects file
+typedef struct Object {
+	u16 x; // Pixel position of the top left corner
+	u16 y;
+	u8 type;
+	u8 subtype;
+	u16 parameter;
+} Object;
+
+typedef int check_size_object[sizeof(Object)==8 ? 1 : -1];
+
+static const u16 object_type_sizes[COUNT_OBJECT_TYPE] = {
+	[OBJECT_ENEMY] = 16,
+	[OBJECT_ITEM] = 8,
+	[OBJECT_TRIGGER] = 16,
+};
+
+#define OBJECT_MAX_SIZE 16
+#define OBJECT_NONE 0xffffffff
+#define OBJECT_CELL_SHIFT 3 // Cells are Game Boy tiles
+#define OBJECT_FILE_MAGIC 0x314a424f // "OBJ1"
+
+typedef struct Object_Layer {
+	u32 count;
+	u32 capacity;
+	Object *objects;
+
+	// Per object links of the chain of its cell
+	u32 *next_in_cell;
+	u32 *previous_in_cell;
+	u8 *selected;
+
+	u32 selection_count;
+	u32 *selection;
+
+	// Open addressing hash from cell key to the first object in the cell.
+	// Keys of cells that became empty stay until the next rehash.
+	u32 cell_capacity; // Power of two
+	u32 cell_used;
+	u32 *cell_keys;
+	u32 *cell_heads;
+
+	// Reused by queries
+	u32 query_capacity;
+	u32 *query_results;
+} Object_Layer;
+
+#define OBJECT_CELL_EMPTY_KEY 0xffffffff
+
+static inline u32 object_cell_key(u32 x, u32 y) {
+	return ((y >> OBJECT_CELL_SHIFT) << 16) | (x >> OBJECT_CELL_SHIFT);
+}
+
+static inline u32 object_cell_hash(u32 key, u32 capacity) {
+	return (key * 2654435761u) & (capacity - 1);
+}
+
+static u32 *object_layer_find_cell(Object_Layer *layer, u32 key) {
+	if (layer->cell_capacity == 0) return NULL;
+
+	u32 slot = object_cell_hash(key, layer->cell_capacity);
+
+	for (;;) {
+		u32 slot_key = layer->cell_keys[slot];
+		if (slot_key == key) return &layer->cell_heads[slot];
+		if (slot_key == OBJECT_CELL_EMPTY_KEY) return NULL;
+		slot = (slot + 1) & (layer->cell_capacity - 1);
+	}
+}
+
+static void object_layer_link(Object_Layer *layer, u32 index);
+
+static void object_layer_rehash(Object_Layer *layer, u32 new_capacity) {
+	free(layer->cell_keys);
+	free(layer->cell_heads);
+
+	layer->cell_capacity = new_capacity;
+	layer->cell_used = 0;
+	layer->cell_keys = malloc(new_capacity * sizeof(u32));
+	layer->cell_heads = malloc(new_capacity * sizeof(u32));
+
+	if (!layer->cell_keys || !layer->cell_heads) {
+		panic("Out of memory growing the object layer.\n");
+	}
+
+	memset(layer->cell_keys, 0xff, new_capacity * sizeof(u32));
+
+	for (u32 i = 0; i < layer->count; ++i) {
+		object_layer_link(layer, i);
+	}
+}
+
+// NOTE: Makes room for one more cell. Must be called before an object
+// is linked into a cell that may not exist yet, while every object is linked.
+static void object_layer_reserve_cell(Object_Layer *layer) {
+	if (2 * (layer->cell_used + 1) > layer->cell_capacity) {
+		// Sized by the object count, keys of empty cells are dropped
+		u32 new_capacity = 64;
+		while (new_capacity < 4 * (layer->count + 1)) new_capacity *= 2;
+		object_layer_rehash(layer, new_capacity);
+	}
+}
+
+static u32 *object_layer_insert_cell(Object_Layer *layer, u32 key) {
+
+	assert(2 * layer->cell_used < layer->cell_capacity);
+
+	u32 slot = object_cell_hash(key, layer->cell_capacity);
+
+	for (;;) {
+		u32 slot_key = layer->cell_keys[slot];
+
+		if (slot_key == key) {
+			return &layer->cell_heads[slot];
+		}
+
+		if (slot_key == OBJECT_CELL_EMPTY_KEY) {
+			layer->cell_keys[slot] = key;
+			layer->cell_heads[slot] = OBJECT_NONE;
+			++layer->cell_used;
+			return &layer->cell_heads[slot];
+		}
+
+		slot = (slot + 1) & (layer->cell_capacity - 1);
+	}
+}
+
+static void object_layer_link(Object_Layer *layer, u32 index) {
+	Object *object = &layer->objects[index];
+	u32 *head = object_layer_insert_cell(layer, object_cell_key(object->x, object->y));
+
+	layer->previous_in_cell[index] = OBJECT_NONE;
+	layer->next_in_cell[index] = *head;
+	if (*head != OBJECT_NONE) layer->previous_in_cell[*head] = index;
+	*head = index;
+}
+
+static void object_layer_unlink(Object_Layer *layer, u32 index) {
+	u32 next = layer->next_in_cell[index];
+	u32 previous = layer->previous_in_cell[index];
+
+	if (next != OBJECT_NONE) layer->previous_in_cell[next] = previous;
+
+	if (previous != OBJECT_NONE) {
+		layer->next_in_cell[previous] = next;
+	}
+	else {
+		Object *object = &layer->objects[index];
+		u32 *head = object_layer_find_cell(layer, object_cell_key(object->x, object->y));
+		assert(head && *head == index);
+		*head = next;
+	}
+}
+
+static void object_layer_free(Object_Layer *layer) {
+	free(layer->objects);
+	free(layer->next_in_cell);
+	free(layer->previous_in_cell);
+	free(layer->selected);
+	free(layer->selection);
+	free(layer->cell_keys);
+	free(layer->cell_heads);
+	free(layer->query_results);
+	*layer = (Object_Layer){0};
+}
+
+static umm object_layer_memory_size(Object_Layer *layer) {
+	umm result = (umm)layer->capacity * (sizeof(Object) + 3*sizeof(u32) + sizeof(u8));
+	result += (umm)layer->cell_capacity * 2 * sizeof(u32);
+	result += (umm)layer->query_capacity * sizeof(u32);
+	return result;
+}
+
+static void object_layer_reserve(Object_Layer *layer, u32 capacity) {
+	if (capacity <= layer->capacity) return;
+
+	u32 new_capacity = layer->capacity ? layer->capacity : 256;
+	while (new_capacity < capacity) new_capacity *= 2;
+
+	Object *objects = realloc(layer->objects, new_capacity * sizeof(Object));
+	if (objects) layer->objects = objects;
+	u32 *next_in_cell = realloc(layer->next_in_cell, new_capacity * sizeof(u32));
+	if (next_in_cell) layer->next_in_cell = next_in_cell;
+	u32 *previous_in_cell = realloc(layer->previous_in_cell, new_capacity * sizeof(u32));
+	if (previous_in_cell) layer->previous_in_cell = previous_in_cell;
+	u8 *selected = realloc(layer->selected, new_capacity * sizeof(u8));
+	if (selected) layer->selected = selected;
+	u32 *selection = realloc(layer->selection, new_capacity * sizeof(u32));
+	if (selection) layer->selection = selection;
+
+	if (!objects || !next_in_cell || !previous_in_cell || !selected || !selection) {
+		panic("Out of memory growing the object layer.\n");
+	}
+
+	layer->capacity = new_capacity;
+}
+
+static u32 object_layer_add(Object_Layer *layer, Object object) {
+	object_layer_reserve(layer, layer->count + 1);
+	object_layer_reserve_cell(layer);
+
+	u32 index = layer->count++;
+	layer->objects[index] = object;
+	layer->selected[index] = false;
+	object_layer_link(layer, index);
+
+	return index;
+}
+
+static void object_layer_move(Object_Layer *layer, u32 index, u16 x, u16 y) {
+	Object *object = &layer->objects[index];
+
+	if (object_cell_key(x, y) == object_cell_key(object->x, object->y)) {
+		object->x = x;
+		object->y = y;
+	}
+	else {
+		object_layer_reserve_cell(layer);
+		object_layer_unlink(layer, index);
+		object->x = x;
+		object->y = y;
+		object_layer_link(layer, index);
+	}
+}
+
+static void object_layer_clear_selection(Object_Layer *layer) {
+	for (u32 i = 0; i < layer->selection_count; ++i) {
+		layer->selected[layer->selection[i]] = false;
+	}
+	layer->selection_count = 0;
+}
+
+static void object_layer_select(Object_Layer *layer, u32 index, b32 select) {
+	if (layer->selected[index] == select) return;
+
+	layer->selected[index] = select;
+
+	if (select) {
+		layer->selection[layer->selection_count++] = index;
+	}
+	else {
+		for (u32 i = 0; i < layer->selection_count; ++i) {
+			if (layer->selection[i] == index) {
+				layer->selection[i] = layer->selection[--layer->selection_count];
+				break;
+			}
+		}
+	}
+}
+
+// NOTE: Moves every selected object by the same offset. The offset is
+// clamped so that the selection keeps its shape inside the level.
+static void object_layer_move_selection(Object_Layer *layer, s32 dx, s32 dy, u32 level_width_pixels, u32 level_height_pixels) {
+
+	if (layer->selection_count == 0) return;
+
+	s32 min_x = 0x7fffffff, min_y = 0x7fffffff;
+	s32 max_x = 0, max_y = 0;
+
+	for (u32 i = 0; i < layer->selection_count; ++i) {
+		Object *object = &layer->objects[layer->selection[i]];
+		s32 size = object_type_sizes[object->type];
+		if (object->x < min_x) min_x = object->x;
+		if (object->y < min_y) min_y = object->y;
+		if (object->x + size > max_x) max_x = object->x + size;
+		if (object->y + size > max_y) max_y = object->y + size;
+	}
+
+	if (min_x + dx < 0) dx = -min_x;
+	if (min_y + dy < 0) dy = -min_y;
+	if (max_x + dx > (s32)level_width_pixels) dx = (s32)level_width_pixels - max_x;
+	if (max_y + dy > (s32)level_height_pixels) dy = (s32)level_height_pixels - max_y;
+
+	if (dx == 0 && dy == 0) return;
+
+	for (u32 i = 0; i < layer->selection_count; ++i) {
+		u32 index = layer->selection[i];
+		Object *object = &layer->objects[index];
+		object_layer_move(layer, index, object->x + dx, object->y + dy);
+	}
+}
+
+// NOTE: Compacts the object array in one pass and rebuilds the hash,
+// which beats unlinking objects one by one once the selection is large.
+static void object_layer_delete_selection(Object_Layer *layer) {
+	if (layer->selection_count == 0) return;
+
+	u32 kept = 0;
+
+	for (u32 i = 0; i < layer->count; ++i) {
+		if (!layer->selected[i]) {
+			layer->objects[kept++] = layer->objects[i];
+		}
+		layer->selected[i] = false;
+	}
+
+	layer->count = kept;
+	layer->selection_count = 0;
+
+	u32 cell_capacity = 64;
+	while (cell_capacity < 4 * (kept + 1)) cell_capacity *= 2;
+	object_layer_rehash(layer, cell_capacity);
+}
+
+static void object_layer_push_result(Object_Layer *layer, u32 *count, u32 index) {
+	if (*count == layer->query_capacity) {
+		u32 new_capacity = layer->query_capacity ? 2*layer->query_capacity : 256;
+		u32 *results = realloc(layer->query_results, new_capacity * sizeof(u32));
+		if (!results) panic("Out of memory querying the object layer.\n");
+		layer->query_results = results;
+		layer->query_capacity = new_capacity;
+	}
+
+	layer->query_results[(*count)++] = index;
+}
+
+static inline b32 object_overlaps(Object *object, s32 x0, s32 y0, s32 x1, s32 y1) {
+	s32 size = object_type_sizes[object->type];
+	return object->x < x1 && object->x + size > x0 && object->y < y1 && object->y + size > y0;
+}
+
+// NOTE: Finds the objects overlapping the pixel rectangle [x0, x1) x
+// [y0, y1). The result indices are in layer->query_results, valid until the
+// next query or edit.
+static u32 object_layer_query(Object_Layer *layer, s32 x0, s32 y0, s32 x1, s32 y1) {
+
+	u32 count = 0;
+
+	if (layer->count == 0 || x0 >= x1 || y0 >= y1) return 0;
+
+	// An object anchored up to OBJECT_MAX_SIZE-1 pixels left of or above the
+	// rectangle can still reach into it.
+	s32 cell_x0 = (x0 - (OBJECT_MAX_SIZE - 1)) >> OBJECT_CELL_SHIFT;
+	s32 cell_y0 = (y0 - (OBJECT_MAX_SIZE - 1)) >> OBJECT_CELL_SHIFT;
+	s32 cell_x1 = ((x1 - 1) >> OBJECT_CELL_SHIFT) + 1;
+	s32 cell_y1 = ((y1 - 1) >> OBJECT_CELL_SHIFT) + 1;
+
+	if (cell_x0 < 0) cell_x0 = 0;
+	if (cell_y0 < 0) cell_y0 = 0;
+	if (cell_x1 > 0xffff) cell_x1 = 0xffff;
+	if (cell_y1 > 0xffff) cell_y1 = 0xffff;
+
+	s64 cell_count = (s64)(cell_x1 - cell_x0) * (cell_y1 - cell_y0);
+
+	if (cell_count > (s64)layer->cell_used) {
+		// Zoomed far out, cheaper to look at every object
+		for (u32 i = 0; i < layer->count; ++i) {
+			if (object_overlaps(&layer->objects[i], x0, y0, x1, y1)) {
+				object_layer_push_result(layer, &count, i);
+			}
+		}
+		return count;
+	}
+
+	for (s32 cell_y = cell_y0; cell_y < cell_y1; ++cell_y) {
+		for (s32 cell_x = cell_x0; cell_x < cell_x1; ++cell_x) {
+
+			u32 *head = object_layer_find_cell(layer, ((u32)cell_y << 16) | (u32)cell_x);
+			if (!head) continue;
+
+			for (u32 i = *head; i != OBJECT_NONE; i = layer->next_in_cell[i]) {
+				if (object_overlaps(&layer->objects[i], x0, y0, x1, y1)) {
+					object_layer_push_result(layer, &count, i);
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+// NOTE: Topmost (most recently added) object under the pixel
+static u32 object_layer_hit_test(Object_Layer *layer, s32 x, s32 y) {
+	u32 count = object_layer_query(layer, x, y, x + 1, y + 1);
+	u32 result = OBJECT_NONE;
+
+	for (u32 i = 0; i < count; ++i) {
+		u32 index = layer->query_results[i];
+		if (result == OBJECT_NONE || index > result) result = index;
+	}
+
+	return result;
+}
+
+static void object_layer_objects_path(char *out_path, umm out_path_size, char *level_path) {
+	snprintf(out_path, out_path_size, "%s.objects", level_path);
+}
+
+// NOTE: Replaces the contents of a layer without a selection
+static void object_layer_set_objects(Object_Layer *layer, Object *objects, u32 count) {
+	object_layer_reserve(layer, count);
+	memcpy(layer->objects, objects, (umm)count * sizeof(Object));
+	memset(layer->selected, 0, count);
+	layer->count = count;
+
+	for (u32 i = 0; i < count; ++i) {
+		if (layer->objects[i].type >= COUNT_OBJECT_TYPE) layer->objects[i].type = OBJECT_TRIGGER;
+	}
+
+	u32 cell_capacity = 64;
+	while (cell_capacity < 4 * count) cell_capacity *= 2;
+	object_layer_rehash(layer, cell_capacity);
+}
+
+// NOTE: Objects are stored next to the level binary as
+// <level>.objects: a u32 magic, a u32 count and count Object records.
+static b32 save_level_objects(Object_Layer *layer, char *level_path) {
+	char path[1100];
+	object_layer_objects_path(path, sizeof(path), level_path);
+
+	if (layer->count == 0) {
+		// Do not leave a stale file behind
+		remove(path);
+		return true;
+	}
+
+	umm size = 2 * sizeof(u32) + (umm)layer->count * sizeof(Object);
+	u8 *buffer = malloc(size);
+
+	if (!buffer) {
+		fprintf(stderr, "Out of memory saving objects.\n");
+		return false;
+	}
+
+	u32 header[2] = {OBJECT_FILE_MAGIC, layer->count};
+	memcpy(buffer, header, sizeof(header));
+	memcpy(buffer + sizeof(header), layer->objects, (umm)layer->count * sizeof(Object));
+
+	b32 success = write_entire_file_atomic(path, buffer, size);
+	free(buffer);
+
+	return success;
+}
+
+// NOTE: A level without an objects file simply has no objects
+static b32 load_level_objects(Object_Layer *layer, char *level_path) {
+	char path[1100];
+	object_layer_objects_path(path, sizeof(path), level_path);
+
+	object_layer_free(layer);
+
+	Length_Buffer file = read_entire_file(path);
+	if (!file.data) return true;
+
+	u32 header[2];
+	b32 valid = file.length >= sizeof(header);
+
+	if (valid) {
+		memcpy(header, file.data, sizeof(header));
+		valid = header[0] == OBJECT_FILE_MAGIC && file.length == sizeof(header) + (umm)header[1] * sizeof(Object);
+	}
+
+	if (!valid) {
+		fprintf(stderr, "Objects file %s is damaged.\n", path);
+		free(file.data);
+		return false;
+	}
+
+	object_layer_set_objects(layer, (Object *)(file.data + sizeof(header)), header[1]);
+
+	free(file.data);
+	return true;
+}
+
+static void render_objects(
+	SDL_Renderer *renderer,
+	Object_Layer *layer,
+	s32 visible_x0, s32 visible_y0, s32 visible_x1, s32 visible_y1,
+	s32 origin_x, s32 origin_y, s32 pixel_scale)
+{
+	static const u8 object_type_colors[COUNT_OBJECT_TYPE][3] = {
+		[OBJECT_ENEMY] = {220, 40, 40},
+		[OBJECT_ITEM] = {240, 200, 0},
+		[OBJECT_TRIGGER] = {160, 60, 220},
+	};
+
+	u32 count = object_layer_query(layer, visible_x0, visible_y0, visible_x1, visible_y1);
+	if (count == 0) return;
+
+	SDL_Rect *rects = malloc(count * sizeof(SDL_Rect));
+	if (!rects) return;
+
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+
+	// One batch per type, then outlines of the selected objects
+	for (u32 type = 0; type <= COUNT_OBJECT_TYPE; ++type) {
+		s32 rect_count = 0;
+
+		for (u32 i = 0; i < count; ++i) {
+			u32 index = layer->query_results[i];
+			Object *object = &layer->objects[index];
+
+			if (type == COUNT_OBJECT_TYPE ? !layer->selected[index] : object->type != type) continue;
+
+			s32 size = object_type_sizes[object->type] * pixel_scale;
+			rects[rect_count++] = (SDL_Rect){
+				origin_x + object->x * pixel_scale,
+				origin_y + object->y * pixel_scale,
+				size,
+				size,
+			};
+		}
+
+		if (rect_count == 0) continue;
+
+		if (type < COUNT_OBJECT_TYPE) {
+			const u8 *color = object_type_colors[type];
+			SDL_SetRenderDrawColor(renderer, color[0], color[1], color[2], 140);
+			SDL_RenderFillRects(renderer, rects, rect_count);
+			SDL_SetRenderDrawColor(renderer, color[0], color[1], color[2], 255);
+			SDL_RenderDrawRects(renderer, rects, rect_count);
+		}
+		else {
+			SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+			SDL_RenderDrawRects(renderer, rects, rect_count);
+		}
+	}
+
+	free(rects);
+}
@@ -0,0 +1,1800 @@
+// NOTE: Imports PNG mockups as levels. The image is quantized to the
+// four DMG shades, cut into 8x8 tiles and encoded to 2bpp; identical tiles
+// are merged through a hash table. The level grid indexes the distinct tiles
+// in order of first appearance, and they make up a tile set in the same format
+// as the ones the editor loads.
+//
+// Loading a PNG only reads it, whoever asks (the loader thread, --diff, the
+// exporters), and leaves the tile set out. The explicit imports, Ctrl+O and
+// --batch, take the tile set too and write it next to the image as
+// <image>.tileset.bin with write_png_tileset.
+//
+// Grayscale and indexed images of any bit depth are read, without interlacing.
+// Shades come from luminance: 0-63 is the darkest shade (3), 192-255 the
+// lightest (0), so an image drawn in the DMG palette or in four evenly spaced
+// grays comes back exactly. Images that are not a multiple of 8 pixels are
+// padded with the lightest shade.
+//
+// Decompression and unfiltering are inherently serial and run on the calling
+// thread. Quantizing, encoding and hashing run on the job pool, one tile row
+// per job.
+//
+// Levels are exported the other way, as screenshots at 1x to 4x: composited
+// from the tile set on the CPU a scanline at a time and streamed through
+// deflate into the file, so only a few scanlines are ever in memory.
+
+#define PNG_COLOR_GRAYSCALE 0
+#define PNG_COLOR_INDEXED   3
+
+// NOTE: Worker threads next to the caller for each import, set once at
+// startup. Batch mode leaves it at 0 when it already runs files in parallel.
+static u32 png_import_thread_count;
+
+static void level_export_path(char *out_path, umm out_path_size, char *path, char *extension);
+
+
+//
+// Inflate (RFC 1950 and 1951)
+//
+
+#define INFLATE_FAST_BITS 10
+
+typedef struct Inflate_Huffman {
+	u16 fast[1 << INFLATE_FAST_BITS]; // symbol << 4 | length, 0 for longer codes
+	u16 counts[16];                   // Codes of each length
+	u16 symbols[288];                 // Sorted by code
+} Inflate_Huffman;
+
+typedef struct Inflate_State {
+	u8 *at;
+	u8 *end;
+	u64 bits;
+	u32 bit_count;
+	u32 padding; // Zero bytes fed in past the end of the input
+
+	u8 *out;
+	u8 *out_at;
+	u8 *out_end;
+
+	char *problem;
+} Inflate_State;
+
+static const u16 inflate_length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const u8 inflate_length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const u16 inflate_distance_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+
+static const u8 inflate_distance_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// NOTE: Keeps at least 57 bits buffered. Past the end of the input it
+// feeds zeros and counts them, so a truncated stream is caught at the end
+// rather than on every read.
+static inline void inflate_refill(Inflate_State *state) {
+	while (state->bit_count <= 56) {
+		u64 byte = 0;
+
+		if (state->at < state->end) byte = *state->at++;
+		else ++state->padding;
+
+		state->bits |= byte << state->bit_count;
+		state->bit_count += 8;
+	}
+}
+
+static inline u32 inflate_bits(Inflate_State *state, u32 count) {
+	if (state->bit_count < count) inflate_refill(state);
+
+	u32 result = (u32)(state->bits & ((1ull << count) - 1));
+	state->bits >>= count;
+	state->bit_count -= count;
+	return result;
+}
+
+static b32 inflate_build_huffman(Inflate_Huffman *huffman, u8 *lengths, u32 count) {
+	memset(huffman, 0, sizeof(*huffman));
+
+	for (u32 i = 0; i < count; ++i) ++huffman->counts[lengths[i]];
+	huffman->counts[0] = 0;
+
+	// Over-subscribed code lengths cannot be decoded. Incomplete ones are
+	// allowed, the distance code of a block with one match has a single code.
+	s32 left = 1;
+	for (u32 length = 1; length < 16; ++length) {
+		left = 2*left - huffman->counts[length];
+		if (left < 0) return false;
+	}
+
+	u16 offsets[16];
+	offsets[1] = 0;
+	for (u32 length = 1; length < 15; ++length) {
+		offsets[length + 1] = offsets[length] + huffman->counts[length];
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		if (lengths[i]) huffman->symbols[offsets[lengths[i]]++] = (u16)i;
+	}
+
+	// Codes are stored starting with their most significant bit, so the fast
+	// table is indexed with the code bit reversed.
+	u32 code = 0;
+	u32 symbol_index = 0;
+
+	for (u32 length = 1; length <= INFLATE_FAST_BITS; ++length) {
+		for (u32 i = 0; i < huffman->counts[length]; ++i) {
+			u32 reversed = 0;
+			for (u32 bit = 0; bit < length; ++bit) {
+				reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+			}
+
+			u16 entry = (u16)(huffman->symbols[symbol_index++] << 4 | length);
+
+			for (u32 slot = reversed; slot < (1 << INFLATE_FAST_BITS); slot += 1 << length) {
+				huffman->fast[slot] = entry;
+			}
+
+			++code;
+		}
+
+		code <<= 1;
+	}
+
+	return true;
+}
+
+// NOTE: Codes longer than the fast table are decoded a bit at a time
+static inline s32 inflate_decode(Inflate_State *state, Inflate_Huffman *huffman) {
+	if (state->bit_count < 15) inflate_refill(state);
+
+	u16 entry = huffman->fast[state->bits & ((1 << INFLATE_FAST_BITS) - 1)];
+
+	if (entry) {
+		u32 length = entry & 15;
+		state->bits >>= length;
+		state->bit_count -= length;
+		return entry >> 4;
+	}
+
+	s32 code = 0;
+	s32 first = 0;
+	s32 index = 0;
+
+	for (u32 length = 1; length < 16; ++length) {
+		code |= (state->bits >> (length - 1)) & 1;
+		s32 count = huffman->counts[length];
+
+		if (code - first < count) {
+			state->bits >>= length;
+			state->bit_count -= length;
+			return huffman->symbols[index + code - first];
+		}
+
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	return -1;
+}
+
+static b32 inflate_stored_block(Inflate_State *state) {
+	inflate_bits(state, state->bit_count & 7);
+
+	u32 length = inflate_bits(state, 16);
+	u32 length_complement = inflate_bits(state, 16);
+
+	if (length != (~length_complement & 0xffff)) {
+		state->problem = "bad stored block length";
+		return false;
+	}
+
+	if ((umm)(state->out_end - state->out_at) < length) {
+		state->problem = "more image data than the image has pixels";
+		return false;
+	}
+
+	// Whole bytes still in the bit buffer first, then straight from the input
+	while (length && state->bit_count) {
+		*state->out_at++ = (u8)inflate_bits(state, 8);
+		--length;
+	}
+
+	if ((umm)(state->end - state->at) < length) {
+		state->problem = "truncated image data";
+		return false;
+	}
+
+	memcpy(state->out_at, state->at, length);
+	state->out_at += length;
+	state->at += length;
+
+	return true;
+}
+
+static b32 inflate_dynamic_tables(Inflate_State *state, Inflate_Huffman *literals, Inflate_Huffman *distances) {
+	static const u8 order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+	u32 literal_count = inflate_bits(state, 5) + 257;
+	u32 distance_count = inflate_bits(state, 5) + 1;
+	u32 length_code_count = inflate_bits(state, 4) + 4;
+
+	if (literal_count > 286 || distance_count > 30) {
+		state->problem = "bad code counts";
+		return false;
+	}
+
+	u8 lengths[286 + 30] = {0};
+
+	for (u32 i = 0; i < length_code_count; ++i) {
+		lengths[order[i]] = (u8)inflate_bits(state, 3);
+	}
+
+	Inflate_Huffman length_codes;
+
+	if (!inflate_build_huffman(&length_codes, lengths, 19)) {
+		state->problem = "bad code length code";
+		return false;
+	}
+
+	memset(lengths, 0, 19);
+
+	for (u32 i = 0; i < literal_count + distance_count;) {
+		s32 symbol = inflate_decode(state, &length_codes);
+
+		if (symbol < 0) {
+			state->problem = "bad code length";
+			return false;
+		}
+
+		if (symbol < 16) {
+			lengths[i++] = (u8)symbol;
+			continue;
+		}
+
+		u8 repeated = 0;
+		u32 repeat;
+
+		if (symbol == 16) {
+			if (i == 0) {
+				state->problem = "code length repeat with nothing to repeat";
+				return false;
+			}
+			repeated = lengths[i - 1];
+			repeat = 3 + inflate_bits(state, 2);
+		}
+		else if (symbol == 17) repeat = 3 + inflate_bits(state, 3);
+		else repeat = 11 + inflate_bits(state, 7);
+
+		if (i + repeat > literal_count + distance_count) {
+			state->problem = "code lengths overrun";
+			return false;
+		}
+
+		while (repeat--) lengths[i++] = repeated;
+	}
+
+	if (lengths[256] == 0) {
+		state->problem = "no end of block code";
+		return false;
+	}
+
+	if (!inflate_build_huffman(literals, lengths, literal_count) ||
+		!inflate_build_huffman(distances, lengths + literal_count, distance_count))
+	{
+		state->problem = "bad code lengths";
+		return false;
+	}
+
+	return true;
+}
+
+static b32 inflate_fixed_tables(Inflate_Huffman *literals, Inflate_Huffman *distances) {
+	u8 lengths[288];
+	u32 i = 0;
+
+	for (; i < 144; ++i) lengths[i] = 8;
+	for (; i < 256; ++i) lengths[i] = 9;
+	for (; i < 280; ++i) lengths[i] = 7;
+	for (; i < 288; ++i) lengths[i] = 8;
+
+	b32 success = inflate_build_huffman(literals, lengths, 288);
+
+	for (i = 0; i < 30; ++i) lengths[i] = 5;
+
+	return inflate_build_huffman(distances, lengths, 30) && success;
+}
+
+static b32 inflate_codes(Inflate_State *state, Inflate_Huffman *literals, Inflate_Huffman *distances) {
+	u8 *out_at = state->out_at;
+	u8 *out_end = state->out_end;
+
+	for (;;) {
+		s32 symbol = inflate_decode(state, literals);
+
+		if (symbol < 256) {
+			if (symbol < 0) {
+				state->problem = "bad literal or length code";
+				break;
+			}
+
+			if (out_at == out_end) {
+				state->problem = "more image data than the image has pixels";
+				break;
+			}
+
+			*out_at++ = (u8)symbol;
+			continue;
+		}
+
+		if (symbol == 256) {
+			state->out_at = out_at;
+			return true;
+		}
+
+		symbol -= 257;
+
+		if (symbol >= 29) {
+			state->problem = "bad length code";
+			break;
+		}
+
+		u32 length = inflate_length_base[symbol] + inflate_bits(state, inflate_length_extra[symbol]);
+
+		s32 distance_symbol = inflate_decode(state, distances);
+
+		if (distance_symbol < 0 || distance_symbol >= 30) {
+			state->problem = "bad distance code";
+			break;
+		}
+
+		umm distance = inflate_distance_base[distance_symbol] + inflate_bits(state, inflate_distance_extra[distance_symbol]);
+
+		if (distance > (umm)(out_at - state->out)) {
+			state->problem = "distance too far back";
+			break;
+		}
+
+		if ((umm)(out_end - out_at) < length) {
+			state->problem = "more image data than the image has pixels";
+			break;
+		}
+
+		// Overlapping copies repeat the last distance bytes, so go a byte at a
+		// time unless the source is far enough behind for whole words.
+		u8 *from = out_at - distance;
+
+		if (distance >= 8 && (umm)(out_end - out_at) >= length + 8) {
+			u8 *copy_end = out_at + length;
+			while (out_at < copy_end) {
+				memcpy(out_at, from, 8);
+				out_at += 8;
+				from += 8;
+			}
+			out_at = copy_end;
+		}
+		else {
+			while (length--) *out_at++ = *from++;
+		}
+	}
+
+	state->out_at = out_at;
+	return false;
+}
+
+// NOTE: Pass 1 to start, or the previous result to continue
+static u32 adler32(u32 adler, u8 *data, umm size) {
+	u32 a = adler & 0xffff;
+	u32 b = adler >> 16;
+
+	while (size) {
+		// The most bytes before b can overflow 32 bits
+		umm chunk = size < 5552 ? size : 5552;
+		size -= chunk;
+
+		while (chunk--) {
+			a += *data++;
+			b += a;
+		}
+
+		a %= 65521;
+		b %= 65521;
+	}
+
+	return b << 16 | a;
+}
+
+// NOTE: Decompresses a zlib stream into exactly out_size bytes
+static char *inflate_zlib(u8 *data, umm size, u8 *out, umm out_size) {
+	if (size < 6) return "truncated image data";
+
+	u32 header = data[0] << 8 | data[1];
+
+	if ((data[0] & 0x0f) != 8 || (data[0] >> 4) > 7 || header % 31 != 0) {
+		return "bad zlib header";
+	}
+
+	if (data[1] & 0x20) return "preset dictionaries are not supported";
+
+	Inflate_State state = {0};
+	state.at = data + 2;
+	state.end = data + size;
+	state.out = out;
+	state.out_at = out;
+	state.out_end = out + out_size;
+
+	Inflate_Huffman *literals = malloc(2 * sizeof(Inflate_Huffman));
+	if (!literals) return "out of memory";
+	Inflate_Huffman *distances = literals + 1;
+
+	b32 last_block = false;
+
+	while (!last_block && !state.problem) {
+		last_block = inflate_bits(&state, 1);
+		u32 type = inflate_bits(&state, 2);
+
+		if (type == 0) {
+			inflate_stored_block(&state);
+		}
+		else if (type == 1) {
+			inflate_fixed_tables(literals, distances);
+			inflate_codes(&state, literals, distances);
+		}
+		else if (type == 2) {
+			if (inflate_dynamic_tables(&state, literals, distances)) {
+				inflate_codes(&state, literals, distances);
+			}
+		}
+		else {
+			state.problem = "bad block type";
+		}
+
+		// Reading past the end is only noticed here
+		if (!state.problem && state.bit_count < 8 * state.padding) {
+			state.problem = "truncated image data";
+		}
+	}
+
+	free(literals);
+
+	if (state.problem) return state.problem;
+
+	if (state.out_at != state.out_end) return "less image data than the image has pixels";
+
+	inflate_bits(&state, state.bit_count & 7);
+	u32 checksum = inflate_bits(&state, 8) << 24;
+	checksum |= inflate_bits(&state, 8) << 16;
+	checksum |= inflate_bits(&state, 8) << 8;
+	checksum |= inflate_bits(&state, 8);
+
+	if (state.bit_count < 8 * state.padding) return "truncated image data";
+	if (checksum != adler32(1, out, out_size)) return "image data checksum mismatch";
+
+	return NULL;
+}
+
+
+//
+// PNG decoding
+//
+
+static inline u32 png_read_u32(u8 *at) {
+	return (u32)at[0] << 24 | at[1] << 16 | at[2] << 8 | at[3];
+}
+
+static inline u8 png_paeth(u8 a, u8 b, u8 c) {
+	s32 p = a + b - c;
+	s32 pa = abs(p - a);
+	s32 pb = abs(p - b);
+	s32 pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc) return a;
+	if (pb <= pc) return b;
+	return c;
+}
+
+// NOTE: In place. Each row is its filter type byte followed by
+// row_size bytes; pixel_size is the filter's byte distance to the left pixel.
+static char *png_unfilter(u8 *rows, u32 height, umm row_size, u32 pixel_size) {
+	u8 *previous = NULL;
+
+	for (u32 y = 0; y < height; ++y) {
+		u8 *row = rows + y * (row_size + 1);
+		u8 filter = *row++;
+
+		// The row above the first is taken to be zeros
+		if (!previous && filter == 2) filter = 0;
+		if (!previous && filter == 4) filter = 1;
+
+		switch (filter) {
+			case 0: break;
+
+			case 1: {
+				for (umm x = pixel_size; x < row_size; ++x) row[x] += row[x - pixel_size];
+			}
+			break;
+
+			case 2: {
+				for (umm x = 0; x < row_size; ++x) row[x] += previous[x];
+			}
+			break;
+
+			case 3: {
+				for (umm x = 0; x < row_size; ++x) {
+					u32 left = x >= pixel_size ? row[x - pixel_size] : 0;
+					u32 up = previous ? previous[x] : 0;
+					row[x] += (u8)((left + up) >> 1);
+				}
+			}
+			break;
+
+			case 4: {
+				for (umm x = 0; x < pixel_size && x < row_size; ++x) row[x] += previous[x];
+
+				for (umm x = pixel_size; x < row_size; ++x) {
+					row[x] += png_paeth(row[x - pixel_size], previous[x], previous[x - pixel_size]);
+				}
+			}
+			break;
+
+			default: return "bad row filter";
+		}
+
+		previous = row;
+	}
+
+	return NULL;
+}
+
+typedef struct Png_Image {
+	u32 width;
+	u32 height;
+	u32 bit_depth;
+	u32 color_type;
+
+	u8 *rows; // Unfiltered, each row after its filter type byte
+	umm row_size;
+
+	// Shade of every sample value; 16-bit samples are looked up by their high byte
+	u8 shades[256];
+} Png_Image;
+
+static inline u8 png_pixel_shade(Png_Image *image, u8 *row, u32 x) {
+	switch (image->bit_depth) {
+		case 8: return image->shades[row[x]];
+		case 16: return image->shades[row[2*x]];
+		default: {
+			u32 depth = image->bit_depth;
+			u32 bit = x * depth;
+			u32 sample = (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+			return image->shades[sample];
+		}
+	}
+}
+
+static char *png_decode(Png_Image *image, u8 *data, umm size) {
+	static const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+	if (size < 8 || memcmp(data, signature, 8) != 0) return "not a PNG file";
+
+	u8 *at = data + 8;
+	u8 *end = data + size;
+
+	// IDAT chunks are one zlib stream split up, gathered here
+	u8 *compressed = malloc(size);
+	umm compressed_size = 0;
+	if (!compressed) return "out of memory";
+
+	u8 palette[256*3];
+	u32 palette_count = 0;
+	b32 seen_header = false;
+	b32 seen_end = false;
+	char *problem = NULL;
+
+	while (!problem && !seen_end) {
+		if (end - at < 12) {
+			problem = "truncated file";
+			break;
+		}
+
+		u32 length = png_read_u32(at);
+		u8 *type = at + 4;
+		u8 *chunk = at + 8;
+
+		if (length > (umm)(end - chunk) - 4) {
+			problem = "truncated file";
+			break;
+		}
+
+		if (crc32(0, type, 4 + length) != png_read_u32(chunk + length)) {
+			problem = "chunk checksum mismatch";
+			break;
+		}
+
+		at = chunk + length + 4;
+
+		if (memcmp(type, "IHDR", 4) == 0) {
+			if (length != 13) {
+				problem = "bad header";
+				break;
+			}
+
+			image->width = png_read_u32(chunk);
+			image->height = png_read_u32(chunk + 4);
+			image->bit_depth = chunk[8];
+			image->color_type = chunk[9];
+			seen_header = true;
+
+			if (chunk[10] != 0 || chunk[11] != 0) problem = "unknown compression or filter method";
+			else if (chunk[12] != 0) problem = "interlaced images are not supported";
+		}
+		else if (!seen_header) {
+			problem = "no header";
+		}
+		else if (memcmp(type, "PLTE", 4) == 0) {
+			if (length % 3 || length > sizeof(palette)) {
+				problem = "bad palette";
+				break;
+			}
+
+			memcpy(palette, chunk, length);
+			palette_count = length / 3;
+		}
+		else if (memcmp(type, "IDAT", 4) == 0) {
+			memcpy(compressed + compressed_size, chunk, length);
+			compressed_size += length;
+		}
+		else if (memcmp(type, "IEND", 4) == 0) {
+			seen_end = true;
+		}
+		else if (!(type[0] & 0x20)) {
+			// Ancillary chunks have a lower case first letter and can be skipped
+			problem = "unknown critical chunk";
+		}
+	}
+
+	u32 depth = image->bit_depth;
+
+	if (problem) {}
+	else if (image->color_type == PNG_COLOR_GRAYSCALE) {
+		if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16) {
+			problem = "bad bit depth";
+		}
+		else {
+			u32 max = depth == 16 ? 255 : (1 << depth) - 1;
+
+			for (u32 i = 0; i <= max; ++i) {
+				u32 gray = i * 255 / max;
+				image->shades[i] = (u8)(3 - (gray >> 6));
+			}
+		}
+	}
+	else if (image->color_type == PNG_COLOR_INDEXED) {
+		if (depth != 1 && depth != 2 && depth != 4 && depth != 8) {
+			problem = "bad bit depth";
+		}
+		else if (!palette_count) {
+			problem = "indexed image without a palette";
+		}
+
+		// Indices past the palette are errors in the image, shown as the lightest shade
+		for (u32 i = 0; i < palette_count; ++i) {
+			u8 *color = &palette[3*i];
+			u32 luminance = (299 * color[0] + 587 * color[1] + 114 * color[2]) / 1000;
+			image->shades[i] = (u8)(3 - (luminance >> 6));
+		}
+	}
+	else {
+		problem = "only grayscale and indexed images can be imported, convert it first";
+	}
+
+	if (!problem && (image->width == 0 || image->height == 0 ||
+		image->width > LEVEL_MAX_WIDTH * GAMEBOY_TILE_WIDTH ||
+		image->height > LEVEL_MAX_HEIGHT * GAMEBOY_TILE_WIDTH))
+	{
+		problem = "bad dimensions";
+	}
+
+	if (!problem) {
+		image->row_size = ((umm)image->width * depth + 7) / 8;
+		umm raw_size = (image->row_size + 1) * image->height;
+
+		image->rows = malloc(raw_size);
+
+		if (!image->rows) problem = "out of memory";
+		else problem = inflate_zlib(compressed, compressed_size, image->rows, raw_size);
+	}
+
+	free(compressed);
+
+	if (!problem) {
+		problem = png_unfilter(image->rows, image->height, image->row_size, depth < 8 ? 1 : depth / 8);
+	}
+
+	if (problem) {
+		free(image->rows);
+		image->rows = NULL;
+	}
+
+	return problem;
+}
+
+
+//
+// Tile import
+//
+
+typedef struct Png_Tiles {
+	Png_Image *image;
+	u32 width; // In tiles
+	u32 height;
+
+	u8 *tiles;   // 2bpp, width*height tiles
+	u64 *hashes;
+} Png_Tiles;
+
+typedef struct Png_Tile_Row_Job {
+	Png_Tiles *tiles;
+	u32 tile_y;
+} Png_Tile_Row_Job;
+
+static inline u64 png_tile_hash(u8 *tile) {
+	u64 low, high;
+	memcpy(&low, tile, 8);
+	memcpy(&high, tile + 8, 8);
+
+	u64 hash = low * 0x9e3779b97f4a7c15ull ^ high;
+	hash *= 0xc2b2ae3d27d4eb4full;
+	return hash ^ (hash >> 29);
+}
+
+static void png_tile_row_job(Job_Pool *pool, u32 worker_index, void *data) {
+	(void)pool;
+	(void)worker_index;
+
+	Png_Tile_Row_Job *job = data;
+	Png_Tiles *tiles = job->tiles;
+	Png_Image *image = tiles->image;
+
+	umm first_tile = (umm)job->tile_y * tiles->width;
+	u8 *out = tiles->tiles + first_tile * GAMEBOY_BYTES_PER_TILE;
+
+	u8 *rows[GAMEBOY_TILE_WIDTH];
+
+	for (u32 i = 0; i < GAMEBOY_TILE_WIDTH; ++i) {
+		u32 y = job->tile_y * GAMEBOY_TILE_WIDTH + i;
+		rows[i] = y < image->height ? image->rows + y * (image->row_size + 1) + 1 : NULL;
+	}
+
+	for (u32 tile_x = 0; tile_x < tiles->width; ++tile_x) {
+		u32 x0 = tile_x * GAMEBOY_TILE_WIDTH;
+		u32 x_count = image->width - x0 < GAMEBOY_TILE_WIDTH ? image->width - x0 : GAMEBOY_TILE_WIDTH;
+
+		for (u32 i = 0; i < GAMEBOY_TILE_WIDTH; ++i) {
+			u8 low_byte = 0;
+			u8 high_byte = 0;
+
+			if (rows[i]) {
+				for (u32 x = 0; x < x_count; ++x) {
+					u8 shade = png_pixel_shade(image, rows[i], x0 + x);
+					low_byte |= (shade & 1) << (7 - x);
+					high_byte |= (shade >> 1) << (7 - x);
+				}
+			}
+
+			*out++ = low_byte;
+			*out++ = high_byte;
+		}
+
+		tiles->hashes[first_tile + tile_x] = png_tile_hash(out - GAMEBOY_BYTES_PER_TILE);
+	}
+}
+
+static inline b32 level_path_is_png(char *path) {
+	char *dot = strrchr(path, '.');
+	return dot && (strcmp(dot, ".png") == 0 || strcmp(dot, ".PNG") == 0);
+}
+
+// NOTE: Cuts the image into out_grid and the tile set it indexes, given to
+// the caller in out_tile_data if asked for. Reads the image and nothing else.
+static b32 import_png_grid(char *path, Level_Grid *out_grid, Length_Buffer *out_tile_data) {
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	Mapped_File file = map_file(path);
+
+	if (!file.data) {
+		fprintf(stderr, "Could not open file %s for reading.\n", path);
+		return false;
+	}
+
+	Png_Image image = {0};
+	char *problem = png_decode(&image, file.data, file.length);
+
+	unmap_file(&file);
+
+	u64 decoded = SDL_GetPerformanceCounter();
+
+	Png_Tiles tiles = {0};
+	tiles.image = &image;
+	tiles.width = (image.width + GAMEBOY_TILE_WIDTH - 1) / GAMEBOY_TILE_WIDTH;
+	tiles.height = (image.height + GAMEBOY_TILE_WIDTH - 1) / GAMEBOY_TILE_WIDTH;
+
+	umm tile_count = (umm)tiles.width * tiles.height;
+
+	// Open addressing, at most half full; slots hold a distinct tile index + 1
+	umm slot_count = next_higher_pow2(2 * tile_count);
+	u32 *slots = NULL;
+	Png_Tile_Row_Job *jobs = NULL;
+	Level_Grid grid = {0};
+
+	if (!problem) {
+		tiles.tiles = malloc(tile_count * GAMEBOY_BYTES_PER_TILE);
+		tiles.hashes = malloc(tile_count * sizeof(u64));
+		slots = calloc(slot_count, sizeof(u32));
+		jobs = malloc(tiles.height * sizeof(Png_Tile_Row_Job));
+
+		if (!tiles.tiles || !tiles.hashes || !slots || !jobs ||
+			!level_grid_allocate(&grid, tiles.width, tiles.height))
+		{
+			problem = "out of memory";
+		}
+	}
+
+	if (!problem) {
+		Job_Pool pool;
+		job_pool_start(&pool, png_import_thread_count);
+
+		for (u32 y = 0; y < tiles.height; ++y) {
+			jobs[y] = (Png_Tile_Row_Job){&tiles, y};
+			job_pool_submit(&pool, 0, png_tile_row_job, &jobs[y]);
+		}
+
+		job_pool_stop(&pool);
+	}
+
+	u32 distinct_count = 0;
+
+	if (!problem) {
+		// Distinct tiles are compacted to the front of the tile buffer in
+		// order of first appearance, which is the order of the tile set.
+		for (umm i = 0; i < tile_count; ++i) {
+			u8 *tile = tiles.tiles + i * GAMEBOY_BYTES_PER_TILE;
+			umm slot = tiles.hashes[i] & (slot_count - 1);
+			u32 id;
+
+			for (;;) {
+				if (!slots[slot]) {
+					id = distinct_count++;
+					slots[slot] = id + 1;
+					memmove(tiles.tiles + (umm)id * GAMEBOY_BYTES_PER_TILE, tile, GAMEBOY_BYTES_PER_TILE);
+					tiles.hashes[id] = tiles.hashes[i];
+					break;
+				}
+
+				id = slots[slot] - 1;
+
+				if (tiles.hashes[id] == tiles.hashes[i] &&
+					memcmp(tiles.tiles + (umm)id * GAMEBOY_BYTES_PER_TILE, tile, GAMEBOY_BYTES_PER_TILE) == 0)
+				{
+					break;
+				}
+
+				slot = (slot + 1) & (slot_count - 1);
+			}
+
+			grid.tiles[i] = id;
+		}
+
+		if (distinct_count > TILE_INDEX_COUNT) {
+			fprintf(stderr, "PNG %s has %u distinct tiles, a level can use at most %u.\n", path, distinct_count, TILE_INDEX_COUNT);
+			problem = "too many distinct tiles";
+		}
+	}
+
+	free(image.rows);
+	free(tiles.hashes);
+	free(slots);
+	free(jobs);
+
+	if (problem) {
+		fprintf(stderr, "PNG %s: %s.\n", path, problem);
+		free(tiles.tiles);
+		level_grid_free(&grid);
+		return false;
+	}
+
+	*out_grid = grid;
+
+	if (out_tile_data) {
+		// The distinct tiles are already at the front
+		out_tile_data->length = (umm)distinct_count * GAMEBOY_BYTES_PER_TILE;
+		out_tile_data->data = tiles.tiles;
+	}
+	else {
+		free(tiles.tiles);
+	}
+
+	double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+
+	fprintf(stderr, "Imported %s: %ux%u pixels, %ux%u tiles, %u distinct in %.1f ms (%.1f ms decoding)\n",
+		path, image.width, image.height, tiles.width, tiles.height, distinct_count,
+		(SDL_GetPerformanceCounter() - start) * ms_per_tick, (decoded - start) * ms_per_tick);
+
+	return true;
+}
+
+// NOTE: What load_level does with a PNG, without the tile set
+static b32 import_png_level(Level *level, char *path) {
+	Level_Grid grid;
+	if (!import_png_grid(path, &grid, NULL)) return false;
+
+	level_grid_free(&level->grid);
+	level->grid = grid;
+	object_layer_free(&level->objects);
+
+	return true;
+}
+
+// NOTE: Writes the tile set of an imported image next to it, as
+// <image>.tileset.bin, and its path to out_tileset_path.
+static b32 write_png_tileset(char *image_path, Length_Buffer tile_data, char *out_tileset_path, umm out_tileset_path_size) {
+	level_export_path(out_tileset_path, out_tileset_path_size, image_path, ".tileset.bin");
+
+	if (!write_entire_file_atomic(out_tileset_path, tile_data.data, tile_data.length)) {
+		fprintf(stderr, "Could not write the tile set %s.\n", out_tileset_path);
+		return false;
+	}
+
+	return true;
+}
+
+
+//
+// Deflate (RFC 1950 and 1951)
+//
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_BLOCK_SYMBOLS 16384
+#define DEFLATE_STORED_SIZE 65535
+#define DEFLATE_OUT_SIZE 65536
+
+#define PNG_DEFAULT_COMPRESSION 6
+
+typedef struct Deflate_Parameters {
+	u16 chain_depth;   // Candidates tried per position
+	u16 nice_length;   // Stop searching at a match this long
+	u16 insert_limit;  // Longer matches are not added to the hash chains
+	b32 lazy;          // Try the next position before taking a match
+} Deflate_Parameters;
+
+// NOTE: Level 0 stores, 1 is fastest, 9 compresses best
+static const Deflate_Parameters deflate_levels[10] = {
+	{0, 0, 0, false},
+	{4, 8, 4, false},
+	{8, 16, 5, false},
+	{16, 32, 6, false},
+	{16, 32, DEFLATE_MAX_MATCH, true},
+	{32, 64, DEFLATE_MAX_MATCH, true},
+	{128, 128, DEFLATE_MAX_MATCH, true},
+	{256, DEFLATE_MAX_MATCH, DEFLATE_MAX_MATCH, true},
+	{1024, DEFLATE_MAX_MATCH, DEFLATE_MAX_MATCH, true},
+	{4096, DEFLATE_MAX_MATCH, DEFLATE_MAX_MATCH, true},
+};
+
+// NOTE: Receives the compressed stream as it is produced
+typedef void Deflate_Sink(void *context, u8 *data, umm size);
+
+typedef struct Deflate_State {
+	u32 level;
+	Deflate_Parameters parameters;
+
+	Deflate_Sink *sink;
+	void *sink_context;
+
+	// Two window sizes, so a whole window of history stays behind the
+	// position until it passes the middle and the upper half slides down.
+	u8 window[2 * DEFLATE_WINDOW_SIZE];
+	u32 window_used;
+	u32 position; // Next byte to encode
+	u32 inserted; // Positions below this are in the hash chains
+
+	s32 head[1 << DEFLATE_HASH_BITS];
+	s32 chain[2 * DEFLATE_WINDOW_SIZE]; // Previous position with the same hash, -1 for none
+
+	// A match found at position that is waiting on the lazy check at position + 1
+	u32 pending_length;
+	u32 pending_distance;
+
+	// Symbols of the current block. Distance 0 marks a literal.
+	u16 symbols[DEFLATE_BLOCK_SYMBOLS];
+	u16 distances[DEFLATE_BLOCK_SYMBOLS];
+	u32 symbol_count;
+	u32 literal_frequencies[286];
+	u32 distance_frequencies[30];
+
+	u8 length_codes[DEFLATE_MAX_MATCH + 1];
+	u8 distance_codes[512];
+
+	u64 bits;
+	u32 bit_count;
+	u8 out[DEFLATE_OUT_SIZE];
+	u32 out_used;
+
+	u32 adler;
+} Deflate_State;
+
+static inline void deflate_put_bits(Deflate_State *state, u32 value, u32 count) {
+	state->bits |= (u64)value << state->bit_count;
+	state->bit_count += count;
+
+	if (state->bit_count >= 32) {
+		u8 *out = state->out + state->out_used;
+		out[0] = (u8)state->bits;
+		out[1] = (u8)(state->bits >> 8);
+		out[2] = (u8)(state->bits >> 16);
+		out[3] = (u8)(state->bits >> 24);
+		state->bits >>= 32;
+		state->bit_count -= 32;
+		state->out_used += 4;
+
+		if (state->out_used > DEFLATE_OUT_SIZE - 4) {
+			state->sink(state->sink_context, state->out, state->out_used);
+			state->out_used = 0;
+		}
+	}
+}
+
+// NOTE: Pads to a byte boundary and hands everything to the sink
+static void deflate_flush_bits(Deflate_State *state) {
+	while (state->bit_count > 0) {
+		state->out[state->out_used++] = (u8)state->bits;
+		state->bits >>= 8;
+		state->bit_count = state->bit_count > 8 ? state->bit_count - 8 : 0;
+	}
+
+	state->bits = 0;
+
+	if (state->out_used) {
+		state->sink(state->sink_context, state->out, state->out_used);
+		state->out_used = 0;
+	}
+}
+
+static s32 deflate_compare_frequency(const void *a, const void *b) {
+	u32 x = *(u32 *)a;
+	u32 y = *(u32 *)b;
+	return (x > y) - (x < y);
+}
+
+// NOTE: Huffman code lengths no longer than limit. The lengths are
+// computed in place over the sorted frequencies (Moffat and Katajainen); when
+// the tree is too deep the frequencies are flattened and it is built again.
+static void deflate_code_lengths(u32 *frequencies, u32 count, u32 limit, u8 *lengths) {
+	u32 keys[288];
+	u32 scaled[288];
+
+	memcpy(scaled, frequencies, count * sizeof(u32));
+	memset(lengths, 0, count);
+
+	for (;;) {
+		u32 used = 0;
+
+		for (u32 i = 0; i < count; ++i) {
+			if (scaled[i]) keys[used++] = scaled[i] << 9 | i;
+		}
+
+		if (used == 0) return;
+
+		if (used == 1) {
+			lengths[keys[0] & 511] = 1;
+			return;
+		}
+
+		qsort(keys, used, sizeof(u32), deflate_compare_frequency);
+
+		s32 a[288] = {0};
+		s32 n = (s32)used;
+		for (s32 i = 0; i < n; ++i) a[i] = keys[i] >> 9;
+
+		// Internal node weights, then parents, then depths
+		s32 root = 0;
+		s32 leaf = 2;
+		a[0] += a[1];
+
+		for (s32 next = 1; next < n - 1; ++next) {
+			if (leaf >= n || a[root] < a[leaf]) {
+				a[next] = a[root];
+				a[root++] = next;
+			}
+			else {
+				a[next] = a[leaf++];
+			}
+
+			if (leaf >= n || (root < next && a[root] < a[leaf])) {
+				a[next] += a[root];
+				a[root++] = next;
+			}
+			else {
+				a[next] += a[leaf++];
+			}
+		}
+
+		a[n - 2] = 0;
+		for (s32 next = n - 3; next >= 0; --next) a[next] = a[a[next]] + 1;
+
+		s32 available = 1;
+		s32 depth = 0;
+		s32 next = n - 1;
+		root = n - 2;
+
+		while (available > 0) {
+			s32 internal = 0;
+			while (root >= 0 && a[root] == depth) {
+				++internal;
+				--root;
+			}
+
+			while (available > internal) {
+				a[next--] = depth;
+				--available;
+			}
+
+			available = 2 * internal;
+			++depth;
+		}
+
+		// a[0] went to the least frequent symbol, so it is the longest
+		if ((u32)a[0] <= limit) {
+			for (s32 i = 0; i < n; ++i) lengths[keys[i] & 511] = (u8)a[i];
+			return;
+		}
+
+		for (u32 i = 0; i < count; ++i) {
+			if (scaled[i]) scaled[i] = (scaled[i] >> 1) | 1;
+		}
+	}
+}
+
+// NOTE: Canonical codes, bit reversed for the least significant bit
+// first order of the stream
+static void deflate_codes(u8 *lengths, u32 count, u16 *codes) {
+	u32 length_counts[16] = {0};
+	for (u32 i = 0; i < count; ++i) ++length_counts[lengths[i]];
+	length_counts[0] = 0;
+
+	u32 next_code[16];
+	u32 code = 0;
+
+	for (u32 length = 1; length < 16; ++length) {
+		code = (code + length_counts[length - 1]) << 1;
+		next_code[length] = code;
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		u32 length = lengths[i];
+		if (!length) continue;
+
+		u32 value = next_code[length]++;
+		u32 reversed = 0;
+
+		for (u32 bit = 0; bit < length; ++bit) {
+			reversed |= ((value >> bit) & 1) << (length - 1 - bit);
+		}
+
+		codes[i] = (u16)reversed;
+	}
+}
+
+static void deflate_flush_block(Deflate_State *state, b32 last) {
+	static const u8 order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+	state->literal_frequencies[256] = 1;
+
+	u8 lengths[286 + 30];
+	u8 *literal_lengths = lengths;
+	u8 *distance_lengths = lengths + 286;
+
+	deflate_code_lengths(state->literal_frequencies, 286, 15, literal_lengths);
+	deflate_code_lengths(state->distance_frequencies, 30, 15, distance_lengths);
+
+	// A block without matches still needs one distance code
+	u32 distance_used = 0;
+	for (u32 i = 0; i < 30; ++i) distance_used += distance_lengths[i] != 0;
+	if (!distance_used) distance_lengths[0] = 1;
+
+	u32 literal_count = 286;
+	while (literal_count > 257 && !literal_lengths[literal_count - 1]) --literal_count;
+
+	u32 distance_count = 30;
+	while (distance_count > 1 && !distance_lengths[distance_count - 1]) --distance_count;
+
+	// The two length lists run together, run length coded with symbols 16-18
+	u8 combined[286 + 30];
+	memcpy(combined, literal_lengths, literal_count);
+	memcpy(combined + literal_count, distance_lengths, distance_count);
+	u32 combined_count = literal_count + distance_count;
+
+	u8 runs[286 + 30];
+	u8 run_extra[286 + 30];
+	u32 run_count = 0;
+	u32 run_frequencies[19] = {0};
+
+	for (u32 i = 0; i < combined_count;) {
+		u8 length = combined[i];
+		u32 repeat = 1;
+		while (i + repeat < combined_count && combined[i + repeat] == length) ++repeat;
+
+		if (length == 0 && repeat >= 3) {
+			if (repeat > 138) repeat = 138;
+			runs[run_count] = repeat >= 11 ? 18 : 17;
+			run_extra[run_count++] = (u8)(repeat >= 11 ? repeat - 11 : repeat - 3);
+		}
+		else if (length != 0 && repeat >= 4) {
+			// The first one literally, then up to six repeats of it
+			if (repeat > 7) repeat = 7;
+			runs[run_count] = length;
+			run_extra[run_count++] = 0;
+			runs[run_count] = 16;
+			run_extra[run_count++] = (u8)(repeat - 4);
+		}
+		else {
+			repeat = 1;
+			runs[run_count] = length;
+			run_extra[run_count++] = 0;
+		}
+
+		i += repeat;
+	}
+
+	for (u32 i = 0; i < run_count; ++i) ++run_frequencies[runs[i]];
+
+	u8 run_lengths[19];
+	deflate_code_lengths(run_frequencies, 19, 7, run_lengths);
+
+	u32 run_length_count = 19;
+	while (run_length_count > 4 && !run_lengths[order[run_length_count - 1]]) --run_length_count;
+
+	// Fixed codes win for small blocks, where the tables cost more than they
+	// save. Extra bits are the same either way and left out.
+	u64 dynamic_bits = 14 + 3 * run_length_count;
+	u64 fixed_bits = 0;
+
+	for (u32 i = 0; i < run_count; ++i) {
+		dynamic_bits += run_lengths[runs[i]] + (runs[i] == 16 ? 2 : runs[i] == 17 ? 3 : runs[i] == 18 ? 7 : 0);
+	}
+
+	for (u32 i = 0; i < 286; ++i) {
+		u32 fixed_length = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+		dynamic_bits += (u64)state->literal_frequencies[i] * literal_lengths[i];
+		fixed_bits += (u64)state->literal_frequencies[i] * fixed_length;
+	}
+
+	for (u32 i = 0; i < 30; ++i) {
+		dynamic_bits += (u64)state->distance_frequencies[i] * distance_lengths[i];
+		fixed_bits += (u64)state->distance_frequencies[i] * 5;
+	}
+
+	b32 dynamic = dynamic_bits < fixed_bits;
+
+	u16 literal_codes[288];
+	u16 distance_codes[30];
+	u8 fixed_lengths[288];
+
+	deflate_put_bits(state, last, 1);
+
+	if (dynamic) {
+		deflate_put_bits(state, 2, 2);
+		deflate_put_bits(state, literal_count - 257, 5);
+		deflate_put_bits(state, distance_count - 1, 5);
+		deflate_put_bits(state, run_length_count - 4, 4);
+
+		for (u32 i = 0; i < run_length_count; ++i) {
+			deflate_put_bits(state, run_lengths[order[i]], 3);
+		}
+
+		u16 run_codes[19];
+		deflate_codes(run_lengths, 19, run_codes);
+
+		for (u32 i = 0; i < run_count; ++i) {
+			u8 symbol = runs[i];
+			deflate_put_bits(state, run_codes[symbol], run_lengths[symbol]);
+
+			if (symbol == 16) deflate_put_bits(state, run_extra[i], 2);
+			else if (symbol == 17) deflate_put_bits(state, run_extra[i], 3);
+			else if (symbol == 18) deflate_put_bits(state, run_extra[i], 7);
+		}
+
+		deflate_codes(literal_lengths, 286, literal_codes);
+		deflate_codes(distance_lengths, 30, distance_codes);
+	}
+	else {
+		deflate_put_bits(state, 1, 2);
+
+		for (u32 i = 0; i < 288; ++i) fixed_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+		literal_lengths = fixed_lengths;
+		deflate_codes(fixed_lengths, 288, literal_codes);
+
+		memset(distance_lengths, 5, 30);
+		deflate_codes(distance_lengths, 30, distance_codes);
+	}
+
+	for (u32 i = 0; i < state->symbol_count; ++i) {
+		u32 symbol = state->symbols[i];
+		u32 distance = state->distances[i];
+
+		if (!distance) {
+			deflate_put_bits(state, literal_codes[symbol], literal_lengths[symbol]);
+			continue;
+		}
+
+		// Lengths are kept as length - 3 so they fit next to the literals
+		u32 length = symbol - 256 + DEFLATE_MIN_MATCH;
+		u32 length_code = state->length_codes[length];
+		deflate_put_bits(state, literal_codes[257 + length_code], literal_lengths[257 + length_code]);
+		deflate_put_bits(state, length - inflate_length_base[length_code], inflate_length_extra[length_code]);
+
+		u32 distance_code = distance <= 256 ? state->distance_codes[distance - 1] : state->distance_codes[256 + ((distance - 1) >> 7)];
+		deflate_put_bits(state, distance_codes[distance_code], distance_lengths[distance_code]);
+		deflate_put_bits(state, distance - inflate_distance_base[distance_code], inflate_distance_extra[distance_code]);
+	}
+
+	deflate_put_bits(state, literal_codes[256], literal_lengths[256]);
+
+	state->symbol_count = 0;
+	memset(state->literal_frequencies, 0, sizeof(state->literal_frequencies));
+	memset(state->distance_frequencies, 0, sizeof(state->distance_frequencies));
+}
+
+static inline void deflate_literal(Deflate_State *state, u8 literal) {
+	state->symbols[state->symbol_count] = literal;
+	state->distances[state->symbol_count++] = 0;
+	++state->literal_frequencies[literal];
+
+	if (state->symbol_count == DEFLATE_BLOCK_SYMBOLS) deflate_flush_block(state, false);
+}
+
+static inline void deflate_match(Deflate_State *state, u32 length, u32 distance) {
+	state->symbols[state->symbol_count] = (u16)(256 + length - DEFLATE_MIN_MATCH);
+	state->distances[state->symbol_count++] = (u16)distance;
+	++state->literal_frequencies[257 + state->length_codes[length]];
+	++state->distance_frequencies[distance <= 256 ? state->distance_codes[distance - 1] : state->distance_codes[256 + ((distance - 1) >> 7)]];
+
+	if (state->symbol_count == DEFLATE_BLOCK_SYMBOLS) deflate_flush_block(state, false);
+}
+
+static inline u32 deflate_hash(u8 *at) {
+	u32 value = at[0] | at[1] << 8 | at[2] << 16;
+	return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// NOTE: Adds positions up to and including until to the hash chains
+static inline void deflate_insert(Deflate_State *state, u32 until) {
+	while (state->inserted <= until && state->inserted + DEFLATE_MIN_MATCH <= state->window_used) {
+		u32 hash = deflate_hash(state->window + state->inserted);
+		state->chain[state->inserted] = state->head[hash];
+		state->head[hash] = state->inserted;
+		++state->inserted;
+	}
+}
+
+// NOTE: The longest match for position, searched before position
+// itself is inserted
+static u32 deflate_longest_match(Deflate_State *state, u32 position, u32 *out_distance) {
+	u32 available = state->window_used - position;
+	u32 max_length = available < DEFLATE_MAX_MATCH ? available : DEFLATE_MAX_MATCH;
+	u32 best_length = DEFLATE_MIN_MATCH - 1;
+
+	if (max_length < DEFLATE_MIN_MATCH) return 0;
+
+	u8 *target = state->window + position;
+	s32 candidate = state->head[deflate_hash(target)];
+	u32 depth = state->parameters.chain_depth;
+
+	while (candidate >= 0 && position - candidate <= DEFLATE_WINDOW_SIZE && depth--) {
+		u8 *from = state->window + candidate;
+
+		if (from[best_length] == target[best_length] && from[0] == target[0] && from[1] == target[1]) {
+			u32 length = 0;
+
+			while (length + 8 <= max_length) {
+				u64 x, y;
+				memcpy(&x, from + length, 8);
+				memcpy(&y, target + length, 8);
+
+				if (x != y) {
+					length += __builtin_ctzll(x ^ y) >> 3;
+					goto compared;
+				}
+
+				length += 8;
+			}
+
+			while (length < max_length && from[length] == target[length]) ++length;
+
+		compared:
+			if (length > best_length) {
+				best_length = length;
+				*out_distance = position - candidate;
+				if (length >= state->parameters.nice_length || length == max_length) break;
+			}
+		}
+
+		candidate = state->chain[candidate];
+	}
+
+	return best_length >= DEFLATE_MIN_MATCH ? best_length : 0;
+}
+
+// NOTE: Encodes the window up to the last DEFLATE_MAX_MATCH bytes, so
+// every match sees as far ahead as it may reach, or everything when final.
+static void deflate_compress_window(Deflate_State *state, b32 final) {
+	u32 keep = final ? 0 : DEFLATE_MAX_MATCH;
+	Deflate_Parameters *parameters = &state->parameters;
+
+	while (state->window_used - state->position > keep) {
+		u32 position = state->position;
+		u32 length = state->pending_length;
+		u32 distance = state->pending_distance;
+
+		if (!length) {
+			length = deflate_longest_match(state, position, &distance);
+			deflate_insert(state, position);
+		}
+
+		state->pending_length = 0;
+
+		if (length && parameters->lazy && length < parameters->nice_length &&
+			state->window_used - (position + 1) > keep)
+		{
+			u32 next_distance;
+			u32 next_length = deflate_longest_match(state, position + 1, &next_distance);
+			deflate_insert(state, position + 1);
+
+			if (next_length > length) {
+				deflate_literal(state, state->window[position]);
+				state->pending_length = next_length;
+				state->pending_distance = next_distance;
+				state->position = position + 1;
+				continue;
+			}
+		}
+
+		if (length) {
+			deflate_match(state, length, distance);
+
+			if (length <= parameters->insert_limit) {
+				deflate_insert(state, position + length - 1);
+			}
+			else {
+				state->inserted = position + length;
+			}
+
+			state->position = position + length;
+		}
+		else {
+			deflate_literal(state, state->window[position]);
+			state->position = position + 1;
+		}
+	}
+}
+
+static void deflate_slide_window(Deflate_State *state) {
+	assert(state->position >= DEFLATE_WINDOW_SIZE && state->inserted >= DEFLATE_WINDOW_SIZE);
+
+	memmove(state->window, state->window + DEFLATE_WINDOW_SIZE, state->window_used - DEFLATE_WINDOW_SIZE);
+	state->window_used -= DEFLATE_WINDOW_SIZE;
+	state->position -= DEFLATE_WINDOW_SIZE;
+	state->inserted -= DEFLATE_WINDOW_SIZE;
+
+	for (u32 i = 0; i < (1 << DEFLATE_HASH_BITS); ++i) {
+		s32 at = state->head[i];
+		state->head[i] = at >= DEFLATE_WINDOW_SIZE ? at - DEFLATE_WINDOW_SIZE : -1;
+	}
+
+	for (u32 i = 0; i < DEFLATE_WINDOW_SIZE; ++i) {
+		s32 at = state->chain[i + DEFLATE_WINDOW_SIZE];
+		state->chain[i] = at >= DEFLATE_WINDOW_SIZE ? at - DEFLATE_WINDOW_SIZE : -1;
+	}
+}
+
+static void deflate_stored_block(Deflate_State *state, b32 last) {
+	deflate_put_bits(state, last, 1);
+	deflate_put_bits(state, 0, 2);
+	deflate_flush_bits(state);
+
+	u8 header[4] = {
+		(u8)state->window_used, (u8)(state->window_used >> 8),
+		(u8)~state->window_used, (u8)(~state->window_used >> 8),
+	};
+
+	state->sink(state->sink_context, header, 4);
+	state->sink(state->sink_context, state->window, state->window_used);
+	state->window_used = 0;
+}
+
+static Deflate_State *deflate_start(u32 level, Deflate_Sink *sink, void *sink_context) {
+	Deflate_State *state = calloc(1, sizeof(Deflate_State));
+	if (!state) return NULL;
+
+	memset(state->head, 0xff, sizeof(state->head));
+
+	state->level = level > 9 ? 9 : level;
+	state->parameters = deflate_levels[state->level];
+	state->sink = sink;
+	state->sink_context = sink_context;
+	state->adler = 1;
+
+	for (u32 code = 0; code < 29; ++code) {
+		u32 end = code == 28 ? DEFLATE_MAX_MATCH + 1 : inflate_length_base[code + 1];
+		for (u32 length = inflate_length_base[code]; length < end; ++length) state->length_codes[length] = (u8)code;
+	}
+
+	// Distances up to 256 directly, the rest by (distance - 1) >> 7
+	for (u32 code = 0; code < 30; ++code) {
+		u32 end = code == 29 ? DEFLATE_WINDOW_SIZE + 1 : inflate_distance_base[code + 1];
+
+		for (u32 distance = inflate_distance_base[code]; distance < end; ++distance) {
+			if (distance <= 256) state->distance_codes[distance - 1] = (u8)code;
+			else state->distance_codes[256 + ((distance - 1) >> 7)] = (u8)code;
+		}
+	}
+
+	// zlib header: deflate with a 32K window, and the level as a hint
+	u8 header[2] = {0x78, state->level < 2 ? 0x01 : state->level < 6 ? 0x5e : state->level == 6 ? 0x9c : 0xda};
+	sink(sink_context, header, 2);
+
+	return state;
+}
+
+static void deflate_write(Deflate_State *state, u8 *data, umm size) {
+	state->adler = adler32(state->adler, data, size);
+
+	while (size) {
+		u32 capacity = state->level == 0 ? DEFLATE_STORED_SIZE : 2 * DEFLATE_WINDOW_SIZE;
+		u32 chunk = capacity - state->window_used;
+		if (chunk > size) chunk = (u32)size;
+
+		memcpy(state->window + state->window_used, data, chunk);
+		state->window_used += chunk;
+		data += chunk;
+		size -= chunk;
+
+		if (state->window_used < capacity) break;
+
+		if (state->level == 0) {
+			deflate_stored_block(state, false);
+		}
+		else {
+			deflate_compress_window(state, false);
+			deflate_slide_window(state);
+		}
+	}
+}
+
+// NOTE: Ends the stream and frees the state
+static void deflate_finish(Deflate_State *state) {
+	if (state->level == 0) {
+		deflate_stored_block(state, true);
+	}
+	else {
+		deflate_compress_window(state, true);
+		deflate_flush_block(state, true);
+	}
+
+	deflate_flush_bits(state);
+
+	u8 checksum[4] = {(u8)(state->adler >> 24), (u8)(state->adler >> 16), (u8)(state->adler >> 8), (u8)state->adler};
+	state->sink(state->sink_context, checksum, 4);
+
+	free(state);
+}
+
+
+//
+// Level export
+//
+
+#define PNG_IDAT_SIZE 65536
+
+typedef struct Png_Writer {
+	FILE *file;
+	b32 failed;
+	u32 idat_used;
+	u8 idat[PNG_IDAT_SIZE];
+} Png_Writer;
+
+static void png_write_chunk(Png_Writer *writer, char *type, u8 *data, u32 size) {
+	u8 header[8] = {(u8)(size >> 24), (u8)(size >> 16), (u8)(size >> 8), (u8)size};
+	memcpy(header + 4, type, 4);
+
+	u32 crc = crc32(crc32(0, header + 4, 4), data, size);
+	u8 footer[4] = {(u8)(crc >> 24), (u8)(crc >> 16), (u8)(crc >> 8), (u8)crc};
+
+	if (fwrite(header, 8, 1, writer->file) != 1 ||
+		(size && fwrite(data, size, 1, writer->file) != 1) ||
+		fwrite(footer, 4, 1, writer->file) != 1)
+	{
+		writer->failed = true;
+	}
+}
+
+static void png_idat_sink(void *context, u8 *data, umm size) {
+	Png_Writer *writer = context;
+
+	while (size) {
+		u32 chunk = PNG_IDAT_SIZE - writer->idat_used;
+		if (chunk > size) chunk = (u32)size;
+
+		memcpy(writer->idat + writer->idat_used, data, chunk);
+		writer->idat_used += chunk;
+		data += chunk;
+		size -= chunk;
+
+		if (writer->idat_used == PNG_IDAT_SIZE) {
+			png_write_chunk(writer, "IDAT", writer->idat, writer->idat_used);
+			writer->idat_used = 0;
+		}
+	}
+}
+
+// NOTE: Writes <level>.<scale>x.png, an indexed 2-bit image in the
+// editor's palette, scale pixels across for every Game Boy pixel. tile_data
+// is the tile set in Game Boy format; cells with indices past its end are
+// left in the lightest shade.
+static b32 export_level_png(Level *level, char *path, u8 *tile_data, umm tile_data_size, u32 scale, u32 compression_level) {
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	assert(scale >= 1 && scale <= 4);
+
+	Level_Grid *grid = &level->grid;
+	u32 tile_count = (u32)(tile_data_size / GAMEBOY_BYTES_PER_TILE);
+	if (tile_count > TILE_INDEX_COUNT) tile_count = TILE_INDEX_COUNT;
+
+	u32 image_width = grid->width * GAMEBOY_TILE_WIDTH * scale;
+	u32 image_height = grid->height * GAMEBOY_TILE_WIDTH * scale;
+
+	// A tile row scaled up is 2*scale bytes of 2-bit pixels, packed once per
+	// tile, row and horizontal flip
+	u32 tile_row_size = 2 * scale;
+	umm row_size = (umm)grid->width * tile_row_size;
+
+	u8 *tile_rows = calloc((umm)TILE_INDEX_COUNT * 2 * GAMEBOY_TILE_WIDTH, tile_row_size);
+	u8 *scanline = malloc(row_size + 1);
+
+	char export_path[1100];
+	char extension[16];
+	snprintf(extension, sizeof(extension), ".%ux.png", scale);
+	level_export_path(export_path, sizeof(export_path), path, extension);
+
+	char temp_path[1100 + 4];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", export_path);
+
+	Png_Writer *writer = malloc(sizeof(Png_Writer));
+	if (writer) *writer = (Png_Writer){0};
+
+	if (!tile_rows || !scanline || !writer) {
+		fprintf(stderr, "Out of memory exporting %s.\n", export_path);
+		free(tile_rows);
+		free(scanline);
+		free(writer);
+		return false;
+	}
+
+	for (u32 index = 0; index < tile_count; ++index) {
+		u8 *tile = tile_data + index * GAMEBOY_BYTES_PER_TILE;
+
+		for (u32 y = 0; y < GAMEBOY_TILE_WIDTH; ++y) {
+			for (u32 flip = 0; flip < 2; ++flip) {
+				u8 *out = tile_rows + ((umm)(index * GAMEBOY_TILE_WIDTH + y) * 2 + flip) * tile_row_size;
+				u32 bit = 0;
+
+				for (u32 x = 0; x < GAMEBOY_TILE_WIDTH; ++x) {
+					u32 source_x = flip ? x : 7 - x;
+					u32 shade = ((tile[2*y] >> source_x) & 1) | ((tile[2*y + 1] >> source_x) & 1) << 1;
+
+					for (u32 i = 0; i < scale; ++i, bit += 2) {
+						out[bit >> 3] |= shade << (6 - (bit & 7));
+					}
+				}
+			}
+		}
+	}
+
+	writer->file = fopen(temp_path, "wb");
+
+	if (!writer->file) {
+		fprintf(stderr, "Could not open file %s for writing.\n", temp_path);
+		free(tile_rows);
+		free(scanline);
+		free(writer);
+		return false;
+	}
+
+	static const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if (fwrite(signature, 8, 1, writer->file) != 1) writer->failed = true;
+
+	u8 header[13] = {
+		(u8)(image_width >> 24), (u8)(image_width >> 16), (u8)(image_width >> 8), (u8)image_width,
+		(u8)(image_height >> 24), (u8)(image_height >> 16), (u8)(image_height >> 8), (u8)image_height,
+		2, PNG_COLOR_INDEXED, 0, 0, 0,
+	};
+	png_write_chunk(writer, "IHDR", header, sizeof(header));
+
+	u8 palette[4*3];
+	for (u32 i = 0; i < 4; ++i) {
+		palette[3*i + 0] = (u8)(game_boy_palette[i] >> 24);
+		palette[3*i + 1] = (u8)(game_boy_palette[i] >> 16);
+		palette[3*i + 2] = (u8)(game_boy_palette[i] >> 8);
+	}
+	png_write_chunk(writer, "PLTE", palette, sizeof(palette));
+
+	Deflate_State *deflate = deflate_start(compression_level, png_idat_sink, writer);
+
+	if (!deflate) {
+		writer->failed = true;
+	}
+	else {
+		// Palette images compress best unfiltered
+		scanline[0] = 0;
+
+		for (u32 y = 0; y < grid->height && !writer->failed; ++y) {
+			Tile *row = level_grid_row(grid, y);
+
+			for (u32 tile_y = 0; tile_y < GAMEBOY_TILE_WIDTH; ++tile_y) {
+				u8 *out = scanline + 1;
+
+				for (u32 x = 0; x < grid->width; ++x) {
+					Tile tile = row[x];
+					u32 source_y = (tile & TILE_MASK_FLIP_Y) ? 7 - tile_y : tile_y;
+					u32 flip = (tile & TILE_MASK_FLIP_X) != 0;
+
+					memcpy(out, tile_rows + ((umm)(tile_index(tile) * GAMEBOY_TILE_WIDTH + source_y) * 2 + flip) * tile_row_size, tile_row_size);
+					out += tile_row_size;
+				}
+
+				for (u32 i = 0; i < scale; ++i) deflate_write(deflate, scanline, row_size + 1);
+			}
+		}
+
+		deflate_finish(deflate);
+	}
+
+	if (writer->idat_used) png_write_chunk(writer, "IDAT", writer->idat, writer->idat_used);
+	png_write_chunk(writer, "IEND", NULL, 0);
+
+	// Screenshots can be made again, so unlike level saves this does not sync
+	b32 success = !writer->failed;
+	success = fclose(writer->file) == 0 && success;
+	success = success && rename(temp_path, export_path) == 0;
+
+	if (success) {
+		fprintf(stderr, "Exported %s (%ux%u) in %.1f ms\n", export_path, image_width, image_height,
+			(double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+	}
+	else {
+		fprintf(stderr, "Could not write file %s.\n", export_path);
+		remove(temp_path);
+	}
+
+	free(tile_rows);
+	free(scanline);
+	free(writer);
+
+	return success;
+}
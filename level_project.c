@@ -0,0 +1,700 @@
+// NOTE: A project is an index of levels that share one tile set. Levels
+// are loaded on demand by a background thread and stay resident, pre-rendered,
+// in least-recently-used order until the memory budget is exceeded. Flipping
+// between recently used levels is then only a matter of changing the index of
+// the current level.
+//
+// Project index file format, one directive per line:
+//
+//     miscellus_level_project 1
+//     tileset tileset.bin
+//     budget_mb 256
+//     level <name> <width> <height> <path>
+//
+// Relative paths are relative to the directory of the index file. A width and
+// height of 0 means "take the dimensions from the level file".
+
+#define PROJECT_MAGIC "miscellus_level_project"
+#define PROJECT_DEFAULT_MEMORY_BUDGET (256ull*1024*1024)
+#define PROJECT_PATH_LENGTH 1024
+#define PROJECT_NAME_LENGTH 64
+#define LEVEL_ENTRY_NONE 0xffffffff
+
+typedef enum Level_Entry_State {
+	LEVEL_ENTRY_UNLOADED = 0,
+	LEVEL_ENTRY_QUEUED = 1,  // Waiting for the loader thread
+	LEVEL_ENTRY_LOADING = 2, // Owned by the loader thread
+	LEVEL_ENTRY_LOADED = 3,  // Owned by the main thread
+	LEVEL_ENTRY_FAILED = 4,
+} Level_Entry_State;
+
+typedef struct Level_Entry {
+	char name[PROJECT_NAME_LENGTH];
+	char path[PROJECT_PATH_LENGTH]; // Empty for a level that was never saved
+	u32 width;
+	u32 height;
+
+	SDL_atomic_t state;
+	Level *level;
+
+	// Bytes accounted against the memory budget. 0 until the main thread has
+	// picked up the loaded level.
+	umm memory_size;
+
+	u32 lru_previous;
+	u32 lru_next;
+} Level_Entry;
+
+typedef struct Project {
+	char path[PROJECT_PATH_LENGTH];
+	char tileset_path[PROJECT_PATH_LENGTH];
+
+	u32 entry_count;
+	Level_Entry *entries;
+
+	u32 current;
+	u32 previous;
+
+	// Resident levels, most recently used first
+	u32 lru_first;
+	u32 lru_last;
+
+	umm memory_budget;
+	umm memory_used;
+
+	// Largest texture a level can be pre-rendered into, 0 if the renderer
+	// cannot render to textures.
+	s32 max_texture_width;
+	s32 max_texture_height;
+
+	SDL_Thread *loader_thread;
+	SDL_mutex *loader_mutex;
+	SDL_cond *loader_wakeup;
+	u32 loader_urgent;
+	b32 loader_quit;
+} Project;
+
+
+static inline Level_Entry_State level_entry_state(Level_Entry *entry) {
+	return (Level_Entry_State)SDL_AtomicGet(&entry->state);
+}
+
+static void copy_string(char *destination, umm destination_size, char *source, umm source_length) {
+	if (source_length >= destination_size) source_length = destination_size - 1;
+	memcpy(destination, source, source_length);
+	destination[source_length] = '\0';
+}
+
+static void project_resolve_path(Project *project, char *out_path, char *relative_path, umm relative_length) {
+
+	b32 is_absolute = (relative_path[0] == '/' || relative_path[0] == '\\' || (relative_length > 1 && relative_path[1] == ':'));
+
+	umm directory_length = 0;
+
+	if (!is_absolute) {
+		for (umm i = 0; project->path[i]; ++i) {
+			if (project->path[i] == '/' || project->path[i] == '\\') directory_length = i + 1;
+		}
+	}
+
+	if (directory_length + relative_length >= PROJECT_PATH_LENGTH) {
+		relative_length = PROJECT_PATH_LENGTH - 1 - directory_length;
+	}
+
+	memcpy(out_path, project->path, directory_length);
+	memcpy(out_path + directory_length, relative_path, relative_length);
+	out_path[directory_length + relative_length] = '\0';
+}
+
+// NOTE: Where the journal and undo history of a level are kept: next to its
+// file, or next to the project under its name until it is first saved.
+static void project_level_journal_path(Project *project, u32 index, char *out_path) {
+	Level_Entry *entry = &project->entries[index];
+
+	if (entry->path[0]) {
+		copy_string(out_path, PROJECT_PATH_LENGTH, entry->path, strlen(entry->path));
+	}
+	else {
+		char name[PROJECT_NAME_LENGTH + 8];
+		snprintf(name, sizeof(name), "%s.level", entry->name);
+		project_resolve_path(project, out_path, name, strlen(name));
+	}
+}
+
+static Level_Entry *project_add_entry(Project *project, char *name, umm name_length, u32 width, u32 height) {
+
+	Level_Entry *entries = realloc(project->entries, (project->entry_count + 1) * sizeof(Level_Entry));
+	if (!entries) {
+		panic("Out of memory adding a level to the project.\n");
+	}
+
+	project->entries = entries;
+
+	Level_Entry *entry = &entries[project->entry_count++];
+	*entry = (Level_Entry){0};
+	copy_string(entry->name, sizeof(entry->name), name, name_length);
+	entry->width = width;
+	entry->height = height;
+	entry->lru_previous = LEVEL_ENTRY_NONE;
+	entry->lru_next = LEVEL_ENTRY_NONE;
+
+	return entry;
+}
+
+static void project_init(Project *project) {
+	*project = (Project){0};
+	project->current = 0;
+	project->previous = LEVEL_ENTRY_NONE;
+	project->lru_first = LEVEL_ENTRY_NONE;
+	project->lru_last = LEVEL_ENTRY_NONE;
+	project->loader_urgent = LEVEL_ENTRY_NONE;
+	project->memory_budget = PROJECT_DEFAULT_MEMORY_BUDGET;
+}
+
+// NOTE: Returns false, without complaining, when the file is not a
+// project index, so the caller can try it as something else.
+static b32 project_load_index(Project *project, char *index_path) {
+
+	Length_Buffer file = read_entire_file(index_path);
+
+	umm magic_length = sizeof(PROJECT_MAGIC) - 1;
+
+	if (!file.data || file.length < magic_length || memcmp(file.data, PROJECT_MAGIC, magic_length) != 0) {
+		free(file.data);
+		return false;
+	}
+
+	project_init(project);
+	copy_string(project->path, sizeof(project->path), index_path, strlen(index_path));
+
+	char *at = (char *)file.data;
+	char *end = at + file.length;
+	u32 line_number = 0;
+
+	while (at < end) {
+
+		char *line = at;
+		while (at < end && *at != '\n') ++at;
+		char *line_end = at;
+		if (at < end) ++at;
+		++line_number;
+
+		while (line_end > line && (line_end[-1] == '\r' || line_end[-1] == ' ' || line_end[-1] == '\t')) --line_end;
+		while (line < line_end && (*line == ' ' || *line == '\t')) ++line;
+
+		if (line == line_end || *line == '#') continue;
+
+		char directive[32];
+		char argument[PROJECT_PATH_LENGTH];
+		umm line_length = line_end - line;
+
+		if (line_length >= sizeof(argument)) {
+			fprintf(stderr, "%s:%u: Line too long.\n", index_path, line_number);
+			continue;
+		}
+
+		memcpy(argument, line, line_length);
+		argument[line_length] = '\0';
+
+		s32 consumed = 0;
+		if (sscanf(argument, "%31s %n", directive, &consumed) != 1) continue;
+
+		char *rest = argument + consumed;
+		umm rest_length = strlen(rest);
+
+		if (strcmp(directive, PROJECT_MAGIC) == 0) {
+			// Version, only 1 exists
+		}
+		else if (strcmp(directive, "tileset") == 0) {
+			project_resolve_path(project, project->tileset_path, rest, rest_length);
+		}
+		else if (strcmp(directive, "budget_mb") == 0) {
+			u32 megabytes;
+			if (sscanf(rest, "%u", &megabytes) == 1) {
+				project->memory_budget = (umm)megabytes * 1024 * 1024;
+			}
+		}
+		else if (strcmp(directive, "level") == 0) {
+			char name[PROJECT_NAME_LENGTH];
+			u32 width, height;
+
+			if (sscanf(rest, "%63s %u %u %n", name, &width, &height, &consumed) != 3 || rest[consumed] == '\0') {
+				fprintf(stderr, "%s:%u: Expected: level <name> <width> <height> <path>\n", index_path, line_number);
+				continue;
+			}
+
+			if (width > LEVEL_MAX_WIDTH || height > LEVEL_MAX_HEIGHT || (!width != !height)) {
+				fprintf(stderr, "%s:%u: Invalid level dimensions %ux%u.\n", index_path, line_number, width, height);
+				continue;
+			}
+
+			Level_Entry *entry = project_add_entry(project, name, strlen(name), width, height);
+			project_resolve_path(project, entry->path, rest + consumed, strlen(rest + consumed));
+		}
+		else {
+			fprintf(stderr, "%s:%u: Unknown directive '%s'.\n", index_path, line_number, directive);
+		}
+	}
+
+	free(file.data);
+
+	if (project->entry_count == 0) {
+		fprintf(stderr, "Project %s has no levels, starting with an empty one.\n", index_path);
+		project_add_entry(project, "untitled", 8, LEVEL_WIDTH, LEVEL_HEIGHT);
+	}
+
+	return true;
+}
+
+// NOTE: Without an index file the editor works on a single level that
+// has no file yet.
+static void project_init_single_level(Project *project, u32 width, u32 height) {
+	project_init(project);
+	project_add_entry(project, "untitled", 8, width, height);
+}
+
+static umm level_memory_size(Level *level) {
+	umm result = sizeof(Level);
+	result += (umm)level->grid.width * level->grid.height * sizeof(Tile);
+
+	if (level->texture) {
+		result += (umm)level->grid.width * level->grid.height * GAMEBOY_TILE_WIDTH * GAMEBOY_TILE_WIDTH * 4;
+	}
+
+	result += object_layer_memory_size(&level->objects);
+	result += block_layer_memory_size(&level->blocks);
+	result += vram_analysis_memory_size(&level->vram);
+
+	return result;
+}
+
+static void level_free(Level *level) {
+	if (level->journal && level->journal->grid == &level->grid) {
+		journal_close(level->journal);
+	}
+
+	if (level->texture) {
+		SDL_DestroyTexture(level->texture);
+	}
+
+	// Stamps the history with the grid, so before the grid goes
+	history_close(level->history, &level->grid);
+
+	level_grid_free(&level->grid);
+	object_layer_free(&level->objects);
+	block_layer_free(&level->blocks);
+	vram_analysis_free(&level->vram);
+	level_diff_free(&level->diff);
+	tile_mask_free(&level->selected_cells);
+	free(level);
+}
+
+static Level *level_load_for_entry(Level_Entry *entry) {
+
+	Level *level = calloc(1, sizeof(Level));
+	if (!level) return NULL;
+
+	b32 success;
+	FILE *exists = entry->path[0] ? fopen(entry->path, "rb") : NULL;
+
+	if (exists) {
+		fclose(exists);
+
+		// Raw files do not carry their dimensions, the index does
+		success = true;
+		if (entry->width) {
+			success = level_grid_allocate(&level->grid, entry->width, entry->height);
+		}
+
+		success = success && load_level(level, entry->path);
+		success = success && load_level_blocks(&level->blocks, &level->grid, entry->path);
+	}
+	else if (entry->width) {
+		// Listed in the index but not saved yet
+		success = level_grid_allocate(&level->grid, entry->width, entry->height);
+	}
+	else {
+		fprintf(stderr, "Could not open file %s for reading.\n", entry->path);
+		success = false;
+	}
+
+	if (!success) {
+		level_grid_free(&level->grid);
+		object_layer_free(&level->objects);
+		block_layer_free(&level->blocks);
+		free(level);
+		return NULL;
+	}
+
+	level_count_tile_uses(level);
+	level->recover_journal = true;
+
+	return level;
+}
+
+// NOTE: Called with loader_mutex held
+static u32 project_take_queued_entry(Project *project) {
+
+	u32 urgent = project->loader_urgent;
+	project->loader_urgent = LEVEL_ENTRY_NONE;
+
+	if (urgent != LEVEL_ENTRY_NONE && SDL_AtomicCAS(&project->entries[urgent].state, LEVEL_ENTRY_QUEUED, LEVEL_ENTRY_LOADING)) {
+		return urgent;
+	}
+
+	for (u32 i = 0; i < project->entry_count; ++i) {
+		if (SDL_AtomicCAS(&project->entries[i].state, LEVEL_ENTRY_QUEUED, LEVEL_ENTRY_LOADING)) {
+			return i;
+		}
+	}
+
+	return LEVEL_ENTRY_NONE;
+}
+
+static int project_loader_thread(void *data) {
+
+	Project *project = data;
+
+	for (;;) {
+		u32 index = LEVEL_ENTRY_NONE;
+
+		SDL_LockMutex(project->loader_mutex);
+		while (!project->loader_quit) {
+			index = project_take_queued_entry(project);
+			if (index != LEVEL_ENTRY_NONE) break;
+			SDL_CondWait(project->loader_wakeup, project->loader_mutex);
+		}
+		SDL_UnlockMutex(project->loader_mutex);
+
+		if (index == LEVEL_ENTRY_NONE) break;
+
+		Level_Entry *entry = &project->entries[index];
+		Level *level = level_load_for_entry(entry);
+
+		// NOTE: SDL atomics are full barriers, the main thread sees
+		// entry->level once it sees the new state.
+		entry->level = level;
+		SDL_AtomicSet(&entry->state, level ? LEVEL_ENTRY_LOADED : LEVEL_ENTRY_FAILED);
+	}
+
+	return 0;
+}
+
+static void project_start_loader(Project *project) {
+	project->loader_mutex = SDL_CreateMutex();
+	project->loader_wakeup = SDL_CreateCond();
+	project->loader_thread = SDL_CreateThread(project_loader_thread, "level loader", project);
+
+	if (!project->loader_mutex || !project->loader_wakeup || !project->loader_thread) {
+		panic("Could not start level loader thread: %s\n", SDL_GetError());
+	}
+}
+
+static void project_stop_loader(Project *project) {
+	if (!project->loader_thread) return;
+
+	SDL_LockMutex(project->loader_mutex);
+	project->loader_quit = true;
+	SDL_CondSignal(project->loader_wakeup);
+	SDL_UnlockMutex(project->loader_mutex);
+
+	SDL_WaitThread(project->loader_thread, NULL);
+	SDL_DestroyCond(project->loader_wakeup);
+	SDL_DestroyMutex(project->loader_mutex);
+	project->loader_thread = NULL;
+}
+
+static void project_request_load(Project *project, u32 index, b32 urgent) {
+
+	Level_Entry *entry = &project->entries[index];
+
+	SDL_LockMutex(project->loader_mutex);
+
+	if (urgent) {
+		project->loader_urgent = index;
+	}
+
+	if (level_entry_state(entry) == LEVEL_ENTRY_UNLOADED) {
+		SDL_AtomicSet(&entry->state, LEVEL_ENTRY_QUEUED);
+	}
+
+	SDL_CondSignal(project->loader_wakeup);
+	SDL_UnlockMutex(project->loader_mutex);
+}
+
+static void project_lru_unlink(Project *project, u32 index) {
+	Level_Entry *entry = &project->entries[index];
+
+	if (entry->lru_previous != LEVEL_ENTRY_NONE) project->entries[entry->lru_previous].lru_next = entry->lru_next;
+	else if (project->lru_first == index) project->lru_first = entry->lru_next;
+
+	if (entry->lru_next != LEVEL_ENTRY_NONE) project->entries[entry->lru_next].lru_previous = entry->lru_previous;
+	else if (project->lru_last == index) project->lru_last = entry->lru_previous;
+
+	entry->lru_previous = LEVEL_ENTRY_NONE;
+	entry->lru_next = LEVEL_ENTRY_NONE;
+}
+
+static void project_lru_touch(Project *project, u32 index) {
+	if (project->lru_first == index) return;
+
+	project_lru_unlink(project, index);
+
+	Level_Entry *entry = &project->entries[index];
+	entry->lru_next = project->lru_first;
+
+	if (project->lru_first != LEVEL_ENTRY_NONE) project->entries[project->lru_first].lru_previous = index;
+	project->lru_first = index;
+
+	if (project->lru_last == LEVEL_ENTRY_NONE) project->lru_last = index;
+}
+
+static void project_evict(Project *project, u32 index) {
+	Level_Entry *entry = &project->entries[index];
+	assert(level_entry_state(entry) == LEVEL_ENTRY_LOADED);
+
+	project_lru_unlink(project, index);
+	project->memory_used -= entry->memory_size;
+	entry->memory_size = 0;
+
+	level_free(entry->level);
+	entry->level = NULL;
+	SDL_AtomicSet(&entry->state, LEVEL_ENTRY_UNLOADED);
+}
+
+// NOTE: Drop the pre-rendered texture of a resident level, e.g. after
+// its dimensions or the tile set changed. It is rendered again on the next
+// project_update.
+static void project_invalidate_level(Project *project, u32 index) {
+	Level_Entry *entry = &project->entries[index];
+
+	if (level_entry_state(entry) != LEVEL_ENTRY_LOADED || entry->memory_size == 0) return;
+
+	project_lru_unlink(project, index);
+	project->memory_used -= entry->memory_size;
+	entry->memory_size = 0;
+
+	if (entry->level->texture) {
+		SDL_DestroyTexture(entry->level->texture);
+		entry->level->texture = NULL;
+	}
+}
+
+static void project_invalidate_all_levels(Project *project) {
+	for (u32 i = 0; i < project->entry_count; ++i) {
+		project_invalidate_level(project, i);
+	}
+}
+
+static inline Level *project_current_level(Project *project) {
+	Level_Entry *entry = &project->entries[project->current];
+
+	if (level_entry_state(entry) == LEVEL_ENTRY_LOADED) {
+		return entry->level;
+	}
+
+	return NULL;
+}
+
+// NOTE: Project exports read the saved files, so edits that are only
+// in memory are called out first.
+static void project_warn_unsaved_levels(Project *project) {
+	for (u32 i = 0; i < project->entry_count; ++i) {
+		Level_Entry *entry = &project->entries[i];
+
+		if (level_entry_state(entry) == LEVEL_ENTRY_LOADED && entry->level->modified) {
+			fprintf(stderr, "Warning: %s has unsaved changes, exporting the saved file.\n", entry->name);
+		}
+	}
+}
+
+static inline b32 project_level_fits_texture(Project *project, u32 width, u32 height) {
+	return
+		(s64)width * GAMEBOY_TILE_WIDTH <= project->max_texture_width &&
+		(s64)height * GAMEBOY_TILE_WIDTH <= project->max_texture_height;
+}
+
+static void project_prefetch(Project *project, u32 index) {
+	if (index >= project->entry_count) return;
+
+	Level_Entry *entry = &project->entries[index];
+	if (level_entry_state(entry) != LEVEL_ENTRY_UNLOADED || entry->width == 0) return;
+
+	umm estimate = sizeof(Level) + (umm)entry->width * entry->height * sizeof(Tile);
+	if (project_level_fits_texture(project, entry->width, entry->height)) {
+		estimate += (umm)entry->width * entry->height * GAMEBOY_TILE_WIDTH * GAMEBOY_TILE_WIDTH * 4;
+	}
+
+	if (project->memory_used + estimate <= project->memory_budget) {
+		project_request_load(project, index, false);
+	}
+}
+
+static void project_switch_to(Project *project, u32 index) {
+	if (index >= project->entry_count || index == project->current) return;
+
+	project->previous = project->current;
+	project->current = index;
+
+	Level_Entry_State state = level_entry_state(&project->entries[index]);
+
+	if (state == LEVEL_ENTRY_UNLOADED || state == LEVEL_ENTRY_QUEUED) {
+		project_request_load(project, index, true);
+	}
+
+	// Warm up the neighbours, they are the most likely next stop
+	project_prefetch(project, index + 1);
+	project_prefetch(project, index - 1);
+}
+
+// NOTE: Draws the tiles inside tile_rect (in tiles) with their top left
+// corner at origin, each tile tile_size pixels wide.
+static void render_level_tiles(
+	SDL_Renderer *renderer,
+	Level_Grid *grid,
+	SDL_Rect tile_rect,
+	Tile_Map *tile_map,
+	SDL_Texture *tile_map_texture,
+	s32 origin_x,
+	s32 origin_y,
+	s32 tile_size)
+{
+	const u32 tiles_per_row = tile_map->pixels_per_row / GAMEBOY_TILE_WIDTH;
+	if (tiles_per_row == 0) return;
+
+	for (s32 y = tile_rect.y; y < tile_rect.y + tile_rect.h; ++y) {
+		Tile *row = level_grid_row(grid, y);
+
+		for (s32 x = tile_rect.x; x < tile_rect.x + tile_rect.w; ++x) {
+
+			u32 tile_index = row[x];
+			u32 solid_flag = tile_index & TILE_MASK_SOLID;
+			SDL_RendererFlip flip = tile_render_flip(tile_index);
+			tile_index &= TILE_MASK_INDEX;
+
+			SDL_Rect dest_rect = {
+				origin_x + x * tile_size,
+				origin_y + y * tile_size,
+				tile_size,
+				tile_size,
+			};
+			SDL_Rect source_rect = {
+				tile_index % tiles_per_row * GAMEBOY_TILE_WIDTH,
+				tile_index / tiles_per_row * GAMEBOY_TILE_WIDTH,
+				GAMEBOY_TILE_WIDTH,
+				GAMEBOY_TILE_WIDTH,
+			};
+
+			SDL_RenderCopyEx(renderer, tile_map_texture, &source_rect, &dest_rect, 0, NULL, flip);
+
+			if (solid_flag) {
+				SDL_SetRenderDrawColor(renderer, 0, 64, 128, 255);
+				SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+				SDL_RenderFillRect(renderer, &dest_rect);
+				SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+			}
+		}
+	}
+}
+
+static void level_update_texture(Level *level, SDL_Renderer *renderer, Tile_Map *tile_map, SDL_Texture *tile_map_texture) {
+
+	if (!level->texture || level->dirty.w == 0) return;
+
+	// Clip, the dirty rectangle may have been recorded before a resize
+	SDL_Rect dirty = level->dirty;
+	if (dirty.x < 0) { dirty.w += dirty.x; dirty.x = 0; }
+	if (dirty.y < 0) { dirty.h += dirty.y; dirty.y = 0; }
+	if (dirty.x + dirty.w > (s32)level->grid.width) dirty.w = level->grid.width - dirty.x;
+	if (dirty.y + dirty.h > (s32)level->grid.height) dirty.h = level->grid.height - dirty.y;
+
+	if (dirty.w > 0 && dirty.h > 0) {
+		SDL_SetRenderTarget(renderer, level->texture);
+		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+		render_level_tiles(renderer, &level->grid, dirty, tile_map, tile_map_texture, 0, 0, GAMEBOY_TILE_WIDTH);
+		SDL_SetRenderTarget(renderer, NULL);
+	}
+
+	level->dirty = (SDL_Rect){0};
+}
+
+// NOTE: Called once per frame on the main thread. Picks up levels the
+// loader thread finished, pre-renders them and evicts the least recently used
+// levels while the project is over its memory budget.
+static void project_update(Project *project, SDL_Renderer *renderer, Tile_Map *tile_map, SDL_Texture *tile_map_texture) {
+
+	// Pre-rendering is the expensive part, so only one level that is not the
+	// current one is picked up per frame.
+	b32 picked_up_background_level = false;
+
+	for (u32 pass = 0; pass < 2; ++pass) {
+		for (u32 i = 0; i < project->entry_count; ++i) {
+
+			// First pass only looks at the current level
+			if ((pass == 0) != (i == project->current)) continue;
+
+			Level_Entry *entry = &project->entries[i];
+
+			if (level_entry_state(entry) != LEVEL_ENTRY_LOADED || entry->memory_size != 0) continue;
+
+			if (i != project->current) {
+				if (picked_up_background_level) continue;
+				picked_up_background_level = true;
+			}
+
+			Level *level = entry->level;
+			entry->width = level->grid.width;
+			entry->height = level->grid.height;
+
+			if (!level->texture && project_level_fits_texture(project, level->grid.width, level->grid.height)) {
+				level->texture = SDL_CreateTexture(
+					renderer,
+					SDL_PIXELFORMAT_RGBA8888,
+					SDL_TEXTUREACCESS_TARGET,
+					level->grid.width * GAMEBOY_TILE_WIDTH,
+					level->grid.height * GAMEBOY_TILE_WIDTH);
+			}
+
+			level->dirty = (SDL_Rect){0, 0, level->grid.width, level->grid.height};
+			level_update_texture(level, renderer, tile_map, tile_map_texture);
+
+			entry->memory_size = level_memory_size(level);
+			project->memory_used += entry->memory_size;
+			project_lru_touch(project, i);
+		}
+	}
+
+	if (project->entries[project->current].memory_size) {
+		project_lru_touch(project, project->current);
+	}
+
+	// Evict from the cold end, never the current level and never a level with
+	// unsaved changes.
+	u32 index = project->lru_last;
+
+	while (project->memory_used > project->memory_budget && index != LEVEL_ENTRY_NONE) {
+		Level_Entry *entry = &project->entries[index];
+		u32 next_index = entry->lru_previous;
+
+		if (index != project->current && !entry->level->modified) {
+			project_evict(project, index);
+		}
+
+		index = next_index;
+	}
+}
+
+static void project_shutdown(Project *project) {
+	project_stop_loader(project);
+
+	for (u32 i = 0; i < project->entry_count; ++i) {
+		Level_Entry *entry = &project->entries[i];
+		if (level_entry_state(entry) == LEVEL_ENTRY_LOADED) {
+			level_free(entry->level);
+		}
+	}
+
+	free(project->entries);
+	project->entries = NULL;
+	project->entry_count = 0;
+}
@@ -0,0 +1,186 @@
+// NOTE: Selecting every cell of a level that holds a tile, for global
+// replace. The whole grid is compared four tiles at a time with SSE2 and the
+// result is a bit mask, one bit per cell and 64 cells per word, row by row.
+// The flood fill in level_fill.c builds its masks the same way.
+//
+// Tiles match under a key mask, so a selection can ignore the flip flags
+// (TILE_MATCH_SIMILAR) or take them into account (TILE_MATCH_EXACT).
+
+#define TILE_MATCH_EXACT   (~(Tile)0)
+#define TILE_MATCH_SIMILAR ((Tile)(TILE_MASK_INDEX | TILE_MASK_SOLID))
+
+typedef struct Tile_Mask {
+	u32 width;
+	u32 height;
+	u32 words_per_row;
+	u64 *bits; // NULL when nothing is selected
+
+	Tile key;
+	Tile key_mask;
+	umm count;
+
+	// Rows holding selected cells, inclusive
+	u32 y0;
+	u32 y1;
+} Tile_Mask;
+
+
+// NOTE: Sets a bit in out for every cell of the row where
+// (cell & key_mask) == (key & key_mask). Writes (width + 63) / 64 words.
+static void tile_match_row(Tile *row, u32 width, Tile key, Tile key_mask, u64 *out) {
+	u32 x = 0;
+	key &= key_mask;
+
+#if defined(__SSE2__)
+	__m128i keys = _mm_set1_epi32((s32)key);
+	__m128i key_masks = _mm_set1_epi32((s32)key_mask);
+
+	for (; x + 64 <= width; x += 64) {
+		u64 bits = 0;
+
+		for (u32 i = 0; i < 64; i += 4) {
+			__m128i cells = _mm_loadu_si128((__m128i *)(row + x + i));
+			__m128i equal = _mm_cmpeq_epi32(_mm_and_si128(cells, key_masks), keys);
+			bits |= (u64)_mm_movemask_ps(_mm_castsi128_ps(equal)) << i;
+		}
+
+		out[x / 64] = bits;
+	}
+#endif
+
+	for (; x < width; x += 64) {
+		u32 count = width - x < 64 ? width - x : 64;
+		u64 bits = 0;
+
+		for (u32 i = 0; i < count; ++i) {
+			bits |= (u64)((row[x + i] & key_mask) == key) << i;
+		}
+
+		out[x / 64] = bits;
+	}
+}
+
+static void tile_mask_free(Tile_Mask *mask) {
+	free(mask->bits);
+	*mask = (Tile_Mask){0};
+}
+
+// NOTE: Selects every cell matching key under key_mask. Returns how
+// many, 0 with nothing allocated if none match or out of memory.
+static umm tile_mask_select(Tile_Mask *mask, Level_Grid *grid, Tile key, Tile key_mask) {
+	tile_mask_free(mask);
+
+	u32 words = (grid->width + 63) / 64;
+	u64 *bits = malloc((umm)words * grid->height * sizeof(u64));
+
+	if (!bits) {
+		fprintf(stderr, "Out of memory selecting tiles.\n");
+		return 0;
+	}
+
+	umm count = 0;
+	u32 y0 = grid->height;
+	u32 y1 = 0;
+
+	for (u32 y = 0; y < grid->height; ++y) {
+		u64 *row_bits = &bits[(umm)y * words];
+		tile_match_row(level_grid_row(grid, y), grid->width, key, key_mask, row_bits);
+
+		umm row_count = 0;
+		for (u32 word = 0; word < words; ++word) {
+			row_count += __builtin_popcountll(row_bits[word]);
+		}
+
+		if (row_count) {
+			if (y < y0) y0 = y;
+			y1 = y;
+			count += row_count;
+		}
+	}
+
+	if (!count) {
+		free(bits);
+		return 0;
+	}
+
+	*mask = (Tile_Mask){
+		.width = grid->width,
+		.height = grid->height,
+		.words_per_row = words,
+		.bits = bits,
+		.key = key,
+		.key_mask = key_mask,
+		.count = count,
+		.y0 = y0,
+		.y1 = y1,
+	};
+
+	return count;
+}
+
+// NOTE: For every tile write, so the selection stays every cell holding
+// the tile now. The rows of selected cells only ever grow, so y0 and y1 may
+// take in rows that no longer have any.
+static inline void tile_mask_update_cell(Tile_Mask *mask, u32 x, u32 y, Tile tile) {
+	if (!mask->bits || x >= mask->width || y >= mask->height) return;
+
+	u64 *word = &mask->bits[(umm)y * mask->words_per_row + x / 64];
+	u64 bit = (u64)1 << (x % 64);
+	b32 selected = (tile & mask->key_mask) == (mask->key & mask->key_mask);
+
+	if (selected == ((*word & bit) != 0)) return;
+
+	if (selected) {
+		*word |= bit;
+		++mask->count;
+		if (y < mask->y0) mask->y0 = y;
+		if (y > mask->y1) mask->y1 = y;
+	}
+	else {
+		*word &= ~bit;
+		--mask->count;
+	}
+}
+
+// NOTE: Shades the selected cells of the visible rows, a rectangle per
+// run of set bits.
+static void render_tile_mask(
+	SDL_Renderer *renderer,
+	Tile_Mask *mask,
+	SDL_Rect visible_tiles,
+	s32 origin_x, s32 origin_y,
+	s32 tile_size)
+{
+	if (!mask->bits) return;
+
+	s32 x_end = visible_tiles.x + visible_tiles.w;
+	s32 y_end = visible_tiles.y + visible_tiles.h;
+	if (x_end > (s32)mask->width) x_end = mask->width;
+	if (y_end > (s32)mask->y1 + 1) y_end = mask->y1 + 1;
+
+	SDL_SetRenderDrawColor(renderer, 0, 150, 200, 120);
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+
+	for (s32 y = visible_tiles.y > (s32)mask->y0 ? visible_tiles.y : (s32)mask->y0; y < y_end; ++y) {
+		u64 *bits = &mask->bits[(umm)y * mask->words_per_row];
+		s32 x = visible_tiles.x;
+
+		while (x < x_end) {
+			if (!(bits[x / 64] >> (x % 64) & 1)) {
+				++x;
+				continue;
+			}
+
+			s32 run_start = x;
+			while (x < x_end && (bits[x / 64] >> (x % 64) & 1)) ++x;
+
+			SDL_Rect rect = {
+				origin_x + run_start * tile_size,
+				origin_y + y * tile_size,
+				(x - run_start) * tile_size,
+				tile_size,
+			};
+			SDL_RenderFillRect(renderer, &rect);
+		}
+	}
+}
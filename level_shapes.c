@@ -0,0 +1,218 @@
+// NOTE: Integer rasterizers for lines, rectangles and ellipses drawn
+// with an N x N brush. Shapes are not written cell by cell while they are
+// traced; they add horizontal spans to a Span_List, which span_list_finish
+// sorts and merges so that every cell is covered by exactly one span. The
+// spans are then written row by row, see level_set_spans, so a thick line
+// across a large level touches each cell once however much the brush
+// overlaps itself.
+//
+// A brush of size n covers (x - (n-1)/2, y - (n-1)/2) to (x + n/2, y + n/2),
+// so odd sizes are centred and even sizes lean right and down.
+
+#define BRUSH_MAX_SIZE 16
+
+typedef struct Span {
+	s32 y;
+	s32 x0; // Inclusive
+	s32 x1; // Exclusive
+} Span;
+
+typedef struct Span_List {
+	Span *spans;
+	u32 count;
+	u32 capacity;
+
+	// Spans are clipped to 0 <= x < clip_width, 0 <= y < clip_height
+	s32 clip_width;
+	s32 clip_height;
+} Span_List;
+
+
+static void span_list_free(Span_List *list) {
+	free(list->spans);
+	*list = (Span_List){0};
+}
+
+static void span_list_begin(Span_List *list, u32 clip_width, u32 clip_height) {
+	list->count = 0;
+	list->clip_width = clip_width;
+	list->clip_height = clip_height;
+}
+
+static void span_list_add(Span_List *list, s32 y, s32 x0, s32 x1) {
+	if (y < 0 || y >= list->clip_height) return;
+	if (x0 < 0) x0 = 0;
+	if (x1 > list->clip_width) x1 = list->clip_width;
+	if (x0 >= x1) return;
+
+	if (list->count == list->capacity) {
+		u32 capacity = list->capacity ? 2 * list->capacity : 256;
+		Span *grown = realloc(list->spans, capacity * sizeof(Span));
+		if (!grown) panic("Out of memory.\n");
+		list->spans = grown;
+		list->capacity = capacity;
+	}
+
+	list->spans[list->count++] = (Span){y, x0, x1};
+}
+
+static inline void span_list_add_brush(Span_List *list, s32 x, s32 y, u32 brush_size) {
+	s32 low = (brush_size - 1) / 2;
+	s32 high = brush_size / 2;
+
+	for (s32 brush_y = y - low; brush_y <= y + high; ++brush_y) {
+		span_list_add(list, brush_y, x - low, x + high + 1);
+	}
+}
+
+static int compare_spans(const void *a, const void *b) {
+	const Span *span_a = a;
+	const Span *span_b = b;
+
+	if (span_a->y != span_b->y) return span_a->y < span_b->y ? -1 : 1;
+	if (span_a->x0 != span_b->x0) return span_a->x0 < span_b->x0 ? -1 : 1;
+	return 0;
+}
+
+// NOTE: Sorts the spans by row and merges the ones that overlap or
+// touch, so no cell is in two spans.
+static void span_list_finish(Span_List *list) {
+	if (list->count < 2) return;
+
+	qsort(list->spans, list->count, sizeof(Span), compare_spans);
+
+	u32 merged = 0;
+
+	for (u32 i = 1; i < list->count; ++i) {
+		Span *last = &list->spans[merged];
+		Span *span = &list->spans[i];
+
+		if (span->y == last->y && span->x0 <= last->x1) {
+			if (span->x1 > last->x1) last->x1 = span->x1;
+		}
+		else {
+			list->spans[++merged] = *span;
+		}
+	}
+
+	list->count = merged + 1;
+}
+
+// NOTE: Bresenham, both endpoints included
+static void span_list_line(Span_List *list, s32 x0, s32 y0, s32 x1, s32 y1, u32 brush_size) {
+	s32 dx = abs(x1 - x0);
+	s32 dy = -abs(y1 - y0);
+	s32 sx = x0 < x1 ? 1 : -1;
+	s32 sy = y0 < y1 ? 1 : -1;
+	s32 error = dx + dy;
+
+	for (;;) {
+		span_list_add_brush(list, x0, y0, brush_size);
+
+		if (x0 == x1 && y0 == y1) break;
+
+		s32 error2 = 2 * error;
+		if (error2 >= dy) { error += dy; x0 += sx; }
+		if (error2 <= dx) { error += dx; y0 += sy; }
+	}
+}
+
+// NOTE: The rectangle with corners (x0, y0) and (x1, y1), both
+// included. The brush thickens the outline, or grows a filled rectangle.
+static void span_list_rect(Span_List *list, s32 x0, s32 y0, s32 x1, s32 y1, u32 brush_size, b32 filled) {
+	if (x0 > x1) { s32 swap = x0; x0 = x1; x1 = swap; }
+	if (y0 > y1) { s32 swap = y0; y0 = y1; y1 = swap; }
+
+	s32 low = (brush_size - 1) / 2;
+	s32 high = brush_size / 2;
+
+	for (s32 y = y0 - low; y <= y1 + high; ++y) {
+		b32 edge_row = y <= y0 + high || y >= y1 - low;
+
+		if (filled || edge_row) {
+			span_list_add(list, y, x0 - low, x1 + high + 1);
+		}
+		else {
+			span_list_add(list, y, x0 - low, x0 + high + 1);
+			span_list_add(list, y, x1 - low, x1 + high + 1);
+		}
+	}
+}
+
+// NOTE: The ellipse inside the rectangle with corners (x0, y0) and
+// (x1, y1), after Alois Zingl's integer algorithm, which also gets even
+// sizes and flat ellipses right. The errors need 64 bits at level sizes.
+static void span_list_ellipse(Span_List *list, s32 x0, s32 y0, s32 x1, s32 y1, u32 brush_size, b32 filled) {
+	s64 a = abs(x1 - x0);
+	s64 b = abs(y1 - y0);
+	s64 b1 = b & 1;
+	s64 dx = 4 * (1 - a) * b * b;
+	s64 dy = 4 * (b1 + 1) * a * a;
+	s64 error = dx + dy + b1 * a * a;
+
+	if (x0 > x1) { x0 = x1; x1 += a; }
+	if (y0 > y1) y0 = y1;
+	y0 += (b + 1) / 2;
+	y1 = y0 - b1;
+	a *= 8 * a;
+	b1 = 8 * b * b;
+
+	do {
+		if (filled) {
+			span_list_add(list, y0, x0, x1 + 1);
+			span_list_add(list, y1, x0, x1 + 1);
+		}
+
+		if (!filled || brush_size > 1) {
+			span_list_add_brush(list, x1, y0, brush_size);
+			span_list_add_brush(list, x0, y0, brush_size);
+			span_list_add_brush(list, x0, y1, brush_size);
+			span_list_add_brush(list, x1, y1, brush_size);
+		}
+
+		s64 error2 = 2 * error;
+		if (error2 <= dy) { y0++; y1--; error += dy += a; }
+		if (error2 >= dx || 2 * error > dy) { x0++; x1--; error += dx += b1; }
+	} while (x0 <= x1);
+
+	// Flat and thin ellipses stop early, finish their tips
+	while (y0 - y1 <= b) {
+		span_list_add_brush(list, x0 - 1, y0, brush_size);
+		span_list_add_brush(list, x1 + 1, y0++, brush_size);
+		span_list_add_brush(list, x0 - 1, y1, brush_size);
+		span_list_add_brush(list, x1 + 1, y1--, brush_size);
+	}
+}
+
+// NOTE: Shades the spans on the visible rows, for previews of shapes
+// that are not written yet. The spans are sorted, so only the visible rows
+// are looked at.
+static void render_spans(
+	SDL_Renderer *renderer,
+	Span_List *list,
+	SDL_Rect visible_tiles,
+	s32 origin_x, s32 origin_y,
+	s32 tile_size)
+{
+	u32 first = 0;
+	u32 last = list->count;
+
+	// First span on a visible row
+	while (first < last) {
+		u32 middle = first + (last - first) / 2;
+		if (list->spans[middle].y < visible_tiles.y) first = middle + 1;
+		else last = middle;
+	}
+
+	for (u32 i = first; i < list->count && list->spans[i].y < visible_tiles.y + visible_tiles.h; ++i) {
+		Span *span = &list->spans[i];
+
+		SDL_Rect rect = {
+			origin_x + span->x0 * tile_size,
+			origin_y + span->y * tile_size,
+			(span->x1 - span->x0) * tile_size,
+			tile_size,
+		};
+		SDL_RenderFillRect(renderer, &rect);
+	}
+}
@@ -0,0 +1,449 @@
+// NOTE: Source exports for game builds that link level data in
+// directly: <level>.asm for RGBDS and <level>.c with <level>.h for GBDK,
+// holding the same two planes as the raw .bin format. Symbols are named after the level file, so
+// levels/world 1-2.level becomes world_1_2_tiles, world_1_2_collision and
+// world_1_2_width / world_1_2_height.
+//
+// The text is formatted straight into one buffer that is reused from level to
+// level, sized up front for the worst case so the inner loops never check for
+// space, and each file is written with a single write.
+//
+// A ROMX bank is 16 KiB, so a level whose two planes do not fit in one is
+// split by rows: bank n holds rows_per_bank rows of both planes, labelled
+// world_1_2_tiles_<n> and world_1_2_collision_<n>. The assembly gets a ROMX
+// section per bank. GBDK puts a whole file in one bank, so each bank is its
+// own <level>_<n>.c, autobanked with BANKREF for BANK() to find it, and there
+// is no <level>.c. The game switches to BANK(world_1_2_tiles_<n>) for the rows
+// it needs.
+
+#define SOURCE_SYMBOL_LENGTH 128
+#define SOURCE_BYTES_PER_LINE 16
+#define SOURCE_BANK_SIZE 0x4000
+
+typedef struct Source_Buffer {
+	char *data;
+	umm used;
+	umm capacity;
+} Source_Buffer;
+
+// Two hex digits for every byte value
+static char source_hex_pairs[512];
+
+
+static void source_export_init(void) {
+	char *digits = "0123456789abcdef";
+
+	for (u32 i = 0; i < 256; ++i) {
+		source_hex_pairs[2*i + 0] = digits[i >> 4];
+		source_hex_pairs[2*i + 1] = digits[i & 0xf];
+	}
+}
+
+static b32 source_buffer_reserve(Source_Buffer *buffer, umm size) {
+	if (buffer->used + size <= buffer->capacity) return true;
+
+	umm new_capacity = buffer->capacity ? buffer->capacity : 1 << 20;
+	while (new_capacity < buffer->used + size) new_capacity *= 2;
+
+	char *new_data = realloc(buffer->data, new_capacity);
+	if (!new_data) return false;
+
+	buffer->data = new_data;
+	buffer->capacity = new_capacity;
+	return true;
+}
+
+static void source_buffer_free(Source_Buffer *buffer) {
+	free(buffer->data);
+	*buffer = (Source_Buffer){0};
+}
+
+// NOTE: The append functions assume the space has been reserved
+static inline void source_append(Source_Buffer *buffer, char *text) {
+	umm length = strlen(text);
+	memcpy(buffer->data + buffer->used, text, length);
+	buffer->used += length;
+}
+
+static inline void source_append_u32(Source_Buffer *buffer, u32 value) {
+	char digits[10];
+	u32 count = 0;
+
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	char *out = buffer->data + buffer->used;
+	while (count) *out++ = digits[--count];
+	buffer->used = out - buffer->data;
+}
+
+// NOTE: Writes size bytes as comma separated hex, SOURCE_BYTES_PER_LINE
+// to a line, each line started with line_prefix. C initializers continue over
+// the line break, so they keep the comma at the end of every line.
+static void source_append_bytes(Source_Buffer *buffer, u8 *bytes, umm size, char *line_prefix, char *byte_prefix, b32 comma_at_line_end) {
+	umm line_prefix_length = strlen(line_prefix);
+	umm byte_prefix_length = strlen(byte_prefix);
+
+	char *out = buffer->data + buffer->used;
+
+	for (umm i = 0; i < size; i += SOURCE_BYTES_PER_LINE) {
+		umm line_end = i + SOURCE_BYTES_PER_LINE;
+		if (line_end > size) line_end = size;
+
+		memcpy(out, line_prefix, line_prefix_length);
+		out += line_prefix_length;
+
+		for (umm j = i; j < line_end; ++j) {
+			memcpy(out, byte_prefix, byte_prefix_length);
+			out += byte_prefix_length;
+
+			out[0] = source_hex_pairs[2*bytes[j] + 0];
+			out[1] = source_hex_pairs[2*bytes[j] + 1];
+			out[2] = ',';
+			out += 3;
+		}
+
+		if (comma_at_line_end) *out++ = '\n';
+		else out[-1] = '\n';
+	}
+
+	buffer->used = out - buffer->data;
+}
+
+static inline umm source_bytes_size(umm size, char *line_prefix, char *byte_prefix) {
+	umm line_count = (size + SOURCE_BYTES_PER_LINE - 1) / SOURCE_BYTES_PER_LINE;
+	return line_count * (strlen(line_prefix) + 1) + size * (strlen(byte_prefix) + 3);
+}
+
+// NOTE: The file name without directories or extension, with anything
+// that cannot go in an identifier replaced by '_'.
+static void source_symbol_from_path(char *out_symbol, umm out_symbol_size, char *path) {
+	char *name = path;
+
+	for (char *at = path; *at; ++at) {
+		if (*at == '/' || *at == '\\') name = at + 1;
+	}
+
+	char *dot = strrchr(name, '.');
+	umm length = dot ? (umm)(dot - name) : strlen(name);
+
+	umm out = 0;
+
+	if (length == 0 || (name[0] >= '0' && name[0] <= '9')) {
+		out_symbol[out++] = '_';
+	}
+
+	for (umm i = 0; i < length && out + 1 < out_symbol_size; ++i) {
+		char c = name[i];
+		b32 valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+		out_symbol[out++] = valid ? c : '_';
+	}
+
+	out_symbol[out] = '\0';
+}
+
+// NOTE: How a level is split over banks, see the top of the file. A
+// bank_count of 0 means both planes fit in one bank and are not split.
+typedef struct Source_Banks {
+	u32 rows_per_bank;
+	u32 bank_count;
+} Source_Banks;
+
+static Source_Banks source_banks(u32 width, u32 height) {
+	Source_Banks banks = {0};
+
+	if (2 * (umm)width * height > SOURCE_BANK_SIZE) {
+		// At least two rows, levels are at most LEVEL_MAX_WIDTH wide
+		banks.rows_per_bank = SOURCE_BANK_SIZE / (2 * width);
+		banks.bank_count = (height + banks.rows_per_bank - 1) / banks.rows_per_bank;
+	}
+
+	return banks;
+}
+
+// NOTE: symbol_<name>_<bank>
+static void source_append_bank_label(Source_Buffer *buffer, char *symbol, char *name, u32 bank) {
+	source_append(buffer, symbol);
+	source_append(buffer, name);
+	source_append_u32(buffer, bank);
+}
+
+static void source_append_rgbds(Source_Buffer *buffer, char *symbol, u8 *planes, u32 width, u32 height, Source_Banks banks) {
+	umm cell_count = (umm)width * height;
+
+	if (banks.bank_count) {
+		source_append(buffer, "; Level data exported by the level editor, ");
+		source_append_u32(buffer, banks.rows_per_bank);
+		source_append(buffer, " rows of both planes per bank\n\nDEF ");
+		source_append(buffer, symbol);
+		source_append(buffer, "_width EQU ");
+		source_append_u32(buffer, width);
+		source_append(buffer, "\nDEF ");
+		source_append(buffer, symbol);
+		source_append(buffer, "_height EQU ");
+		source_append_u32(buffer, height);
+		source_append(buffer, "\nDEF ");
+		source_append(buffer, symbol);
+		source_append(buffer, "_rows_per_bank EQU ");
+		source_append_u32(buffer, banks.rows_per_bank);
+		source_append(buffer, "\nDEF ");
+		source_append(buffer, symbol);
+		source_append(buffer, "_bank_count EQU ");
+		source_append_u32(buffer, banks.bank_count);
+		source_append(buffer, "\n");
+
+		for (u32 bank = 0; bank < banks.bank_count; ++bank) {
+			u32 y0 = bank * banks.rows_per_bank;
+			u32 rows = height - y0 < banks.rows_per_bank ? height - y0 : banks.rows_per_bank;
+			umm offset = (umm)y0 * width;
+
+			source_append(buffer, "\nSECTION \"");
+			source_append_bank_label(buffer, symbol, "_", bank);
+			source_append(buffer, "\", ROMX\n\n");
+			source_append_bank_label(buffer, symbol, "_tiles_", bank);
+			source_append(buffer, "::\n");
+			source_append_bytes(buffer, planes + offset, (umm)rows * width, "\tdb ", "$", false);
+
+			source_append(buffer, "\n");
+			source_append_bank_label(buffer, symbol, "_collision_", bank);
+			source_append(buffer, "::\n");
+			source_append_bytes(buffer, planes + cell_count + offset, (umm)rows * width, "\tdb ", "$", false);
+		}
+
+		return;
+	}
+
+	source_append(buffer, "; Level data exported by the level editor\n\nSECTION \"");
+	source_append(buffer, symbol);
+	source_append(buffer, "\", ROMX\n\nDEF ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_width EQU ");
+	source_append_u32(buffer, width);
+	source_append(buffer, "\nDEF ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_height EQU ");
+	source_append_u32(buffer, height);
+
+	source_append(buffer, "\n\n");
+	source_append(buffer, symbol);
+	source_append(buffer, "_tiles::\n");
+	source_append_bytes(buffer, planes, cell_count, "\tdb ", "$", false);
+
+	source_append(buffer, "\n");
+	source_append(buffer, symbol);
+	source_append(buffer, "_collision::\n");
+	source_append_bytes(buffer, planes + cell_count, cell_count, "\tdb ", "$", false);
+}
+
+// NOTE: The header only declares the arrays, so it can be included from any
+// number of translation units. The arrays are defined once, in the .c file.
+static void source_append_gbdk_header(Source_Buffer *buffer, char *symbol, u32 width, u32 height, Source_Banks banks) {
+	source_append(buffer, "// Level data exported by the level editor\n\n#ifndef LEVEL_");
+	source_append(buffer, symbol);
+	source_append(buffer, "_H\n#define LEVEL_");
+	source_append(buffer, symbol);
+	source_append(buffer, "_H\n\n#define ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_width ");
+	source_append_u32(buffer, width);
+	source_append(buffer, "\n#define ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_height ");
+	source_append_u32(buffer, height);
+
+	if (banks.bank_count) {
+		source_append(buffer, "\n#define ");
+		source_append(buffer, symbol);
+		source_append(buffer, "_rows_per_bank ");
+		source_append_u32(buffer, banks.rows_per_bank);
+		source_append(buffer, "\n#define ");
+		source_append(buffer, symbol);
+		source_append(buffer, "_bank_count ");
+		source_append_u32(buffer, banks.bank_count);
+		source_append(buffer, "\n\n#include <gb/gb.h>\n");
+
+		for (u32 bank = 0; bank < banks.bank_count; ++bank) {
+			source_append(buffer, "\nBANKREF_EXTERN(");
+			source_append_bank_label(buffer, symbol, "_tiles_", bank);
+			source_append(buffer, ")\nextern const unsigned char ");
+			source_append_bank_label(buffer, symbol, "_tiles_", bank);
+			source_append(buffer, "[];\nextern const unsigned char ");
+			source_append_bank_label(buffer, symbol, "_collision_", bank);
+			source_append(buffer, "[];\n");
+		}
+
+		source_append(buffer, "\n#endif\n");
+		return;
+	}
+
+	source_append(buffer, "\n\nextern const unsigned char ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_tiles[];\nextern const unsigned char ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_collision[];\n\n#endif\n");
+}
+
+static void source_append_gbdk(Source_Buffer *buffer, char *symbol, char *header_name, u8 *planes, u32 width, u32 height) {
+	umm cell_count = (umm)width * height;
+
+	source_append(buffer, "// Level data exported by the level editor\n\n#include \"");
+	source_append(buffer, header_name);
+	source_append(buffer, "\"\n\nconst unsigned char ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_tiles[] = {\n");
+	source_append_bytes(buffer, planes, cell_count, "\t", "0x", true);
+
+	source_append(buffer, "};\n\nconst unsigned char ");
+	source_append(buffer, symbol);
+	source_append(buffer, "_collision[] = {\n");
+	source_append_bytes(buffer, planes + cell_count, cell_count, "\t", "0x", true);
+
+	source_append(buffer, "};\n");
+}
+
+// NOTE: <level>_<bank>.c, rows y0 up to y0 + rows of both planes
+static void source_append_gbdk_bank(Source_Buffer *buffer, char *symbol, char *header_name, u8 *planes, u32 width, u32 height, u32 bank, u32 y0, u32 rows) {
+	umm cell_count = (umm)width * height;
+	umm offset = (umm)y0 * width;
+
+	source_append(buffer, "// Level data exported by the level editor\n\n#pragma bank 255\n\n#include \"");
+	source_append(buffer, header_name);
+	source_append(buffer, "\"\n\nBANKREF(");
+	source_append_bank_label(buffer, symbol, "_tiles_", bank);
+	source_append(buffer, ")\n\nconst unsigned char ");
+	source_append_bank_label(buffer, symbol, "_tiles_", bank);
+	source_append(buffer, "[] = {\n");
+	source_append_bytes(buffer, planes + offset, (umm)rows * width, "\t", "0x", true);
+
+	source_append(buffer, "};\n\nconst unsigned char ");
+	source_append_bank_label(buffer, symbol, "_collision_", bank);
+	source_append(buffer, "[] = {\n");
+	source_append_bytes(buffer, planes + cell_count + offset, (umm)rows * width, "\t", "0x", true);
+
+	source_append(buffer, "};\n");
+}
+
+// NOTE: Writes <level>.asm, <level>.c (or <level>_<n>.c per bank) and
+// <level>.h next to the level. The buffer is kept by the caller so a batch of
+// levels reuses one allocation.
+static b32 export_level_sources(Level *level, char *path, Source_Buffer *buffer) {
+
+	Level_Grid *grid = &level->grid;
+	umm cell_count = (umm)grid->width * grid->height;
+
+	u32 truncated_count;
+	u8 *planes = level_raw_planes(grid, &truncated_count);
+
+	Source_Banks banks = source_banks(grid->width, grid->height);
+
+	// Fixed text, the symbol and the header name used a dozen times, and a few
+	// numbers, then per bank its labels a handful of times
+	umm text_size = 512 + 16 * SOURCE_SYMBOL_LENGTH + 1100;
+	text_size += (umm)banks.bank_count * (128 + 8 * (SOURCE_SYMBOL_LENGTH + 24));
+	umm asm_size = text_size + 2 * source_bytes_size(cell_count, "\tdb ", "$");
+	umm c_size = text_size + 2 * source_bytes_size(cell_count, "\t", "0x");
+
+	buffer->used = 0;
+
+	if (!planes || !source_buffer_reserve(buffer, asm_size > c_size ? asm_size : c_size)) {
+		fprintf(stderr, "Out of memory exporting %s.\n", path);
+		free(planes);
+		return false;
+	}
+
+	if (truncated_count) {
+		fprintf(stderr, "Warning: %u tiles in %s use indices above 255, which the exports cannot store.\n", truncated_count, path);
+	}
+
+	char symbol[SOURCE_SYMBOL_LENGTH];
+	source_symbol_from_path(symbol, sizeof(symbol), path);
+
+	char export_path[1100];
+
+	source_append_rgbds(buffer, symbol, planes, grid->width, grid->height, banks);
+	level_export_path(export_path, sizeof(export_path), path, ".asm");
+	b32 success = write_entire_file_atomic(export_path, buffer->data, buffer->used);
+
+	buffer->used = 0;
+	source_append_gbdk_header(buffer, symbol, grid->width, grid->height, banks);
+	level_export_path(export_path, sizeof(export_path), path, ".h");
+	success = write_entire_file_atomic(export_path, buffer->data, buffer->used) && success;
+
+	// The .c file includes the header from next to it
+	char *header_name = export_path;
+	for (char *at = export_path; *at; ++at) {
+		if (*at == '/' || *at == '\\') header_name = at + 1;
+	}
+
+	// Copied, export_path is reused for the .c files
+	char header_file_name[1100];
+	snprintf(header_file_name, sizeof(header_file_name), "%s", header_name);
+
+	if (banks.bank_count) {
+		for (u32 bank = 0; bank < banks.bank_count; ++bank) {
+			u32 y0 = bank * banks.rows_per_bank;
+			u32 rows = grid->height - y0 < banks.rows_per_bank ? grid->height - y0 : banks.rows_per_bank;
+
+			char extension[16];
+			snprintf(extension, sizeof(extension), "_%u.c", bank);
+
+			buffer->used = 0;
+			source_append_gbdk_bank(buffer, symbol, header_file_name, planes, grid->width, grid->height, bank, y0, rows);
+			level_export_path(export_path, sizeof(export_path), path, extension);
+			success = write_entire_file_atomic(export_path, buffer->data, buffer->used) && success;
+		}
+	}
+	else {
+		buffer->used = 0;
+		source_append_gbdk(buffer, symbol, header_file_name, planes, grid->width, grid->height);
+		level_export_path(export_path, sizeof(export_path), path, ".c");
+		success = write_entire_file_atomic(export_path, buffer->data, buffer->used) && success;
+	}
+
+	free(planes);
+	return success;
+}
+
+// NOTE: Exports the saved file of every level in the project
+static b32 export_project_sources(Project *project) {
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	Source_Buffer buffer = {0};
+	u32 exported_count = 0;
+	u32 failed_count = 0;
+	umm cell_count = 0;
+
+	for (u32 i = 0; i < project->entry_count; ++i) {
+		Level_Entry *entry = &project->entries[i];
+
+		if (!entry->path[0]) {
+			++failed_count;
+			continue;
+		}
+
+		Level *level = level_load_for_entry(entry);
+
+		if (level && export_level_sources(level, entry->path, &buffer)) {
+			++exported_count;
+			cell_count += (umm)level->grid.width * level->grid.height;
+		}
+		else {
+			++failed_count;
+		}
+
+		if (level) level_free(level);
+	}
+
+	source_buffer_free(&buffer);
+
+	u64 end = SDL_GetPerformanceCounter();
+
+	fprintf(stderr, "Source export: %u levels (%llu cells), %u failed, %.1f ms\n",
+		exported_count, cell_count, failed_count,
+		(double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+
+	return failed_count == 0;
+}
@@ -0,0 +1,150 @@
+// NOTE: Stamp brushes, rectangles of tiles picked from the tile set.
+// A stamp is held in a Level_Grid of its own and written into the level with
+// level_paste, a row blit per stamp row.
+//
+// Dragging a stamp does not write one at every tile the mouse crosses, which
+// would write most cells over and over. The stroke lays the stamps on a
+// lattice the size of the stamp, anchored where the stroke started, so
+// stamps next to each other tile without overlapping. A bit per lattice cell
+// remembers the ones already stamped, so going back over the same path
+// writes nothing.
+
+typedef struct Stamp_Stroke {
+	s32 stamp_width;
+	s32 stamp_height;
+
+	// Where the first stamp went, modulo the stamp size
+	s32 offset_x;
+	s32 offset_y;
+
+	u32 cells_per_row;
+	u32 cell_rows;
+	u32 words_per_row;
+	u64 *stamped; // One bit per lattice cell, NULL outside of a stroke
+} Stamp_Stroke;
+
+
+static inline s32 stamp_floor_div(s32 a, s32 b) {
+	s32 quotient = a / b;
+	if ((a % b) && ((a < 0) != (b < 0))) --quotient;
+	return quotient;
+}
+
+// NOTE: Top left of the stamp when the mouse is over (x, y). Odd
+// sizes are centred and even sizes lean right and down, like the brush.
+static inline void stamp_position(Level_Grid *stamp, s32 x, s32 y, s32 *out_x, s32 *out_y) {
+	*out_x = x - ((s32)stamp->width - 1) / 2;
+	*out_y = y - ((s32)stamp->height - 1) / 2;
+}
+
+static void stamp_stroke_free(Stamp_Stroke *stroke) {
+	free(stroke->stamped);
+	*stroke = (Stamp_Stroke){0};
+}
+
+// NOTE: Starts a stroke with the first stamp at (x, y), top left, on a
+// level of grid_width x grid_height tiles. False if out of memory.
+static b32 stamp_stroke_begin(Stamp_Stroke *stroke, Level_Grid *stamp, u32 grid_width, u32 grid_height, s32 x, s32 y) {
+	stamp_stroke_free(stroke);
+
+	s32 width = stamp->width;
+	s32 height = stamp->height;
+
+	// Every stamp overlapping the level is in lattice cell -1 up to
+	// (grid size - 1) / stamp size, stored one higher
+	stroke->stamp_width = width;
+	stroke->stamp_height = height;
+	stroke->offset_x = x - stamp_floor_div(x, width) * width;
+	stroke->offset_y = y - stamp_floor_div(y, height) * height;
+	stroke->cells_per_row = (grid_width - 1) / width + 2;
+	stroke->cell_rows = (grid_height - 1) / height + 2;
+	stroke->words_per_row = (stroke->cells_per_row + 63) / 64;
+	stroke->stamped = calloc((umm)stroke->words_per_row * stroke->cell_rows, sizeof(u64));
+
+	return stroke->stamped != NULL;
+}
+
+// NOTE: Moves a stamp at (x, y), top left, to the place on the
+// lattice of the stroke that holds the mouse, see stamp_position.
+static inline void stamp_stroke_snap(Stamp_Stroke *stroke, s32 *x, s32 *y) {
+	s32 cell_x = stamp_floor_div(*x - stroke->offset_x + (stroke->stamp_width - 1) / 2, stroke->stamp_width);
+	s32 cell_y = stamp_floor_div(*y - stroke->offset_y + (stroke->stamp_height - 1) / 2, stroke->stamp_height);
+
+	*x = stroke->offset_x + cell_x * stroke->stamp_width;
+	*y = stroke->offset_y + cell_y * stroke->stamp_height;
+}
+
+// NOTE: Snaps a stamp at (x, y), top left, to the lattice. Returns
+// true the first time its lattice cell is claimed, false if it was stamped
+// before or is off the level.
+static b32 stamp_stroke_claim(Stamp_Stroke *stroke, s32 *x, s32 *y) {
+	stamp_stroke_snap(stroke, x, y);
+
+	u32 column = (*x - stroke->offset_x) / stroke->stamp_width + 1;
+	u32 row = (*y - stroke->offset_y) / stroke->stamp_height + 1;
+	if (column >= stroke->cells_per_row || row >= stroke->cell_rows) return false;
+
+	u64 *word = &stroke->stamped[(umm)row * stroke->words_per_row + column / 64];
+	u64 bit = (u64)1 << (column % 64);
+
+	if (*word & bit) return false;
+
+	*word |= bit;
+	return true;
+}
+
+// NOTE: Draws the stamp see-through with its top left tile at
+// (origin_x, origin_y). The tiles go out first and the solid shading after,
+// in one call, so the renderer can batch the copies.
+static void render_stamp_ghost(
+	SDL_Renderer *renderer,
+	Level_Grid *stamp,
+	Tile_Map *tile_map,
+	SDL_Texture *tile_map_texture,
+	s32 origin_x, s32 origin_y,
+	s32 tile_size)
+{
+	const u32 tiles_per_row = tile_map->pixels_per_row / GAMEBOY_TILE_WIDTH;
+	if (tiles_per_row == 0) return;
+
+	SDL_Rect solid_rects[TILE_INDEX_COUNT];
+	u32 solid_count = 0;
+
+	SDL_SetTextureAlphaMod(tile_map_texture, 160);
+
+	for (u32 y = 0; y < stamp->height; ++y) {
+		Tile *row = level_grid_row(stamp, y);
+
+		for (u32 x = 0; x < stamp->width; ++x) {
+			u32 tile_index = row[x] & TILE_MASK_INDEX;
+
+			SDL_Rect dest_rect = {
+				origin_x + x * tile_size,
+				origin_y + y * tile_size,
+				tile_size,
+				tile_size,
+			};
+			SDL_Rect source_rect = {
+				tile_index % tiles_per_row * GAMEBOY_TILE_WIDTH,
+				tile_index / tiles_per_row * GAMEBOY_TILE_WIDTH,
+				GAMEBOY_TILE_WIDTH,
+				GAMEBOY_TILE_WIDTH,
+			};
+
+			SDL_RenderCopyEx(renderer, tile_map_texture, &source_rect, &dest_rect, 0, NULL, tile_render_flip(row[x]));
+
+			if ((row[x] & TILE_MASK_SOLID) && solid_count < TILE_INDEX_COUNT) {
+				solid_rects[solid_count++] = dest_rect;
+			}
+		}
+	}
+
+	SDL_SetTextureAlphaMod(tile_map_texture, 255);
+
+	if (solid_count) {
+		SDL_SetRenderDrawColor(renderer, 0, 64, 128, 255);
+		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+		SDL_RenderFillRects(renderer, solid_rects, solid_count);
+		SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	}
+}
@@ -0,0 +1,590 @@
+// NOTE: Imports maps from the Tiled editor: JSON maps (.json, .tmj),
+// TMX maps with CSV encoded layers (.tmx) and single layer CSV exports
+// (.csv). The file is mapped and scanned in place; the only allocation is the
+// new grid.
+//
+// The first tile layer becomes the tiles. A tile layer named "collision" or
+// "solid" marks every cell it covers as solid. Global tile IDs are turned into
+// indices into our tile set by subtracting the first tileset's firstgid, so
+// the tilesets are expected to be laid out in the order of our tile set.
+// Horizontal and vertical flips are kept; the diagonal flip (Tiled's 90
+// degree rotations) has no Game Boy equivalent and is dropped.
+
+#define TILED_FLIP_HORIZONTAL 0x80000000
+#define TILED_FLIP_VERTICAL   0x40000000
+#define TILED_FLIP_DIAGONAL   0x20000000
+#define TILED_ROTATE_HEXAGON  0x10000000
+#define TILED_GID_MASK        0x0fffffff
+
+#define TILED_MAX_DEPTH 64
+
+typedef struct Tiled_Layer {
+	u8 *data; // The tile IDs as CSV or a JSON array, NULL if not found
+	u8 *data_end;
+	u32 width;
+	u32 height;
+} Tiled_Layer;
+
+typedef struct Tiled_Map {
+	u32 width;
+	u32 height;
+	u32 first_gid;
+	Tiled_Layer tiles;
+	Tiled_Layer solid;
+	char *problem;
+} Tiled_Map;
+
+typedef struct Tiled_Parser {
+	u8 *at;
+	u8 *end;
+	b32 failed;
+} Tiled_Parser;
+
+typedef struct Tiled_Import_Stats {
+	umm diagonal_count;  // Dropped rotations
+	umm truncated_count; // Indices past TILE_INDEX_COUNT
+} Tiled_Import_Stats;
+
+
+static inline b32 tiled_is_space(u8 c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline void tiled_skip_space(Tiled_Parser *parser) {
+	while (parser->at < parser->end && tiled_is_space(*parser->at)) ++parser->at;
+}
+
+static inline b32 tiled_accept(Tiled_Parser *parser, u8 c) {
+	tiled_skip_space(parser);
+
+	if (parser->at < parser->end && *parser->at == c) {
+		++parser->at;
+		return true;
+	}
+
+	return false;
+}
+
+static inline void tiled_expect(Tiled_Parser *parser, u8 c) {
+	if (!tiled_accept(parser, c)) parser->failed = true;
+}
+
+// NOTE: Points at the string contents in the file, escapes left as they are
+static b32 tiled_string(Tiled_Parser *parser, u8 **out_start, umm *out_length) {
+	if (!tiled_accept(parser, '"')) {
+		parser->failed = true;
+		return false;
+	}
+
+	u8 *start = parser->at;
+
+	while (parser->at < parser->end && *parser->at != '"') {
+		if (*parser->at == '\\') ++parser->at;
+		++parser->at;
+	}
+
+	if (parser->at >= parser->end) {
+		parser->failed = true;
+		return false;
+	}
+
+	*out_start = start;
+	*out_length = parser->at - start;
+	++parser->at;
+	return true;
+}
+
+static inline b32 tiled_string_is(u8 *string, umm length, char *name) {
+	umm name_length = strlen(name);
+	return length == name_length && memcmp(string, name, length) == 0;
+}
+
+static u32 tiled_number(Tiled_Parser *parser) {
+	tiled_skip_space(parser);
+
+	u64 value = 0;
+	u8 *start = parser->at;
+
+	while (parser->at < parser->end && *parser->at >= '0' && *parser->at <= '9') {
+		value = value * 10 + (*parser->at++ - '0');
+		if (value > 0xffffffff) parser->failed = true;
+	}
+
+	if (parser->at == start) parser->failed = true;
+
+	return (u32)value;
+}
+
+static void tiled_skip_value(Tiled_Parser *parser, u32 depth) {
+	tiled_skip_space(parser);
+
+	if (parser->at >= parser->end || depth > TILED_MAX_DEPTH) {
+		parser->failed = true;
+		return;
+	}
+
+	u8 c = *parser->at;
+
+	if (c == '"') {
+		u8 *string;
+		umm length;
+		tiled_string(parser, &string, &length);
+	}
+	else if (c == '{' || c == '[') {
+		u8 close = (c == '{') ? '}' : ']';
+		++parser->at;
+
+		if (tiled_accept(parser, close)) return;
+
+		do {
+			if (c == '{') {
+				u8 *key;
+				umm key_length;
+				tiled_string(parser, &key, &key_length);
+				tiled_expect(parser, ':');
+			}
+
+			tiled_skip_value(parser, depth + 1);
+		} while (!parser->failed && tiled_accept(parser, ','));
+
+		tiled_expect(parser, close);
+	}
+	else {
+		// Numbers, true, false and null
+		u8 *start = parser->at;
+
+		while (parser->at < parser->end) {
+			c = *parser->at;
+			if (c == ',' || c == '}' || c == ']' || tiled_is_space(c)) break;
+			++parser->at;
+		}
+
+		if (parser->at == start) parser->failed = true;
+	}
+}
+
+static void tiled_parse_json_layers(Tiled_Parser *parser, Tiled_Map *map, u32 depth);
+
+// NOTE: One entry of a "layers" array. Group layers recurse.
+static void tiled_parse_json_layer(Tiled_Parser *parser, Tiled_Map *map, u32 depth) {
+
+	Tiled_Layer layer = {0};
+	b32 is_tile_layer = false;
+	b32 is_solid = false;
+
+	tiled_expect(parser, '{');
+
+	if (!tiled_accept(parser, '}')) {
+		do {
+			u8 *key;
+			umm key_length;
+			if (!tiled_string(parser, &key, &key_length)) break;
+			tiled_expect(parser, ':');
+
+			if (tiled_string_is(key, key_length, "type")) {
+				u8 *type;
+				umm type_length;
+				tiled_string(parser, &type, &type_length);
+				is_tile_layer = tiled_string_is(type, type_length, "tilelayer");
+			}
+			else if (tiled_string_is(key, key_length, "name")) {
+				u8 *name;
+				umm name_length;
+				tiled_string(parser, &name, &name_length);
+				is_solid = tiled_string_is(name, name_length, "collision") || tiled_string_is(name, name_length, "solid");
+			}
+			else if (tiled_string_is(key, key_length, "width")) {
+				layer.width = tiled_number(parser);
+			}
+			else if (tiled_string_is(key, key_length, "height")) {
+				layer.height = tiled_number(parser);
+			}
+			else if (tiled_string_is(key, key_length, "data")) {
+				tiled_skip_space(parser);
+
+				if (parser->at < parser->end && *parser->at == '[') {
+					// A flat array of numbers, so the first ']' closes it
+					u8 *close = memchr(parser->at, ']', parser->end - parser->at);
+
+					if (close) {
+						layer.data = parser->at;
+						layer.data_end = close;
+						parser->at = close + 1;
+					}
+					else {
+						parser->failed = true;
+					}
+				}
+				else {
+					// Base64, possibly compressed
+					map->problem = "only CSV and JSON array tile layer data is supported";
+					tiled_skip_value(parser, depth + 1);
+				}
+			}
+			else if (tiled_string_is(key, key_length, "chunks")) {
+				map->problem = "infinite maps are not supported";
+				tiled_skip_value(parser, depth + 1);
+			}
+			else if (tiled_string_is(key, key_length, "layers")) {
+				tiled_parse_json_layers(parser, map, depth + 1);
+			}
+			else {
+				tiled_skip_value(parser, depth + 1);
+			}
+		} while (!parser->failed && tiled_accept(parser, ','));
+
+		tiled_expect(parser, '}');
+	}
+
+	if (is_tile_layer && layer.data) {
+		if (is_solid) {
+			if (!map->solid.data) map->solid = layer;
+		}
+		else if (!map->tiles.data) {
+			map->tiles = layer;
+		}
+	}
+}
+
+static void tiled_parse_json_layers(Tiled_Parser *parser, Tiled_Map *map, u32 depth) {
+	if (depth > TILED_MAX_DEPTH) {
+		parser->failed = true;
+		return;
+	}
+
+	tiled_expect(parser, '[');
+	if (tiled_accept(parser, ']')) return;
+
+	do {
+		tiled_parse_json_layer(parser, map, depth);
+	} while (!parser->failed && tiled_accept(parser, ','));
+
+	tiled_expect(parser, ']');
+}
+
+static void tiled_parse_json_tilesets(Tiled_Parser *parser, Tiled_Map *map) {
+	tiled_expect(parser, '[');
+	if (tiled_accept(parser, ']')) return;
+
+	do {
+		tiled_expect(parser, '{');
+		if (tiled_accept(parser, '}')) continue;
+
+		do {
+			u8 *key;
+			umm key_length;
+			if (!tiled_string(parser, &key, &key_length)) break;
+			tiled_expect(parser, ':');
+
+			if (tiled_string_is(key, key_length, "firstgid")) {
+				u32 first_gid = tiled_number(parser);
+				if (first_gid < map->first_gid) map->first_gid = first_gid;
+			}
+			else {
+				tiled_skip_value(parser, 2);
+			}
+		} while (!parser->failed && tiled_accept(parser, ','));
+
+		tiled_expect(parser, '}');
+	} while (!parser->failed && tiled_accept(parser, ','));
+
+	tiled_expect(parser, ']');
+}
+
+static void tiled_parse_json(u8 *data, umm length, Tiled_Map *map) {
+	Tiled_Parser parser = {data, data + length, false};
+
+	tiled_expect(&parser, '{');
+
+	if (!tiled_accept(&parser, '}')) {
+		do {
+			u8 *key;
+			umm key_length;
+			if (!tiled_string(&parser, &key, &key_length)) break;
+			tiled_expect(&parser, ':');
+
+			if (tiled_string_is(key, key_length, "width")) map->width = tiled_number(&parser);
+			else if (tiled_string_is(key, key_length, "height")) map->height = tiled_number(&parser);
+			else if (tiled_string_is(key, key_length, "layers")) tiled_parse_json_layers(&parser, map, 1);
+			else if (tiled_string_is(key, key_length, "tilesets")) tiled_parse_json_tilesets(&parser, map);
+			else tiled_skip_value(&parser, 1);
+		} while (!parser.failed && tiled_accept(&parser, ','));
+
+		tiled_expect(&parser, '}');
+	}
+
+	if (parser.failed && !map->problem) map->problem = "malformed JSON";
+}
+
+// NOTE: Finds text in [at, end), the mapped file has no terminator
+static u8 *tiled_find(u8 *at, u8 *end, char *text) {
+	umm length = strlen(text);
+
+	while ((umm)(end - at) >= length) {
+		u8 *candidate = memchr(at, text[0], end - at - length + 1);
+		if (!candidate) return NULL;
+		if (memcmp(candidate, text, length) == 0) return candidate;
+		at = candidate + 1;
+	}
+
+	return NULL;
+}
+
+// NOTE: The value of name="value" inside the tag [tag, tag_end)
+static b32 tiled_xml_attribute(u8 *tag, u8 *tag_end, char *name, u8 **out_value, umm *out_length) {
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), " %s=\"", name);
+
+	u8 *value = tiled_find(tag, tag_end, pattern);
+	if (!value) return false;
+
+	value += strlen(pattern);
+	u8 *value_end = memchr(value, '"', tag_end - value);
+	if (!value_end) return false;
+
+	*out_value = value;
+	*out_length = value_end - value;
+	return true;
+}
+
+static u32 tiled_xml_number_attribute(u8 *tag, u8 *tag_end, char *name) {
+	u8 *value;
+	umm length;
+	if (!tiled_xml_attribute(tag, tag_end, name, &value, &length)) return 0;
+
+	Tiled_Parser parser = {value, value + length, false};
+	u32 result = tiled_number(&parser);
+	return parser.failed ? 0 : result;
+}
+
+static void tiled_parse_tmx(u8 *data, umm length, Tiled_Map *map) {
+	u8 *end = data + length;
+
+	u8 *map_tag = tiled_find(data, end, "<map ");
+	u8 *map_tag_end = map_tag ? memchr(map_tag, '>', end - map_tag) : NULL;
+
+	if (!map_tag_end) {
+		map->problem = "no <map> element";
+		return;
+	}
+
+	map->width = tiled_xml_number_attribute(map_tag, map_tag_end, "width");
+	map->height = tiled_xml_number_attribute(map_tag, map_tag_end, "height");
+
+	if (tiled_xml_number_attribute(map_tag, map_tag_end, "infinite")) {
+		map->problem = "infinite maps are not supported";
+		return;
+	}
+
+	for (u8 *at = map_tag_end; (at = tiled_find(at, end, "<tileset ")) != NULL; ++at) {
+		u8 *tag_end = memchr(at, '>', end - at);
+		if (!tag_end) break;
+
+		u32 first_gid = tiled_xml_number_attribute(at, tag_end, "firstgid");
+		if (first_gid && first_gid < map->first_gid) map->first_gid = first_gid;
+	}
+
+	for (u8 *at = map_tag_end; (at = tiled_find(at, end, "<layer ")) != NULL; ++at) {
+		u8 *tag_end = memchr(at, '>', end - at);
+		u8 *data_tag = tag_end ? tiled_find(tag_end, end, "<data") : NULL;
+		u8 *data_tag_end = data_tag ? memchr(data_tag, '>', end - data_tag) : NULL;
+		u8 *data_end = data_tag_end ? tiled_find(data_tag_end, end, "</data>") : NULL;
+
+		if (!data_end) {
+			map->problem = "malformed <layer> element";
+			return;
+		}
+
+		u8 *encoding;
+		umm encoding_length;
+		if (!tiled_xml_attribute(data_tag, data_tag_end, "encoding", &encoding, &encoding_length) ||
+			!tiled_string_is(encoding, encoding_length, "csv") ||
+			tiled_find(data_tag, data_tag_end, " compression="))
+		{
+			map->problem = "only CSV and JSON array tile layer data is supported";
+			return;
+		}
+
+		u8 *name;
+		umm name_length;
+		b32 is_solid =
+			tiled_xml_attribute(at, tag_end, "name", &name, &name_length) &&
+			(tiled_string_is(name, name_length, "collision") || tiled_string_is(name, name_length, "solid"));
+
+		Tiled_Layer layer = {
+			data_tag_end + 1, data_end,
+			tiled_xml_number_attribute(at, tag_end, "width"),
+			tiled_xml_number_attribute(at, tag_end, "height"),
+		};
+
+		if (is_solid) {
+			if (!map->solid.data) map->solid = layer;
+		}
+		else if (!map->tiles.data) {
+			map->tiles = layer;
+		}
+
+		at = data_end;
+	}
+}
+
+// NOTE: A bare CSV export is one row of IDs per line
+static void tiled_parse_csv(u8 *data, umm length, Tiled_Map *map) {
+	u8 *end = data + length;
+	u32 width = 0;
+	u32 height = 0;
+
+	for (u8 *line = data; line < end;) {
+		u8 *line_end = memchr(line, '\n', end - line);
+		if (!line_end) line_end = end;
+
+		u32 value_count = 0;
+		b32 in_value = false;
+
+		for (u8 *at = line; at < line_end; ++at) {
+			b32 is_digit = (*at >= '0' && *at <= '9');
+			if (is_digit && !in_value) ++value_count;
+			in_value = is_digit;
+		}
+
+		if (value_count) {
+			if (width == 0) width = value_count;
+			++height;
+		}
+
+		line = line_end + 1;
+	}
+
+	map->width = width;
+	map->height = height;
+	map->tiles = (Tiled_Layer){data, end, width, height};
+}
+
+// NOTE: Reads the IDs of a layer, separated by anything that is not a
+// digit, straight into the grid. Returns the number of IDs read.
+static umm tiled_read_layer(Tiled_Layer *layer, Level_Grid *grid, u32 first_gid, b32 solid, Tiled_Import_Stats *stats) {
+	u8 *at = layer->data;
+	u8 *end = layer->data_end;
+
+	umm cell_count = (umm)grid->width * grid->height;
+	umm count = 0;
+
+	for (;;) {
+		while (at < end && (u8)(*at - '0') > 9) ++at;
+		if (at >= end) break;
+
+		u32 gid = 0;
+		while (at < end && (u8)(*at - '0') <= 9) gid = gid * 10 + (*at++ - '0');
+
+		if (count < cell_count) {
+			Tile *cell = &grid->tiles[count];
+
+			if (solid) {
+				if (gid) *cell |= TILE_MASK_SOLID;
+			}
+			else if (gid) {
+				u32 id = gid & TILED_GID_MASK;
+				u32 index = id >= first_gid ? id - first_gid : 0;
+
+				stats->truncated_count += index >= TILE_INDEX_COUNT;
+				stats->diagonal_count += (gid & (TILED_FLIP_DIAGONAL | TILED_ROTATE_HEXAGON)) != 0;
+
+				*cell =
+					(*cell & TILE_MASK_SOLID) |
+					tile_index(index) |
+					((gid & TILED_FLIP_HORIZONTAL) ? TILE_MASK_FLIP_X : 0) |
+					((gid & TILED_FLIP_VERTICAL) ? TILE_MASK_FLIP_Y : 0);
+			}
+		}
+
+		++count;
+	}
+
+	return count;
+}
+
+static inline b32 level_path_is_tiled(char *path) {
+	char *dot = strrchr(path, '.');
+	if (!dot) return false;
+
+	return
+		strcmp(dot, ".json") == 0 || strcmp(dot, ".tmj") == 0 ||
+		strcmp(dot, ".tmx") == 0 || strcmp(dot, ".csv") == 0;
+}
+
+static b32 import_tiled_map(Level *level, char *path) {
+
+	u64 start = SDL_GetPerformanceCounter();
+
+	Mapped_File file = map_file(path);
+
+	if (!file.data) {
+		fprintf(stderr, "Could not open file %s for reading.\n", path);
+		return false;
+	}
+
+	Tiled_Map map = {0};
+	map.first_gid = 0xffffffff;
+
+	char *dot = strrchr(path, '.');
+
+	if (strcmp(dot, ".tmx") == 0) tiled_parse_tmx(file.data, file.length, &map);
+	else if (strcmp(dot, ".csv") == 0) tiled_parse_csv(file.data, file.length, &map);
+	else tiled_parse_json(file.data, file.length, &map);
+
+	if (map.first_gid == 0xffffffff) map.first_gid = 1;
+
+	if (!map.problem && !map.tiles.data) {
+		map.problem = "no tile layer";
+	}
+
+	if (!map.problem && (
+		map.width == 0 || map.width > LEVEL_MAX_WIDTH ||
+		map.height == 0 || map.height > LEVEL_MAX_HEIGHT))
+	{
+		map.problem = "bad dimensions";
+	}
+
+	Level_Grid grid = {0};
+
+	if (!map.problem && !level_grid_allocate(&grid, map.width, map.height)) {
+		map.problem = "out of memory";
+	}
+
+	Tiled_Import_Stats stats = {0};
+	umm cell_count = (umm)map.width * map.height;
+
+	if (!map.problem && tiled_read_layer(&map.tiles, &grid, map.first_gid, false, &stats) != cell_count) {
+		map.problem = "tile layer does not match the map size";
+	}
+
+	if (!map.problem && map.solid.data && tiled_read_layer(&map.solid, &grid, map.first_gid, true, &stats) != cell_count) {
+		map.problem = "collision layer does not match the map size";
+	}
+
+	unmap_file(&file);
+
+	if (map.problem) {
+		fprintf(stderr, "Tiled map %s: %s.\n", path, map.problem);
+		level_grid_free(&grid);
+		return false;
+	}
+
+	level_grid_free(&level->grid);
+	level->grid = grid;
+	object_layer_free(&level->objects);
+
+	if (stats.diagonal_count) {
+		fprintf(stderr, "Warning: %llu rotated tiles in %s were imported unrotated.\n", stats.diagonal_count, path);
+	}
+
+	if (stats.truncated_count) {
+		fprintf(stderr, "Warning: %llu tiles in %s use indices above %u.\n", stats.truncated_count, path, TILE_INDEX_COUNT - 1);
+	}
+
+	fprintf(stderr, "Imported %s: %ux%u%s in %.1f ms\n",
+		path, map.width, map.height, map.solid.data ? " with collision" : "",
+		(double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+
+	return true;
+}
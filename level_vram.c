@@ -0,0 +1,224 @@
+// NOTE: Sliding window VRAM analysis. While scrolling, only the tiles
+// around the screen (20x18 tiles plus a margin for the tiles being streamed
+// in) have to be in VRAM at once. For every position of that window over the
+// level this counts the distinct tile indices under it, so positions that do
+// not fit in the 256 (or 384 with $8800 addressing) BG tiles can be flagged.
+//
+// The counts are kept in a histogram that slides along each row of window
+// positions: moving one tile right removes a column and adds a column, instead
+// of rescanning the window. Edits only queue the window positions that can see
+// the changed tiles, and vram_analysis_update works through the queue a few
+// rows at a time so even a 4096x4096 level stays interactive.
+
+#define VRAM_SCREEN_WIDTH 20
+#define VRAM_SCREEN_HEIGHT 18
+#define VRAM_WINDOW_MARGIN 2
+#define VRAM_TILE_LIMIT 256
+#define VRAM_TILE_LIMIT_8800 384
+
+typedef struct Vram_Analysis {
+	u32 window_width;  // In tiles, clipped to the level
+	u32 window_height;
+	u32 positions_x;   // Window positions, left to right and top to bottom
+	u32 positions_y;
+
+	// Distinct tiles under the window at each position, row by row.
+	// NULL when the analysis is not running.
+	u16 *unique_counts;
+
+	u32 tile_limit;
+	u32 violation_count;
+
+	// Window positions still to be (re)counted. w == 0 means up to date.
+	SDL_Rect pending;
+} Vram_Analysis;
+
+
+static void vram_analysis_free(Vram_Analysis *analysis) {
+	free(analysis->unique_counts);
+	*analysis = (Vram_Analysis){0};
+}
+
+static umm vram_analysis_memory_size(Vram_Analysis *analysis) {
+	return analysis->unique_counts ? (umm)analysis->positions_x * analysis->positions_y * sizeof(u16) : 0;
+}
+
+static b32 vram_analysis_begin(Vram_Analysis *analysis, Level_Grid *grid, u32 tile_limit) {
+
+	vram_analysis_free(analysis);
+
+	u32 window_width = VRAM_SCREEN_WIDTH + 2*VRAM_WINDOW_MARGIN;
+	u32 window_height = VRAM_SCREEN_HEIGHT + 2*VRAM_WINDOW_MARGIN;
+	if (window_width > grid->width) window_width = grid->width;
+	if (window_height > grid->height) window_height = grid->height;
+
+	analysis->window_width = window_width;
+	analysis->window_height = window_height;
+	analysis->positions_x = grid->width - window_width + 1;
+	analysis->positions_y = grid->height - window_height + 1;
+	analysis->tile_limit = tile_limit;
+
+	analysis->unique_counts = calloc((umm)analysis->positions_x * analysis->positions_y, sizeof(u16));
+
+	if (!analysis->unique_counts) {
+		fprintf(stderr, "Out of memory starting the VRAM analysis.\n");
+		vram_analysis_free(analysis);
+		return false;
+	}
+
+	analysis->pending = (SDL_Rect){0, 0, analysis->positions_x, analysis->positions_y};
+
+	return true;
+}
+
+static void vram_analysis_set_limit(Vram_Analysis *analysis, u32 tile_limit) {
+	analysis->tile_limit = tile_limit;
+	analysis->violation_count = 0;
+
+	if (!analysis->unique_counts) return;
+
+	umm position_count = (umm)analysis->positions_x * analysis->positions_y;
+
+	for (umm i = 0; i < position_count; ++i) {
+		if (analysis->unique_counts[i] > tile_limit) ++analysis->violation_count;
+	}
+}
+
+// NOTE: Queues every window position that overlaps the changed tiles
+static void vram_analysis_mark_dirty(Vram_Analysis *analysis, s32 x, s32 y, s32 w, s32 h) {
+
+	if (!analysis->unique_counts) return;
+
+	s32 x0 = x - (s32)analysis->window_width + 1;
+	s32 y0 = y - (s32)analysis->window_height + 1;
+	s32 x1 = x + w;
+	s32 y1 = y + h;
+
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > (s32)analysis->positions_x) x1 = analysis->positions_x;
+	if (y1 > (s32)analysis->positions_y) y1 = analysis->positions_y;
+	if (x0 >= x1 || y0 >= y1) return;
+
+	SDL_Rect *pending = &analysis->pending;
+
+	if (pending->w == 0) {
+		*pending = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+		return;
+	}
+
+	if (pending->x + pending->w > x1) x1 = pending->x + pending->w;
+	if (pending->y + pending->h > y1) y1 = pending->y + pending->h;
+	if (pending->x < x0) x0 = pending->x;
+	if (pending->y < y0) y0 = pending->y;
+	*pending = (SDL_Rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+// NOTE: Counts one row of window positions, from first_x to last_x
+// inclusive, sliding the histogram one column at a time.
+static void vram_analysis_count_row(Vram_Analysis *analysis, Level_Grid *grid, u32 position_y, u32 first_x, u32 last_x) {
+
+	u16 histogram[TILE_INDEX_COUNT] = {0};
+	u32 unique = 0;
+
+	u32 window_width = analysis->window_width;
+	u32 window_height = analysis->window_height;
+	u32 tile_limit = analysis->tile_limit;
+	u16 *counts = &analysis->unique_counts[(umm)position_y * analysis->positions_x];
+
+	for (u32 y = 0; y < window_height; ++y) {
+		Tile *row = level_grid_row(grid, position_y + y);
+
+		for (u32 x = first_x; x < first_x + window_width; ++x) {
+			if (histogram[tile_index(row[x])]++ == 0) ++unique;
+		}
+	}
+
+	for (u32 position_x = first_x;; ++position_x) {
+
+		u32 old_count = counts[position_x];
+		analysis->violation_count -= (old_count > tile_limit);
+		analysis->violation_count += (unique > tile_limit);
+		counts[position_x] = (u16)unique;
+
+		if (position_x == last_x) break;
+
+		u32 column_out = position_x;
+		u32 column_in = position_x + window_width;
+
+		for (u32 y = 0; y < window_height; ++y) {
+			Tile *row = level_grid_row(grid, position_y + y);
+			if (--histogram[tile_index(row[column_out])] == 0) --unique;
+			if (histogram[tile_index(row[column_in])]++ == 0) ++unique;
+		}
+	}
+}
+
+// NOTE: Works through queued window positions for up to budget_ticks
+// performance counter ticks. Returns true when the analysis is up to date.
+static b32 vram_analysis_update(Vram_Analysis *analysis, Level_Grid *grid, u64 budget_ticks) {
+
+	if (!analysis->unique_counts) return true;
+
+	u64 start = SDL_GetPerformanceCounter();
+	SDL_Rect *pending = &analysis->pending;
+
+	while (pending->w) {
+		vram_analysis_count_row(analysis, grid, pending->y, pending->x, pending->x + pending->w - 1);
+
+		++pending->y;
+		if (--pending->h == 0) {
+			*pending = (SDL_Rect){0};
+		}
+
+		if (SDL_GetPerformanceCounter() - start > budget_ticks) break;
+	}
+
+	return pending->w == 0;
+}
+
+static inline b32 vram_analysis_violates(Vram_Analysis *analysis, u32 position_x, u32 position_y) {
+	return analysis->unique_counts[(umm)position_y * analysis->positions_x + position_x] > analysis->tile_limit;
+}
+
+// NOTE: Tints the tile at the top left corner of every window position
+// that needs more tiles than the limit. Runs of tinted tiles are merged.
+static void render_vram_violations(
+	SDL_Renderer *renderer,
+	Vram_Analysis *analysis,
+	SDL_Rect visible_tiles,
+	s32 origin_x, s32 origin_y,
+	s32 tile_size)
+{
+	if (!analysis->unique_counts || analysis->violation_count == 0) return;
+
+	s32 x_end = visible_tiles.x + visible_tiles.w;
+	s32 y_end = visible_tiles.y + visible_tiles.h;
+	if (x_end > (s32)analysis->positions_x) x_end = analysis->positions_x;
+	if (y_end > (s32)analysis->positions_y) y_end = analysis->positions_y;
+
+	SDL_SetRenderDrawColor(renderer, 200, 0, 0, 90);
+	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+
+	for (s32 y = visible_tiles.y; y < y_end; ++y) {
+		s32 x = visible_tiles.x;
+
+		while (x < x_end) {
+			if (!vram_analysis_violates(analysis, x, y)) {
+				++x;
+				continue;
+			}
+
+			s32 run_start = x;
+			while (x < x_end && vram_analysis_violates(analysis, x, y)) ++x;
+
+			SDL_Rect rect = {
+				origin_x + run_start * tile_size,
+				origin_y + y * tile_size,
+				(x - run_start) * tile_size,
+				tile_size,
+			};
+			SDL_RenderFillRect(renderer, &rect);
+		}
+	}
+}